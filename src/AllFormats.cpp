@@ -16,14 +16,15 @@
 #include "Loaders/HeaderBLoader.h"
 
 
-elBlockLoaderSelector::elBlockLoaderSelector()
+elBlockLoaderSelector::elBlockLoaderSelector(const elContext& Context) :
+    fsFormatSelector<elBlockLoader>(Context)
 {
     fsFormat Formats[] = {
-        make_shared<elAsfGstrLoader>(),
-        make_shared<elAsfPtLoader>(),
-        make_shared<elSingleBlockLoader>(),
-        make_shared<elHeaderBLoader>(),
-        make_shared<elHeaderlessLoader>()
+        make_shared<elAsfGstrLoader>(Context),
+        make_shared<elAsfPtLoader>(Context),
+        make_shared<elSingleBlockLoader>(Context),
+        make_shared<elHeaderBLoader>(Context),
+        make_shared<elHeaderlessLoader>(Context)
     };
     SelectorListAdd(Formats, sizeof(Formats) / sizeof(fsFormat));
     return;
@@ -83,7 +84,8 @@ void elBlockLoaderSelector::ListSupportedParsers(std::vector<std::string>& Names
     return SU()->ListSupportedParsers(Names);
 }
 
-elParserSelector::elParserSelector()
+elParserSelector::elParserSelector(const elContext& Context) :
+    fsFormatSelector<elParser>(Context)
 {
     // No need to add the formats -- they'll be added in elBlockLoader::CreateParser()
     return;
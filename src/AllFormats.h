@@ -17,7 +17,7 @@
 class elBlockLoaderSelector : public fsFormatSelector<elBlockLoader>
 {
 public:
-    elBlockLoaderSelector();
+    elBlockLoaderSelector(const elContext& Context);
     virtual ~elBlockLoaderSelector();
 
     /// Initializes the loader, returning false if this file cannot be read by this loader.
@@ -43,7 +43,7 @@ public:
 class elParserSelector : public fsFormatSelector<elParser>
 {
 public:
-    elParserSelector();
+    elParserSelector(const elContext& Context);
     virtual ~elParserSelector();
 
     /// Parses the entire input stream and checks to see if it's a format that can be parsed.
@@ -7,6 +7,7 @@
 #include "Internal.h"
 #include "BlockLoader.h"
 #include "Parser.h"
+#include "Parsers/ParserVersion5.h"
 
 elBlock::elBlock() :
         Size(0),
@@ -34,7 +35,8 @@ void elBlock::Clear()
     return;
 }
 
-elBlockLoader::elBlockLoader() :
+elBlockLoader::elBlockLoader(const elContext& Context) :
+        m_Context(Context),
         m_Input(NULL),
         m_CurrentBlockIndex(0)
 {
@@ -63,7 +65,7 @@ unsigned int elBlockLoader::GetCurrentBlockIndex()
 
 shared_ptr<elParser> elBlockLoader::CreateParser() const
 {
-    return make_shared<elParser>();
+    return make_shared<elParserVersion5>(m_Context);
 }
 
 void elBlockLoader::ListSupportedParsers(std::vector<std::string>& Names) const
@@ -26,11 +26,12 @@ public:
 };
 
 class elParser;
+class elContext;
 
 class elBlockLoader
 {
 public:
-    elBlockLoader();
+    elBlockLoader(const elContext& Context);
     virtual ~elBlockLoader();
 
     /// Get the name associated with this loader.
@@ -52,6 +53,9 @@ public:
     virtual void ListSupportedParsers(std::vector<std::string>& Names) const;
 
 protected:
+    /// Where the messages go, and what the parsers this creates are given.
+    const elContext& m_Context;
+
     std::istream* m_Input;
     unsigned int m_CurrentBlockIndex;
 };
@@ -0,0 +1,51 @@
+/*
+    EA Layer 3 Extractor/Decoder
+    Copyright (C) 2010, Ben Moench.
+    See License.txt
+*/
+
+#include "Internal.h"
+#include "Context.h"
+
+#include <mpg123.h>
+#include <stdexcept>
+
+
+elContext::elContext() :
+    m_Verbose(0)
+{
+    if (mpg123_init() != MPG123_OK)
+    {
+        throw (std::runtime_error("Could not initialize mpg123."));
+    }
+    return;
+}
+
+elContext::~elContext()
+{
+    mpg123_exit();
+    return;
+}
+
+void elContext::SetVerbose(int Verbose)
+{
+    m_Verbose = Verbose;
+    return;
+}
+
+int elContext::GetVerbose() const
+{
+    return m_Verbose;
+}
+
+mpg123_handle* elContext::CreateMpg123Decoder() const
+{
+    mpg123_handle* Decoder = mpg123_new(NULL, NULL);
+    if (!Decoder)
+    {
+        throw (std::runtime_error("Could not create an mpg123 decoder."));
+    }
+    mpg123_open_feed(Decoder);
+    mpg123_param(Decoder, MPG123_REMOVE_FLAGS, MPG123_GAPLESS, 0);
+    return Decoder;
+}
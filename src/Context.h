@@ -0,0 +1,41 @@
+/*
+    EA Layer 3 Extractor/Decoder
+    Copyright (C) 2010, Ben Moench.
+    See License.txt
+*/
+
+#pragma once
+
+#include "Internal.h"
+
+struct mpg123_handle_struct;
+typedef struct mpg123_handle_struct mpg123_handle;
+
+/**
+ * What the decoding classes share instead of keeping it in globals: how much
+ * they print, and the mpg123 library, which is initialized for as long as the
+ * context is around. Main makes one and hands it to everything it creates; a
+ * program can have any number of them, each decoding its own files at once.
+ */
+class elContext
+{
+public:
+    elContext();
+    ~elContext();
+
+    /// Print what's going on with 1, and more with 2 when ENABLE_VERY_VERBOSE is defined.
+    void SetVerbose(int Verbose);
+
+    int GetVerbose() const;
+
+    /**
+     * Create an mpg123 decoder which is fed MPEG frames a piece at a time, with
+     * gapless decoding turned off so nothing is cut from the start or the end.
+     * Delete it with mpg123_delete(). Each stream needs one of its own, but
+     * they can be made on any thread.
+     */
+    mpg123_handle* CreateMpg123Decoder() const;
+
+protected:
+    int m_Verbose;
+};
@@ -8,115 +8,867 @@
 #include "FileDecoder.h"
 
 #include "AllFormats.h"
+#include "Parsers/ParserVersion5.h"
 #include "Parsers/ParserVersion6.h"
 #include "BlockLoader.h"
 #include "MpegGenerator.h"
 #include "MpegOutputStream.h"
 #include "PcmOutputStream.h"
 #include "WaveWriter.h"
+#include "Interleave.h"
+#include "PcmConverter.h"
+#include "LoudnessMeter.h"
+#include "PeakFileWriter.h"
+#include "Hash64.h"
+#include "OutputSink.h"
+#include "Context.h"
 
 #include <fstream>
+#include <algorithm>
 #include <stdexcept>
 #include <boost/format.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/bind.hpp>
+#include <boost/atomic.hpp>
+#include <boost/lockfree/spsc_queue.hpp>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/uio.h>
+#endif
 
 using boost::format;
 using std::runtime_error;
 
 
-static void _SeparateFilename(const std::string& Filename, std::string& PathAndName, std::string& Ext)
+/// How many bytes of MP3 frames each thread gathers before writing them.
+#define MPEG_WRITE_CHUNK_SIZE (1024 * 1024)
+
+/// How many samples each stream of a multichannel wave can decode ahead of the others.
+#define DECODE_RING_SIZE (64 * 1024)
+
+/// How many frames of a wave each thread decodes at a time.
+#define PCM_DECODE_CHUNK_FRAMES 1024
+
+/// How many samples of a wave are decoded before each write.
+#define PCM_WRITE_BUFFER_SAMPLES (1024 * 1024)
+
+
+static void _SeparateFilename(const std::string& Filename, std::string& PathAndName, std::string& Ext)
+{
+    PathAndName = Filename;
+    Ext = "";
+    
+    for (unsigned int i = Filename.length(); i > 0; i--)
+    {
+        if (Filename.at(i - 1) == '.')
+        {
+            PathAndName = Filename.substr(0, i - 1);
+            Ext = Filename.substr(i - 1);
+            break;
+        }
+    }
+    
+    return;
+}
+
+
+static std::string _ReplaceExtension(const std::string& Filename, const std::string& Ext)
+{
+    std::string PathAndName;
+    std::string OldExt;
+    _SeparateFilename(Filename, PathAndName, OldExt);
+    return PathAndName + Ext;
+}
+
+
+/// What's measured from the samples of an output as they go by, for the files written next to it.
+struct elOutputMeasures
+{
+    shared_ptr<elLoudnessMeter> meter;
+    shared_ptr<std::ofstream> peakFile;
+    shared_ptr<elPeakFileWriter> peaks;
+    shared_ptr<elHash64> hash;
+
+    void Process(const uint8_t* samples, elSampleFormat format, unsigned int count)
+    {
+        if (hash)
+        {
+            hash->Update(samples, count * GetSampleSize(format));
+        }
+        if (meter)
+        {
+            meter->Process(samples, format, count);
+        }
+        if (peaks)
+        {
+            peaks->Process(samples, format, count);
+        }
+    }
+};
+
+
+/// Writes the samples of a wave, taking them to another rate and set of channels on the way if that's wanted.
+class elWaveSampleWriter
+{
+public:
+    /// Without a converter the samples are written as they are; with one they have to be floats.
+    elWaveSampleWriter(elSampleFormat format, shared_ptr<elPcmConverter> converter,
+                       unsigned int sampleRate, unsigned int channels) :
+        output(NULL), format(converter ? converter->GetSampleFormat() : format), converter(converter),
+        sampleRate(converter ? converter->GetSampleRate() : sampleRate),
+        channels(converter ? converter->GetChannels() : channels), limited(false), length(0), slack(0), written(0) {};
+
+    /// Without an output nothing is written, but the samples are still measured.
+    void SetOutput(elOutputSink* output) { this->output = output; }
+
+    /**
+     * Set how many sample frames are going to come in, which decides how many
+     * are written: what comes after them is cut off, and if there aren't as
+     * many the rest are silent. That way the length is known before the header
+     * is written. If more than frameSamples, one MPEG frame's worth, are
+     * missing then the decode went wrong, and Finish() throws.
+     */
+    void SetInputLength(unsigned long frames, unsigned int frameSamples)
+    {
+        limited = true;
+        length = converter ? converter->GetOutputFrames(frames) : frames;
+        slack = converter ? converter->GetOutputFrames(frameSamples) : frameSamples;
+    }
+
+    void Write(const uint8_t* samples, unsigned int count)
+    {
+        if (!converter)
+        {
+            WriteSamples(samples, count);
+            return;
+        }
+        converted.clear();
+        converter->Convert((const float*) samples, count, converted);
+        WriteSamples(converted.empty() ? NULL : &converted[0], converted.size() / GetSampleSize(format));
+    }
+
+    /// Write what the converter has left once the stream has ended.
+    void Finish()
+    {
+        if (converter)
+        {
+            converted.clear();
+            converter->Flush(converted);
+            WriteSamples(converted.empty() ? NULL : &converted[0], converted.size() / GetSampleSize(format));
+        }
+
+        // The header already has the length, so the stream has to be made that long
+        if (limited && GetSamplesLeft())
+        {
+            const uint64_t missing = GetSamplesLeft() / channels;
+            std::ostringstream message;
+            message << "The decoded stream is " << missing << " sample frames short of the " << length << " in its header.";
+            if (missing > slack)
+            {
+                throw (runtime_error(message.str()));
+            }
+            std::cerr << message.str() << " Filling them with silence." << std::endl;
+            converted.assign((unsigned int) std::min(GetSamplesLeft(), (uint64_t) PCM_WRITE_BUFFER_SAMPLES) * GetSampleSize(format), 0);
+            while (GetSamplesLeft())
+            {
+                WriteSamples(&converted[0], (unsigned int) std::min(GetSamplesLeft(), (uint64_t) PCM_WRITE_BUFFER_SAMPLES));
+            }
+        }
+    }
+
+    /// The format, sample rate and channels of what's written.
+    elSampleFormat GetSampleFormat() const { return format; }
+    unsigned int GetSampleRate() const { return sampleRate; }
+    unsigned int GetChannels() const { return channels; }
+
+    /// How many sample frames are written, once the input length is set.
+    unsigned long GetLength() const { return length; }
+
+    /// Measure the samples as they're written, once they're in the format of the wave.
+    void SetMeasures(shared_ptr<elOutputMeasures> measures) { this->measures = measures; }
+    shared_ptr<elOutputMeasures> GetMeasures() const { return measures; }
+
+private:
+    /// How many samples are left to write to make it as long as it's limited to.
+    uint64_t GetSamplesLeft() const { return (uint64_t) length * channels - written; }
+
+    void WriteSamples(const uint8_t* samples, unsigned int count)
+    {
+        if (limited)
+        {
+            count = (unsigned int) std::min((uint64_t) count, GetSamplesLeft());
+        }
+        if (!count)
+        {
+            return;
+        }
+        if (output)
+        {
+            output->Write(samples, count * GetSampleSize(format));
+        }
+        if (measures)
+        {
+            measures->Process(samples, format, count);
+        }
+        written += count;
+    }
+
+    elOutputSink* output;
+    elSampleFormat format;
+    shared_ptr<elPcmConverter> converter;
+    std::vector<uint8_t> converted;
+    unsigned int sampleRate;
+    unsigned int channels;
+    shared_ptr<elOutputMeasures> measures;
+
+    /// How many sample frames are written if it's limited, how many of them can be missing, and how many samples have been.
+    bool limited;
+    unsigned long length;
+    unsigned long slack;
+    uint64_t written;
+};
+
+
+/// An output file which is written to while the input is being parsed.
+struct elStreamingOutput
+{
+    unsigned int index;
+    std::string filename;
+    shared_ptr<elOutputSink> sink;
+    shared_ptr<elMpegOutputStream> mpegStream;
+    shared_ptr<elPcmOutputStream> pcmStream;
+    shared_array<uint8_t> mpegBuffer;
+    shared_array<uint8_t> pcmBuffer;
+    shared_ptr<elWaveSampleWriter> pcmWriter;
+
+    /// Measures the decoded MP3, when it's measured.
+    shared_ptr<elOutputMeasures> measures;
+};
+
+
+static void _WriteMpegFrames(elOutputSink& output, elMpegOutputStream& stream, uint8_t* buffer, unsigned int bufferSize)
+{
+    do
+    {
+        unsigned int lastRead;
+        lastRead = stream.Read(buffer, bufferSize);
+        output.Write(buffer, lastRead);
+    }
+    while (!stream.Eos());
+    return;
+}
+
+
+#ifndef _WIN32
+/// The MP3 frames being written to a file by several threads.
+struct elMpegFileWriter
+{
+    elMpegFileWriter(const elMpegGenerator& gen, unsigned int index) :
+        gen(gen), index(index), fd(-1), nextChunk(0) {};
+
+    const elMpegGenerator& gen;
+    unsigned int index;
+    int fd;
+
+    /// Where each frame starts in the file; the last one is the file size.
+    std::vector<unsigned long> offsets;
+
+    /// The first frame of each chunk; the last one is the frame count.
+    std::vector<unsigned int> chunks;
+    unsigned int nextChunk;
+    boost::mutex lock;
+
+    /// What went wrong with each chunk, if anything.
+    std::vector<std::string> errors;
+};
+
+
+static void _WriteSegments(int fd, std::vector<struct iovec>& segments, off_t offset)
+{
+    unsigned int first = 0;
+    while (first < segments.size())
+    {
+        const int count = std::min((unsigned int)IOV_MAX, (unsigned int)segments.size() - first);
+        ssize_t written = pwritev(fd, &segments[first], count, offset);
+        if (written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written < 0)
+        {
+            throw (runtime_error(std::string("Could not write to the output file: ") + strerror(errno)));
+        }
+        if (written == 0)
+        {
+            // Nothing more can go in, and trying again wouldn't change that
+            throw (runtime_error("Could not write to the output file: nothing was written."));
+        }
+        offset += written;
+
+        // Skip what was written; a short write leaves part of a segment
+        while (first < segments.size() && (size_t)written >= segments[first].iov_len)
+        {
+            written -= segments[first].iov_len;
+            first++;
+        }
+        if (written)
+        {
+            segments[first].iov_base = (uint8_t*)segments[first].iov_base + written;
+            segments[first].iov_len -= written;
+        }
+    }
+    return;
+}
+
+
+static void _WriteMpegChunks(elMpegFileWriter* writer)
+{
+    const elMpegGenerator& gen = writer->gen;
+    std::vector<elMpegGenerator::elMpegSegment> segments;
+    elMpegGenerator::elMpegSegmentBuffer segmentBuffer;
+    std::vector<struct iovec> vectors;
+
+    while (true)
+    {
+        unsigned int chunk;
+        {
+            boost::mutex::scoped_lock locked(writer->lock);
+            if (writer->nextChunk + 1 >= writer->chunks.size())
+            {
+                break;
+            }
+            chunk = writer->nextChunk++;
+        }
+
+        const unsigned int first = writer->chunks[chunk];
+        const unsigned int last = writer->chunks[chunk + 1];
+
+        try
+        {
+            // The pieces of the frames are written straight from the granules where they can be
+            segments.clear();
+            segmentBuffer.Clear();
+            for (unsigned int i = first; i < last; i++)
+            {
+                gen.GetFrameSegments(segments, segmentBuffer, i, writer->index);
+            }
+
+            vectors.resize(segments.size());
+            for (unsigned int i = 0; i < segments.size(); i++)
+            {
+                vectors[i].iov_base = (void*)segments[i].Data;
+                vectors[i].iov_len = segments[i].Size;
+            }
+            _WriteSegments(writer->fd, vectors, writer->offsets[first]);
+        }
+        catch (std::exception& e)
+        {
+            writer->errors[chunk] = e.what();
+        }
+    }
+    return;
+}
+#endif
+
+
+/// A stream being decoded a chunk of frames at a time by several threads, then written in order.
+struct elPcmChunkDecoder
+{
+    elPcmChunkDecoder(const elMpegGenerator& gen, unsigned int index, elSampleFormat format) :
+        gen(gen), index(index), format(format), nextChunk(0), written(0), ahead(0) {};
+
+    const elMpegGenerator& gen;
+    unsigned int index;
+    elSampleFormat format;
+
+    /// The first frame of each chunk; the last one is the frame count.
+    std::vector<unsigned int> chunks;
+    unsigned int nextChunk;
+
+    /// How many chunks have been written; the threads don't decode more than ahead chunks past that.
+    unsigned int written;
+    unsigned int ahead;
+
+    /// The samples of each chunk, from when it's decoded until it's written.
+    std::vector< shared_ptr< std::vector<uint8_t> > > samples;
+    std::vector<bool> decoded;
+
+    /// What went wrong with each chunk, if anything.
+    std::vector<std::string> errors;
+
+    boost::mutex lock;
+    boost::condition_variable changed;
+};
+
+
+static void _DecodePcmChunks(elPcmChunkDecoder* decoder)
+{
+    const unsigned int bufferSamples = PCM_WRITE_BUFFER_SAMPLES;
+    const unsigned int sampleSize = GetSampleSize(decoder->format);
+    shared_array<uint8_t> buffer(new uint8_t[bufferSamples * sampleSize]);
+    const unsigned int chunkCount = decoder->chunks.size() - 1;
+
+    while (true)
+    {
+        unsigned int chunk;
+        {
+            boost::mutex::scoped_lock locked(decoder->lock);
+            while (decoder->nextChunk < chunkCount && decoder->nextChunk >= decoder->written + decoder->ahead)
+            {
+                decoder->changed.wait(locked);
+            }
+            if (decoder->nextChunk >= chunkCount)
+            {
+                break;
+            }
+            chunk = decoder->nextChunk++;
+        }
+
+        // Each chunk gets a decoder of its own, the last one going on to the end of the stream
+        shared_ptr< std::vector<uint8_t> > samples = make_shared< std::vector<uint8_t> >();
+        std::string error;
+        try
+        {
+            shared_ptr<elPcmOutputStream> stream = decoder->gen.CreatePcmStream(decoder->index);
+            stream->SetSampleFormat(decoder->format);
+            stream->SetFrameRange(decoder->chunks[chunk], chunk + 1 < chunkCount ? decoder->chunks[chunk + 1] : 0);
+            do
+            {
+                const unsigned int read = stream->Read(buffer.get(), bufferSamples);
+                samples->insert(samples->end(), buffer.get(), buffer.get() + read * sampleSize);
+            }
+            while (!stream->Eos());
+        }
+        catch (std::exception& e)
+        {
+            error = e.what();
+        }
+
+        {
+            boost::mutex::scoped_lock locked(decoder->lock);
+            decoder->samples[chunk] = samples;
+            decoder->errors[chunk] = error;
+            decoder->decoded[chunk] = true;
+        }
+        decoder->changed.notify_all();
+    }
+    return;
+}
+
+
+/// A stream of a multichannel wave being decoded on its own thread.
+struct elDecodingStream
+{
+    elDecodingStream(shared_ptr<elPcmOutputStream> stream, shared_ptr<elPcmConverter> converter, boost::mutex& lock,
+                     boost::condition_variable& changed) :
+        stream(stream), converter(converter), channels(stream->GetChannels()),
+        sampleSize(GetSampleSize(stream->GetSampleFormat())), samples(DECODE_RING_SIZE * sampleSize), done(false),
+        lock(lock), changed(changed) {};
+
+    shared_ptr<elPcmOutputStream> stream;
+
+    /// Takes the stream to the rate of the wave, if it has another one.
+    shared_ptr<elPcmConverter> converter;
+    unsigned int channels;
+    unsigned int sampleSize;
+
+    /// The bytes of the decoded samples, waiting to be interleaved with the other streams.
+    boost::lockfree::spsc_queue<uint8_t> samples;
+
+    /// Set once the last samples are in the ring.
+    boost::atomic<bool> done;
+    std::string error;
+
+    /// Shared by all of the streams and the interleaver; whoever waits on a ring waits on this.
+    boost::mutex& lock;
+    boost::condition_variable& changed;
+};
+
+
+/// Wake up whatever is waiting on the rings, after something has been pushed, popped or has ended.
+static void _NotifyDecodingStreams(elDecodingStream* decoding)
+{
+    // Taking the lock means a waiter has either seen the change or is already waiting
+    {
+        boost::mutex::scoped_lock locked(decoding->lock);
+    }
+    decoding->changed.notify_all();
+    return;
+}
+
+
+static void _PushDecodedSamples(elDecodingStream* decoding, const uint8_t* samples, unsigned int size)
+{
+    unsigned int pushed = 0;
+    while (pushed < size)
+    {
+        const unsigned int count = decoding->samples.push(samples + pushed, size - pushed);
+        pushed += count;
+        if (count)
+        {
+            _NotifyDecodingStreams(decoding);
+        }
+
+        // Wait for the interleaver to make room
+        if (pushed < size)
+        {
+            boost::mutex::scoped_lock locked(decoding->lock);
+            while (!decoding->samples.write_available())
+            {
+                decoding->changed.wait(locked);
+            }
+        }
+    }
+    return;
+}
+
+
+/// Has a stream that hasn't ended got less than a sample frame in its ring?
+static bool _IsStarved(const shared_ptr<elDecodingStream>& decoding)
+{
+    return !decoding->done.load(boost::memory_order_acquire) &&
+           decoding->samples.read_available() < decoding->channels * decoding->sampleSize;
+}
+
+
+static void _DecodeStream(elDecodingStream* decoding)
+{
+    const unsigned int bufferSamples = elPcmOutputStream::RecommendBufferSize();
+    shared_array<uint8_t> buffer(new uint8_t[bufferSamples * decoding->sampleSize]);
+    std::vector<uint8_t> converted;
+
+    try
+    {
+        do
+        {
+            const unsigned int read = decoding->stream->Read(buffer.get(), bufferSamples);
+            if (!decoding->converter)
+            {
+                _PushDecodedSamples(decoding, buffer.get(), read * decoding->sampleSize);
+                continue;
+            }
+
+            converted.clear();
+            decoding->converter->Convert((const float*) buffer.get(), read, converted);
+            if (decoding->stream->Eos())
+            {
+                decoding->converter->Flush(converted);
+            }
+            if (!converted.empty())
+            {
+                _PushDecodedSamples(decoding, &converted[0], converted.size());
+            }
+        }
+        while (!decoding->stream->Eos());
+    }
+    catch (std::exception& e)
+    {
+        decoding->error = e.what();
+    }
+    decoding->done.store(true, boost::memory_order_release);
+    _NotifyDecodingStreams(decoding);
+    return;
+}
+
+
+static void _WritePcmSamples(elWaveSampleWriter& writer, elPcmOutputStream& stream, uint8_t* buffer, unsigned int bufferSamples)
+{
+    do
+    {
+        unsigned int lastRead;
+        lastRead = stream.Read(buffer, bufferSamples);
+        writer.Write(buffer, lastRead);
+    }
+    while (!stream.Eos());
+    return;
+}
+
+
+static void _MeasurePcmSamples(elOutputMeasures& measures, elPcmOutputStream& stream, uint8_t* buffer, unsigned int bufferSamples)
+{
+    do
+    {
+        unsigned int lastRead;
+        lastRead = stream.Read(buffer, bufferSamples);
+        measures.Process(buffer, stream.GetSampleFormat(), lastRead);
+    }
+    while (!stream.Eos());
+    return;
+}
+
+
+elFileDecoder::elFileDecoder(const elContext& context) :
+    context(context),
+    inputFilename(""),
+    inputOffset(0),
+    inputStream(-1),
+    inputParser(P_AUTO),
+    outputFilename(""),
+    outputFormat(F_AUTO),
+    lowMemory(false),
+    constantBitrate(0),
+    freeFormat(false),
+    lookahead(DEFAULT_LOOKAHEAD),
+    threadCount(0),
+    useMpg123(false),
+    sampleFormat(SF_INT16),
+    outputRate(0),
+    analyze(false),
+    peakBucketFrames(0),
+    verify(false),
+    outputSinkUsed(false),
+    hashLock(make_shared<boost::mutex>())
+{
+    return;
+}
+
+
+elFileDecoder::~elFileDecoder()
+{
+    return;
+}
+
+
+void elFileDecoder::SetInput(const std::string& filename, std::streamoff offset)
+{
+    this->inputFilename = filename;
+    this->inputOffset = offset;
+    return;
+}
+
+
+const std::string& elFileDecoder::GetInput() const
+{
+    return this->inputFilename;
+}
+
+
+void elFileDecoder::SetStream(int stream)
+{
+    this->inputStream = stream;
+    return;
+}
+
+
+int elFileDecoder::GetStream() const
+{
+    return this->inputStream;
+}
+
+
+void elFileDecoder::SetParser(elFileDecoder::Parser parser)
+{
+    this->inputParser = parser;
+    return;
+}
+
+
+elFileDecoder::Parser elFileDecoder::GetParser() const
+{
+    return this->inputParser;
+}
+
+
+void elFileDecoder::SetOutput(const std::string& baseFilename, elFileDecoder::Format format)
+{
+    this->outputFilename = baseFilename;
+    this->outputFormat = format;
+    return;
+}
+
+
+const std::string& elFileDecoder::GetOutputFilename() const
+{
+    return this->outputFilename;
+}
+
+
+elFileDecoder::Format elFileDecoder::GetOutputFormat() const
+{
+    return this->outputFormat;
+}
+
+
+void elFileDecoder::SetOutputSink(shared_ptr<elOutputSink> sink)
+{
+    this->outputSink = sink;
+    this->outputSinkUsed = false;
+    return;
+}
+
+
+shared_ptr<elOutputSink> elFileDecoder::GetOutputSink() const
+{
+    return this->outputSink;
+}
+
+
+void elFileDecoder::SetLowMemory(bool lowMemory)
+{
+    this->lowMemory = lowMemory;
+    return;
+}
+
+
+bool elFileDecoder::GetLowMemory() const
+{
+    return this->lowMemory;
+}
+
+
+void elFileDecoder::SetConstantBitrate(unsigned int bitrate)
+{
+    this->constantBitrate = bitrate;
+    return;
+}
+
+
+unsigned int elFileDecoder::GetConstantBitrate() const
+{
+    return this->constantBitrate;
+}
+
+
+void elFileDecoder::SetFreeFormat(bool freeFormat)
+{
+    this->freeFormat = freeFormat;
+    return;
+}
+
+
+bool elFileDecoder::GetFreeFormat() const
+{
+    return this->freeFormat;
+}
+
+
+void elFileDecoder::SetLookahead(unsigned int frames)
+{
+    this->lookahead = frames;
+    return;
+}
+
+
+unsigned int elFileDecoder::GetLookahead() const
+{
+    return this->lookahead;
+}
+
+
+void elFileDecoder::SetThreadCount(unsigned int threadCount)
+{
+    this->threadCount = threadCount;
+    return;
+}
+
+
+unsigned int elFileDecoder::GetThreadCount() const
+{
+    return this->threadCount;
+}
+
+
+void elFileDecoder::SetUseMpg123(bool useMpg123)
+{
+    this->useMpg123 = useMpg123;
+    return;
+}
+
+
+bool elFileDecoder::GetUseMpg123() const
+{
+    return this->useMpg123;
+}
+
+
+void elFileDecoder::SetSampleFormat(elSampleFormat sampleFormat)
+{
+    this->sampleFormat = sampleFormat;
+    return;
+}
+
+
+elSampleFormat elFileDecoder::GetSampleFormat() const
 {
-    PathAndName = Filename;
-    Ext = "";
-    
-    for (unsigned int i = Filename.length(); i > 0; i--)
-    {
-        if (Filename.at(i - 1) == '.')
-        {
-            PathAndName = Filename.substr(0, i - 1);
-            Ext = Filename.substr(i - 1);
-            break;
-        }
-    }
-    
-    return;
+    return this->sampleFormat;
 }
 
 
-elFileDecoder::elFileDecoder() :
-    inputFilename(""),
-    inputOffset(0),
-    inputStream(-1),
-    inputParser(P_AUTO),
-    outputFilename(""),
-    outputFormat(F_AUTO)
+void elFileDecoder::SetSampleRate(unsigned int sampleRate)
 {
+    this->outputRate = sampleRate;
     return;
 }
 
 
-elFileDecoder::~elFileDecoder()
+unsigned int elFileDecoder::GetSampleRate() const
 {
-    return;
+    return this->outputRate;
 }
 
 
-void elFileDecoder::SetInput(const std::string& filename, std::streamoff offset)
+void elFileDecoder::SetChannelMap(const elChannelMap& channelMap)
 {
-    this->inputFilename = filename;
-    this->inputOffset = offset;
+    this->channelMap = channelMap;
     return;
 }
 
 
-const std::string& elFileDecoder::GetInput() const
+const elChannelMap& elFileDecoder::GetChannelMap() const
 {
-    return this->inputFilename;
+    return this->channelMap;
 }
 
 
-void elFileDecoder::SetStream(int stream)
+void elFileDecoder::SetAnalyze(bool analyze)
 {
-    this->inputStream = stream;
+    this->analyze = analyze;
     return;
 }
 
 
-int elFileDecoder::GetStream() const
+bool elFileDecoder::GetAnalyze() const
 {
-    return this->inputStream;
+    return this->analyze;
 }
 
 
-void elFileDecoder::SetParser(elFileDecoder::Parser parser)
+void elFileDecoder::SetPeaks(unsigned int bucketFrames)
 {
-    this->inputParser = parser;
+    this->peakBucketFrames = bucketFrames;
     return;
 }
 
 
-elFileDecoder::Parser elFileDecoder::GetParser() const
+unsigned int elFileDecoder::GetPeaks() const
 {
-    return this->inputParser;
+    return this->peakBucketFrames;
 }
 
 
-void elFileDecoder::SetOutput(const std::string& baseFilename, elFileDecoder::Format format)
+void elFileDecoder::SetVerify(bool verify, const std::string& manifest)
 {
-    this->outputFilename = baseFilename;
-    this->outputFormat = format;
+    this->verify = verify;
+    this->manifestFilename = manifest;
     return;
 }
 
 
-const std::string& elFileDecoder::GetOutputFilename() const
+bool elFileDecoder::GetVerify() const
 {
-    return this->outputFilename;
+    return this->verify;
 }
 
 
-elFileDecoder::Format elFileDecoder::GetOutputFormat() const
+const std::string& elFileDecoder::GetManifest() const
 {
-    return this->outputFormat;
+    return this->manifestFilename;
 }
 
 
@@ -151,24 +903,29 @@ void elFileDecoder::Process()
     {
         currentPart++;
         
-        VERBOSE("Trying to process part " << (currentPart + 1));
+        VERBOSE(context, "Trying to process part " << (currentPart + 1));
         try
         {
             ProcessPart(input);
         }
         catch (std::exception& E)
         {
-            VERBOSE("Exception processing further part: " << E.what());
+            VERBOSE(context, "Exception processing further part: " << E.what());
             break;
         }
         catch (...)
         {
-            VERBOSE("Crash or something else processing further part.");
+            VERBOSE(context, "Crash or something else processing further part.");
             break;
         }
     }
     
-    VERBOSE("Done.");
+    if (verify)
+    {
+        ReportHashes();
+    }
+    
+    VERBOSE(context, "Done.");
     return;
 }
 
@@ -176,7 +933,7 @@ void elFileDecoder::Process()
 void elFileDecoder::ProcessPart(std::ifstream& input)
 {
     // Determine the input's file type here
-    elBlockLoaderSelector loader;
+    elBlockLoaderSelector loader(context);
     if (!loader.Initialize(&input))
     {
         throw (runtime_error("The input is not in a readable file format."));
@@ -194,11 +951,11 @@ void elFileDecoder::ProcessPart(std::ifstream& input)
     switch (inputParser)
     {
         case P_VERSION5:
-            parser = make_shared<elParser>();
+            parser = make_shared<elParserVersion5>(context);
             break;
             
         case P_VERSION6:
-            parser = make_shared<elParserVersion6>();
+            parser = make_shared<elParserVersion6>(context);
             break;
             
         case P_AUTO:
@@ -208,58 +965,435 @@ void elFileDecoder::ProcessPart(std::ifstream& input)
     }
     
     // Add the first block to the generator.
-    elMpegGenerator gen;
+    elMpegGenerator gen(context);
     if (!gen.Initialize(firstBlock, parser))
     {
         throw (runtime_error("The EALayer3 parser could not be initialized (the bitstream format is not readable)."));
     }
-    
-    // Check the stream count.
-    if (inputStream != -1 && inputStream >= gen.GetStreamCount())
+    
+    // Check the stream count.
+    if (inputStream != -1 && inputStream >= gen.GetStreamCount())
+    {
+        throw (runtime_error((format("The stream index (%i) exceeds the total number of streams (%i).") %
+            (inputStream + 1) % gen.GetStreamCount()).str()));
+    }
+
+    // Don't bother building the frames of the other streams.
+    if (inputStream != -1 && inputStream < 32)
+    {
+        gen.SetStreamMask(1U << inputStream);
+    }
+    
+    if (constantBitrate)
+    {
+        gen.SetConstantBitrate(constantBitrate);
+    }
+    if (freeFormat)
+    {
+        gen.SetFreeFormat(true);
+    }
+    gen.SetLookahead(lookahead);
+    gen.SetThreadCount(threadCount);
+    
+    if (outputFormat == F_AUTO)
+    {
+        AutoSetOutputFormat();
+    }
+
+    // Everything has to go into the one output when there's a sink
+    if (outputSink && WritesOutputs() && inputStream == -1 && outputFormat != F_MULTI_WAVE && gen.GetStreamCount() > 1)
+    {
+        throw (runtime_error("Only one stream can be written to the output; pick one, or write a multi-channel WAV."));
+    }
+
+    // WAVs are decoded straight from the granules unless mpg123 is wanted; the MPEG frames are
+    // still made when verifying, as the MP3s are hashed along with the samples
+    if (!useMpg123 && (outputFormat == F_WAVE || outputFormat == F_MULTI_WAVE || outputFormat == F_NULL))
+    {
+        gen.SetDecodeGranules(true);
+        gen.SetDirectDecoding(!verify || outputFormat == F_NULL);
+    }
+
+    // Write the output while parsing if we're short on memory
+    if (lowMemory)
+    {
+        if (verify && !gen.IsDirectDecoding())
+        {
+            VERBOSE(context, "MP3s are hashed once their VBR frame is filled in, buffering the whole file.");
+        }
+        else if (outputFormat != F_MULTI_WAVE)
+        {
+            StreamPart(loader, gen, firstBlock);
+            return;
+        }
+        else
+        {
+            VERBOSE(context, "Multi-channel WAV output can't be streamed, buffering the whole file.");
+        }
+    }
+
+    // Load in the file
+    VERBOSE(context, "Parsing blocks...");
+    gen.ParseBlock(firstBlock);
+    
+    while (true)
+    {
+        elBlock block;
+        if (!loader.ReadNextBlock(block))
+        {
+            break;
+        }
+        
+        gen.ParseBlock(block);
+    }
+    
+    gen.DoneParsingBlocks();
+    
+    // Write it out in the preferred output format
+    VERBOSE(context, "Writing output file...");
+    
+    if (inputStream == -1)
+    {
+        if (outputFormat == F_MULTI_WAVE)
+        {
+            WriteMultiWave(gen);
+        }
+        else
+        {
+            WriteAllStreams(gen);
+        }
+    }
+    else
+    {
+        WriteSingleStream(gen);
+    }
+    return;
+}
+
+
+void elFileDecoder::StreamPart(elBlockLoader& loader, elMpegGenerator& gen, const elBlock& firstBlock)
+{
+    gen.EnableStreaming();
+
+    // Open the outputs before parsing so the frames can be written as soon as they're finished
+    std::vector<elStreamingOutput> outputs;
+    const unsigned int count = gen.GetStreamCount();
+    for (unsigned int i = 0; i < count; i++)
+    {
+        if (inputStream != -1 && inputStream != i)
+        {
+            continue;
+        }
+
+        elStreamingOutput output;
+        output.index = i;
+        output.filename = inputStream == -1 ? GenStreamFilename(i, count) : GenStreamFilename(i, 1);
+        if (WritesOutputs())
+        {
+            output.sink = OpenOutputSink(output.filename);
+        }
+
+        if (outputFormat == F_WAVE || outputFormat == F_NULL)
+        {
+            output.pcmStream = gen.CreatePcmStream(i);
+            output.pcmStream->SetSampleFormat(GetDecodeFormat());
+            output.pcmBuffer = shared_array<uint8_t>(new uint8_t[elPcmOutputStream::RecommendBufferSize() *
+                                                                 GetSampleSize(GetDecodeFormat())]);
+            output.pcmWriter = shared_ptr<elWaveSampleWriter>(new elWaveSampleWriter(GetDecodeFormat(),
+                CreateConverter(gen.GetSampleRate(i), gen.GetChannels(i)), gen.GetSampleRate(i), gen.GetChannels(i)));
+            output.pcmWriter->SetMeasures(CreateMeasures(output.filename, output.pcmWriter->GetSampleRate(),
+                                                         output.pcmWriter->GetChannels()));
+
+            // The length isn't known until the last block is parsed
+            if (output.sink)
+            {
+                output.pcmWriter->SetOutput(output.sink.get());
+                WriteStreamingWaveHeader(*output.sink, output.pcmWriter->GetSampleRate(), sampleFormat,
+                                         output.pcmWriter->GetChannels());
+            }
+        }
+        else
+        {
+            output.mpegStream = gen.CreateMpegStream(i);
+            output.mpegBuffer = shared_array<uint8_t>(new uint8_t[MAX_MPEG_FRAME_BUFFER]);
+
+            // The frames are decoded as they're written to measure them
+            output.measures = CreateMeasures(output.filename, gen.GetSampleRate(i), gen.GetChannels(i));
+            if (output.measures)
+            {
+                output.pcmStream = gen.CreatePcmStream(i);
+                output.pcmStream->SetSampleFormat(SF_FLOAT32);
+                output.pcmBuffer = shared_array<uint8_t>(new uint8_t[elPcmOutputStream::RecommendBufferSize() *
+                                                                     GetSampleSize(SF_FLOAT32)]);
+            }
+        }
+        outputs.push_back(output);
+    }
+
+    // Parse the blocks, writing out what's finished after each one
+    VERBOSE(context, "Parsing and writing blocks...");
+    elBlock block = firstBlock;
+    while (true)
+    {
+        gen.ParseBlock(block);
+        DrainStreamingOutputs(outputs);
+
+        if (!loader.ReadNextBlock(block))
+        {
+            break;
+        }
+    }
+
+    gen.DoneParsingBlocks();
+    DrainStreamingOutputs(outputs);
+
+    // Go back and fill in the headers, if the outputs can be seeked
+    for (std::vector<elStreamingOutput>::iterator output = outputs.begin(); output != outputs.end(); ++output)
+    {
+        if (output->pcmWriter)
+        {
+            output->pcmWriter->Finish();
+            if (output->pcmWriter->GetMeasures())
+            {
+                FinishMeasures(output->filename, *output->pcmWriter->GetMeasures());
+            }
+            if (!output->sink)
+            {
+                continue;
+            }
+
+            elOutputSink& sink = *output->sink;
+            const uint64_t sampleCount = (sink.Tell() - WAVE_RF64_HEADER_SIZE) / GetSampleSize(sampleFormat);
+            if (sink.Seek(0))
+            {
+                FinishStreamingWaveHeader(sink, output->pcmWriter->GetSampleRate(), sampleFormat,
+                                          output->pcmWriter->GetChannels(), sampleCount);
+            }
+            else
+            {
+                VERBOSE(context, "The output can't be seeked, leaving the length of the WAV open.");
+            }
+            sink.Close();
+        }
+        else
+        {
+            if (output->measures)
+            {
+                if (output->measures->meter)
+                {
+                    const elLoudnessMeter& meter = *output->measures->meter;
+                    gen.SetReplayGain(meter.GetReplayGain(), meter.GetSamplePeak(), output->index);
+                }
+                FinishMeasures(output->filename, *output->measures);
+            }
+
+            elOutputSink& sink = *output->sink;
+            const unsigned int vbrSize = gen.ReadVbrFrame(output->mpegBuffer.get(), MAX_MPEG_FRAME_BUFFER, output->index);
+            if (sink.Seek(0))
+            {
+                sink.Write(output->mpegBuffer.get(), vbrSize);
+            }
+            else
+            {
+                VERBOSE(context, "The output can't be seeked, leaving the VBR frame empty.");
+            }
+            sink.Close();
+        }
+    }
+    return;
+}
+
+
+void elFileDecoder::DrainStreamingOutputs(std::vector<elStreamingOutput>& outputs)
+{
+    for (std::vector<elStreamingOutput>::iterator output = outputs.begin(); output != outputs.end(); ++output)
+    {
+        if (output->pcmWriter)
+        {
+            _WritePcmSamples(*output->pcmWriter, *output->pcmStream, output->pcmBuffer.get(),
+                             elPcmOutputStream::RecommendBufferSize());
+        }
+        else
+        {
+            _WriteMpegFrames(*output->sink, *output->mpegStream, output->mpegBuffer.get(),
+                             MAX_MPEG_FRAME_BUFFER);
+            if (output->measures)
+            {
+                _MeasurePcmSamples(*output->measures, *output->pcmStream, output->pcmBuffer.get(),
+                                   elPcmOutputStream::RecommendBufferSize());
+            }
+        }
+    }
+    return;
+}
+
+
+elSampleFormat elFileDecoder::GetDecodeFormat() const
+{
+    // The converter works on floats, which the decoder can give it without rounding anything
+    if (outputRate || !channelMap.empty())
+    {
+        return SF_FLOAT32;
+    }
+    return sampleFormat;
+}
+
+
+shared_ptr<elPcmConverter> elFileDecoder::CreateConverter(unsigned int sampleRate, unsigned int channels) const
+{
+    if ((!outputRate || outputRate == sampleRate) && channelMap.empty() && GetDecodeFormat() == sampleFormat)
+    {
+        return shared_ptr<elPcmConverter>();
+    }
+    return shared_ptr<elPcmConverter>(new elPcmConverter(sampleRate, channels, outputRate, channelMap, sampleFormat));
+}
+
+
+shared_ptr<elOutputMeasures> elFileDecoder::CreateMeasures(const std::string& filename, unsigned int sampleRate,
+                                                          unsigned int channels) const
+{
+    // Nothing is written when verifying, the samples are only hashed
+    if (verify)
+    {
+        shared_ptr<elOutputMeasures> measures = make_shared<elOutputMeasures>();
+        measures->hash = make_shared<elHash64>();
+        return measures;
+    }
+    if (!analyze && !peakBucketFrames)
+    {
+        return shared_ptr<elOutputMeasures>();
+    }
+
+    shared_ptr<elOutputMeasures> measures = make_shared<elOutputMeasures>();
+    if (analyze)
+    {
+        measures->meter = make_shared<elLoudnessMeter>(sampleRate, channels);
+    }
+    if (peakBucketFrames)
+    {
+        measures->peakFile = make_shared<std::ofstream>();
+        OpenOutputFile(*measures->peakFile, _ReplaceExtension(filename, ".peaks"));
+        measures->peaks = shared_ptr<elPeakFileWriter>(new elPeakFileWriter(*measures->peakFile, sampleRate, channels,
+                                                                            peakBucketFrames));
+    }
+    return measures;
+}
+
+
+void elFileDecoder::FinishMeasures(const std::string& filename, elOutputMeasures& measures)
+{
+    // The samples are listed under the name of the WAV, next to the MP3 of the same stream
+    if (measures.hash)
+    {
+        AddOutputHash(_ReplaceExtension(filename, ".wav"), measures.hash->GetHexDigest());
+    }
+
+    // The files go next to the output, with the extension changed
+    if (measures.meter)
+    {
+        std::ofstream report;
+        OpenOutputFile(report, _ReplaceExtension(filename, ".json"));
+        WriteLoudnessReport(report, *measures.meter);
+        if (report.fail())
+        {
+            throw (runtime_error("Could not write the analysis of '" + filename + "'."));
+        }
+    }
+    if (measures.peaks)
+    {
+        measures.peaks->Finish();
+        if (measures.peakFile->fail())
+        {
+            throw (runtime_error("Could not write the peaks of '" + filename + "'."));
+        }
+    }
+    return;
+}
+
+
+bool elFileDecoder::WritesOutputs() const
+{
+    return !verify && outputFormat != F_NULL;
+}
+
+
+void elFileDecoder::AddOutputHash(const std::string& filename, const std::string& hash)
+{
+    // The streams of a part can be hashed by several threads
+    boost::mutex::scoped_lock locked(*hashLock);
+    outputHashes[filename] = hash;
+    return;
+}
+
+
+void elFileDecoder::ReportHashes()
+{
+    // Without a manifest the hashes are listed in the format of one
+    if (manifestFilename.empty())
+    {
+        for (std::map<std::string, std::string>::const_iterator i = outputHashes.begin(); i != outputHashes.end(); ++i)
+        {
+            std::cout << i->second << "  " << i->first << std::endl;
+        }
+        return;
+    }
+
+    // Each line of the manifest is a hash and the name of the output it's for
+    std::ifstream manifest(manifestFilename.c_str());
+    if (!manifest.is_open())
     {
-        throw (runtime_error((format("The stream index (%i) exceeds the total number of streams (%i).") %
-            (inputStream + 1) % gen.GetStreamCount()).str()));
+        throw (runtime_error("Could not open the manifest '" + manifestFilename + "'."));
     }
-    
-    // Load in the file
-    VERBOSE("Parsing blocks...");
-    gen.ParseBlock(firstBlock);
-    
-    while (true)
+    std::map<std::string, std::string> expected;
+    std::string line;
+    while (std::getline(manifest, line))
     {
-        elBlock block;
-        if (!loader.ReadNextBlock(block))
+        const std::string::size_type split = line.find_first_of(" \t");
+        const std::string::size_type name = line.find_first_not_of(" \t", split);
+        if (split == std::string::npos || name == std::string::npos)
         {
-            break;
+            continue;
         }
-        
-        gen.ParseBlock(block);
-    }
-    
-    gen.DoneParsingBlocks();
-    
-    // Write it out in the preferred output format
-    VERBOSE("Writing output file...");
-    
-    if (outputFormat == F_AUTO)
-    {
-        AutoSetOutputFormat();
+        std::string hash = line.substr(0, split);
+        std::transform(hash.begin(), hash.end(), hash.begin(), ::tolower);
+        expected[line.substr(name)] = hash;
     }
 
-    if (inputStream == -1)
+    unsigned int failed = 0;
+    unsigned int checked = outputHashes.size();
+    for (std::map<std::string, std::string>::const_iterator i = outputHashes.begin(); i != outputHashes.end(); ++i)
     {
-        if (outputFormat == F_MULTI_WAVE)
+        std::map<std::string, std::string>::const_iterator match = expected.find(i->first);
+        if (match == expected.end())
         {
-            WriteMultiWave(gen);
+            std::cout << i->first << ": not in the manifest" << std::endl;
+            failed++;
+        }
+        else if (match->second != i->second)
+        {
+            std::cout << i->first << ": FAILED" << std::endl;
+            VERBOSE(context, "Expected " << match->second << ", got " << i->second << ".");
+            failed++;
         }
         else
         {
-            WriteAllStreams(gen);
+            std::cout << i->first << ": OK" << std::endl;
         }
     }
-    else
+
+    // Whatever the manifest has that wasn't made at all fails too
+    for (std::map<std::string, std::string>::const_iterator i = expected.begin(); i != expected.end(); ++i)
     {
-        WriteSingleStream(gen);
+        if (outputHashes.find(i->first) == outputHashes.end())
+        {
+            std::cout << i->first << ": missing" << std::endl;
+            failed++;
+            checked++;
+        }
+    }
+    if (failed)
+    {
+        throw (runtime_error((format("%i of %i outputs don't match the manifest.") % failed % checked).str()));
     }
     return;
 }
@@ -267,7 +1401,7 @@ void elFileDecoder::ProcessPart(std::ifstream& input)
 
 void elFileDecoder::AutoSetOutputFormat()
 {
-    VERBOSE("Auto setting the output format");
+    VERBOSE(context, "Auto setting the output format");
     
     // Autodetect the output format from filename
     if (outputFilename.empty())
@@ -318,6 +1452,7 @@ std::string elFileDecoder::GenOutputFilename(const std::string& append) const
                 break;
             case F_WAVE:
             case F_MULTI_WAVE:
+            case F_NULL:
                 ext = ".wav";
                 break;
             case F_AUTO:
@@ -335,73 +1470,122 @@ std::string elFileDecoder::GenOutputFilename(const std::string& append) const
 }
 
 
-void elFileDecoder::WriteSingleStream(elMpegGenerator& gen)
+std::string elFileDecoder::GenStreamFilename(unsigned int index, unsigned int count) const
 {
-    // Get output file name
-    std::string filename;
     if (currentPart == 0)
     {
-        filename = GenOutputFilename("");
+        if (count == 1)
+        {
+            return GenOutputFilename("");
+        }
+        return GenOutputFilename((format("_%i") % (index + 1)).str());
     }
-    else
+
+    if (count == 1)
     {
-        filename = GenOutputFilename((format("_part%i") % (currentPart + 1)).str());
+        return GenOutputFilename((format("_part%i") % (currentPart + 1)).str());
     }
-    
-    // Open it and write it
-    std::ofstream outFile;
-    VERBOSE("Output file: " << filename);
-    outFile.open(filename.c_str(), std::ios_base::out | std::ios_base::binary);
-    if (!outFile.is_open())
+    return GenOutputFilename((format("_%ipart%i") % (index + 1) % (currentPart + 1)).str());
+}
+
+
+void elFileDecoder::OpenOutputFile(std::ofstream& output, const std::string& filename) const
+{
+    VERBOSE(context, "Output file: " << filename);
+    output.open(filename.c_str(), std::ios_base::out | std::ios_base::binary);
+    if (!output.is_open())
     {
         throw (runtime_error("Could not open output file '" + filename + "'."));
     }
-    
-    WriteMp3OrWave(outFile, gen, inputStream);
+    return;
+}
+
+
+shared_ptr<elOutputSink> elFileDecoder::OpenOutputSink(const std::string& filename, uint64_t size)
+{
+    if (!outputSink)
+    {
+        VERBOSE(context, "Output file: " << filename);
+        return CreateFileSink(context, filename, size);
+    }
+
+    if (outputSinkUsed)
+    {
+        throw (runtime_error("Only one output can be written to the output sink."));
+    }
+    outputSinkUsed = true;
+    return outputSink;
+}
+
+
+shared_ptr<elOutputSink> elFileDecoder::OpenWave(const std::string& filename, elWaveSampleWriter& writer)
+{
+    // The length is known, so the header is written once, up front, as RF64 if the wave is too long for RIFF
+    const uint64_t sampleCount = (uint64_t) writer.GetLength() * writer.GetChannels();
+    shared_ptr<elOutputSink> sink = OpenOutputSink(filename, GetWaveHeaderSize(writer.GetSampleFormat(), sampleCount) +
+                                                             sampleCount * GetSampleSize(writer.GetSampleFormat()));
+    WriteWaveHeader(*sink, writer.GetSampleRate(), writer.GetSampleFormat(), writer.GetChannels(), sampleCount);
+    writer.SetOutput(sink.get());
+    return sink;
+}
+
+
+void elFileDecoder::WriteSingleStream(elMpegGenerator& gen)
+{
+    WriteMp3OrWave(GenStreamFilename(inputStream, 1), gen, inputStream);
 }
 
 
 void elFileDecoder::WriteAllStreams(elMpegGenerator& gen)
 {
-    const int count = gen.GetStreamCount();
+    const unsigned int count = gen.GetStreamCount();
+
+    // Each MP3 is already written by several threads, but the streams are decoded one frame after another
+    unsigned int threads = threadCount ? threadCount : boost::thread::hardware_concurrency();
+    threads = std::min(threads, count);
+    if ((outputFormat != F_WAVE && outputFormat != F_NULL) || threads < 2)
+    {
+        for (unsigned int i = 0; i < count; i++)
+        {
+            WriteMp3OrWave(GenStreamFilename(i, count), gen, i);
+        }
+        return;
+    }
+
+    // Decode the streams at the same time
+    std::vector<std::string> errors(count);
+    boost::thread_group group;
+    for (unsigned int i = 0; i < threads; i++)
+    {
+        group.create_thread(boost::bind(&elFileDecoder::WriteStreams, this, boost::ref(gen), i, threads, &errors));
+    }
+    group.join_all();
+
     for (unsigned int i = 0; i < count; i++)
     {
-        // Get output file name
-        std::string filename;
-        if (currentPart == 0)
+        if (!errors[i].empty())
         {
-            if (count == 1)
-            {
-                filename = GenOutputFilename("");
-            }
-            else
-            {
-                filename = GenOutputFilename((format("_%i") % (i + 1)).str());
-            }
+            throw (runtime_error(errors[i]));
         }
-        else
+    }
+}
+
+
+void elFileDecoder::WriteStreams(elMpegGenerator& gen, unsigned int first, unsigned int step, std::vector<std::string>* errors)
+{
+    const unsigned int count = gen.GetStreamCount();
+    for (unsigned int i = first; i < count; i += step)
+    {
+        try
         {
-            if (count == 1)
-            {
-                filename = GenOutputFilename((format("_part%i") % (currentPart + 1)).str());
-            }
-            else
-            {
-                filename = GenOutputFilename((format("_%ipart%i") % (i + 1) % (currentPart + 1)).str());
-            }
+            WriteMp3OrWave(GenStreamFilename(i, count), gen, i);
         }
-        
-        // Open it and write it
-        std::ofstream outFile;
-        VERBOSE("Output file: " << filename);
-        outFile.open(filename.c_str(), std::ios_base::out | std::ios_base::binary);
-        if (!outFile.is_open())
+        catch (std::exception& e)
         {
-            throw (runtime_error("Could not open output file '" + filename + "'."));
+            (*errors)[i] = e.what();
         }
-        
-        WriteMp3OrWave(outFile, gen, i);
     }
+    return;
 }
 
 
@@ -418,23 +1602,48 @@ void elFileDecoder::WriteMultiWave(elMpegGenerator& gen)
         filename = GenOutputFilename((format("_part%i") % (currentPart + 1)).str());
     }
     
-    // Open it and write it
-    std::ofstream outFile;
-    VERBOSE("Output file: " << filename);
-    outFile.open(filename.c_str(), std::ios_base::out | std::ios_base::binary);
-    if (!outFile.is_open())
+    // Every stream is taken to the rate of the first one, unless another one is wanted
+    const unsigned int SampleRate = outputRate ? outputRate : gen.GetSampleRate(0);
+    bool Converting = !channelMap.empty();
+    for (unsigned int i = 0; i < gen.GetStreamCount(); i++)
     {
-        throw (runtime_error("Could not open output file '" + filename + "'."));
+        Converting = Converting || gen.GetSampleRate(i) != SampleRate;
     }
+    const elSampleFormat RingFormat = Converting ? SF_FLOAT32 : sampleFormat;
     
-    // Create the streams
-    std::vector< shared_ptr<elPcmOutputStream> > Streams;
+    // Decode each stream on its own thread
+    std::vector< shared_ptr<elDecodingStream> > Streams;
+    boost::mutex StreamLock;
+    boost::condition_variable StreamChanged;
     unsigned int ChannelCount = 0;
+    unsigned long Length = 0;
+    unsigned int Slack = 0;
     
     for (unsigned int i = 0; i < gen.GetStreamCount(); i++)
     {
-        Streams.push_back(gen.CreatePcmStream(i));
+        // Each stream's MP3 is hashed on its own, as it would be written without -mc
+        if (verify && !gen.IsDirectDecoding())
+        {
+            HashMp3(GenStreamFilename(i, gen.GetStreamCount()), gen, i);
+        }
+
+        shared_ptr<elPcmOutputStream> Stream = gen.CreatePcmStream(i);
+        Stream->SetSampleFormat(RingFormat);
+        shared_ptr<elPcmConverter> Converter;
+        if (gen.GetSampleRate(i) != SampleRate)
+        {
+            Converter = shared_ptr<elPcmConverter>(new elPcmConverter(gen.GetSampleRate(i), gen.GetChannels(i),
+                                                                      SampleRate, elChannelMap(), SF_FLOAT32));
+        }
+        Streams.push_back(make_shared<elDecodingStream>(Stream, Converter, boost::ref(StreamLock),
+                                                        boost::ref(StreamChanged)));
         ChannelCount += gen.GetChannels(i);
+        
+        // The longest stream decides how long the wave is
+        const unsigned long Frames = gen.GetDecodedSampleFrameCount(i);
+        Length = std::max(Length, Converter ? Converter->GetOutputFrames(Frames) : Frames);
+        const unsigned int FrameSamples = gen.GetSamplesPerFrame(i);
+        Slack = std::max(Slack, Converter ? (unsigned int) Converter->GetOutputFrames(FrameSamples) : FrameSamples);
     }
     
     if (!Streams.size())
@@ -442,105 +1651,417 @@ void elFileDecoder::WriteMultiWave(elMpegGenerator& gen)
         return;
     }
     
-    // Allocate a buffer
-    shared_array<short> ReadBuffer(new short[ChannelCount *
-    elPcmOutputStream::RecommendBufferSize()]);
-    const unsigned int PcmBufferSamples = elPcmOutputStream::RecommendBufferSize();
-    shared_array<short> PcmBuffer(new short[PcmBufferSamples]);
+    // The channels are mapped once the streams are interleaved
+    shared_ptr<elPcmConverter> Converter;
+    if (Converting)
+    {
+        Converter = shared_ptr<elPcmConverter>(new elPcmConverter(SampleRate, ChannelCount, 0, channelMap, sampleFormat));
+    }
+    elWaveSampleWriter Writer(RingFormat, Converter, SampleRate, ChannelCount);
+    Writer.SetMeasures(CreateMeasures(filename, Writer.GetSampleRate(), Writer.GetChannels()));
+    Writer.SetInputLength(Length, Slack);
+    
+    // Open it and write the header
+    shared_ptr<elOutputSink> Output;
+    if (WritesOutputs())
+    {
+        Output = OpenWave(filename, Writer);
+    }
+    
+    // Interleave whatever all of the streams have decoded; the streams which have ended are silent
+    const unsigned int BlockFrames = DECODE_RING_SIZE / 4;
+    const unsigned int SampleSize = GetSampleSize(RingFormat);
+    shared_array<uint8_t> ReadBuffer(new uint8_t[ChannelCount * BlockFrames * SampleSize]);
+    std::vector< shared_array<uint8_t> > PcmBuffers;
+    std::vector<const uint8_t*> Inputs;
+    std::vector<unsigned int> Channels;
     
-    // Prepare the wave
-    PrepareWaveHeader(outFile);
+    for (unsigned int i = 0; i < Streams.size(); i++)
+    {
+        PcmBuffers.push_back(shared_array<uint8_t>(new uint8_t[Streams[i]->channels * BlockFrames * SampleSize]));
+        Inputs.push_back(PcmBuffers[i].get());
+        Channels.push_back(Streams[i]->channels);
+    }
     
-    // Decode
-    while (!Streams[0]->Eos())
+    boost::thread_group Decoders;
+    try
     {
-        unsigned int Ch = 0;
-        unsigned int Frames = 0;
+        for (unsigned int i = 0; i < Streams.size(); i++)
+        {
+            Decoders.create_thread(boost::bind(_DecodeStream, Streams[i].get()));
+        }
         
-        for (unsigned int i = 0; i < gen.GetStreamCount(); i++)
+        while (true)
         {
-            unsigned int Read;
-            Read = Streams[i]->Read(PcmBuffer.get(), PcmBufferSamples);
-            Frames = Read / Streams[i]->GetChannels();
+            unsigned int Frames = BlockFrames;
+            unsigned int MostLeft = 0;
+            bool AllDone = true;
+            
+            for (unsigned int i = 0; i < Streams.size(); i++)
+            {
+                // Once a stream is done, everything it decoded is in the ring
+                const bool Done = Streams[i]->done.load(boost::memory_order_acquire);
+                const unsigned int Available = Streams[i]->samples.read_available() / (Streams[i]->channels * SampleSize);
+                if (!Done)
+                {
+                    Frames = std::min(Frames, Available);
+                    AllDone = false;
+                }
+                MostLeft = std::max(MostLeft, Available);
+            }
             
-            unsigned int OldCh = Ch;
+            // The longest stream decides when the wave ends
+            if (AllDone)
+            {
+                if (!MostLeft)
+                {
+                    break;
+                }
+                Frames = std::min(Frames, MostLeft);
+            }
             
-            for (unsigned int j = 0; j < Frames; j++)
+            // Wait for the streams that have run dry to decode some more or to end
+            if (!Frames)
             {
-                Ch = OldCh;
-                
-                for (unsigned int k = 0; k < Streams[i]->GetChannels(); k++)
+                boost::mutex::scoped_lock Locked(StreamLock);
+                while (std::find_if(Streams.begin(), Streams.end(), _IsStarved) != Streams.end())
                 {
-                    ReadBuffer[j * ChannelCount + Ch] = PcmBuffer[j * Streams[i]->GetChannels() + k];
-                    Ch++;
+                    StreamChanged.wait(Locked);
                 }
+                continue;
+            }
+            
+            for (unsigned int i = 0; i < Streams.size(); i++)
+            {
+                uint8_t* Pcm = PcmBuffers[i].get();
+                const unsigned int Size = Frames * Channels[i] * SampleSize;
+                const unsigned int Read = Streams[i]->samples.pop(Pcm, Size);
+                std::fill(Pcm + Read, Pcm + Size, 0);
             }
+            _NotifyDecodingStreams(Streams[0].get());
+            InterleaveSamples(ReadBuffer.get(), &Inputs[0], &Channels[0], Streams.size(), Frames, RingFormat);
+            
+            Writer.Write(ReadBuffer.get(), Frames * ChannelCount);
+        }
+    }
+    catch (...)
+    {
+        // The threads wait for room in their rings, so they have to be stopped before they're let go of
+        Decoders.interrupt_all();
+        Decoders.join_all();
+        throw;
+    }
+    Decoders.join_all();
+    
+    for (unsigned int i = 0; i < Streams.size(); i++)
+    {
+        if (!Streams[i]->error.empty())
+        {
+            throw (runtime_error(Streams[i]->error));
         }
-        
-        outFile.write((char*) ReadBuffer.get(), Frames * ChannelCount * sizeof(short));
     }
     
-    const unsigned int SampleCount = ((unsigned int) outFile.tellp() - 44) / 2;
-    outFile.seekp(0);
-    WriteWaveHeader(outFile, gen.GetSampleRate(0), 16,
-                    ChannelCount, SampleCount);
+    Writer.Finish();
+    if (Writer.GetMeasures())
+    {
+        FinishMeasures(filename, *Writer.GetMeasures());
+    }
+    if (Output)
+    {
+        Output->Close();
+    }
 }
 
 
-void elFileDecoder::WriteMp3OrWave(std::ofstream& output, elMpegGenerator& gen, unsigned int index)
+void elFileDecoder::WriteMp3OrWave(const std::string& filename, elMpegGenerator& gen, unsigned int index)
 {
     switch (outputFormat)
     {
         case F_MP3:
-            WriteMp3(output, gen, index);
+            if (verify)
+            {
+                HashMp3(filename, gen, index);
+                break;
+            }
+            MeasureMp3(filename, gen, index);
+            WriteMp3(filename, gen, index);
             break;
         case F_WAVE:
-            WriteWave(output, gen, index);
+        case F_NULL:
+            if (verify && !gen.IsDirectDecoding())
+            {
+                HashMp3(filename, gen, index);
+            }
+            WriteWave(filename, gen, index);
             break;
     }
 }
 
 
-void elFileDecoder::WriteMp3(std::ofstream& output, elMpegGenerator& gen, unsigned int index)
+void elFileDecoder::MeasureMp3(const std::string& filename, elMpegGenerator& gen, unsigned int index)
+{
+    shared_ptr<elOutputMeasures> measures = CreateMeasures(filename, gen.GetSampleRate(index), gen.GetChannels(index));
+    if (!measures)
+    {
+        return;
+    }
+
+    // The frames are decoded once to measure them, and the LAME tag is filled in before they're written
+    const unsigned int pcmBufferSamples = PCM_WRITE_BUFFER_SAMPLES;
+    shared_array<uint8_t> pcmBuffer(new uint8_t[pcmBufferSamples * GetSampleSize(SF_FLOAT32)]);
+
+    shared_ptr<elPcmOutputStream> stream = gen.CreatePcmStream(index);
+    stream->SetSampleFormat(SF_FLOAT32);
+    _MeasurePcmSamples(*measures, *stream, pcmBuffer.get(), pcmBufferSamples);
+
+    if (measures->meter)
+    {
+        gen.SetReplayGain(measures->meter->GetReplayGain(), measures->meter->GetSamplePeak(), index);
+    }
+    FinishMeasures(filename, *measures);
+    return;
+}
+
+
+void elFileDecoder::HashMp3(const std::string& filename, elMpegGenerator& gen, unsigned int index)
+{
+    // The pieces of the frames are hashed straight from the generator, in the order they'd be written
+    elHash64 hash;
+    std::vector<elMpegGenerator::elMpegSegment> segments;
+    elMpegGenerator::elMpegSegmentBuffer segmentBuffer;
+    const unsigned int frameCount = gen.GetFrameCount(index);
+    for (unsigned int i = 0; i < frameCount; i++)
+    {
+        segments.clear();
+        segmentBuffer.Clear();
+        gen.GetFrameSegments(segments, segmentBuffer, i, index);
+        for (unsigned int j = 0; j < segments.size(); j++)
+        {
+            hash.Update(segments[j].Data, segments[j].Size);
+        }
+    }
+    AddOutputHash(_ReplaceExtension(filename, ".mp3"), hash.GetHexDigest());
+    return;
+}
+
+
+void elFileDecoder::WriteMp3(const std::string& filename, elMpegGenerator& gen, unsigned int index)
 {
+#ifndef _WIN32
+    // Files are written by several threads at once, but a sink has to be written in order
+    if (!outputSink && WriteMp3File(filename, gen, index))
+    {
+        return;
+    }
+#endif
+
+    shared_ptr<elOutputSink> output = OpenOutputSink(filename, gen.GetStreamSize(index));
+
     // Create our buffer
     const unsigned int mpegBufferSize = MAX_MPEG_FRAME_BUFFER;
     shared_array<uint8_t> mpegBuffer(new uint8_t[mpegBufferSize]);
     
     // Now write the stream
     shared_ptr<elMpegOutputStream> stream = gen.CreateMpegStream(index);
-    
-    while (!stream->Eos())
+    _WriteMpegFrames(*output, *stream, mpegBuffer.get(), mpegBufferSize);
+    output->Close();
+}
+
+
+#ifndef _WIN32
+bool elFileDecoder::WriteMp3File(const std::string& filename, elMpegGenerator& gen, unsigned int index)
+{
+    elMpegFileWriter writer(gen, index);
+
+    // Every frame's size is known, so is where it goes in the file
+    const unsigned int frameCount = gen.GetFrameCount(index);
+    writer.offsets.push_back(0);
+    writer.chunks.push_back(0);
+    for (unsigned int i = 0; i < frameCount; i++)
     {
-        unsigned int lastRead;
-        lastRead = stream->Read(mpegBuffer.get(), mpegBufferSize);
-        output.write((char*) mpegBuffer.get(), lastRead);
+        writer.offsets.push_back(writer.offsets.back() + gen.GetFrameSize(i, index));
+        if (writer.offsets.back() - writer.offsets[writer.chunks.back()] >= MPEG_WRITE_CHUNK_SIZE || i + 1 == frameCount)
+        {
+            writer.chunks.push_back(i + 1);
+        }
+    }
+    assert(writer.offsets.back() == gen.GetStreamSize(index));
+    writer.errors.resize(writer.chunks.size());
+
+    VERBOSE(context, "Output file: " << filename);
+    writer.fd = open(filename.c_str(), O_WRONLY | O_CREAT, 0666);
+    if (writer.fd < 0)
+    {
+        throw (runtime_error("Could not open output file '" + filename + "'."));
     }
+
+    // Only a plain file can be written at offsets; anything else, like a pipe, is written in order
+    struct stat status;
+    if (fstat(writer.fd, &status) != 0 || !S_ISREG(status.st_mode))
+    {
+        close(writer.fd);
+        return false;
+    }
+
+    // Make room for the whole file up front
+    const off_t size = writer.offsets.back();
+    if (ftruncate(writer.fd, 0) != 0 || (size && posix_fallocate(writer.fd, 0, size) != 0 && ftruncate(writer.fd, size) != 0))
+    {
+        close(writer.fd);
+        unlink(filename.c_str());
+        throw (runtime_error("Could not make room for output file '" + filename + "'."));
+    }
+
+    // The frames of each chunk are gathered and written by whichever thread is free
+    unsigned int threads = threadCount ? threadCount : boost::thread::hardware_concurrency();
+    threads = std::min(threads, (unsigned int)writer.chunks.size() - 1);
+    if (threads > 1)
+    {
+        boost::thread_group group;
+        for (unsigned int i = 0; i < threads; i++)
+        {
+            group.create_thread(boost::bind(_WriteMpegChunks, &writer));
+        }
+        group.join_all();
+    }
+    else
+    {
+        _WriteMpegChunks(&writer);
+    }
+
+    // The file already has its full length, so don't leave it behind if it isn't all there
+    const bool closed = close(writer.fd) == 0;
+    for (unsigned int i = 0; i < writer.errors.size(); i++)
+    {
+        if (!writer.errors[i].empty())
+        {
+            unlink(filename.c_str());
+            throw (runtime_error(writer.errors[i]));
+        }
+    }
+    if (!closed)
+    {
+        unlink(filename.c_str());
+        throw (runtime_error("Could not write to the output file."));
+    }
+    return true;
 }
+#endif
 
 
-void elFileDecoder::WriteWave(std::ofstream& output, elMpegGenerator& gen, unsigned int index)
+void elFileDecoder::WriteWave(const std::string& filename, elMpegGenerator& gen, unsigned int index)
 {
-    // Create our buffer
-    const unsigned int pcmBufferSamples = elPcmOutputStream::RecommendBufferSize();
-    shared_array<short> pcmBuffer(new short[pcmBufferSamples]);
+    // Long streams are split into chunks of frames which are decoded at the same time
+    elPcmChunkDecoder decoder(gen, index, GetDecodeFormat());
+    const unsigned int frameCount = gen.GetFrameCount(index);
+    for (unsigned int i = 1; i < frameCount; i += PCM_DECODE_CHUNK_FRAMES)
+    {
+        decoder.chunks.push_back(i);
+    }
+    decoder.chunks.push_back(frameCount);
+    decoder.chunks[0] = 0;
 
-    // Create our stream and prepare the wave header
-    shared_ptr<elPcmOutputStream> stream = gen.CreatePcmStream(index);
-    PrepareWaveHeader(output);
-    
-    // Write the data
-    while (!stream->Eos())
+    const unsigned int chunkCount = decoder.chunks.size() - 1;
+    unsigned int threads = threadCount ? threadCount : boost::thread::hardware_concurrency();
+    threads = std::min(threads, chunkCount);
+
+    // Write the wave header; without an output the samples are only measured
+    elWaveSampleWriter writer(GetDecodeFormat(), CreateConverter(gen.GetSampleRate(index), gen.GetChannels(index)),
+                              gen.GetSampleRate(index), gen.GetChannels(index));
+    writer.SetMeasures(CreateMeasures(filename, writer.GetSampleRate(), writer.GetChannels()));
+    writer.SetInputLength(gen.GetDecodedSampleFrameCount(index), gen.GetSamplesPerFrame(index));
+    shared_ptr<elOutputSink> output;
+    if (WritesOutputs())
     {
-        unsigned int lastRead;
-        lastRead = stream->Read(pcmBuffer.get(), pcmBufferSamples);
-        output.write((char*) pcmBuffer.get(), lastRead * sizeof(short));
+        output = OpenWave(filename, writer);
+    }
+
+    if (threads < 2)
+    {
+        // Create our buffer
+        const unsigned int pcmBufferSamples = PCM_WRITE_BUFFER_SAMPLES;
+        shared_array<uint8_t> pcmBuffer(new uint8_t[pcmBufferSamples * GetSampleSize(GetDecodeFormat())]);
+
+        // Write the data
+        shared_ptr<elPcmOutputStream> stream = gen.CreatePcmStream(index);
+        stream->SetSampleFormat(GetDecodeFormat());
+        _WritePcmSamples(writer, *stream, pcmBuffer.get(), pcmBufferSamples);
+    }
+    else
+    {
+        decoder.ahead = threads * 2;
+        decoder.samples.resize(chunkCount);
+        decoder.decoded.resize(chunkCount);
+        decoder.errors.resize(chunkCount);
+
+        boost::thread_group group;
+        std::string error;
+        try
+        {
+            for (unsigned int i = 0; i < threads; i++)
+            {
+                group.create_thread(boost::bind(_DecodePcmChunks, &decoder));
+            }
+
+            // Write the chunks in order; the stream can't be longer than the sample count
+            const uint64_t sampleCount = (uint64_t) gen.GetSampleFrameCount() * gen.GetChannels(index);
+            const unsigned int sampleSize = GetSampleSize(GetDecodeFormat());
+            uint64_t samplesWritten = 0;
+            for (unsigned int i = 0; i < chunkCount && error.empty(); i++)
+            {
+                shared_ptr< std::vector<uint8_t> > samples;
+                {
+                    boost::mutex::scoped_lock locked(decoder.lock);
+                    while (!decoder.decoded[i])
+                    {
+                        decoder.changed.wait(locked);
+                    }
+                    samples.swap(decoder.samples[i]);
+                    error = decoder.errors[i];
+
+                    // Stop the threads from starting anything else
+                    if (!error.empty())
+                    {
+                        decoder.nextChunk = chunkCount;
+                    }
+                }
+
+                const unsigned int toWrite = (unsigned int) std::min((uint64_t) samples->size() / sampleSize, sampleCount - samplesWritten);
+                if (error.empty() && toWrite)
+                {
+                    writer.Write(&(*samples)[0], toWrite);
+                }
+                samplesWritten += toWrite;
+
+                {
+                    boost::mutex::scoped_lock locked(decoder.lock);
+                    decoder.written++;
+                }
+                decoder.changed.notify_all();
+            }
+        }
+        catch (...)
+        {
+            // The threads wait for the chunks to be written, so they have to be stopped before they're let go of
+            group.interrupt_all();
+            group.join_all();
+            throw;
+        }
+        group.join_all();
+
+        if (!error.empty())
+        {
+            throw (runtime_error(error));
+        }
     }
     
-    const unsigned int sampleCount = ((unsigned int) output.tellp() - 44) / 2;
-    
-    // Now write the final wave header
-    output.seekp(0);
-    WriteWaveHeader(output, gen.GetSampleRate(index), 16,
-                    gen.GetChannels(index), sampleCount);
+    writer.Finish();
+    if (writer.GetMeasures())
+    {
+        FinishMeasures(filename, *writer.GetMeasures());
+    }
+    if (output)
+    {
+        output->Close();
+    }
 }
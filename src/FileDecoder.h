@@ -7,14 +7,35 @@
 #pragma once
 
 #include <string>
+#include <vector>
+#include <map>
+#include <iosfwd>
 
+#include "SampleFormat.h"
+#include "PcmConverter.h"
+
+namespace boost
+{
+    class mutex;
+}
+
+class elContext;
 class elMpegGenerator;
+class elBlockLoader;
+class elBlock;
+class elOutputSink;
+class elWaveSampleWriter;
+struct elOutputMeasures;
+struct elStreamingOutput;
 
 class elFileDecoder
 {
 public:
     
-    elFileDecoder();
+    /**
+     * The context has to outlive the decoder.
+     */
+    elFileDecoder(const elContext& context);
     ~elFileDecoder();
     
     enum Format
@@ -22,7 +43,8 @@ public:
         F_AUTO,
         F_MP3,
         F_WAVE,
-        F_MULTI_WAVE
+        F_MULTI_WAVE,
+        F_NULL
     };
     
     enum Parser
@@ -68,6 +90,137 @@ public:
      */
     Format GetOutputFormat() const;
     
+    /**
+     * Write the output to this sink instead of to a file, such as stdout to
+     * pipe it into something else. Only one output can be written to it, so
+     * it's either a single stream or a multi-channel WAV.
+     */
+    void SetOutputSink(shared_ptr<elOutputSink> sink);
+    
+    /**
+     * Get the sink the output is written to, if it isn't written to a file.
+     */
+    shared_ptr<elOutputSink> GetOutputSink() const;
+    
+    /**
+     * Write the output while the input is parsed, so that the memory used
+     * doesn't grow with the length of the input. Multi-channel WAV output is
+     * still buffered.
+     */
+    void SetLowMemory(bool lowMemory);
+    
+    bool GetLowMemory() const;
+    
+    /**
+     * Write MP3 output at a constant bitrate (in kbit/s) instead of a variable
+     * one. Pass 0 for a variable bitrate.
+     */
+    void SetConstantBitrate(unsigned int bitrate);
+    
+    unsigned int GetConstantBitrate() const;
+    
+    /**
+     * Write MP3 output as free format frames, which are all the same size but
+     * don't have to match a standard bitrate. Not every decoder supports this.
+     */
+    void SetFreeFormat(bool freeFormat);
+    
+    bool GetFreeFormat() const;
+    
+    /**
+     * Set how many MP3 frames can wait for a bitrate while the bit reservoir is
+     * planned; see elMpegGenerator::SetLookahead(). The MP3s written depend on
+     * it. Pass 0 to plan the whole stream at once, which low memory output of
+     * MPEG frames can't do, so Process() throws then.
+     */
+    void SetLookahead(unsigned int frames);
+    
+    unsigned int GetLookahead() const;
+    
+    /**
+     * Set how many threads size the MP3 frames of different streams, write
+     * the frames of a stream, decode the streams to separate WAV files and
+     * decode the chunks of a long stream at the same time. Pass 0 to use one
+     * per processor.
+     */
+    void SetThreadCount(unsigned int threadCount);
+    
+    unsigned int GetThreadCount() const;
+    
+    /**
+     * Decode WAV output by putting MPEG frames together and feeding them to
+     * mpg123, instead of decoding the granules directly with the built-in
+     * decoder. Useful for checking one against the other.
+     */
+    void SetUseMpg123(bool useMpg123);
+    
+    bool GetUseMpg123() const;
+    
+    /**
+     * Write WAVs with 24-bit or 32-bit floating point samples instead of
+     * 16-bit ones. The decoder writes them straight from its own output, so
+     * nothing is lost to rounding on the way.
+     */
+    void SetSampleFormat(elSampleFormat sampleFormat);
+    
+    elSampleFormat GetSampleFormat() const;
+    
+    /**
+     * Resample WAVs to another sample rate. Pass 0 to keep the rate of the
+     * streams; a multi-channel WAV then has the rate of the first stream, and
+     * the other streams are resampled to it.
+     */
+    void SetSampleRate(unsigned int sampleRate);
+    
+    unsigned int GetSampleRate() const;
+    
+    /**
+     * Set which of the decoded channels make up each channel of a WAV; see
+     * ParseChannelMap(). For a multi-channel WAV these are the channels of all
+     * of the streams together. Pass an empty map to keep the channels.
+     */
+    void SetChannelMap(const elChannelMap& channelMap);
+    
+    const elChannelMap& GetChannelMap() const;
+    
+    /**
+     * Measure the integrated loudness, the true and sample peaks, the RMS
+     * level and the DC offset of each output while it's written, and write
+     * them to a .json file next to it. MP3s are decoded once to measure them,
+     * and the ReplayGain and peak go in their LAME tags too.
+     */
+    void SetAnalyze(bool analyze);
+    
+    bool GetAnalyze() const;
+    
+    /**
+     * Write a waveform peak file next to each output, with the minimum, maximum
+     * and RMS of each channel over every bucketFrames sample frames; see
+     * elPeakFileWriter. MP3s are decoded once to work them out. Pass 0 to
+     * write none. With the F_NULL output format the streams are decoded as
+     * they would be for WAVs, but only the peak and analysis files are
+     * written.
+     */
+    void SetPeaks(unsigned int bucketFrames);
+    
+    unsigned int GetPeaks() const;
+    
+    /**
+     * Hash the outputs instead of writing them: the bytes of each MP3, and for
+     * WAV output the samples of each WAV as well, listed under the .mp3 and
+     * .wav names. With the F_NULL output format only the samples are hashed.
+     * Nothing is written at all, not even the peak and analysis files. With a
+     * manifest, which has a hash and an output filename on each line, the
+     * hashes are checked against it and Process() throws if any don't match or
+     * any in the manifest weren't made; otherwise they're listed on stdout in
+     * the same format.
+     */
+    void SetVerify(bool verify, const std::string& manifest = "");
+    
+    bool GetVerify() const;
+    
+    const std::string& GetManifest() const;
+    
     // TODO add a class to force a certain parser
     
     /**
@@ -77,25 +230,66 @@ public:
     
     
 private:
+    const elContext& context;
     std::string inputFilename;
     std::streamoff inputOffset;
     int inputStream;
     Parser inputParser;
     std::string outputFilename;
     Format outputFormat;
+    bool lowMemory;
+    unsigned int constantBitrate;
+    bool freeFormat;
+    unsigned int lookahead;
+    unsigned int threadCount;
+    bool useMpg123;
+    elSampleFormat sampleFormat;
+    unsigned int outputRate;
+    elChannelMap channelMap;
+    bool analyze;
+    unsigned int peakBucketFrames;
+    bool verify;
+    std::string manifestFilename;
     
 private:
     int currentPart;
     
+    /// The sink the output goes to instead of a file, and whether it's been written to.
+    shared_ptr<elOutputSink> outputSink;
+    bool outputSinkUsed;
+    
+    /// The hash of each output by its filename, when verifying.
+    std::map<std::string, std::string> outputHashes;
+    shared_ptr<boost::mutex> hashLock;
+    
     void ProcessPart(std::ifstream& input);
     void AutoSetOutputFormat();
+    elSampleFormat GetDecodeFormat() const;
+    shared_ptr<elPcmConverter> CreateConverter(unsigned int sampleRate, unsigned int channels) const;
+    shared_ptr<elOutputMeasures> CreateMeasures(const std::string& filename, unsigned int sampleRate, unsigned int channels) const;
+    void FinishMeasures(const std::string& filename, elOutputMeasures& measures);
+    bool WritesOutputs() const;
+    void AddOutputHash(const std::string& filename, const std::string& hash);
+    void ReportHashes();
     std::string GenOutputFilename(const std::string& append) const;
+    std::string GenStreamFilename(unsigned int index, unsigned int count) const;
+    void OpenOutputFile(std::ofstream& output, const std::string& filename) const;
+    shared_ptr<elOutputSink> OpenOutputSink(const std::string& filename, uint64_t size = 0);
+    shared_ptr<elOutputSink> OpenWave(const std::string& filename, elWaveSampleWriter& writer);
+    void StreamPart(elBlockLoader& loader, elMpegGenerator& gen, const elBlock& firstBlock);
+    void DrainStreamingOutputs(std::vector<elStreamingOutput>& outputs);
     void WriteSingleStream(elMpegGenerator& gen);
     void WriteAllStreams(elMpegGenerator& gen);
+    void WriteStreams(elMpegGenerator& gen, unsigned int first, unsigned int step, std::vector<std::string>* errors);
     void WriteMultiWave(elMpegGenerator& gen);
-    void WriteMp3OrWave(std::ofstream& output, elMpegGenerator& gen, unsigned int index);
-    void WriteMp3(std::ofstream& output, elMpegGenerator& gen, unsigned int index);
-    void WriteWave(std::ofstream& output, elMpegGenerator& gen, unsigned int index);
+    void WriteMp3OrWave(const std::string& filename, elMpegGenerator& gen, unsigned int index);
+    void HashMp3(const std::string& filename, elMpegGenerator& gen, unsigned int index);
+    void MeasureMp3(const std::string& filename, elMpegGenerator& gen, unsigned int index);
+    void WriteMp3(const std::string& filename, elMpegGenerator& gen, unsigned int index);
+#ifndef _WIN32
+    bool WriteMp3File(const std::string& filename, elMpegGenerator& gen, unsigned int index);
+#endif
+    void WriteWave(const std::string& filename, elMpegGenerator& gen, unsigned int index);
 };
 
 
@@ -35,7 +35,10 @@ template<class T>
 class fsFormatSelector : public T
 {
 public:
-    fsFormatSelector()
+    /// The selector is made like any of its formats, with the same argument.
+    template<class TArg>
+    explicit fsFormatSelector(const TArg& Arg) :
+        T(Arg)
     {
         return;
     }
@@ -0,0 +1,172 @@
+/*
+    EA Layer 3 Extractor/Decoder
+    Copyright (C) 2010, Ben Moench.
+    See License.txt
+*/
+
+#include "Internal.h"
+#include "Hash64.h"
+
+#include <iomanip>
+#include <algorithm>
+
+// The primes of XXH64
+#define HASH_PRIME_1 0x9E3779B185EBCA87ULL
+#define HASH_PRIME_2 0xC2B2AE3D27D4EB4FULL
+#define HASH_PRIME_3 0x165667B19E3779F9ULL
+#define HASH_PRIME_4 0x85EBCA77C2B2AE63ULL
+#define HASH_PRIME_5 0x27D4EB2F165667C5ULL
+
+
+static inline uint64_t _Rotate(uint64_t Value, unsigned int Bits)
+{
+    return (Value << Bits) | (Value >> (64 - Bits));
+}
+
+/// Read eight or four bytes as little endian, wherever they are.
+static inline uint64_t _Read64(const uint8_t* Data)
+{
+    uint64_t Value = 0;
+    for (unsigned int i = 0; i < 8; i++)
+    {
+        Value |= (uint64_t)Data[i] << (i * 8);
+    }
+    return Value;
+}
+
+static inline uint64_t _Read32(const uint8_t* Data)
+{
+    return (uint64_t)Data[0] | ((uint64_t)Data[1] << 8) | ((uint64_t)Data[2] << 16) | ((uint64_t)Data[3] << 24);
+}
+
+/// Take eight bytes into a lane.
+static inline uint64_t _Round(uint64_t Lane, uint64_t Input)
+{
+    Lane += Input * HASH_PRIME_2;
+    Lane = _Rotate(Lane, 31);
+    return Lane * HASH_PRIME_1;
+}
+
+static inline uint64_t _MergeRound(uint64_t Hash, uint64_t Lane)
+{
+    Hash ^= _Round(0, Lane);
+    return Hash * HASH_PRIME_1 + HASH_PRIME_4;
+}
+
+
+elHash64::elHash64(uint64_t Seed) :
+    m_Seed(Seed),
+    m_Size(0),
+    m_StripeSize(0)
+{
+    m_Lanes[0] = Seed + HASH_PRIME_1 + HASH_PRIME_2;
+    m_Lanes[1] = Seed + HASH_PRIME_2;
+    m_Lanes[2] = Seed;
+    m_Lanes[3] = Seed - HASH_PRIME_1;
+    return;
+}
+
+elHash64::~elHash64()
+{
+    return;
+}
+
+void elHash64::Update(const void* Data, unsigned long Size)
+{
+    const uint8_t* Bytes = (const uint8_t*)Data;
+    m_Size += Size;
+
+    // Finish the stripe that was started last time
+    if (m_StripeSize)
+    {
+        const unsigned int ToCopy = std::min((unsigned long)(32 - m_StripeSize), Size);
+        memcpy(m_Stripe + m_StripeSize, Bytes, ToCopy);
+        m_StripeSize += ToCopy;
+        Bytes += ToCopy;
+        Size -= ToCopy;
+        if (m_StripeSize < 32)
+        {
+            return;
+        }
+        for (unsigned int i = 0; i < 4; i++)
+        {
+            m_Lanes[i] = _Round(m_Lanes[i], _Read64(m_Stripe + i * 8));
+        }
+        m_StripeSize = 0;
+    }
+
+    // Then the whole stripes, keeping the lanes in registers
+    uint64_t Lane0 = m_Lanes[0];
+    uint64_t Lane1 = m_Lanes[1];
+    uint64_t Lane2 = m_Lanes[2];
+    uint64_t Lane3 = m_Lanes[3];
+    for (; Size >= 32; Bytes += 32, Size -= 32)
+    {
+        Lane0 = _Round(Lane0, _Read64(Bytes));
+        Lane1 = _Round(Lane1, _Read64(Bytes + 8));
+        Lane2 = _Round(Lane2, _Read64(Bytes + 16));
+        Lane3 = _Round(Lane3, _Read64(Bytes + 24));
+    }
+    m_Lanes[0] = Lane0;
+    m_Lanes[1] = Lane1;
+    m_Lanes[2] = Lane2;
+    m_Lanes[3] = Lane3;
+
+    memcpy(m_Stripe, Bytes, Size);
+    m_StripeSize = Size;
+    return;
+}
+
+uint64_t elHash64::GetDigest() const
+{
+    uint64_t Hash;
+    if (m_Size >= 32)
+    {
+        Hash = _Rotate(m_Lanes[0], 1) + _Rotate(m_Lanes[1], 7) + _Rotate(m_Lanes[2], 12) + _Rotate(m_Lanes[3], 18);
+        for (unsigned int i = 0; i < 4; i++)
+        {
+            Hash = _MergeRound(Hash, m_Lanes[i]);
+        }
+    }
+    else
+    {
+        Hash = m_Seed + HASH_PRIME_5;
+    }
+    Hash += m_Size;
+
+    // The bytes that didn't make a whole stripe
+    const uint8_t* Bytes = m_Stripe;
+    unsigned int Left = m_StripeSize;
+    for (; Left >= 8; Bytes += 8, Left -= 8)
+    {
+        Hash ^= _Round(0, _Read64(Bytes));
+        Hash = _Rotate(Hash, 27) * HASH_PRIME_1 + HASH_PRIME_4;
+    }
+    if (Left >= 4)
+    {
+        Hash ^= _Read32(Bytes) * HASH_PRIME_1;
+        Hash = _Rotate(Hash, 23) * HASH_PRIME_2 + HASH_PRIME_3;
+        Bytes += 4;
+        Left -= 4;
+    }
+    for (; Left; Bytes++, Left--)
+    {
+        Hash ^= *Bytes * HASH_PRIME_5;
+        Hash = _Rotate(Hash, 11) * HASH_PRIME_1;
+    }
+
+    // Mix the last bits in
+    Hash ^= Hash >> 33;
+    Hash *= HASH_PRIME_2;
+    Hash ^= Hash >> 29;
+    Hash *= HASH_PRIME_3;
+    Hash ^= Hash >> 32;
+    return Hash;
+}
+
+std::string elHash64::GetHexDigest() const
+{
+    std::ostringstream Hex;
+    Hex << std::hex << std::setw(16) << std::setfill('0') << GetDigest();
+    return Hex.str();
+}
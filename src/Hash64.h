@@ -0,0 +1,39 @@
+/*
+    EA Layer 3 Extractor/Decoder
+    Copyright (C) 2010, Ben Moench.
+    See License.txt
+*/
+
+#pragma once
+
+#include "Internal.h"
+
+/**
+ * A fast 64-bit hash of a stream of bytes, which can come a piece at a time.
+ * It's XXH64, so the hashes of files match the ones xxhsum gives.
+ */
+class elHash64
+{
+public:
+    elHash64(uint64_t Seed = 0);
+    ~elHash64();
+
+    /// Hash some more bytes.
+    void Update(const void* Data, unsigned long Size);
+
+    /// Get the hash of all of the bytes so far.
+    uint64_t GetDigest() const;
+
+    /// Get the hash as 16 hex digits.
+    std::string GetHexDigest() const;
+
+protected:
+    /// The four lanes that each 32 byte stripe goes into.
+    uint64_t m_Lanes[4];
+    uint64_t m_Seed;
+    uint64_t m_Size;
+
+    /// The start of a stripe that hasn't been filled yet.
+    uint8_t m_Stripe[32];
+    unsigned int m_StripeSize;
+};
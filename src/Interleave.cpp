@@ -0,0 +1,282 @@
+/*
+    EA Layer 3 Extractor/Decoder
+    Copyright (C) 2010, Ben Moench.
+    See License.txt
+*/
+
+#include "Internal.h"
+#include "Interleave.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/// A packed 24-bit sample, only ever copied as a whole.
+struct elInt24Sample
+{
+    uint8_t Bytes[3];
+};
+
+/// Interleave Streams streams of Channels channels each, starting at sample frame First.
+template <unsigned int Channels, unsigned int Streams>
+static void _InterleaveFixed(short* Output, const short* const* Inputs, unsigned int First, unsigned int Frames)
+{
+    for (unsigned int j = First; j < Frames; j++)
+    {
+        for (unsigned int i = 0; i < Streams; i++)
+        {
+            for (unsigned int k = 0; k < Channels; k++)
+            {
+                Output[(j * Streams + i) * Channels + k] = Inputs[i][j * Channels + k];
+            }
+        }
+    }
+    return;
+}
+
+/// Interleave streams with any number of channels each, of samples of any type.
+template <typename Sample>
+static void _InterleaveAny(Sample* Output, const Sample* const* Inputs, const unsigned int* Channels,
+                           unsigned int StreamCount, unsigned int Frames)
+{
+    unsigned int ChannelCount = 0;
+    for (unsigned int i = 0; i < StreamCount; i++)
+    {
+        ChannelCount += Channels[i];
+    }
+
+    unsigned int Ch = 0;
+    for (unsigned int i = 0; i < StreamCount; i++)
+    {
+        const Sample* Input = Inputs[i];
+        Sample* Out = Output + Ch;
+        for (unsigned int j = 0; j < Frames; j++)
+        {
+            for (unsigned int k = 0; k < Channels[i]; k++)
+            {
+                Out[k] = Input[k];
+            }
+            Input += Channels[i];
+            Out += ChannelCount;
+        }
+        Ch += Channels[i];
+    }
+    return;
+}
+
+#ifdef __SSE2__
+/// Two mono streams, eight sample frames at a time; returns how many were done.
+static unsigned int _InterleaveMono2(short* Output, const short* const* Inputs, unsigned int Frames)
+{
+    unsigned int j = 0;
+    for (; j + 8 <= Frames; j += 8)
+    {
+        const __m128i A = _mm_loadu_si128((const __m128i*)(Inputs[0] + j));
+        const __m128i B = _mm_loadu_si128((const __m128i*)(Inputs[1] + j));
+        _mm_storeu_si128((__m128i*)(Output + j * 2), _mm_unpacklo_epi16(A, B));
+        _mm_storeu_si128((__m128i*)(Output + j * 2 + 8), _mm_unpackhi_epi16(A, B));
+    }
+    return j;
+}
+
+/// Four mono streams, eight sample frames at a time.
+static unsigned int _InterleaveMono4(short* Output, const short* const* Inputs, unsigned int Frames)
+{
+    unsigned int j = 0;
+    for (; j + 8 <= Frames; j += 8)
+    {
+        const __m128i A = _mm_loadu_si128((const __m128i*)(Inputs[0] + j));
+        const __m128i B = _mm_loadu_si128((const __m128i*)(Inputs[1] + j));
+        const __m128i C = _mm_loadu_si128((const __m128i*)(Inputs[2] + j));
+        const __m128i D = _mm_loadu_si128((const __m128i*)(Inputs[3] + j));
+
+        // Pairs of streams, then pairs of pairs
+        const __m128i AB0 = _mm_unpacklo_epi16(A, B);
+        const __m128i AB1 = _mm_unpackhi_epi16(A, B);
+        const __m128i CD0 = _mm_unpacklo_epi16(C, D);
+        const __m128i CD1 = _mm_unpackhi_epi16(C, D);
+
+        short* Out = Output + j * 4;
+        _mm_storeu_si128((__m128i*)(Out + 0), _mm_unpacklo_epi32(AB0, CD0));
+        _mm_storeu_si128((__m128i*)(Out + 8), _mm_unpackhi_epi32(AB0, CD0));
+        _mm_storeu_si128((__m128i*)(Out + 16), _mm_unpacklo_epi32(AB1, CD1));
+        _mm_storeu_si128((__m128i*)(Out + 24), _mm_unpackhi_epi32(AB1, CD1));
+    }
+    return j;
+}
+
+/// Eight mono streams, eight sample frames at a time.
+static unsigned int _InterleaveMono8(short* Output, const short* const* Inputs, unsigned int Frames)
+{
+    unsigned int j = 0;
+    for (; j + 8 <= Frames; j += 8)
+    {
+        __m128i S[8];
+        for (unsigned int i = 0; i < 8; i++)
+        {
+            S[i] = _mm_loadu_si128((const __m128i*)(Inputs[i] + j));
+        }
+
+        // Pairs of streams
+        __m128i T[8];
+        for (unsigned int i = 0; i < 4; i++)
+        {
+            T[i * 2] = _mm_unpacklo_epi16(S[i * 2], S[i * 2 + 1]);
+            T[i * 2 + 1] = _mm_unpackhi_epi16(S[i * 2], S[i * 2 + 1]);
+        }
+
+        // Fours of streams, two sample frames in each
+        __m128i U[8];
+        for (unsigned int i = 0; i < 2; i++)
+        {
+            U[i * 4 + 0] = _mm_unpacklo_epi32(T[i * 4 + 0], T[i * 4 + 2]);
+            U[i * 4 + 1] = _mm_unpackhi_epi32(T[i * 4 + 0], T[i * 4 + 2]);
+            U[i * 4 + 2] = _mm_unpacklo_epi32(T[i * 4 + 1], T[i * 4 + 3]);
+            U[i * 4 + 3] = _mm_unpackhi_epi32(T[i * 4 + 1], T[i * 4 + 3]);
+        }
+
+        // Whole sample frames
+        short* Out = Output + j * 8;
+        for (unsigned int i = 0; i < 4; i++)
+        {
+            _mm_storeu_si128((__m128i*)(Out + i * 16), _mm_unpacklo_epi64(U[i], U[i + 4]));
+            _mm_storeu_si128((__m128i*)(Out + i * 16 + 8), _mm_unpackhi_epi64(U[i], U[i + 4]));
+        }
+    }
+    return j;
+}
+
+/// Two stereo streams, four sample frames at a time.
+static unsigned int _InterleaveStereo2(short* Output, const short* const* Inputs, unsigned int Frames)
+{
+    unsigned int j = 0;
+    for (; j + 4 <= Frames; j += 4)
+    {
+        const __m128i A = _mm_loadu_si128((const __m128i*)(Inputs[0] + j * 2));
+        const __m128i B = _mm_loadu_si128((const __m128i*)(Inputs[1] + j * 2));
+        _mm_storeu_si128((__m128i*)(Output + j * 4), _mm_unpacklo_epi32(A, B));
+        _mm_storeu_si128((__m128i*)(Output + j * 4 + 8), _mm_unpackhi_epi32(A, B));
+    }
+    return j;
+}
+
+/// Four stereo streams, four sample frames at a time.
+static unsigned int _InterleaveStereo4(short* Output, const short* const* Inputs, unsigned int Frames)
+{
+    unsigned int j = 0;
+    for (; j + 4 <= Frames; j += 4)
+    {
+        const __m128i A = _mm_loadu_si128((const __m128i*)(Inputs[0] + j * 2));
+        const __m128i B = _mm_loadu_si128((const __m128i*)(Inputs[1] + j * 2));
+        const __m128i C = _mm_loadu_si128((const __m128i*)(Inputs[2] + j * 2));
+        const __m128i D = _mm_loadu_si128((const __m128i*)(Inputs[3] + j * 2));
+
+        const __m128i AB0 = _mm_unpacklo_epi32(A, B);
+        const __m128i AB1 = _mm_unpackhi_epi32(A, B);
+        const __m128i CD0 = _mm_unpacklo_epi32(C, D);
+        const __m128i CD1 = _mm_unpackhi_epi32(C, D);
+
+        short* Out = Output + j * 8;
+        _mm_storeu_si128((__m128i*)(Out + 0), _mm_unpacklo_epi64(AB0, CD0));
+        _mm_storeu_si128((__m128i*)(Out + 8), _mm_unpackhi_epi64(AB0, CD0));
+        _mm_storeu_si128((__m128i*)(Out + 16), _mm_unpacklo_epi64(AB1, CD1));
+        _mm_storeu_si128((__m128i*)(Out + 24), _mm_unpackhi_epi64(AB1, CD1));
+    }
+    return j;
+}
+#else
+static unsigned int _InterleaveMono2(short*, const short* const*, unsigned int) { return 0; }
+static unsigned int _InterleaveMono4(short*, const short* const*, unsigned int) { return 0; }
+static unsigned int _InterleaveMono8(short*, const short* const*, unsigned int) { return 0; }
+static unsigned int _InterleaveStereo2(short*, const short* const*, unsigned int) { return 0; }
+static unsigned int _InterleaveStereo4(short*, const short* const*, unsigned int) { return 0; }
+#endif // __SSE2__
+
+/// Interleave 16-bit samples, with the vector kernels for the common layouts.
+static void _InterleaveInt16(short* Output, const short* const* Inputs, const unsigned int* Channels,
+                             unsigned int StreamCount, unsigned int Frames)
+{
+    // The common layouts are all mono or all stereo streams
+    bool AllMono = true;
+    bool AllStereo = true;
+    for (unsigned int i = 0; i < StreamCount; i++)
+    {
+        AllMono = AllMono && Channels[i] == 1;
+        AllStereo = AllStereo && Channels[i] == 2;
+    }
+
+    // The vector kernels do what they can and the rest is finished one sample frame at a time
+    if (AllMono)
+    {
+        switch (StreamCount)
+        {
+            case 1: _InterleaveFixed<1, 1>(Output, Inputs, 0, Frames); return;
+            case 2: _InterleaveFixed<1, 2>(Output, Inputs, _InterleaveMono2(Output, Inputs, Frames), Frames); return;
+            case 3: _InterleaveFixed<1, 3>(Output, Inputs, 0, Frames); return;
+            case 4: _InterleaveFixed<1, 4>(Output, Inputs, _InterleaveMono4(Output, Inputs, Frames), Frames); return;
+            case 5: _InterleaveFixed<1, 5>(Output, Inputs, 0, Frames); return;
+            case 6: _InterleaveFixed<1, 6>(Output, Inputs, 0, Frames); return;
+            case 8: _InterleaveFixed<1, 8>(Output, Inputs, _InterleaveMono8(Output, Inputs, Frames), Frames); return;
+        }
+    }
+    else if (AllStereo)
+    {
+        switch (StreamCount)
+        {
+            case 1: _InterleaveFixed<2, 1>(Output, Inputs, 0, Frames); return;
+            case 2: _InterleaveFixed<2, 2>(Output, Inputs, _InterleaveStereo2(Output, Inputs, Frames), Frames); return;
+            case 3: _InterleaveFixed<2, 3>(Output, Inputs, 0, Frames); return;
+            case 4: _InterleaveFixed<2, 4>(Output, Inputs, _InterleaveStereo4(Output, Inputs, Frames), Frames); return;
+        }
+    }
+
+    _InterleaveAny(Output, Inputs, Channels, StreamCount, Frames);
+    return;
+}
+
+/// Point at the samples of each stream as the type they're moved as.
+template <typename Sample>
+static std::vector<const Sample*> _SampleInputs(const uint8_t* const* Inputs, unsigned int StreamCount)
+{
+    std::vector<const Sample*> Samples(StreamCount);
+    for (unsigned int i = 0; i < StreamCount; i++)
+    {
+        Samples[i] = (const Sample*)Inputs[i];
+    }
+    return Samples;
+}
+
+void InterleaveSamples(uint8_t* Output, const uint8_t* const* Inputs, const unsigned int* Channels,
+                       unsigned int StreamCount, unsigned int Frames, elSampleFormat Format)
+{
+    std::vector<unsigned int> Counts(Channels, Channels + StreamCount);
+    switch (Format)
+    {
+        case SF_INT16:
+        {
+            std::vector<const short*> Samples = _SampleInputs<short>(Inputs, StreamCount);
+            _InterleaveInt16((short*)Output, &Samples[0], &Counts[0], StreamCount, Frames);
+            break;
+        }
+
+        case SF_FLOAT32:
+        {
+            // Only whole samples are moved, so each float is as good as two 16-bit channels
+            std::vector<const short*> Samples = _SampleInputs<short>(Inputs, StreamCount);
+            for (unsigned int i = 0; i < StreamCount; i++)
+            {
+                Counts[i] *= 2;
+            }
+            _InterleaveInt16((short*)Output, &Samples[0], &Counts[0], StreamCount, Frames);
+            break;
+        }
+
+        case SF_INT24:
+        {
+            std::vector<const elInt24Sample*> Samples = _SampleInputs<elInt24Sample>(Inputs, StreamCount);
+            _InterleaveAny((elInt24Sample*)Output, &Samples[0], &Counts[0], StreamCount, Frames);
+            break;
+        }
+    }
+    return;
+}
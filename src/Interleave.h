@@ -0,0 +1,18 @@
+/*
+    EA Layer 3 Extractor/Decoder
+    Copyright (C) 2010, Ben Moench.
+    See License.txt
+*/
+
+#pragma once
+
+#include "SampleFormat.h"
+
+/**
+ * Interleave the samples of several streams into one buffer of sample frames,
+ * with the channels of each stream after the ones of the stream before it. Each
+ * input holds Frames sample frames with the channels of its stream, all in the
+ * same format.
+ */
+void InterleaveSamples(uint8_t* Output, const uint8_t* const* Inputs, const unsigned int* Channels,
+                       unsigned int StreamCount, unsigned int Frames, elSampleFormat Format);
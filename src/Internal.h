@@ -14,6 +14,7 @@
 #include "MyStdInt.h"
 
 #include <iostream>
+#include <sstream>
 #include <string>
 #include <vector>
 #include <deque>
@@ -25,19 +26,19 @@ using namespace boost;
 
 //#define ENABLE_VERY_VERBOSE
 
-// Macro for verbose
-extern int g_Verbose;
-#define VERBOSE(_output) VERBOSE_NO_ENDL(_output << std::endl)
-#define VERBOSE_NO_ENDL(_output) if(g_Verbose >= 1) { std::cout << _output; }
-#define VERBOSEVAR(_variable) VERBOSE("    " << #_variable << " = " << (_variable))
+// Macro for verbose; the level comes from the elContext passed in (see Context.h), and each
+// message is put together before it's printed so the messages from different threads don't get mixed up
+#define VERBOSE(_context, _output) VERBOSE_NO_ENDL(_context, _output << std::endl)
+#define VERBOSE_NO_ENDL(_context, _output) if((_context).GetVerbose() >= 1) { std::ostringstream _Message; _Message << _output; std::cout << _Message.str(); }
+#define VERBOSEVAR(_context, _variable) VERBOSE(_context, "    " << #_variable << " = " << (_variable))
 
 // Macro for very verbose
 #ifdef ENABLE_VERY_VERBOSE
-#define VERY_VERBOSE(_output) VERY_VERBOSE_NO_ENDL(_output << std::endl)
-#define VERY_VERBOSE_NO_ENDL(_output) if(g_Verbose >= 2) { std::cout << _output; }
+#define VERY_VERBOSE(_context, _output) VERY_VERBOSE_NO_ENDL(_context, _output << std::endl)
+#define VERY_VERBOSE_NO_ENDL(_context, _output) if((_context).GetVerbose() >= 2) { std::ostringstream _Message; _Message << _output; std::cout << _Message.str(); }
 #else
-#define VERY_VERBOSE(_output)
-#define VERY_VERBOSE_NO_ENDL(_output)
+#define VERY_VERBOSE(_context, _output)
+#define VERY_VERBOSE_NO_ENDL(_context, _output)
 #endif
 
 #ifndef NULL
@@ -0,0 +1,1118 @@
+/*
+    EA Layer 3 Extractor/Decoder
+    Copyright (C) 2010, Ben Moench.
+    See License.txt
+*/
+
+#include "Internal.h"
+#include "Layer3Decoder.h"
+#include "Layer3Tables.h"
+
+#include <math.h>
+#include <algorithm>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif // M_PI
+
+/// The bits each level of a Huffman lookup table looks at, at most.
+#define HUFFMAN_LOOKUP_BITS 8
+
+/// The flag of a Huffman lookup entry that points to the next level instead of holding a value.
+#define HUFFMAN_LINK 0x80000000
+
+/// The largest big value, which is 15 with the most linbits added to it.
+#define MAX_BIG_VALUE (15 + (1 << 13) - 1)
+
+/// The most scalefactor bands a granule can have: 13 short bands with three windows each.
+#define MAX_BANDS 39
+
+/// The lengths of the scalefactors of MPEG 1 for each scalefac_compress.
+static const unsigned char ScalefactorLengths[2][16] = {
+    {0, 0, 0, 0, 3, 1, 1, 1, 2, 2, 2, 3, 3, 3, 4, 4},
+    {0, 1, 2, 3, 0, 1, 2, 3, 1, 2, 3, 1, 2, 3, 2, 3}
+};
+
+/// Added to the long scalefactors when preflag is set.
+static const unsigned char Pretab[22] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 3, 3, 3, 2, 0};
+
+/// How many scalefactors of MPEG 2 are in each of the four groups, for long, short and mixed blocks.
+static const unsigned char LsfScalefactorCounts[6][3][4] = {
+    {{6, 5, 5, 5}, {9, 9, 9, 9}, {6, 9, 9, 9}},
+    {{6, 5, 7, 3}, {9, 9, 12, 6}, {6, 9, 12, 6}},
+    {{11, 10, 0, 0}, {18, 18, 0, 0}, {15, 18, 0, 0}},
+    {{7, 7, 7, 0}, {12, 12, 12, 0}, {6, 15, 12, 0}},
+    {{6, 6, 6, 3}, {12, 9, 9, 6}, {6, 12, 9, 6}},
+    {{8, 8, 5, 0}, {15, 12, 9, 0}, {6, 18, 9, 0}}
+};
+
+/// The alias reduction coefficients.
+static const double AntialiasCoefficients[8] = {-0.6, -0.535, -0.33, -0.185, -0.095, -0.041, -0.0142, -0.0037};
+
+
+/// Reads the main data of a granule; past the end of it there are only zeros.
+class elMainDataReader
+{
+public:
+    elMainDataReader(const uint8_t* Data, unsigned int Size) :
+        m_Data(Data), m_Size(Size), m_Position(0) {};
+
+    /// Look at the next 1 to 24 bits without reading them.
+    inline uint32_t Peek(unsigned int Count) const
+    {
+        const unsigned int Byte = m_Position >> 3;
+        uint32_t Bits;
+        if (Byte + 4 <= m_Size)
+        {
+            Bits = (m_Data[Byte] << 24) | (m_Data[Byte + 1] << 16) | (m_Data[Byte + 2] << 8) | m_Data[Byte + 3];
+        }
+        else
+        {
+            Bits = 0;
+            for (unsigned int i = 0; i < 4; i++)
+            {
+                Bits = (Bits << 8) | (Byte + i < m_Size ? m_Data[Byte + i] : 0);
+            }
+        }
+        return (Bits << (m_Position & 7)) >> (32 - Count);
+    }
+
+    inline void Skip(unsigned int Count)
+    {
+        m_Position += Count;
+        return;
+    }
+
+    inline uint32_t Read(unsigned int Count)
+    {
+        if (!Count)
+        {
+            return 0;
+        }
+        const uint32_t Bits = Peek(Count);
+        m_Position += Count;
+        return Bits;
+    }
+
+    inline unsigned int GetPosition() const
+    {
+        return m_Position;
+    }
+
+    inline void SetPosition(unsigned int Position)
+    {
+        m_Position = Position;
+        return;
+    }
+
+protected:
+    const uint8_t* m_Data;
+    unsigned int m_Size;
+    unsigned int m_Position;
+};
+
+
+/**
+ * A Huffman code table turned into lookup tables, which take up to
+ * HUFFMAN_LOOKUP_BITS at a time. An entry either holds a value and how many
+ * of the bits looked at belong to its code, or points to the table for the
+ * codes which are longer than that.
+ */
+class elHuffmanDecoder
+{
+public:
+    elHuffmanDecoder() : m_Size(0), m_Linbits(0) {};
+
+    void Build(const elHuffmanCodeTable& Table)
+    {
+        m_Size = Table.Size;
+        m_Linbits = Table.Linbits;
+        if (!Table.Codes)
+        {
+            return;
+        }
+
+        std::vector<unsigned int> Values;
+        for (unsigned int i = 0; i < Table.Size * Table.Size; i++)
+        {
+            Values.push_back(i);
+        }
+        BuildLevel(Table, Values, 0, HUFFMAN_LOOKUP_BITS);
+        return;
+    }
+
+    /// Is there no table, so that every value is 0?
+    inline bool IsEmpty() const
+    {
+        return m_Entries.empty();
+    }
+
+    inline unsigned int GetSize() const
+    {
+        return m_Size;
+    }
+
+    inline unsigned int GetLinbits() const
+    {
+        return m_Linbits;
+    }
+
+    inline unsigned int Decode(elMainDataReader& Reader) const
+    {
+        unsigned int Offset = 0;
+        unsigned int Bits = HUFFMAN_LOOKUP_BITS;
+        while (true)
+        {
+            const uint32_t Entry = m_Entries[Offset + Reader.Peek(Bits)];
+            if (Entry & HUFFMAN_LINK)
+            {
+                Reader.Skip(Bits);
+                Offset = Entry & 0xFFFF;
+                Bits = (Entry >> 16) & 0xFF;
+                continue;
+            }
+            Reader.Skip((Entry >> 8) & 0xFF);
+            return Entry & 0xFF;
+        }
+    }
+
+protected:
+    unsigned int BuildLevel(const elHuffmanCodeTable& Table, const std::vector<unsigned int>& Values,
+                            unsigned int Consumed, unsigned int Bits)
+    {
+        // Bits which aren't the start of any code are read as a zero value
+        const unsigned int Start = m_Entries.size();
+        m_Entries.resize(Start + (1 << Bits), Bits << 8);
+
+        std::vector<std::vector<unsigned int> > Longer(1 << Bits);
+        for (unsigned int i = 0; i < Values.size(); i++)
+        {
+            const unsigned int Value = Values[i];
+            const unsigned int Left = Table.Lengths[Value] - Consumed;
+            const unsigned int Code = Table.Codes[Value] & ((1U << Left) - 1);
+            if (Left <= Bits)
+            {
+                const unsigned int First = Code << (Bits - Left);
+                for (unsigned int j = 0; j < (1U << (Bits - Left)); j++)
+                {
+                    m_Entries[Start + First + j] = (Left << 8) | Value;
+                }
+            }
+            else
+            {
+                Longer[Code >> (Left - Bits)].push_back(Value);
+            }
+        }
+
+        // The longer codes are looked up in the next level
+        for (unsigned int i = 0; i < Longer.size(); i++)
+        {
+            if (Longer[i].empty())
+            {
+                continue;
+            }
+            unsigned int Longest = 0;
+            for (unsigned int j = 0; j < Longer[i].size(); j++)
+            {
+                Longest = std::max(Longest, (unsigned int)Table.Lengths[Longer[i][j]] - Consumed - Bits);
+            }
+            const unsigned int NextBits = std::min(Longest, (unsigned int)HUFFMAN_LOOKUP_BITS);
+            const unsigned int Next = BuildLevel(Table, Longer[i], Consumed + Bits, NextBits);
+            m_Entries[Start + i] = HUFFMAN_LINK | (NextBits << 16) | Next;
+        }
+        return Start;
+    }
+
+    std::vector<uint32_t> m_Entries;
+    unsigned int m_Size;
+    unsigned int m_Linbits;
+};
+
+
+/// The tables the decoder works out from the ones in the standard when the program starts.
+class elLayer3DecoderTables
+{
+public:
+    elLayer3DecoderTables()
+    {
+        for (unsigned int i = 0; i < 32; i++)
+        {
+            BigValues[i].Build(Layer3BigValueTables[i]);
+        }
+        for (unsigned int i = 0; i < 2; i++)
+        {
+            Count1[i].Build(Layer3Count1Tables[i]);
+        }
+
+        for (unsigned int i = 0; i <= MAX_BIG_VALUE; i++)
+        {
+            Pow43[i] = (float)pow((double)i, 4.0 / 3.0);
+        }
+
+        // The MPEG 1 intensity stereo ratios; the last one puts everything on the left
+        for (unsigned int i = 0; i < 7; i++)
+        {
+            const double Ratio = tan(i * M_PI / 12);
+            Intensity[i][0] = i == 6 ? 1.0f : (float)(Ratio / (1 + Ratio));
+            Intensity[i][1] = i == 6 ? 0.0f : (float)(1 / (1 + Ratio));
+        }
+
+        for (unsigned int i = 0; i < 8; i++)
+        {
+            const double Scale = sqrt(1 + AntialiasCoefficients[i] * AntialiasCoefficients[i]);
+            AntialiasCs[i] = (float)(1 / Scale);
+            AntialiasCa[i] = (float)(AntialiasCoefficients[i] / Scale);
+        }
+
+        // The windows of the normal, start and stop blocks, and the one used for each short block
+        for (unsigned int i = 0; i < 36; i++)
+        {
+            const float Long = (float)sin(M_PI / 36 * (i + 0.5));
+            Window[0][i] = Long;
+            Window[1][i] = i < 18 ? Long : (i < 24 ? 1.0f : (i < 30 ? (float)sin(M_PI / 12 * (i - 18 + 0.5)) : 0.0f));
+            Window[3][i] = i < 6 ? 0.0f : (i < 12 ? (float)sin(M_PI / 12 * (i - 6 + 0.5)) : (i < 18 ? 1.0f : Long));
+            Window[2][i] = i < 12 ? (float)sin(M_PI / 12 * (i + 0.5)) : 0.0f;
+        }
+
+        for (unsigned int i = 0; i < 36; i++)
+        {
+            for (unsigned int k = 0; k < 18; k++)
+            {
+                ImdctLong[i][k] = (float)cos(M_PI / 72 * (2 * i + 1 + 18) * (2 * k + 1));
+            }
+        }
+        for (unsigned int i = 0; i < 12; i++)
+        {
+            for (unsigned int k = 0; k < 6; k++)
+            {
+                ImdctShort[i][k] = (float)cos(M_PI / 24 * (2 * i + 1 + 6) * (2 * k + 1));
+            }
+        }
+
+        // The matrixing is a 32 point DCT, split into its even and odd outputs
+        for (unsigned int m = 0; m < 16; m++)
+        {
+            for (unsigned int k = 0; k < 16; k++)
+            {
+                DctEven[m][k] = (float)cos(M_PI / 32 * m * (2 * k + 1));
+                DctOdd[m][k] = (float)cos(M_PI / 64 * (2 * m + 1) * (2 * k + 1));
+            }
+        }
+
+        // Every other 64 taps of the window are negative, and the second half mirrors the first
+        for (unsigned int i = 0; i < 512; i++)
+        {
+            const int Tap = i <= 256 ? Layer3SynthesisWindow[i] : Layer3SynthesisWindow[512 - i];
+            SynthesisWindow[i] = (float)((i / 64) % 2 ? -Tap : Tap) / 65536.0f;
+        }
+        return;
+    }
+
+    elHuffmanDecoder BigValues[32];
+    elHuffmanDecoder Count1[2];
+    float Pow43[MAX_BIG_VALUE + 1];
+    float Intensity[7][2];
+    float AntialiasCs[8];
+    float AntialiasCa[8];
+    float Window[4][36];
+    float ImdctLong[36][18];
+    float ImdctShort[12][6];
+    float DctEven[16][16];
+    float DctOdd[16][16];
+    float SynthesisWindow[512];
+};
+
+static const elLayer3DecoderTables Tables;
+
+
+/// Reads bits from the side info which didn't go into part2_3_length, from the most significant one.
+static unsigned int _ReadSideInfoBits(const elChannelInfo& Ci, unsigned int RestBits, unsigned int& Position, unsigned int Count)
+{
+    unsigned int Value = 0;
+    for (unsigned int i = 0; i < Count; i++, Position++)
+    {
+        const uint32_t Bit = Position < 32 ? Ci.SideInfo[0] >> (31 - Position) : Ci.SideInfo[1] >> (RestBits - 1 - (Position - 32));
+        Value = (Value << 1) | (Bit & 1);
+    }
+    return Value;
+}
+
+
+elLayer3Decoder::elLayer3Decoder()
+{
+    Reset();
+    return;
+}
+
+elLayer3Decoder::~elLayer3Decoder()
+{
+    return;
+}
+
+void elLayer3Decoder::Reset()
+{
+    memset(m_Scalefactors, 0, sizeof(m_Scalefactors));
+    memset(m_Overlap, 0, sizeof(m_Overlap));
+    memset(m_Synth, 0, sizeof(m_Synth));
+    m_SynthPos[0] = 0;
+    m_SynthPos[1] = 0;
+    return;
+}
+
+unsigned int elLayer3Decoder::DecodeFrame(const elFrame& Frame, uint8_t* Buffer, unsigned int BufferSamples,
+                                          elSampleFormat Format)
+{
+    const elGranule& BaseGr = Frame.Gr[0];
+    if (!BaseGr.Used || BaseGr.Version == MV_RESERVED || BaseGr.SampleRateIndex > 2 ||
+        BaseGr.Channels < 1 || BaseGr.Channels > 2)
+    {
+        return 0;
+    }
+
+    const unsigned int Granules = BaseGr.Version == MV_1 ? 2 : 1;
+    const unsigned int Samples = Granules * LAYER3_GRANULE_SAMPLES * BaseGr.Channels;
+    if (Samples > BufferSamples)
+    {
+        return 0;
+    }
+
+    // The scfsi of the frame is kept with the second granule
+    unsigned int Scfsi[2] = {0, 0};
+    if (Granules == 2)
+    {
+        for (unsigned int i = 0; i < BaseGr.Channels; i++)
+        {
+            Scfsi[i] = Frame.Gr[1].ChannelInfo[i].Scfsi;
+        }
+    }
+
+    const unsigned int GranuleSamples = LAYER3_GRANULE_SAMPLES * BaseGr.Channels;
+    for (unsigned int i = 0; i < Granules; i++)
+    {
+        DecodeGranule(Frame.Gr[i], i, Scfsi);
+        ConvertSamples(Buffer + i * GranuleSamples * GetSampleSize(Format), Format, m_Pcm, GranuleSamples);
+    }
+    return Samples;
+}
+
+unsigned int elLayer3Decoder::RecommendBufferSize()
+{
+    return 2 * LAYER3_GRANULE_SAMPLES * 2;
+}
+
+void elLayer3Decoder::DecodeGranule(const elGranule& Gr, unsigned int GranuleIndex, unsigned int Scfsi[2])
+{
+    const unsigned int Channels = Gr.Channels;
+    elSideInfo Si[2];
+    elBand Bands[2][MAX_BANDS];
+    unsigned int BandCount[2];
+    int Values[2][LAYER3_GRANULE_SAMPLES];
+    unsigned int NonZero[2];
+
+    // The main data of the channels follow each other without any padding in between
+    elMainDataReader Reader(Gr.Data.get(), Gr.Data ? Gr.DataSize : 0);
+    unsigned int End = 0;
+    for (unsigned int i = 0; i < Channels; i++)
+    {
+        ReadSideInfo(Gr, i, Si[i]);
+        BandCount[i] = ListBands(Gr, Si[i], Bands[i]);
+
+        Reader.SetPosition(End);
+        End += Si[i].Part23Length;
+
+        bool Preflag = Si[i].Preflag;
+        if (Gr.Version == MV_1)
+        {
+            ReadScalefactors(Reader, Si[i], GranuleIndex, Scfsi[i], m_Scalefactors[i]);
+        }
+        else
+        {
+            ReadScalefactorsLsf(Reader, Gr, i, Si[i], m_Scalefactors[i], Preflag);
+        }
+        NonZero[i] = ReadSpectrum(Reader, End, Si[i], Values[i]);
+        Requantize(Values[i], NonZero[i], Si[i], m_Scalefactors[i], Preflag, Bands[i], BandCount[i], m_Samples[i]);
+    }
+
+    if (Channels == 2 && Gr.ChannelMode == CM_JOINT_STEREO && Gr.ModeExtension)
+    {
+        ProcessStereo(Gr, Si, Values[1], NonZero[1], Bands[1], BandCount[1]);
+    }
+
+    for (unsigned int i = 0; i < Channels; i++)
+    {
+        Reorder(Gr, Si[i], m_Samples[i]);
+        Antialias(Si[i], m_Samples[i]);
+        Hybrid(Si[i], i, m_Samples[i]);
+        Synthesize(i, m_Samples[i], Channels, m_Pcm);
+    }
+    return;
+}
+
+void elLayer3Decoder::ReadSideInfo(const elGranule& Gr, unsigned int Channel, elSideInfo& Si) const
+{
+    const elChannelInfo& Ci = Gr.ChannelInfo[Channel];
+    const bool Lsf = Gr.Version != MV_1;
+    const unsigned int RestBits = Lsf ? 51 - 32 : 47 - 32;
+    unsigned int Position = 0;
+
+    Si.Part23Length = Ci.Size;
+    Si.BigValues = std::min(_ReadSideInfoBits(Ci, RestBits, Position, 9) * 2, (unsigned int)LAYER3_GRANULE_SAMPLES);
+    Si.GlobalGain = _ReadSideInfoBits(Ci, RestBits, Position, 8);
+    Si.ScalefacCompress = _ReadSideInfoBits(Ci, RestBits, Position, Lsf ? 9 : 4);
+
+    const elScalefactorBands& Sfb = Layer3ScalefactorBands[Gr.Version][Gr.SampleRateIndex];
+    if (_ReadSideInfoBits(Ci, RestBits, Position, 1))
+    {
+        Si.BlockType = _ReadSideInfoBits(Ci, RestBits, Position, 2);
+        Si.MixedBlock = _ReadSideInfoBits(Ci, RestBits, Position, 1) != 0;
+        for (unsigned int i = 0; i < 2; i++)
+        {
+            Si.TableSelect[i] = _ReadSideInfoBits(Ci, RestBits, Position, 5);
+        }
+        Si.TableSelect[2] = 0;
+        for (unsigned int i = 0; i < 3; i++)
+        {
+            Si.SubblockGain[i] = _ReadSideInfoBits(Ci, RestBits, Position, 3);
+        }
+
+        // The regions are implied by the block type
+        Si.Region1Start = (Si.BlockType == 2 && !Si.MixedBlock) ? Sfb.Short[3] * 3 : Sfb.Long[8];
+        Si.Region2Start = LAYER3_GRANULE_SAMPLES;
+    }
+    else
+    {
+        Si.BlockType = 0;
+        Si.MixedBlock = false;
+        for (unsigned int i = 0; i < 3; i++)
+        {
+            Si.TableSelect[i] = _ReadSideInfoBits(Ci, RestBits, Position, 5);
+            Si.SubblockGain[i] = 0;
+        }
+        const unsigned int Region0Count = _ReadSideInfoBits(Ci, RestBits, Position, 4);
+        const unsigned int Region1Count = _ReadSideInfoBits(Ci, RestBits, Position, 3);
+        Si.Region1Start = Sfb.Long[std::min(Region0Count + 1, 22U)];
+        Si.Region2Start = Sfb.Long[std::min(Region0Count + Region1Count + 2, 22U)];
+    }
+
+    Si.Preflag = Lsf ? false : _ReadSideInfoBits(Ci, RestBits, Position, 1) != 0;
+    Si.ScalefacScale = _ReadSideInfoBits(Ci, RestBits, Position, 1) != 0;
+    Si.Count1Table = _ReadSideInfoBits(Ci, RestBits, Position, 1);
+    return;
+}
+
+unsigned int elLayer3Decoder::ListBands(const elGranule& Gr, const elSideInfo& Si, elBand* Bands) const
+{
+    const elScalefactorBands& Sfb = Layer3ScalefactorBands[Gr.Version][Gr.SampleRateIndex];
+    unsigned int Count = 0;
+
+    // Mixed blocks start with the long bands below the second subband, and the short ones go on from there
+    const unsigned int LongBands = Si.BlockType != 2 ? 22 : (Si.MixedBlock ? (Gr.Version == MV_1 ? 8 : 6) : 0);
+    for (unsigned int i = 0; i < LongBands; i++)
+    {
+        elBand& Band = Bands[Count++];
+        Band.Start = Sfb.Long[i];
+        Band.Width = Sfb.Long[i + 1] - Sfb.Long[i];
+        Band.Sfb = i;
+        Band.Window = 0;
+        Band.Short = false;
+    }
+    if (Si.BlockType != 2)
+    {
+        return Count;
+    }
+
+    for (unsigned int i = Si.MixedBlock ? 3 : 0; i < 13; i++)
+    {
+        for (unsigned int j = 0; j < 3; j++)
+        {
+            elBand& Band = Bands[Count++];
+            Band.Width = Sfb.Short[i + 1] - Sfb.Short[i];
+            Band.Start = Sfb.Short[i] * 3 + j * Band.Width;
+            Band.Sfb = i;
+            Band.Window = j;
+            Band.Short = true;
+        }
+    }
+    return Count;
+}
+
+void elLayer3Decoder::ReadScalefactors(elMainDataReader& Reader, const elSideInfo& Si, unsigned int GranuleIndex,
+                                       unsigned int Scfsi, elScalefactors& Sf)
+{
+    const unsigned int Slen1 = ScalefactorLengths[0][Si.ScalefacCompress];
+    const unsigned int Slen2 = ScalefactorLengths[1][Si.ScalefacCompress];
+
+    if (Si.BlockType == 2)
+    {
+        unsigned int Sfb = 0;
+        if (Si.MixedBlock)
+        {
+            for (; Sfb < 8; Sfb++)
+            {
+                Sf.Long[Sfb] = Reader.Read(Slen1);
+            }
+            Sfb = 3;
+        }
+        for (; Sfb < 12; Sfb++)
+        {
+            for (unsigned int i = 0; i < 3; i++)
+            {
+                Sf.Short[Sfb][i] = Reader.Read(Sfb < 6 ? Slen1 : Slen2);
+            }
+        }
+        for (unsigned int i = 0; i < 3; i++)
+        {
+            Sf.Short[12][i] = 0;
+        }
+
+        // mpg123 keeps the short scalefactors one after another where the long ones go, so a second
+        // granule that keeps the long ones with scfsi gets those instead of what an older frame left
+        unsigned int Position = Si.MixedBlock ? 8 : 0;
+        for (Sfb = Si.MixedBlock ? 3 : 0; Sfb < 13 && Position < 22; Sfb++)
+        {
+            for (unsigned int i = 0; i < 3 && Position < 22; i++)
+            {
+                Sf.Long[Position++] = Sf.Short[Sfb][i];
+            }
+        }
+    }
+    else
+    {
+        // With scfsi set for a group, the second granule keeps the scalefactors of the first
+        static const unsigned int Groups[5] = {0, 6, 11, 16, 21};
+        for (unsigned int i = 0; i < 4; i++)
+        {
+            if (GranuleIndex == 1 && (Scfsi >> (3 - i)) & 1)
+            {
+                continue;
+            }
+            for (unsigned int Sfb = Groups[i]; Sfb < Groups[i + 1]; Sfb++)
+            {
+                Sf.Long[Sfb] = Reader.Read(i < 2 ? Slen1 : Slen2);
+            }
+        }
+        Sf.Long[21] = 0;
+    }
+
+    // The intensity stereo positions of MPEG 1 always go up to 7
+    for (unsigned int i = 0; i < 22; i++)
+    {
+        Sf.LongMax[i] = 7;
+    }
+    for (unsigned int i = 0; i < 13; i++)
+    {
+        for (unsigned int j = 0; j < 3; j++)
+        {
+            Sf.ShortMax[i][j] = 7;
+        }
+    }
+    return;
+}
+
+void elLayer3Decoder::ReadScalefactorsLsf(elMainDataReader& Reader, const elGranule& Gr, unsigned int Channel,
+                                          const elSideInfo& Si, elScalefactors& Sf, bool& Preflag)
+{
+    // The right channel of intensity stereo has its own ways of packing the lengths
+    unsigned int Lengths[4] = {0, 0, 0, 0};
+    unsigned int Table;
+    unsigned int Compress = Si.ScalefacCompress;
+    Preflag = false;
+
+    if (Channel == 1 && Gr.ChannelMode == CM_JOINT_STEREO && (Gr.ModeExtension & 1))
+    {
+        Compress >>= 1;
+        if (Compress < 180)
+        {
+            Lengths[0] = Compress / 36;
+            Lengths[1] = (Compress % 36) / 6;
+            Lengths[2] = Compress % 6;
+            Table = 3;
+        }
+        else if (Compress < 244)
+        {
+            Compress -= 180;
+            Lengths[0] = (Compress % 64) >> 4;
+            Lengths[1] = (Compress % 16) >> 2;
+            Lengths[2] = Compress % 4;
+            Table = 4;
+        }
+        else
+        {
+            Compress -= 244;
+            Lengths[0] = Compress / 3;
+            Lengths[1] = Compress % 3;
+            Table = 5;
+        }
+    }
+    else
+    {
+        if (Compress < 400)
+        {
+            Lengths[0] = (Compress >> 4) / 5;
+            Lengths[1] = (Compress >> 4) % 5;
+            Lengths[2] = (Compress % 16) >> 2;
+            Lengths[3] = Compress % 4;
+            Table = 0;
+        }
+        else if (Compress < 500)
+        {
+            Compress -= 400;
+            Lengths[0] = (Compress >> 2) / 5;
+            Lengths[1] = (Compress >> 2) % 5;
+            Lengths[2] = Compress % 4;
+            Table = 1;
+        }
+        else
+        {
+            Compress -= 500;
+            Lengths[0] = Compress / 3;
+            Lengths[1] = Compress % 3;
+            Table = 2;
+            Preflag = true;
+        }
+    }
+
+    // Read them one after the other, and then spread them over the bands
+    const unsigned int Block = Si.BlockType == 2 ? (Si.MixedBlock ? 2 : 1) : 0;
+    int Values[MAX_BANDS];
+    int Max[MAX_BANDS];
+    unsigned int Count = 0;
+    for (unsigned int i = 0; i < 4; i++)
+    {
+        for (unsigned int j = 0; j < LsfScalefactorCounts[Table][Block][i]; j++)
+        {
+            Values[Count] = Reader.Read(Lengths[i]);
+            Max[Count] = (1 << Lengths[i]) - 1;
+            Count++;
+        }
+    }
+    for (; Count < MAX_BANDS; Count++)
+    {
+        Values[Count] = 0;
+        Max[Count] = 0;
+    }
+
+    memset(&Sf, 0, sizeof(Sf));
+    if (Block == 0)
+    {
+        for (unsigned int i = 0; i < 21; i++)
+        {
+            Sf.Long[i] = Values[i];
+            Sf.LongMax[i] = Max[i];
+        }
+    }
+    else
+    {
+        const unsigned int LongBands = Block == 2 ? 6 : 0;
+        const unsigned int FirstShort = Block == 2 ? 3 : 0;
+        for (unsigned int i = 0; i < LongBands; i++)
+        {
+            Sf.Long[i] = Values[i];
+            Sf.LongMax[i] = Max[i];
+        }
+        for (unsigned int i = LongBands; i < MAX_BANDS; i++)
+        {
+            const unsigned int Sfb = FirstShort + (i - LongBands) / 3;
+            if (Sfb < 12)
+            {
+                Sf.Short[Sfb][(i - LongBands) % 3] = Values[i];
+                Sf.ShortMax[Sfb][(i - LongBands) % 3] = Max[i];
+            }
+        }
+    }
+    return;
+}
+
+unsigned int elLayer3Decoder::ReadSpectrum(elMainDataReader& Reader, unsigned int End, const elSideInfo& Si, int* Values) const
+{
+    unsigned int i = 0;
+
+    // The big values come in pairs, with a table for each region
+    for (; i < Si.BigValues; i += 2)
+    {
+        const unsigned int Region = i < Si.Region1Start ? 0 : (i < Si.Region2Start ? 1 : 2);
+        const elHuffmanDecoder& Table = Tables.BigValues[Si.TableSelect[Region]];
+        if (Table.IsEmpty())
+        {
+            Values[i] = 0;
+            Values[i + 1] = 0;
+            continue;
+        }
+
+        const unsigned int Pair = Table.Decode(Reader);
+        int X = Pair / Table.GetSize();
+        int Y = Pair % Table.GetSize();
+        if (X == 15)
+        {
+            X += Reader.Read(Table.GetLinbits());
+        }
+        if (X && Reader.Read(1))
+        {
+            X = -X;
+        }
+        if (Y == 15)
+        {
+            Y += Reader.Read(Table.GetLinbits());
+        }
+        if (Y && Reader.Read(1))
+        {
+            Y = -Y;
+        }
+        Values[i] = X;
+        Values[i + 1] = Y;
+    }
+
+    // Then quads of values up to 1, until part2_3_length runs out
+    const elHuffmanDecoder& Quads = Tables.Count1[Si.Count1Table];
+    while (i + 4 <= LAYER3_GRANULE_SAMPLES && Reader.GetPosition() < End)
+    {
+        const unsigned int Quad = Quads.Decode(Reader);
+        int Quad4[4];
+        for (unsigned int j = 0; j < 4; j++)
+        {
+            Quad4[j] = (Quad >> (3 - j)) & 1;
+            if (Quad4[j] && Reader.Read(1))
+            {
+                Quad4[j] = -1;
+            }
+        }
+
+        // A quad which runs past the end is only what's left of the bits
+        if (Reader.GetPosition() > End)
+        {
+            break;
+        }
+        for (unsigned int j = 0; j < 4; j++)
+        {
+            Values[i + j] = Quad4[j];
+        }
+        i += 4;
+    }
+
+    const unsigned int NonZero = i;
+    for (; i < LAYER3_GRANULE_SAMPLES; i++)
+    {
+        Values[i] = 0;
+    }
+    return NonZero;
+}
+
+void elLayer3Decoder::Requantize(const int* Values, unsigned int NonZero, const elSideInfo& Si, const elScalefactors& Sf,
+                                 bool Preflag, const elBand* Bands, unsigned int BandCount, float* Samples) const
+{
+    const int Shift = Si.ScalefacScale ? 4 : 2;
+    for (unsigned int i = 0; i < BandCount; i++)
+    {
+        const elBand& Band = Bands[i];
+        if (Band.Start >= NonZero)
+        {
+            std::fill(Samples + Band.Start, Samples + Band.Start + Band.Width, 0.0f);
+            continue;
+        }
+
+        // The gain is in steps of a quarter of a power of two
+        int Exponent = (int)Si.GlobalGain - 210;
+        if (Band.Short)
+        {
+            Exponent -= 8 * Si.SubblockGain[Band.Window] + Shift * Sf.Short[Band.Sfb][Band.Window];
+        }
+        else
+        {
+            Exponent -= Shift * (Sf.Long[Band.Sfb] + (Preflag ? Pretab[Band.Sfb] : 0));
+        }
+        const float Gain = (float)pow(2.0, Exponent / 4.0);
+
+        for (unsigned int j = Band.Start; j < Band.Start + Band.Width; j++)
+        {
+            const int Value = Values[j];
+            Samples[j] = Value >= 0 ? Tables.Pow43[Value] * Gain : -Tables.Pow43[-Value] * Gain;
+        }
+    }
+    return;
+}
+
+void elLayer3Decoder::ProcessStereo(const elGranule& Gr, const elSideInfo* Si, const int* RightValues, unsigned int RightNonZero,
+                                    const elBand* Bands, unsigned int BandCount)
+{
+    const bool MidSide = (Gr.ModeExtension & 2) != 0;
+    const bool Intensity = (Gr.ModeExtension & 1) != 0;
+    const bool Lsf = Gr.Version != MV_1;
+    const elScalefactors& Sf = m_Scalefactors[1];
+    float* Left = m_Samples[0];
+    float* Right = m_Samples[1];
+
+    // Intensity stereo starts above the last band of the right channel with anything in it, for each window
+    int LastLong = -1;
+    int LastShort[3] = {-1, -1, -1};
+    bool AnyShort = false;
+    for (unsigned int i = 0; Intensity && i < BandCount; i++)
+    {
+        const elBand& Band = Bands[i];
+        bool Used = false;
+        for (unsigned int j = Band.Start; j < Band.Start + Band.Width && j < RightNonZero && !Used; j++)
+        {
+            Used = RightValues[j] != 0;
+        }
+        if (Used && Band.Short)
+        {
+            LastShort[Band.Window] = Band.Sfb;
+            AnyShort = true;
+        }
+        else if (Used)
+        {
+            LastLong = Band.Sfb;
+        }
+    }
+
+    // The long bands of a mixed block only count if none of the short ones has anything
+    if (AnyShort)
+    {
+        LastLong = 22;
+    }
+
+    const double IntensityScale = pow(2.0, -(double)((Si[1].ScalefacCompress & 1) + 1) / 4.0);
+    const float MidSideScale = (float)(1 / sqrt(2.0));
+    for (unsigned int i = 0; i < BandCount; i++)
+    {
+        const elBand& Band = Bands[i];
+        const unsigned int End = Band.Start + Band.Width;
+
+        if (Intensity && (int)Band.Sfb > (Band.Short ? LastShort[Band.Window] : LastLong))
+        {
+            // The last band doesn't have a position of its own, and takes the one before it
+            unsigned int Sfb = Band.Sfb;
+            if (Sfb == (Band.Short ? 12U : 21U))
+            {
+                Sfb--;
+            }
+            const int Position = Band.Short ? Sf.Short[Sfb][Band.Window] : Sf.Long[Sfb];
+            const int Illegal = Band.Short ? Sf.ShortMax[Sfb][Band.Window] : Sf.LongMax[Sfb];
+
+            if (Position != Illegal)
+            {
+                float LeftScale;
+                float RightScale;
+                if (!Lsf)
+                {
+                    LeftScale = Tables.Intensity[Position][0];
+                    RightScale = Tables.Intensity[Position][1];
+                }
+                else if (Position & 1)
+                {
+                    LeftScale = (float)pow(IntensityScale, (Position + 1) / 2);
+                    RightScale = 1.0f;
+                }
+                else
+                {
+                    LeftScale = 1.0f;
+                    RightScale = (float)pow(IntensityScale, Position / 2);
+                }
+
+                for (unsigned int j = Band.Start; j < End; j++)
+                {
+                    const float Middle = Left[j];
+                    Left[j] = Middle * LeftScale;
+                    Right[j] = Middle * RightScale;
+                }
+                continue;
+            }
+        }
+
+        if (MidSide)
+        {
+            for (unsigned int j = Band.Start; j < End; j++)
+            {
+                const float Middle = Left[j];
+                const float Side = Right[j];
+                Left[j] = (Middle + Side) * MidSideScale;
+                Right[j] = (Middle - Side) * MidSideScale;
+            }
+        }
+    }
+    return;
+}
+
+void elLayer3Decoder::Reorder(const elGranule& Gr, const elSideInfo& Si, float* Samples) const
+{
+    if (Si.BlockType != 2)
+    {
+        return;
+    }
+
+    // The short blocks come a window at a time in each band, and the IMDCT wants them interleaved
+    const elScalefactorBands& Sfb = Layer3ScalefactorBands[Gr.Version][Gr.SampleRateIndex];
+    float Reordered[LAYER3_GRANULE_SAMPLES];
+    const unsigned int First = Si.MixedBlock ? 3 : 0;
+    for (unsigned int i = First; i < 13; i++)
+    {
+        const unsigned int Start = Sfb.Short[i] * 3;
+        const unsigned int Width = Sfb.Short[i + 1] - Sfb.Short[i];
+        for (unsigned int j = 0; j < 3; j++)
+        {
+            for (unsigned int k = 0; k < Width; k++)
+            {
+                Reordered[Start + 3 * k + j] = Samples[Start + j * Width + k];
+            }
+        }
+    }
+    const unsigned int Start = Sfb.Short[First] * 3;
+    memcpy(Samples + Start, Reordered + Start, (LAYER3_GRANULE_SAMPLES - Start) * sizeof(float));
+    return;
+}
+
+void elLayer3Decoder::Antialias(const elSideInfo& Si, float* Samples) const
+{
+    // Only the boundaries between long blocks are smoothed over
+    if (Si.BlockType == 2 && !Si.MixedBlock)
+    {
+        return;
+    }
+    const unsigned int Subbands = Si.BlockType == 2 ? 2 : 32;
+
+    for (unsigned int i = 1; i < Subbands; i++)
+    {
+        float* Boundary = Samples + 18 * i;
+        for (unsigned int j = 0; j < 8; j++)
+        {
+            const float Lower = Boundary[-1 - (int)j];
+            const float Upper = Boundary[j];
+            Boundary[-1 - (int)j] = Lower * Tables.AntialiasCs[j] - Upper * Tables.AntialiasCa[j];
+            Boundary[j] = Upper * Tables.AntialiasCs[j] + Lower * Tables.AntialiasCa[j];
+        }
+    }
+    return;
+}
+
+void elLayer3Decoder::Hybrid(const elSideInfo& Si, unsigned int Channel, float* Samples)
+{
+    for (unsigned int i = 0; i < 32; i++)
+    {
+        float* Lines = Samples + 18 * i;
+        float* Overlap = m_Overlap[Channel][i];
+        float Output[36];
+
+        // The subbands below the short blocks of a mixed block use the normal window
+        const unsigned int BlockType = (Si.MixedBlock && i < 2) ? 0 : Si.BlockType;
+
+        bool Silent = true;
+        for (unsigned int j = 0; j < 18 && Silent; j++)
+        {
+            Silent = Lines[j] == 0.0f;
+        }
+
+        if (Silent)
+        {
+            std::fill(Output, Output + 36, 0.0f);
+        }
+        else if (BlockType == 2)
+        {
+            // Three overlapping short blocks in the middle of the long one
+            std::fill(Output, Output + 36, 0.0f);
+            for (unsigned int j = 0; j < 3; j++)
+            {
+                for (unsigned int k = 0; k < 12; k++)
+                {
+                    float Sum = 0.0f;
+                    for (unsigned int l = 0; l < 6; l++)
+                    {
+                        Sum += Lines[3 * l + j] * Tables.ImdctShort[k][l];
+                    }
+                    Output[6 + 6 * j + k] += Sum * Tables.Window[2][k];
+                }
+            }
+        }
+        else
+        {
+            for (unsigned int k = 0; k < 36; k++)
+            {
+                float Sum = 0.0f;
+                for (unsigned int l = 0; l < 18; l++)
+                {
+                    Sum += Lines[l] * Tables.ImdctLong[k][l];
+                }
+                Output[k] = Sum * Tables.Window[BlockType][k];
+            }
+        }
+
+        // Add the overlap from the granule before, and keep the second half for the next one
+        for (unsigned int j = 0; j < 18; j++)
+        {
+            Lines[j] = Output[j] + Overlap[j];
+            Overlap[j] = Output[18 + j];
+        }
+
+        // Every other sample of the odd subbands is inverted
+        if (i & 1)
+        {
+            for (unsigned int j = 1; j < 18; j += 2)
+            {
+                Lines[j] = -Lines[j];
+            }
+        }
+    }
+    return;
+}
+
+void elLayer3Decoder::Synthesize(unsigned int Channel, const float* Samples, unsigned int Channels, float* Pcm)
+{
+    for (unsigned int i = 0; i < 18; i++)
+    {
+        // Fold the subbands for the even and odd outputs of the DCT
+        float Even[16];
+        float Odd[16];
+        for (unsigned int j = 0; j < 16; j++)
+        {
+            const float Low = Samples[18 * j + i];
+            const float High = Samples[18 * (31 - j) + i];
+            Even[j] = Low + High;
+            Odd[j] = Low - High;
+        }
+
+        float Dct[32];
+        for (unsigned int j = 0; j < 16; j++)
+        {
+            float EvenSum = 0.0f;
+            float OddSum = 0.0f;
+            for (unsigned int k = 0; k < 16; k++)
+            {
+                EvenSum += Even[k] * Tables.DctEven[j][k];
+                OddSum += Odd[k] * Tables.DctOdd[j][k];
+            }
+            Dct[2 * j] = EvenSum;
+            Dct[2 * j + 1] = OddSum;
+        }
+
+        // The 64 outputs of the matrixing are the DCT, shifted and mirrored
+        m_SynthPos[Channel] = (m_SynthPos[Channel] + 15) & 15;
+        float* V = m_Synth[Channel][m_SynthPos[Channel]];
+        for (unsigned int j = 0; j < 16; j++)
+        {
+            V[j] = Dct[j + 16];
+        }
+        V[16] = 0.0f;
+        for (unsigned int j = 17; j < 48; j++)
+        {
+            V[j] = -Dct[48 - j];
+        }
+        for (unsigned int j = 48; j < 64; j++)
+        {
+            V[j] = -Dct[j - 48];
+        }
+
+        // Window the first half of the even outputs and the second half of the odd ones
+        for (unsigned int j = 0; j < 32; j++)
+        {
+            float Sum = 0.0f;
+            for (unsigned int k = 0; k < 8; k++)
+            {
+                const float* Newer = m_Synth[Channel][(m_SynthPos[Channel] + 2 * k) & 15];
+                const float* Older = m_Synth[Channel][(m_SynthPos[Channel] + 2 * k + 1) & 15];
+                Sum += Newer[j] * Tables.SynthesisWindow[64 * k + j];
+                Sum += Older[32 + j] * Tables.SynthesisWindow[64 * k + 32 + j];
+            }
+
+            Pcm[(32 * i + j) * Channels + Channel] = Sum;
+        }
+    }
+    return;
+}
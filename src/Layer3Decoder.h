@@ -0,0 +1,115 @@
+/*
+    EA Layer 3 Extractor/Decoder
+    Copyright (C) 2010, Ben Moench.
+    See License.txt
+*/
+
+#pragma once
+
+#include "Internal.h"
+#include "Parser.h"
+#include "SampleFormat.h"
+
+/// The number of samples each channel of a granule decodes to.
+#define LAYER3_GRANULE_SAMPLES 576
+
+class elMainDataReader;
+
+/**
+ * Decodes the granules of a stream straight to PCM, from the side info and main
+ * data the parser read, instead of putting MPEG frames together and handing
+ * them to mpg123. Every granule carries its own main data, so there is no bit
+ * reservoir to follow; the only state kept from one frame to the next is the
+ * IMDCT overlap and the synthesis filter history.
+ */
+class elLayer3Decoder
+{
+public:
+    elLayer3Decoder();
+    ~elLayer3Decoder();
+
+    /// Forget everything decoded so far, as at the start of a stream.
+    void Reset();
+
+    /**
+     * Decode the granules of a frame into interleaved samples of the format.
+     * Returns the number of samples written, or 0 if the buffer is too small
+     * for them.
+     */
+    unsigned int DecodeFrame(const elFrame& Frame, uint8_t* Buffer, unsigned int BufferSamples,
+                             elSampleFormat Format);
+
+    /// Get the size of the buffer that a frame needs at most.
+    static unsigned int RecommendBufferSize();
+
+protected:
+    /// The side info of one channel of a granule, unpacked.
+    struct elSideInfo
+    {
+        unsigned int Part23Length;
+        unsigned int BigValues;
+        unsigned int GlobalGain;
+        unsigned int ScalefacCompress;
+        unsigned int BlockType;
+        bool MixedBlock;
+        unsigned int TableSelect[3];
+        unsigned int SubblockGain[3];
+        unsigned int Region1Start;
+        unsigned int Region2Start;
+        bool Preflag;
+        bool ScalefacScale;
+        unsigned int Count1Table;
+    };
+
+    /// The scalefactors of one channel, and the largest value each could have had.
+    struct elScalefactors
+    {
+        int Long[22];
+        int Short[13][3];
+        int LongMax[22];
+        int ShortMax[13][3];
+    };
+
+    /// A scalefactor band of a granule, in the order the samples come in.
+    struct elBand
+    {
+        unsigned int Start;
+        unsigned int Width;
+        unsigned int Sfb;
+        unsigned int Window;
+        bool Short;
+    };
+
+    void DecodeGranule(const elGranule& Gr, unsigned int GranuleIndex, unsigned int Scfsi[2]);
+    void ReadSideInfo(const elGranule& Gr, unsigned int Channel, elSideInfo& Si) const;
+    unsigned int ListBands(const elGranule& Gr, const elSideInfo& Si, elBand* Bands) const;
+    void ReadScalefactors(elMainDataReader& Reader, const elSideInfo& Si, unsigned int GranuleIndex,
+                          unsigned int Scfsi, elScalefactors& Sf);
+    void ReadScalefactorsLsf(elMainDataReader& Reader, const elGranule& Gr, unsigned int Channel,
+                             const elSideInfo& Si, elScalefactors& Sf, bool& Preflag);
+    unsigned int ReadSpectrum(elMainDataReader& Reader, unsigned int End, const elSideInfo& Si, int* Values) const;
+    void Requantize(const int* Values, unsigned int NonZero, const elSideInfo& Si, const elScalefactors& Sf,
+                    bool Preflag, const elBand* Bands, unsigned int BandCount, float* Samples) const;
+    void ProcessStereo(const elGranule& Gr, const elSideInfo* Si, const int* RightValues, unsigned int RightNonZero,
+                       const elBand* Bands, unsigned int BandCount);
+    void Reorder(const elGranule& Gr, const elSideInfo& Si, float* Samples) const;
+    void Antialias(const elSideInfo& Si, float* Samples) const;
+    void Hybrid(const elSideInfo& Si, unsigned int Channel, float* Samples);
+    void Synthesize(unsigned int Channel, const float* Samples, unsigned int Channels, float* Pcm);
+
+    /// The samples of each channel of the granule being decoded.
+    float m_Samples[2][LAYER3_GRANULE_SAMPLES];
+
+    /// The interleaved output of the granule, before it's converted to the format wanted.
+    float m_Pcm[2 * LAYER3_GRANULE_SAMPLES];
+
+    /// The scalefactors of each channel from the granule before, for scfsi.
+    elScalefactors m_Scalefactors[2];
+
+    /// The second half of the last IMDCT of each subband, added to the next one.
+    float m_Overlap[2][32][18];
+
+    /// The last 16 outputs of the synthesis matrixing; the newest is at m_SynthPos and the older ones follow it.
+    float m_Synth[2][16][64];
+    unsigned int m_SynthPos[2];
+};
@@ -0,0 +1,40 @@
+/*
+    EA Layer 3 Extractor/Decoder
+    Copyright (C) 2010, Ben Moench.
+    See License.txt
+*/
+
+#pragma once
+
+#include "Internal.h"
+
+/// A Huffman code table from the standard, with the code and its length for each value.
+struct elHuffmanCodeTable
+{
+    /// The codes of the Size by Size values, x major; the count1 tables are 4 by 4, with vw as x and xy as y.
+    const uint16_t* Codes;
+    const uint8_t* Lengths;
+    unsigned int Size;
+
+    /// How many extra bits follow a value of 15; only the big value tables have these.
+    unsigned int Linbits;
+};
+
+/// Where the scalefactor bands start, and where the last one ends.
+struct elScalefactorBands
+{
+    unsigned short Long[23];
+    unsigned short Short[14];
+};
+
+/// The big value tables, by table_select; the ones without a code have a Size of 0.
+extern const elHuffmanCodeTable Layer3BigValueTables[32];
+
+/// The count1 tables, by count1table_select.
+extern const elHuffmanCodeTable Layer3Count1Tables[2];
+
+/// The scalefactor bands for each MPEG version and sample rate index.
+extern const elScalefactorBands Layer3ScalefactorBands[4][3];
+
+/// The first half of the synthesis window, scaled by 65536; the other half is a mirror of it.
+extern const int Layer3SynthesisWindow[257];
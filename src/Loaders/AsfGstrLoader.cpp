@@ -7,7 +7,8 @@
 #include "Internal.h"
 #include "AsfGstrLoader.h"
 
-elAsfGstrLoader::elAsfGstrLoader() :
+elAsfGstrLoader::elAsfGstrLoader(const elContext& Context) :
+    elSCxLoader(Context),
     m_BlockCount(0)
 {
     return;
@@ -12,7 +12,7 @@
 class elAsfGstrLoader : public elSCxLoader
 {
 public:
-    elAsfGstrLoader();
+    elAsfGstrLoader(const elContext& Context);
     virtual ~elAsfGstrLoader();
 
     /// Get the name associated with this loader.
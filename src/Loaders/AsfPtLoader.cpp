@@ -7,7 +7,8 @@
 #include "Internal.h"
 #include "AsfPtLoader.h"
 
-elAsfPtLoader::elAsfPtLoader() :
+elAsfPtLoader::elAsfPtLoader(const elContext& Context) :
+    elSCxLoader(Context),
     m_BlockCount(0)
 {
     return;
@@ -12,7 +12,7 @@
 class elAsfPtLoader : public elSCxLoader
 {
 public:
-    elAsfPtLoader();
+    elAsfPtLoader(const elContext& Context);
     virtual ~elAsfPtLoader();
 
     /// Get the name associated with this loader.
@@ -5,10 +5,13 @@
 */
 
 #include "Internal.h"
+#include "../Context.h"
 #include "HeaderBLoader.h"
+#include "../Parsers/ParserVersion5.h"
 #include "../Parsers/ParserVersion6.h"
 
-elHeaderBLoader::elHeaderBLoader() :
+elHeaderBLoader::elHeaderBLoader(const elContext& Context) :
+    elBlockLoader(Context),
     m_SampleRate(0),
     m_UseParser6(true)
 {
@@ -40,12 +43,12 @@ bool elHeaderBLoader::Initialize(std::istream* Input)
 
     if (BlockType != 0x4800)
     {
-        VERBOSE("L: header B loader incorrect because of block type");
+        VERBOSE(m_Context, "L: header B loader incorrect because of block type");
         return false;
     }
     if (BlockSize < 8)
     {
-        VERBOSE("L: header B loader incorrect because of block size");
+        VERBOSE(m_Context, "L: header B loader incorrect because of block size");
         return false;
     }
 
@@ -69,13 +72,13 @@ bool elHeaderBLoader::Initialize(std::istream* Input)
     }
     else
     {
-        VERBOSE("L: header B loader incorrect because of compression");
+        VERBOSE(m_Context, "L: header B loader incorrect because of compression");
         return false;
     }
     m_SampleRate = SampleRate;
 
     m_Input->seekg(BlockSize - 8, std::ios_base::cur);
-    VERBOSE("L: header B loader correct");
+    VERBOSE(m_Context, "L: header B loader correct");
     return true;
 }
 
@@ -116,13 +119,13 @@ bool elHeaderBLoader::ReadNextBlock(elBlock& Block)
     }
     else if (BlockType != 0x4400)
     {
-        VERBOSE("L: header B invalid block type");
+        VERBOSE(m_Context, "L: header B invalid block type");
         return false;
     }
 
     if (BlockSize <= 8)
     {
-        VERBOSE("L: header B block too small");
+        VERBOSE(m_Context, "L: header B block too small");
         return false;
     }
 
@@ -145,14 +148,14 @@ shared_ptr<elParser> elHeaderBLoader::CreateParser() const
 {
     if (m_UseParser6)
     {
-        return make_shared<elParserVersion6>();
+        return make_shared<elParserVersion6>(m_Context);
     }
-    return make_shared<elParser>();
+    return make_shared<elParserVersion5>(m_Context);
 }
 
 void elHeaderBLoader::ListSupportedParsers(std::vector<std::string>& Names) const
 {
-    Names.push_back(make_shared<elParser>()->GetName());
-    Names.push_back(make_shared<elParserVersion6>()->GetName());
+    Names.push_back(make_shared<elParserVersion5>(m_Context)->GetName());
+    Names.push_back(make_shared<elParserVersion6>(m_Context)->GetName());
     return;
 }
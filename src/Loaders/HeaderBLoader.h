@@ -12,7 +12,7 @@
 class elHeaderBLoader : public elBlockLoader
 {
 public:
-    elHeaderBLoader();
+    elHeaderBLoader(const elContext& Context);
     virtual ~elHeaderBLoader();
 
     /// Get the name associated with this loader.
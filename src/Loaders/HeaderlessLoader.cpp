@@ -5,13 +5,16 @@
 */
 
 #include "Internal.h"
+#include "../Context.h"
 #include "HeaderlessLoader.h"
 #include "../AllFormats.h"
 
 #include "../Parser.h"
+#include "../Parsers/ParserVersion5.h"
 #include "../Parsers/ParserVersion6.h"
 
-elHeaderlessLoader::elHeaderlessLoader() :
+elHeaderlessLoader::elHeaderlessLoader(const elContext& Context) :
+        elBlockLoader(Context),
         m_LastPacket(false)
 {
     return;
@@ -54,13 +57,13 @@ bool elHeaderlessLoader::Initialize(std::istream* Input)
         }
         if (Flags & 0x7FFF)
         {
-            VERBOSE("L: headerless loader incorrect because of flags");
+            VERBOSE(m_Context, "L: headerless loader incorrect because of flags");
             return false;
         }
 
         if (BlockSize < 8)
         {
-            VERBOSE("L: headerless loader incorrect because block size < 8");
+            VERBOSE(m_Context, "L: headerless loader incorrect because block size < 8");
             return false;
         }
 
@@ -72,7 +75,7 @@ bool elHeaderlessLoader::Initialize(std::istream* Input)
     m_Input->clear();
     m_Input->seekg(StartOffset);
 
-    VERBOSE("L: headerless loader correct");
+    VERBOSE(m_Context, "L: headerless loader correct");
     m_LastPacket = false;
     return true;
 }
@@ -135,10 +138,10 @@ bool elHeaderlessLoader::ReadNextBlock(elBlock& Block)
 
 shared_ptr<elParser> elHeaderlessLoader::CreateParser() const
 {
-    shared_ptr<elParserSelector> Selector = make_shared<elParserSelector>();
+    shared_ptr<elParserSelector> Selector = make_shared<elParserSelector>(m_Context);
     elParserSelector::fsFormat Formats[] = {
-        make_shared<elParserVersion6>(),
-        make_shared<elParser>()
+        make_shared<elParserVersion6>(m_Context),
+        make_shared<elParserVersion5>(m_Context)
     };
 
     Selector->SelectorListAdd(Formats, sizeof(Formats) / sizeof(elParserSelector::fsFormat));
@@ -147,7 +150,7 @@ shared_ptr<elParser> elHeaderlessLoader::CreateParser() const
 
 void elHeaderlessLoader::ListSupportedParsers(std::vector< std::string >& Names) const
 {
-    Names.push_back(make_shared<elParser>()->GetName());
-    Names.push_back(make_shared<elParserVersion6>()->GetName());
+    Names.push_back(make_shared<elParserVersion5>(m_Context)->GetName());
+    Names.push_back(make_shared<elParserVersion6>(m_Context)->GetName());
     return;
 }
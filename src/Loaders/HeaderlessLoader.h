@@ -12,7 +12,7 @@
 class elHeaderlessLoader : public elBlockLoader
 {
 public:
-    elHeaderlessLoader();
+    elHeaderlessLoader(const elContext& Context);
     virtual ~elHeaderlessLoader();
 
     /// Get the name associated with this loader.
@@ -8,7 +8,8 @@
 #include "SCxLoader.h"
 #include "../Parsers/ParserForSCx.h"
 
-elSCxLoader::elSCxLoader()
+elSCxLoader::elSCxLoader(const elContext& Context) :
+    elBlockLoader(Context)
 {
     ClearHeaderFields();
     return;
@@ -81,12 +82,12 @@ bool elSCxLoader::ReadNextBlock(elBlock& Block)
 
 shared_ptr<elParser> elSCxLoader::CreateParser() const
 {
-    return make_shared<elParserForSCx>();
+    return make_shared<elParserForSCx>(m_Context);
 }
 
 void elSCxLoader::ListSupportedParsers(std::vector< std::string >& Names) const
 {
-    Names.push_back(make_shared<elParserForSCx>()->GetName());
+    Names.push_back(make_shared<elParserForSCx>(m_Context)->GetName());
     return;
 }
 
@@ -12,7 +12,7 @@
 class elSCxLoader : public elBlockLoader
 {
 public:
-    elSCxLoader();
+    elSCxLoader(const elContext& Context);
     virtual ~elSCxLoader();
 
     /// Reads the next block from the file and updates the current block index.
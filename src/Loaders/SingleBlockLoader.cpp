@@ -5,11 +5,14 @@
 */
 
 #include "Internal.h"
+#include "../Context.h"
 #include "SingleBlockLoader.h"
 #include "../Parser.h"
+#include "../Parsers/ParserVersion5.h"
 #include "../Parsers/ParserVersion6.h"
 
-elSingleBlockLoader::elSingleBlockLoader() :
+elSingleBlockLoader::elSingleBlockLoader(const elContext& Context) :
+    elBlockLoader(Context),
     m_Compression(0)
 {
     return;
@@ -54,29 +57,29 @@ bool elSingleBlockLoader::Initialize(std::istream* Input)
     // Make sure its valid
     if (Compression < 5 || Compression > 7)
     {
-        VERBOSE("L: single block loader incorrect because of compression");
+        VERBOSE(m_Context, "L: single block loader incorrect because of compression");
         return false;
     }
     m_Compression = Compression;
     
     if (ChannelValue % 4 != 0)
     {
-        VERBOSE("L: single block loader incorrect because of channel value");
+        VERBOSE(m_Context, "L: single block loader incorrect because of channel value");
         return false;
     }
     if (TotalSamples1 != TotalSamples2)
     {
-        VERBOSE("L: single block loader incorrect because total samples don't equal each other");
+        VERBOSE(m_Context, "L: single block loader incorrect because total samples don't equal each other");
         return false;
     }
     m_Input->seekg(0, std::ios_base::end);
     if (BlockSize + 8 > m_Input->tellg())
     {
-        VERBOSE("L: single block loader incorrect because of size");
+        VERBOSE(m_Context, "L: single block loader incorrect because of size");
         return false;
     }
 
-    VERBOSE("L: single block loader correct");
+    VERBOSE(m_Context, "L: single block loader correct");
     m_Input->clear();
     m_Input->seekg(StartOffset);
     return true;
@@ -132,17 +135,17 @@ shared_ptr<elParser> elSingleBlockLoader::CreateParser() const
     switch (m_Compression)
     {
         case 5:
-            return make_shared<elParser>();
+            return make_shared<elParserVersion5>(m_Context);
         case 6:
         case 7:
-            return make_shared<elParserVersion6>();
+            return make_shared<elParserVersion6>(m_Context);
     }
     return shared_ptr<elParser>();
 }
 
 void elSingleBlockLoader::ListSupportedParsers(std::vector< std::string >& Names) const
 {
-    Names.push_back(make_shared<elParser>()->GetName());
-    Names.push_back(make_shared<elParserVersion6>()->GetName());
+    Names.push_back(make_shared<elParserVersion5>(m_Context)->GetName());
+    Names.push_back(make_shared<elParserVersion6>(m_Context)->GetName());
     return;
 }
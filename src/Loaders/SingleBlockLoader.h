@@ -12,7 +12,7 @@
 class elSingleBlockLoader : public elBlockLoader
 {
 public:
-    elSingleBlockLoader();
+    elSingleBlockLoader(const elContext& Context);
     virtual ~elSingleBlockLoader();
 
     /// Get the name associated with this loader.
@@ -0,0 +1,366 @@
+/*
+    EA Layer 3 Extractor/Decoder
+    Copyright (C) 2010, Ben Moench.
+    See License.txt
+*/
+
+#include "Internal.h"
+#include "LoudnessMeter.h"
+
+#include <math.h>
+#include <iomanip>
+#include <algorithm>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+/// How many samples each phase of the true peak filter reaches over.
+#define TRUE_PEAK_TAPS 12
+
+/// The Kaiser window of the true peak filter.
+#define TRUE_PEAK_KAISER_BETA 5.0
+
+/// The blocks of the gating are 400 ms long, starting every 100 ms.
+#define LOUDNESS_STEPS_PER_BLOCK 4
+
+/// Blocks quieter than this are left out of the integrated loudness, as is anything 10 LU under the rest.
+#define LOUDNESS_ABSOLUTE_GATE -70.0
+#define LOUDNESS_RELATIVE_GATE -10.0
+
+/// The loudness ReplayGain 2.0 takes everything to, in LUFS.
+#define REPLAY_GAIN_REFERENCE -18.0
+
+
+/// The zeroth order modified Bessel function, for the Kaiser window.
+static double _BesselI0(double X)
+{
+    double Sum = 1.0;
+    double Term = 1.0;
+    for (unsigned int k = 1; k < 50 && Term > Sum * 1e-12; k++)
+    {
+        Term *= (X / (2.0 * k)) * (X / (2.0 * k));
+        Sum += Term;
+    }
+    return Sum;
+}
+
+/// The loudness of a mean K-weighted energy, in LUFS.
+static double _Loudness(double Energy)
+{
+    return Energy > 0.0 ? -0.691 + 10.0 * log10(Energy) : -HUGE_VAL;
+}
+
+/// A level where 1.0 is full scale in dB.
+static double _Decibels(double Level)
+{
+    return Level > 0.0 ? 20.0 * log10(Level) : -HUGE_VAL;
+}
+
+
+elLoudnessMeter::elLoudnessMeter(unsigned int SampleRate, unsigned int Channels) :
+    m_SampleRate(SampleRate),
+    m_Channels(Channels),
+    m_Frames(0),
+    m_Filters(Channels),
+    m_StepFrames((SampleRate + 5) / 10),
+    m_StepFilled(0),
+    m_StepEnergy(0.0),
+    m_SamplePeak(0.0),
+    m_TruePeak(0.0),
+    m_SquareSum(0.0),
+    m_Sums(Channels, 0.0),
+    m_PeakHistory(Channels, std::vector<float>(TRUE_PEAK_TAPS - 1, 0.0f))
+{
+    // The K-weighting of BS.1770: a high shelf for the head, then a high pass, worked out for this rate
+    double K = tan(M_PI * 1681.974450955533 / SampleRate);
+    double Q = 0.7071752369554196;
+    const double Vh = pow(10.0, 3.999843853973347 / 20.0);
+    const double Vb = pow(Vh, 0.4996667741545416);
+    double A0 = 1.0 + K / Q + K * K;
+    m_ShelfB[0] = (Vh + Vb * K / Q + K * K) / A0;
+    m_ShelfB[1] = 2.0 * (K * K - Vh) / A0;
+    m_ShelfB[2] = (Vh - Vb * K / Q + K * K) / A0;
+    m_ShelfA[0] = 1.0;
+    m_ShelfA[1] = 2.0 * (K * K - 1.0) / A0;
+    m_ShelfA[2] = (1.0 - K / Q + K * K) / A0;
+
+    K = tan(M_PI * 38.13547087602444 / SampleRate);
+    Q = 0.5003270373238773;
+    A0 = 1.0 + K / Q + K * K;
+    m_HighPassB[0] = 1.0;
+    m_HighPassB[1] = -2.0;
+    m_HighPassB[2] = 1.0;
+    m_HighPassA[0] = 1.0;
+    m_HighPassA[1] = 2.0 * (K * K - 1.0) / A0;
+    m_HighPassA[2] = (1.0 - K / Q + K * K) / A0;
+
+    // Look between the samples at four times the rate, or less when the rate is already high
+    m_Oversampling = SampleRate < 96000 ? 4 : (SampleRate < 192000 ? 2 : 1);
+    m_PeakFilter.resize(m_Oversampling * TRUE_PEAK_TAPS);
+    const double WindowScale = 1.0 / _BesselI0(TRUE_PEAK_KAISER_BETA);
+    for (unsigned int p = 1; p < m_Oversampling; p++)
+    {
+        // Phase p falls p parts of the way from the middle sample of its taps to the next one
+        for (unsigned int i = 0; i < TRUE_PEAK_TAPS; i++)
+        {
+            const double X = (TRUE_PEAK_TAPS / 2 - 1) + (double)p / m_Oversampling - i;
+            const double Edge = X / (TRUE_PEAK_TAPS / 2);
+            const double Window = Edge * Edge < 1.0 ?
+                _BesselI0(TRUE_PEAK_KAISER_BETA * sqrt(1.0 - Edge * Edge)) * WindowScale : 0.0;
+            m_PeakFilter[p * TRUE_PEAK_TAPS + i] = (float)(sin(M_PI * X) / (M_PI * X) * Window);
+        }
+    }
+    return;
+}
+
+elLoudnessMeter::~elLoudnessMeter()
+{
+    return;
+}
+
+void elLoudnessMeter::Process(const uint8_t* Samples, elSampleFormat Format, unsigned int Count)
+{
+    const unsigned int Frames = Count / m_Channels;
+    if (!Frames)
+    {
+        return;
+    }
+
+    m_Input.resize(Frames * m_Channels);
+    ConvertSamplesToFloat(&m_Input[0], Samples, Format, Frames * m_Channels);
+
+    MeasureLevels(Frames);
+    MeasureTruePeak(Frames);
+    m_Frames += Frames;
+    return;
+}
+
+void elLoudnessMeter::MeasureLevels(unsigned int Frames)
+{
+    const float* Sample = &m_Input[0];
+    for (unsigned int i = 0; i < Frames; i++)
+    {
+        for (unsigned int c = 0; c < m_Channels; c++, Sample++)
+        {
+            const double X = *Sample;
+            m_SamplePeak = std::max(m_SamplePeak, fabs(X));
+            m_SquareSum += X * X;
+            m_Sums[c] += X;
+
+            // Direct form I, one biquad after the other
+            elFilterState& State = m_Filters[c];
+            const double Y = m_ShelfB[0] * X + m_ShelfB[1] * State.X1 + m_ShelfB[2] * State.X2 -
+                             m_ShelfA[1] * State.Y1 - m_ShelfA[2] * State.Y2;
+            const double Z = m_HighPassB[0] * Y + m_HighPassB[1] * State.Y1 + m_HighPassB[2] * State.Y2 -
+                             m_HighPassA[1] * State.Z1 - m_HighPassA[2] * State.Z2;
+            State.X2 = State.X1;
+            State.X1 = X;
+            State.Y2 = State.Y1;
+            State.Y1 = Y;
+            State.Z2 = State.Z1;
+            State.Z1 = Z;
+            m_StepEnergy += Z * Z;
+        }
+
+        // Every 100 ms the block ending there is finished
+        if (++m_StepFilled < m_StepFrames)
+        {
+            continue;
+        }
+        m_Steps.push_back(m_StepEnergy / m_StepFrames);
+        m_StepEnergy = 0.0;
+        m_StepFilled = 0;
+        if (m_Steps.size() < LOUDNESS_STEPS_PER_BLOCK)
+        {
+            continue;
+        }
+
+        double Energy = 0.0;
+        for (unsigned int j = 0; j < LOUDNESS_STEPS_PER_BLOCK; j++)
+        {
+            Energy += m_Steps[j];
+        }
+        m_Blocks.push_back(Energy / LOUDNESS_STEPS_PER_BLOCK);
+        m_Steps.erase(m_Steps.begin());
+    }
+    return;
+}
+
+void elLoudnessMeter::MeasureTruePeak(unsigned int Frames)
+{
+    if (m_Oversampling < 2)
+    {
+        m_TruePeak = std::max(m_TruePeak, m_SamplePeak);
+        return;
+    }
+
+    std::vector<float> Channel;
+    float Peak = 0.0f;
+    for (unsigned int c = 0; c < m_Channels; c++)
+    {
+        // The channel with the samples it reaches back to in front of it
+        std::vector<float>& History = m_PeakHistory[c];
+        Channel.assign(History.begin(), History.end());
+        Channel.resize(History.size() + Frames);
+        for (unsigned int i = 0; i < Frames; i++)
+        {
+            Channel[History.size() + i] = m_Input[i * m_Channels + c];
+        }
+
+        for (unsigned int p = 1; p < m_Oversampling; p++)
+        {
+            const float* Taps = &m_PeakFilter[p * TRUE_PEAK_TAPS];
+            unsigned int i = 0;
+#ifdef __SSE__
+            // Four points at a time, each tap going into all of them
+            const __m128 SignMask = _mm_set1_ps(-0.0f);
+            __m128 Peaks = _mm_setzero_ps();
+            for (; i + 4 <= Frames; i += 4)
+            {
+                __m128 Sum = _mm_setzero_ps();
+                for (unsigned int k = 0; k < TRUE_PEAK_TAPS; k++)
+                {
+                    Sum = _mm_add_ps(Sum, _mm_mul_ps(_mm_set1_ps(Taps[k]), _mm_loadu_ps(&Channel[i + k])));
+                }
+                Peaks = _mm_max_ps(Peaks, _mm_andnot_ps(SignMask, Sum));
+            }
+            float Lanes[4];
+            _mm_storeu_ps(Lanes, Peaks);
+            Peak = std::max(Peak, std::max(std::max(Lanes[0], Lanes[1]), std::max(Lanes[2], Lanes[3])));
+#endif // __SSE__
+            for (; i < Frames; i++)
+            {
+                float Sum = 0.0f;
+                for (unsigned int k = 0; k < TRUE_PEAK_TAPS; k++)
+                {
+                    Sum += Taps[k] * Channel[i + k];
+                }
+                Peak = std::max(Peak, fabsf(Sum));
+            }
+        }
+
+        History.assign(Channel.end() - History.size(), Channel.end());
+    }
+
+    // The points on the samples are the samples themselves
+    m_TruePeak = std::max(m_TruePeak, std::max((double)Peak, m_SamplePeak));
+    return;
+}
+
+unsigned int elLoudnessMeter::GetSampleRate() const
+{
+    return m_SampleRate;
+}
+
+unsigned int elLoudnessMeter::GetChannels() const
+{
+    return m_Channels;
+}
+
+unsigned long elLoudnessMeter::GetSampleFrames() const
+{
+    return m_Frames;
+}
+
+double elLoudnessMeter::GetIntegratedLoudness() const
+{
+    // Gate the blocks that are too quiet, then the ones that are too quiet next to the rest
+    double Threshold = pow(10.0, (LOUDNESS_ABSOLUTE_GATE + 0.691) / 10.0);
+    for (unsigned int Pass = 0; Pass < 2; Pass++)
+    {
+        double Energy = 0.0;
+        unsigned int Count = 0;
+        for (unsigned int i = 0; i < m_Blocks.size(); i++)
+        {
+            if (m_Blocks[i] > Threshold)
+            {
+                Energy += m_Blocks[i];
+                Count++;
+            }
+        }
+        if (!Count)
+        {
+            return -HUGE_VAL;
+        }
+        if (Pass == 1)
+        {
+            return _Loudness(Energy / Count);
+        }
+        Threshold = std::max(Threshold, Energy / Count * pow(10.0, LOUDNESS_RELATIVE_GATE / 10.0));
+    }
+    return -HUGE_VAL;
+}
+
+double elLoudnessMeter::GetSamplePeak() const
+{
+    return m_SamplePeak;
+}
+
+double elLoudnessMeter::GetTruePeak() const
+{
+    return m_TruePeak;
+}
+
+double elLoudnessMeter::GetRms() const
+{
+    return m_Frames ? sqrt(m_SquareSum / ((double)m_Frames * m_Channels)) : 0.0;
+}
+
+double elLoudnessMeter::GetDcOffset(unsigned int Channel) const
+{
+    return m_Frames ? m_Sums[Channel] / m_Frames : 0.0;
+}
+
+double elLoudnessMeter::GetReplayGain() const
+{
+    const double Loudness = GetIntegratedLoudness();
+    return Loudness > -HUGE_VAL ? REPLAY_GAIN_REFERENCE - Loudness : 0.0;
+}
+
+
+/// Write a level in dB, or null for silence, which JSON has no number for.
+static void _WriteDecibels(std::ostream& Output, double Decibels)
+{
+    if (Decibels > -HUGE_VAL)
+    {
+        Output << std::fixed << std::setprecision(2) << Decibels;
+    }
+    else
+    {
+        Output << "null";
+    }
+    return;
+}
+
+void WriteLoudnessReport(std::ostream& Output, const elLoudnessMeter& Meter)
+{
+    Output << "{" << std::endl;
+    Output << "    \"sample_rate\": " << Meter.GetSampleRate() << "," << std::endl;
+    Output << "    \"channels\": " << Meter.GetChannels() << "," << std::endl;
+    Output << "    \"sample_frames\": " << Meter.GetSampleFrames() << "," << std::endl;
+    const double Loudness = Meter.GetIntegratedLoudness();
+    Output << "    \"integrated_loudness_lufs\": ";
+    _WriteDecibels(Output, Loudness);
+    Output << "," << std::endl;
+    Output << "    \"replay_gain_db\": ";
+    _WriteDecibels(Output, Loudness > -HUGE_VAL ? Meter.GetReplayGain() : -HUGE_VAL);
+    Output << "," << std::endl;
+    Output << "    \"true_peak_dbtp\": ";
+    _WriteDecibels(Output, _Decibels(Meter.GetTruePeak()));
+    Output << "," << std::endl;
+    Output << "    \"sample_peak_dbfs\": ";
+    _WriteDecibels(Output, _Decibels(Meter.GetSamplePeak()));
+    Output << "," << std::endl;
+    Output << "    \"rms_dbfs\": ";
+    _WriteDecibels(Output, _Decibels(Meter.GetRms()));
+    Output << "," << std::endl;
+    Output << "    \"dc_offset\": [";
+    for (unsigned int c = 0; c < Meter.GetChannels(); c++)
+    {
+        Output << (c ? ", " : "") << std::fixed << std::setprecision(6) << Meter.GetDcOffset(c);
+    }
+    Output << "]" << std::endl;
+    Output << "}" << std::endl;
+    return;
+}
@@ -0,0 +1,100 @@
+/*
+    EA Layer 3 Extractor/Decoder
+    Copyright (C) 2010, Ben Moench.
+    See License.txt
+*/
+
+#pragma once
+
+#include "Internal.h"
+#include "SampleFormat.h"
+
+#include <iosfwd>
+
+/**
+ * Measures the loudness and levels of interleaved samples as they go by: the
+ * integrated loudness the way EBU R128 gates it (BS.1770 K-weighting, 400 ms
+ * blocks every 100 ms, an absolute gate at -70 LUFS and a relative one 10 LU
+ * down), the sample and true peaks, the RMS level and the DC offset of each
+ * channel. Every channel weighs the same, since the channels of the streams
+ * don't have a known layout.
+ */
+class elLoudnessMeter
+{
+public:
+    elLoudnessMeter(unsigned int SampleRate, unsigned int Channels);
+    ~elLoudnessMeter();
+
+    /// Measure some samples, which have to be whole sample frames.
+    void Process(const uint8_t* Samples, elSampleFormat Format, unsigned int Count);
+
+    unsigned int GetSampleRate() const;
+    unsigned int GetChannels() const;
+
+    /// Get how many sample frames were measured.
+    unsigned long GetSampleFrames() const;
+
+    /// Get the integrated loudness in LUFS; it's -HUGE_VAL if every block was gated out.
+    double GetIntegratedLoudness() const;
+
+    /// Get the highest sample and the highest peak between the samples, where 1.0 is full scale.
+    double GetSamplePeak() const;
+    double GetTruePeak() const;
+
+    /// Get the RMS level of all of the channels together, where 1.0 is full scale.
+    double GetRms() const;
+
+    /// Get the average of the samples of a channel.
+    double GetDcOffset(unsigned int Channel) const;
+
+    /// Get the gain in dB that takes the integrated loudness to the -18 LUFS ReplayGain 2.0 plays at, or 0 if it's silent.
+    double GetReplayGain() const;
+
+protected:
+    void MeasureLevels(unsigned int Frames);
+    void MeasureTruePeak(unsigned int Frames);
+
+    unsigned int m_SampleRate;
+    unsigned int m_Channels;
+    unsigned long m_Frames;
+
+    /// The samples being measured, as floats.
+    std::vector<float> m_Input;
+
+    /// The state of the two K-weighting biquads of each channel.
+    struct elFilterState
+    {
+        elFilterState() : X1(0.0), X2(0.0), Y1(0.0), Y2(0.0), Z1(0.0), Z2(0.0) {};
+
+        double X1, X2;
+        double Y1, Y2;
+        double Z1, Z2;
+    };
+    std::vector<elFilterState> m_Filters;
+    double m_ShelfB[3], m_ShelfA[3];
+    double m_HighPassB[3], m_HighPassA[3];
+
+    /// The K-weighted energy of the 100 ms blocks so far, and of the one being added up.
+    unsigned int m_StepFrames;
+    unsigned int m_StepFilled;
+    double m_StepEnergy;
+    std::vector<double> m_Steps;
+
+    /// The mean energy of each 400 ms block.
+    std::vector<double> m_Blocks;
+
+    double m_SamplePeak;
+    double m_TruePeak;
+    double m_SquareSum;
+    std::vector<double> m_Sums;
+
+    /// The interpolating filter for the true peak, one phase for each point between two samples.
+    unsigned int m_Oversampling;
+    std::vector<float> m_PeakFilter;
+
+    /// The last samples of each channel, which the interpolation of the next ones reaches back to.
+    std::vector< std::vector<float> > m_PeakHistory;
+};
+
+/// Write what a meter measured as a JSON object; levels are in dB and the silent ones are null.
+void WriteLoudnessReport(std::ostream& Output, const elLoudnessMeter& Meter);
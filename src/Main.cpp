@@ -17,6 +17,7 @@
 #include "MpegOutputStream.h"
 #include "PcmOutputStream.h"
 #include "WaveWriter.h"
+#include "OutputSink.h"
 #include "Parsers/ParserVersion6.h"
 
 #include "MpegParser.h"
@@ -26,8 +27,7 @@
 #include "Writers/HeaderBWriter.h"
 
 #include "Bitstream.h"
-
-int g_Verbose = 0;
+#include "Context.h"
 
 enum EOutputFormat
 {
@@ -35,6 +35,7 @@ enum EOutputFormat
     EOF_MP3,
     EOF_WAVE,
     EOF_MULTI_WAVE,
+    EOF_NULL,
     EOF_EALAYER3
 };
 
@@ -66,6 +67,18 @@ struct SArguments
         Offset(0),
         OutputFormat(EOF_AUTO),
         OutputEALayer3(EOEA_HEADERLESS),
+        LowMemory(false),
+        ConstantBitrate(0),
+        FreeFormat(false),
+        Lookahead(DEFAULT_LOOKAHEAD),
+        ThreadCount(0),
+        UseMpg123(false),
+        SampleFormat(SF_INT16),
+        SampleRate(0),
+        Analyze(false),
+        PeakBucketFrames(0),
+        Verify(false),
+        Verbose(0),
         
         DecodeParser(elFileDecoder::P_AUTO),
         DecodeOutFormat(elFileDecoder::F_AUTO)
@@ -83,6 +96,20 @@ struct SArguments
     std::streamoff Offset;
     EOutputFormat OutputFormat;
     EOutputEALayer3 OutputEALayer3;
+    bool LowMemory;
+    unsigned int ConstantBitrate;
+    bool FreeFormat;
+    unsigned int Lookahead;
+    unsigned int ThreadCount;
+    bool UseMpg123;
+    elSampleFormat SampleFormat;
+    unsigned int SampleRate;
+    elChannelMap ChannelMap;
+    bool Analyze;
+    unsigned int PeakBucketFrames;
+    bool Verify;
+    std::string ManifestFilename;
+    int Verbose;
     
     elFileDecoder::Parser DecodeParser;
     elFileDecoder::Format DecodeOutFormat;
@@ -93,9 +120,9 @@ struct SArguments
 // Functions in this file
 void SeparateFilename(const std::string& Filename, std::string& PathAndName, std::string& Ext);
 bool ParseArguments(SArguments& Args, unsigned long Argc, char* Argv[]);
-void ShowUsage(const std::string& Program);
+void ShowUsage(const std::string& Program, const elContext& Context);
 bool OpenOutputFile(std::ofstream& Output, const std::string& Filename);
-int Encode(SArguments& Args);
+int Encode(SArguments& Args, const elContext& Context);
 
 
 void SeparateFilename(const std::string& Filename, std::string& PathAndName, std::string& Ext)
@@ -179,14 +206,121 @@ bool ParseArguments(SArguments& Args, unsigned long Argc, char* Argv[])
             Args.OutputFormat = EOF_MULTI_WAVE;
             Args.DecodeOutFormat = elFileDecoder::F_MULTI_WAVE;
         }
+        else if (Arg == "--null")
+        {
+            Args.OutputFormat = EOF_NULL;
+            Args.DecodeOutFormat = elFileDecoder::F_NULL;
+        }
         else if (Arg == "-m" || Arg == "--mp3")
         {
             Args.OutputFormat = EOF_MP3;
             Args.DecodeOutFormat = elFileDecoder::F_MP3;
         }
+        else if (Arg == "--low-memory")
+        {
+            Args.LowMemory = true;
+        }
+        else if (Arg == "--cbr")
+        {
+            if (i >= Argc)
+            {
+                return false;
+            }
+
+            Args.ConstantBitrate = atoi(Argv[i++]);
+        }
+        else if (Arg == "--free-format")
+        {
+            Args.FreeFormat = true;
+        }
+        else if (Arg == "--lookahead")
+        {
+            if (i >= Argc)
+            {
+                return false;
+            }
+
+            // A negative count would wrap around to a huge one
+            const char* Value = Argv[i++];
+            char* End;
+            const long Lookahead = strtol(Value, &End, 10);
+            if (End == Value || *End || Lookahead < 0)
+            {
+                return false;
+            }
+            Args.Lookahead = (unsigned int) Lookahead;
+        }
+        else if (Arg == "--threads")
+        {
+            if (i >= Argc)
+            {
+                return false;
+            }
+
+            Args.ThreadCount = atoi(Argv[i++]);
+        }
+        else if (Arg == "--mpg123")
+        {
+            Args.UseMpg123 = true;
+        }
+        else if (Arg == "--24-bit")
+        {
+            Args.SampleFormat = SF_INT24;
+        }
+        else if (Arg == "--float")
+        {
+            Args.SampleFormat = SF_FLOAT32;
+        }
+        else if (Arg == "--rate")
+        {
+            if (i >= Argc)
+            {
+                return false;
+            }
+
+            Args.SampleRate = atoi(Argv[i++]);
+        }
+        else if (Arg == "--channels")
+        {
+            if (i >= Argc || !ParseChannelMap(Argv[i++], Args.ChannelMap))
+            {
+                return false;
+            }
+        }
+        else if (Arg == "--analyze")
+        {
+            Args.Analyze = true;
+        }
+        else if (Arg == "--peaks")
+        {
+            if (i >= Argc)
+            {
+                return false;
+            }
+
+            Args.PeakBucketFrames = atoi(Argv[i++]);
+            if (!Args.PeakBucketFrames)
+            {
+                return false;
+            }
+        }
+        else if (Arg == "--hash")
+        {
+            Args.Verify = true;
+        }
+        else if (Arg == "--verify")
+        {
+            if (i >= Argc)
+            {
+                return false;
+            }
+
+            Args.Verify = true;
+            Args.ManifestFilename = Argv[i++];
+        }
         else if (Arg == "-v" || Arg == "--verbose")
         {
-            g_Verbose = 1;
+            Args.Verbose = 1;
         }
         else if (Arg == "--parser5")
         {
@@ -220,18 +354,36 @@ bool ParseArguments(SArguments& Args, unsigned long Argc, char* Argv[])
     return true;
 }
 
-void ShowUsage(const std::string& Program)
+void ShowUsage(const std::string& Program, const elContext& Context)
 {
     std::cout << "Usage: " << Program << " InputFilename [Options]" << std::endl;
     std::cout << std::endl;
     std::cout << "  -i, --offset Offset   Specify the offset in the file to begin at." << std::endl;
     std::cout << "  -o, --output File     Specify the output filename (.mp3)." << std::endl;
+    std::cout << "                        Use - to write a single stream to stdout." << std::endl;
     std::cout << "  -s, --stream Index    Specify which stream to extract, or all." << std::endl;
     std::cout << "  -m, --mp3             Output to MP3 (no information loss!)." << std::endl;
     std::cout << "  -w, --wave            Output to Microsoft WAV." << std::endl;
     std::cout << "  -mc, --multi-wave     Output to a multi-channel Microsoft WAV." << std::endl;
     std::cout << "  --parser5             Force using the version 5 parser." << std::endl;
     std::cout << "  --parser6             Force using the version 6/7 parser." << std::endl;
+    std::cout << "  --low-memory          Write the output while reading (long files)." << std::endl;
+    std::cout << "  --cbr Bitrate         Write MP3s at a constant bitrate in kbit/s." << std::endl;
+    std::cout << "  --free-format         Write free format MP3s (smaller, not always supported)." << std::endl;
+    std::cout << "  --lookahead Frames    Frames to plan the bit reservoir over (default: " << DEFAULT_LOOKAHEAD << ", 0: all" << std::endl;
+    std::cout << "                        but not with --low-memory MP3s)." << std::endl;
+    std::cout << "  --threads Count       Threads for the streams (default: one per CPU)." << std::endl;
+    std::cout << "  --mpg123              Decode WAVs with mpg123 instead of the built-in decoder." << std::endl;
+    std::cout << "  --24-bit              Write WAVs with 24-bit samples." << std::endl;
+    std::cout << "  --float               Write WAVs with 32-bit floating point samples." << std::endl;
+    std::cout << "  --rate Rate           Resample WAVs to a sample rate in Hz." << std::endl;
+    std::cout << "  --channels Map        Mix the WAV channels from the decoded ones (0+1, 1,0, 0,-)." << std::endl;
+    std::cout << "  --analyze             Write the loudness and peaks of each output to a .json file." << std::endl;
+    std::cout << "  --peaks Samples       Write a waveform peak file with buckets of this many samples." << std::endl;
+    std::cout << "  --null                Decode without writing any output (for --analyze and --peaks)." << std::endl;
+    std::cout << "  --hash                Print a hash of each output instead of writing it." << std::endl;
+    std::cout << "                        The MP3s are hashed too with -w or -mc; --null only hashes WAVs." << std::endl;
+    std::cout << "  --verify Manifest     Check the hashes of the outputs against a list from --hash." << std::endl;
     std::cout << "  -n, --info            Output information about the file." << std::endl;
     std::cout << "  -v, --verbose         Be verbose (useful when streams won't convert)." << std::endl;
     std::cout << "  -b-, --no-banner      Don't show the banner." << std::endl;
@@ -245,7 +397,7 @@ void ShowUsage(const std::string& Program)
     std::cout << "Supported formats: " << std::endl;
 
     // List supported formats
-    elBlockLoaderSelector Loader;
+    elBlockLoaderSelector Loader(Context);
 
     for (elBlockLoaderSelector::fsFormatList::const_iterator Fmt = Loader.SelectorList().begin();
             Fmt != Loader.SelectorList().end(); ++Fmt)
@@ -281,6 +433,10 @@ int main(int Argc, char **Argv)
 
     ArgParse = ParseArguments(Args, Argc, Argv);
 
+    // Everything that reads or writes a stream is given this
+    elContext Context;
+    Context.SetVerbose(Args.Verbose);
+
     // Display banner
     if (Args.ShowBanner)
     {
@@ -293,7 +449,7 @@ int main(int Argc, char **Argv)
     // Display usage
     if (Args.ShowUsage)
     {
-        ShowUsage(Argv[0]);
+        ShowUsage(Argv[0], Context);
     }
 
     // Check for errors
@@ -314,7 +470,7 @@ int main(int Argc, char **Argv)
     {
         try
         {
-            return Encode(Args);
+            return Encode(Args, Context);
         }
         catch (elParserException& E)
         {
@@ -338,7 +494,7 @@ int main(int Argc, char **Argv)
     // Decode the file
     try
     {
-        elFileDecoder decoder;
+        elFileDecoder decoder(Context);
         
         decoder.SetInput(Args.InputFilename, Args.Offset);
         decoder.SetParser(Args.DecodeParser);
@@ -353,6 +509,26 @@ int main(int Argc, char **Argv)
         }
         
         decoder.SetOutput(Args.OutputFilename, Args.DecodeOutFormat);
+        
+        // Everything else that's printed goes to stderr when the output goes to stdout
+        if (Args.OutputFilename == "-")
+        {
+            std::cout.rdbuf(std::cerr.rdbuf());
+            decoder.SetOutputSink(shared_ptr<elOutputSink>(new elStdoutSink()));
+        }
+        
+        decoder.SetLowMemory(Args.LowMemory);
+        decoder.SetConstantBitrate(Args.ConstantBitrate);
+        decoder.SetFreeFormat(Args.FreeFormat);
+        decoder.SetLookahead(Args.Lookahead);
+        decoder.SetThreadCount(Args.ThreadCount);
+        decoder.SetUseMpg123(Args.UseMpg123);
+        decoder.SetSampleFormat(Args.SampleFormat);
+        decoder.SetSampleRate(Args.SampleRate);
+        decoder.SetChannelMap(Args.ChannelMap);
+        decoder.SetAnalyze(Args.Analyze);
+        decoder.SetPeaks(Args.PeakBucketFrames);
+        decoder.SetVerify(Args.Verify, Args.ManifestFilename);
         decoder.Process();
     }
     catch (elParserException& E)
@@ -406,6 +582,11 @@ void CreateOutputFilename(SArguments& Args)
         Args.OutputFilename.append(".wav");
         break;
 
+    case EOF_NULL:
+        // Nothing is written
+        Args.OutputFilename.clear();
+        break;
+
     case EOF_EALAYER3:
         Args.OutputFilename.append(".ealayer3");
         break;
@@ -457,7 +638,7 @@ struct elEncodeInput
 
 typedef std::vector<elEncodeInput> elEncodeInputVector;
 
-int Encode(SArguments& Args)
+int Encode(SArguments& Args, const elContext& Context)
 {
     // Create an output filename if there isn't already one
     bool ShowOutputFile = false;
@@ -489,7 +670,7 @@ int Encode(SArguments& Args)
         InputFiles.back().MpegInput = Input;
 
         // Create the parser
-        shared_ptr<elMpegParser> Parser = make_shared<elMpegParser>();
+        shared_ptr<elMpegParser> Parser = make_shared<elMpegParser>(Context);
         Parser->Initialize(Input.get());
         InputFiles.back().MpegParser = Parser;
     }
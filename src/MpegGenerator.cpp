@@ -6,16 +6,34 @@
 
 #include "Internal.h"
 #include "MpegGenerator.h"
+#include <boost/thread/thread.hpp>
+#include <boost/bind.hpp>
 #include "MpegOutputStream.h"
 #include "PcmOutputStream.h"
 #include "BlockLoader.h"
+#include "AllFormats.h"
 #include "Bitstream.h"
+#include "Context.h"
+#include <climits>
 
 #define VBR_FRAMES_FLAG         0x0001
 #define VBR_BYTES_FLAG          0x0002
 #define VBR_TOC_FLAG            0x0004
 #define VBR_SCALE_FLAG          0x0008
 
+#define VBR_TOC_SIZE            100
+#define VBR_HEADER_SIZE         (4 * 4 + VBR_TOC_SIZE + 4)
+#define LAME_TAG_SIZE           36
+
+/// The number of frame offsets kept for the seek table before every other one is dropped.
+#define MAX_VBR_SEEK_POINTS     400
+
+/// The samples a decoder outputs before the first encoded one; the LAME tag doesn't count these.
+#define MPEG_DECODER_DELAY      529
+
+/// The size of each block of memory a segment buffer hands out pieces of frames from.
+#define SEGMENT_BUFFER_BLOCK_SIZE (MAX_MPEG_FRAME_BUFFER * 16)
+
 static const char* MpegVersionString[4] = {"2.5", "reserved", "2", "1"};
 
 static const unsigned int MpegSampleRateTable[4][4] = {
@@ -32,18 +50,111 @@ static const unsigned int MpegBitrateTable[4][16] = {
     {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 0}
 };
 
+/**
+ * The CRC-16 used by the LAME tag (polynomial 0x8005, reflected) of each byte,
+ * worked out when the program starts. Slices[k] is the CRC of a byte followed
+ * by k zero bytes, so eight bytes can be taken at a time.
+ */
+class elCrc16Tables
+{
+public:
+    elCrc16Tables()
+    {
+        for (unsigned int i = 0; i < 256; i++)
+        {
+            uint16_t Crc = i;
+            for (unsigned int j = 0; j < 8; j++)
+            {
+                Crc = (Crc & 1) ? (Crc >> 1) ^ 0xA001 : Crc >> 1;
+            }
+            Slices[0][i] = Crc;
+        }
+        for (unsigned int k = 1; k < 8; k++)
+        {
+            for (unsigned int i = 0; i < 256; i++)
+            {
+                Slices[k][i] = (Slices[k - 1][i] >> 8) ^ Slices[0][Slices[k - 1][i] & 0xFF];
+            }
+        }
+        return;
+    }
+
+    uint16_t Slices[8][256];
+};
+
+static const elCrc16Tables Crc16Tables;
+
 static const char* MpegChannelModeString[4] = {"stereo", "joint stereo", "dual channel", "mono"};
 
 static const char* MpegModeExtensionString[4] = {"none", "intensity stereo", "MS stereo", "intensity stereo and MS stereo"};
 
 
-elMpegGenerator::elMpegGenerator() :
+/// Get how many bits of main data a granule has, before it's padded to a byte.
+static unsigned int GetGranuleBits(const elGranule& Gr)
+{
+    unsigned int Bits = 0;
+    for (unsigned int i = 0; i < Gr.Channels; i++)
+    {
+        Bits += Gr.ChannelInfo[i].Size;
+    }
+    return Bits;
+}
+
+
+elMpegGenerator::elMpegSegmentBuffer::elMpegSegmentBuffer() :
+        m_Block(0),
+        m_Used(0)
+{
+    return;
+}
+
+uint8_t* elMpegGenerator::elMpegSegmentBuffer::Allocate(unsigned int Size)
+{
+    assert(Size <= SEGMENT_BUFFER_BLOCK_SIZE);
+
+    // Move on to the next block when this one is full; they're kept to use again after Clear()
+    if (m_Blocks.empty() || m_Used + Size > SEGMENT_BUFFER_BLOCK_SIZE)
+    {
+        if (!m_Blocks.empty())
+        {
+            m_Block++;
+        }
+        if (m_Block == m_Blocks.size())
+        {
+            m_Blocks.push_back(shared_array<uint8_t>(new uint8_t[SEGMENT_BUFFER_BLOCK_SIZE]));
+        }
+        m_Used = 0;
+    }
+
+    uint8_t* Data = m_Blocks[m_Block].get() + m_Used;
+    m_Used += Size;
+    return Data;
+}
+
+void elMpegGenerator::elMpegSegmentBuffer::Clear()
+{
+    m_Block = 0;
+    m_Used = 0;
+    return;
+}
+
+
+elMpegGenerator::elMpegGenerator(const elContext& Context) :
+        m_Context(Context),
         m_CurrentFrame(0),
         m_UncompressedSampleFrames(0),
         m_SampleFrames(0),
         m_DoneParsingBlocks(false),
         m_CurMpegFrame(0),
-        m_CurOutputMpegFrame(0)
+        m_CurOutputMpegFrame(0),
+        m_Streaming(false),
+        m_Lookahead(DEFAULT_LOOKAHEAD),
+        m_ConstantBitrate(0),
+        m_FreeFormat(false),
+        m_ThreadCount(0),
+        m_DirectDecoding(false),
+        m_DecodeGranules(false),
+        m_Padding(MAX_MPEG_FRAME_BUFFER, 0xE5)
 {
     return;
 }
@@ -62,6 +173,14 @@ void elMpegGenerator::Clear()
     m_CurMpegFrame = 0;
     m_CurOutputMpegFrame = 0;
     m_Outputs.clear();
+    m_Streaming = false;
+    m_Lookahead = DEFAULT_LOOKAHEAD;
+    m_ConstantBitrate = 0;
+    m_FreeFormat = false;
+    m_ThreadCount = 0;
+    m_DirectDecoding = false;
+    m_DecodeGranules = false;
+    m_VbrFrames.clear();
     return;
 }
 
@@ -75,6 +194,7 @@ bool elMpegGenerator::Initialize(const elBlock& FirstBlock, shared_ptr<elParser>
     {
         return false;
     }
+    m_Parser->SetStreamMask(EL_ALL_STREAMS);
 
     // Create the input stream
     bsBitstream IS(FirstBlock.Data.get(), FirstBlock.Size);
@@ -85,6 +205,13 @@ bool elMpegGenerator::Initialize(const elBlock& FirstBlock, shared_ptr<elParser>
         return false;
     }
 
+    // If a selector picked the parser, use that one directly from now on
+    shared_ptr<elParserSelector> Selector = dynamic_pointer_cast<elParserSelector>(m_Parser);
+    if (Selector)
+    {
+        m_Parser = Selector->SelectorUsed();
+    }
+
     IS.SeekAbsolute(0);
     ReadBlockData(Streams, IS);
 
@@ -100,6 +227,7 @@ bool elMpegGenerator::Initialize(const elBlock& FirstBlock, shared_ptr<elParser>
         elStreamInfo MpegStream;
         MpegStream.Channels = Streams[i][0].Gr[0].Channels;
         MpegStream.SampleRate = Streams[i][0].Gr[0].SampleRate;
+        SetFrameFormat(MpegStream, Streams[i][0].Gr[0]);
         m_StreamInfo.push_back(MpegStream);
 
         // Add the stream to the outputs and create the VBR frame
@@ -107,8 +235,22 @@ bool elMpegGenerator::Initialize(const elBlock& FirstBlock, shared_ptr<elParser>
         m_Outputs.back().push_back(elMpegFrame());
 
         elMpegFrame& VbrFrame = m_Outputs.back().back();
-        memset(VbrFrame.Data.get(), 0x11, MAX_MPEG_FRAME_BUFFER);
-        ConstructMpegVbrFrame(Streams[i][0].Gr, VbrFrame, 0, 0);
+        ConstructMpegVbrFrame(Streams[i][0].Gr, VbrFrame, m_StreamInfo.back());
+
+        // Size it right away; the frame after it doesn't use it as a reservoir
+        elReservoirState State;
+        State.BitrateIndex = EstimateBitrateIndex(VbrFrame.Used, VbrFrame.SampleRate, VbrFrame.Version);
+        VbrFrame.Size = CalculateFrameSize(State.BitrateIndex, VbrFrame.SampleRate, VbrFrame.Version);
+        WriteFields(VbrFrame, State.BitrateIndex, 0);
+
+        State.Reservoir = 0;
+        State.Cost = VbrFrame.Size;
+        State.Previous = 0;
+        VbrFrame.States.push_back(State);
+
+        m_VbrFrames.push_back(VbrFrame);
+        m_StreamInfo.back().Sized = 1;
+        m_StreamInfo.back().Committed = 1;
     }
 
     // Make sure that there is at least one MPEG stream
@@ -143,6 +285,20 @@ long unsigned elMpegGenerator::GetSampleFrameCount() const
     return m_SampleFrames;
 }
 
+unsigned long elMpegGenerator::GetDecodedSampleFrameCount(unsigned int StreamIndex) const
+{
+    if (StreamIndex >= m_StreamInfo.size())
+    {
+        throw (elMpegGeneratorException("Stream index exceeds the number of streams."));
+    }
+
+    // Every frame after the VBR frame is decoded, apart from what the first one leaves out
+    const elStreamInfo& Info = m_StreamInfo[StreamIndex];
+    const unsigned long Decoded = (Info.Finished ? Info.Finished - 1 : 0) * CalculateSamplesPerFrame(Info.Version);
+    const unsigned long Skipped = min((unsigned long)Info.SkippedSamples, Decoded);
+    return min(m_SampleFrames, Decoded - Skipped);
+}
+
 unsigned int elMpegGenerator::GetSampleRate(unsigned int StreamIndex) const
 {
     if (StreamIndex >= m_StreamInfo.size())
@@ -152,6 +308,15 @@ unsigned int elMpegGenerator::GetSampleRate(unsigned int StreamIndex) const
     return m_StreamInfo[StreamIndex].SampleRate;
 }
 
+unsigned int elMpegGenerator::GetSamplesPerFrame(unsigned int StreamIndex) const
+{
+    if (StreamIndex >= m_StreamInfo.size())
+    {
+        throw (elMpegGeneratorException("Stream index exceeds the number of streams."));
+    }
+    return CalculateSamplesPerFrame(m_StreamInfo[StreamIndex].Version);
+}
+
 unsigned int elMpegGenerator::GetChannels(unsigned int StreamIndex) const
 {
     if (StreamIndex >= m_StreamInfo.size())
@@ -161,6 +326,150 @@ unsigned int elMpegGenerator::GetChannels(unsigned int StreamIndex) const
     return m_StreamInfo[StreamIndex].Channels;
 }
 
+void elMpegGenerator::EnableStreaming()
+{
+    if (!m_Parser)
+    {
+        throw (elMpegGeneratorException("Initialize() must be called before enabling streaming."));
+    }
+    if (m_CurMpegFrame != 1)
+    {
+        throw (elMpegGeneratorException("Streaming has to be enabled before parsing any blocks."));
+    }
+    if (!m_Lookahead && !m_DirectDecoding)
+    {
+        throw (elMpegGeneratorException("Streaming needs a lookahead; without one every frame is held until the end."));
+    }
+    m_Streaming = true;
+    return;
+}
+
+bool elMpegGenerator::IsStreaming() const
+{
+    return m_Streaming;
+}
+
+void elMpegGenerator::SetLookahead(unsigned int Frames)
+{
+    if (!m_Parser)
+    {
+        throw (elMpegGeneratorException("Initialize() must be called before setting the lookahead."));
+    }
+    if (m_CurMpegFrame != 1)
+    {
+        throw (elMpegGeneratorException("The lookahead has to be set before parsing any blocks."));
+    }
+    if (!Frames && m_Streaming && !m_DirectDecoding)
+    {
+        throw (elMpegGeneratorException("Streaming needs a lookahead; without one every frame is held until the end."));
+    }
+    m_Lookahead = Frames;
+    return;
+}
+
+unsigned int elMpegGenerator::GetLookahead() const
+{
+    return m_Lookahead;
+}
+
+void elMpegGenerator::SetConstantBitrate(unsigned int Bitrate)
+{
+    if (!m_Parser)
+    {
+        throw (elMpegGeneratorException("Initialize() must be called before setting the bitrate."));
+    }
+    if (m_CurMpegFrame != 1)
+    {
+        throw (elMpegGeneratorException("The bitrate has to be set before parsing any blocks."));
+    }
+    if (Bitrate && m_FreeFormat)
+    {
+        throw (elMpegGeneratorException("Free format frames can't have a constant bitrate."));
+    }
+
+    // Make sure every stream can use it
+    for (unsigned int i = 0; Bitrate && i < m_VbrFrames.size(); i++)
+    {
+        if (m_Parser->IsStreamWanted(i) && !FindBitrateIndex(Bitrate, m_VbrFrames[i].Version))
+        {
+            throw (elMpegGeneratorException("The bitrate is not allowed for the MPEG version of the stream."));
+        }
+    }
+    m_ConstantBitrate = Bitrate;
+    return;
+}
+
+unsigned int elMpegGenerator::GetConstantBitrate() const
+{
+    return m_ConstantBitrate;
+}
+
+void elMpegGenerator::SetFreeFormat(bool FreeFormat)
+{
+    if (!m_Parser)
+    {
+        throw (elMpegGeneratorException("Initialize() must be called before setting free format."));
+    }
+    if (m_CurMpegFrame != 1)
+    {
+        throw (elMpegGeneratorException("Free format has to be set before parsing any blocks."));
+    }
+    if (FreeFormat && m_ConstantBitrate)
+    {
+        throw (elMpegGeneratorException("Free format frames can't have a constant bitrate."));
+    }
+    m_FreeFormat = FreeFormat;
+    return;
+}
+
+bool elMpegGenerator::IsFreeFormat() const
+{
+    return m_FreeFormat;
+}
+
+void elMpegGenerator::SetThreadCount(unsigned int Threads)
+{
+    m_ThreadCount = Threads;
+    return;
+}
+
+unsigned int elMpegGenerator::GetThreadCount() const
+{
+    return m_ThreadCount;
+}
+
+void elMpegGenerator::SetDirectDecoding(bool DirectDecoding)
+{
+    m_DirectDecoding = DirectDecoding;
+    return;
+}
+
+bool elMpegGenerator::IsDirectDecoding() const
+{
+    return m_DirectDecoding;
+}
+
+void elMpegGenerator::SetDecodeGranules(bool DecodeGranules)
+{
+    m_DecodeGranules = DecodeGranules;
+    return;
+}
+
+bool elMpegGenerator::IsDecodingGranules() const
+{
+    return m_DirectDecoding || m_DecodeGranules;
+}
+
+void elMpegGenerator::SetStreamMask(uint32_t Mask)
+{
+    if (!m_Parser)
+    {
+        throw (elMpegGeneratorException("Initialize() must be called before setting the stream mask."));
+    }
+    m_Parser->SetStreamMask(Mask);
+    return;
+}
+
 
 void elMpegGenerator::ParseBlock(const elBlock& Block)
 {
@@ -170,8 +479,23 @@ void elMpegGenerator::ParseBlock(const elBlock& Block)
         throw (elMpegGeneratorException("Already called DoneParsingBlocks(), can't parse any more blocks."));
     }
 
+    // Release the frames that have been read by now
+    if (m_Streaming)
+    {
+        const unsigned int Kept = m_Lookahead ? m_Lookahead : DEFAULT_LOOKAHEAD;
+        for (unsigned int i = 0; i < m_Outputs.size(); i++)
+        {
+            elStreamInfo& Info = m_StreamInfo[i];
+            while (Info.OutputBase + Kept < Info.Finished)
+            {
+                m_Outputs[i].pop_front();
+                Info.OutputBase++;
+            }
+        }
+    }
+
     m_SampleFrames += Block.SampleCount;
-    VERY_VERBOSE("Block offset: " << Block.Offset << "; Block size: " << Block.Size << "; Sample count: " << Block.SampleCount);
+    VERY_VERBOSE(m_Context, "Block offset: " << Block.Offset << "; Block size: " << Block.Size << "; Sample count: " << Block.SampleCount);
 
     // Read the block data
     bsBitstream IS(Block.Data.get(), Block.Size);
@@ -179,9 +503,14 @@ void elMpegGenerator::ParseBlock(const elBlock& Block)
 
     // Create a frame for each stream
     unsigned int OldCurMpegFrame = m_CurMpegFrame;
+    unsigned int FramesLeft = 0;
     for (unsigned int i = 0; i < m_StreamInfo.size(); i++)
     {
         const elStream& CurStr = m_Streams[i];
+        if (!m_Parser->IsStreamWanted(i))
+        {
+            continue;
+        }
 
         // The current frame index
         m_CurMpegFrame = OldCurMpegFrame;
@@ -190,9 +519,9 @@ void elMpegGenerator::ParseBlock(const elBlock& Block)
         {
             // Get the current and previous frames
             m_Outputs[i].push_back(elMpegFrame());
-            elMpegFrame& CurOutFrame = m_Outputs[i][m_CurMpegFrame];
+            elMpegFrame& CurOutFrame = m_Outputs[i].back();
 
-            ConstructMpegFrame(CurStr[0], IS, CurOutFrame);
+            ConstructMpegFrame(CurStr[0], IS, CurOutFrame, m_StreamInfo[i]);
             if (CurOutFrame.Used == 0)
             {
                 m_Outputs[i].pop_back();
@@ -200,10 +529,41 @@ void elMpegGenerator::ParseBlock(const elBlock& Block)
             }
             else
             {
+                // The PCM output replaces the first frame with its uncompressed samples
+                if (m_CurMpegFrame == 1)
+                {
+                    const unsigned int CountA = CurOutFrame.UncompA.Count;
+                    const unsigned int CountB = CurOutFrame.UncompB.Count;
+                    const unsigned int Count = (CountA && CountA < 576) ? CountA : (CountB < 576 ? CountB : 0);
+                    m_StreamInfo[i].SkippedSamples = Count ? CalculateSamplesPerFrame(CurOutFrame.Version) - Count : 0;
+                }
+
                 m_CurMpegFrame++;
                 m_Streams[i].pop_front();
             }
         }
+        FramesLeft = CurStr.size();
+
+        // Pick the bitrates that can't change any more; otherwise all of the streams
+        // are sized at the same time at the end
+        if (m_Streaming && m_DirectDecoding)
+        {
+            FinishDirectFrames(i);
+        }
+        else if (m_Streaming)
+        {
+            SizeFrames(i);
+            UpdateFinishedFrames(i, false);
+        }
+    }
+
+    // The skipped streams only hold empty frames; keep them lined up with the others
+    for (unsigned int i = 0; i < m_StreamInfo.size(); i++)
+    {
+        if (!m_Parser->IsStreamWanted(i) && m_Streams[i].size() > FramesLeft)
+        {
+            m_Streams[i].erase(m_Streams[i].begin(), m_Streams[i].end() - FramesLeft);
+        }
     }
     return;
 }
@@ -216,51 +576,59 @@ void elMpegGenerator::DoneParsingBlocks()
         throw (elMpegGeneratorException("Already called DoneParsingBlocks()"));
     }
 
-    // Write the VBR frame again for each stream
-    for (unsigned int i = 0; i < m_StreamInfo.size(); i++)
+    // The granules are decoded as they are, so there are no frames to size
+    if (m_DirectDecoding)
     {
-        // Get the total file size
-        unsigned long FileSize = 0;
-
-        // Go backwards through the frames and calculate their bitrates
-        for (unsigned int j = m_Outputs[i].size(); j > 0; j--)
+        for (unsigned int i = 0; i < m_StreamInfo.size(); i++)
         {
-            elMpegFrame& Frame = m_Outputs[i][j - 1];
-
-            unsigned int FrameUsed;
-            unsigned int BitrateIndex;
-            FrameUsed = Frame.Used + Frame.UsedByNext;
-            BitrateIndex = EstimateBitrateIndex(FrameUsed, Frame.SampleRate, Frame.Version);
-
-            if (BitrateIndex > 0)
+            if (m_Parser->IsStreamWanted(i))
             {
-                Frame.Size = CalculateFrameSize(BitrateIndex, Frame.SampleRate, Frame.Version);
-                Frame.UsedFromPrevious = 0;
+                FinishDirectFrames(i);
             }
-            else if (j > 1)
-            {
-                elMpegFrame& PrevFrame = m_Outputs[i][j - 2];
-
-                // Use the highest bitrate
-                BitrateIndex = 14;
-                Frame.Size = CalculateFrameSize(BitrateIndex, Frame.SampleRate, Frame.Version);
+        }
+        m_CurMpegFrame = 0;
+        m_CurOutputMpegFrame = 0;
+        m_DoneParsingBlocks = true;
+        return;
+    }
 
-                // Use some bytes from the previous frame
-                const unsigned int BytesNeed = FrameUsed - Frame.Size;
-                Frame.UsedFromPrevious = BytesNeed;
-                PrevFrame.UsedByNext = BytesNeed;
-            }
-            else
-            {
-                throw (elMpegGeneratorException("Was unable to construct MPEG audio frame. The bitrate exceeded the maximum."));
-            }
+    // Size the frames that are left; the streams don't share anything, so they get a thread each
+    elStreamQueue Queue;
+    boost::mutex Lock;
+    for (unsigned int i = 0; i < m_StreamInfo.size(); i++)
+    {
+        if (m_Parser->IsStreamWanted(i))
+        {
+            Queue.Streams.push_back(i);
+        }
+    }
+    Queue.Errors.resize(m_StreamInfo.size());
 
-            // Write
-            WriteFields(Frame, BitrateIndex, Frame.UsedFromPrevious);
-            FileSize += Frame.Size;
+    unsigned int Threads = m_ThreadCount ? m_ThreadCount : boost::thread::hardware_concurrency();
+    Threads = min(Threads, (unsigned int)Queue.Streams.size());
+    if (Threads > 1)
+    {
+        boost::thread_group Group;
+        for (unsigned int i = 0; i < Threads; i++)
+        {
+            Group.create_thread(boost::bind(&elMpegGenerator::FinishStreams, this, &Queue, &Lock));
         }
+        Group.join_all();
+    }
+    else
+    {
+        FinishStreams(&Queue, &Lock);
+    }
 
-        ConstructMpegVbrFrame(NULL, m_Outputs[i][0], m_Outputs[i].size(), FileSize);
+    // Write the VBR frame again for each stream
+    for (unsigned int i = 0; i < Queue.Streams.size(); i++)
+    {
+        const unsigned int StreamIndex = Queue.Streams[i];
+        if (!Queue.Errors[StreamIndex].empty())
+        {
+            throw (elMpegGeneratorException(Queue.Errors[StreamIndex]));
+        }
+        ConstructMpegVbrFrame(NULL, m_VbrFrames[StreamIndex], m_StreamInfo[StreamIndex]);
     }
 
     m_CurMpegFrame = 0;
@@ -272,21 +640,29 @@ void elMpegGenerator::DoneParsingBlocks()
 shared_ptr<elMpegOutputStream> elMpegGenerator::CreateMpegStream(unsigned int StreamIndex) const
 {
     // Check some things
-    if (!m_DoneParsingBlocks)
+    if (!m_DoneParsingBlocks && !m_Streaming)
     {
         throw (elMpegGeneratorException("Haven't called DoneParsingBlocks(), we're not done parsing blocks."));
     }
+    if (m_DirectDecoding)
+    {
+        throw (elMpegGeneratorException("No MPEG frames are made when decoding directly."));
+    }
     if (StreamIndex >= m_Outputs.size())
     {
         throw (elMpegGeneratorException("Stream index exceeds the number of streams."));
     }
+    if (!m_Parser->IsStreamWanted(StreamIndex))
+    {
+        throw (elMpegGeneratorException("The stream was left out by the stream mask."));
+    }
     return shared_ptr<elMpegOutputStream>(new elMpegOutputStream(*this, StreamIndex));
 }
 
 shared_ptr<elPcmOutputStream> elMpegGenerator::CreatePcmStream(unsigned int StreamIndex) const
 {
     // Check some things
-    if (!m_DoneParsingBlocks)
+    if (!m_DoneParsingBlocks && !m_Streaming)
     {
         throw (elMpegGeneratorException("Haven't called DoneParsingBlocks(), we're not done parsing blocks."));
     }
@@ -294,126 +670,701 @@ shared_ptr<elPcmOutputStream> elMpegGenerator::CreatePcmStream(unsigned int Stre
     {
         throw (elMpegGeneratorException("Stream index exceeds the number of streams."));
     }
-    return shared_ptr<elPcmOutputStream>(new elPcmOutputStream(*this, StreamIndex));
+    if (!m_Parser->IsStreamWanted(StreamIndex))
+    {
+        throw (elMpegGeneratorException("The stream was left out by the stream mask."));
+    }
+    return shared_ptr<elPcmOutputStream>(new elPcmOutputStream(m_Context, *this, StreamIndex));
 }
 
 unsigned int elMpegGenerator::GetFrameCount(unsigned int StreamIndex) const
+{
+    // Check some things
+    if (!m_DoneParsingBlocks && !m_Streaming)
+    {
+        throw (elMpegGeneratorException("Haven't called DoneParsingBlocks(), we're not done parsing blocks."));
+    }
+    if (StreamIndex >= m_Outputs.size())
+    {
+        throw (elMpegGeneratorException("Stream index exceeds the number of streams."));
+    }
+    return m_StreamInfo[StreamIndex].Finished;
+}
+
+
+unsigned int elMpegGenerator::GetFrameSize(unsigned int Index, unsigned int StreamIndex) const
+{
+    return GetOutputFrame(Index, StreamIndex).Size;
+}
+
+unsigned long elMpegGenerator::GetStreamSize(unsigned int StreamIndex) const
+{
+    if (StreamIndex >= m_Outputs.size())
+    {
+        throw (elMpegGeneratorException("Stream index exceeds the number of streams."));
+    }
+    return m_StreamInfo[StreamIndex].FinishedSize;
+}
+
+unsigned int elMpegGenerator::ReadFrame(uint8_t* Buffer, unsigned int BufferSize, unsigned int Index, unsigned int StreamIndex) const
+{
+    if (m_DirectDecoding)
+    {
+        throw (elMpegGeneratorException("No MPEG frames are made when decoding directly."));
+    }
+
+    // The frame
+    const elMpegFrame& Frame = GetOutputFrame(Index, StreamIndex);
+    const elMpegStream& Output = m_Outputs[StreamIndex];
+    const elStreamInfo& Info = m_StreamInfo[StreamIndex];
+    const unsigned int Size = min(Frame.Size, BufferSize);
+
+    // The header is written straight into the buffer, unless the buffer is too small for it
+    if (Frame.Data)
+    {
+        memcpy(Buffer, Frame.Data.get(), min(Frame.HeaderSize, Size));
+    }
+    else if (Frame.HeaderSize <= Size)
+    {
+        WriteSideInfo(Frame, Info, Buffer);
+    }
+    else
+    {
+        std::vector<uint8_t> Header(Frame.HeaderSize);
+        WriteSideInfo(Frame, Info, &Header[0]);
+        memcpy(Buffer, &Header[0], Size);
+    }
+
+    // Fill the main data area with the main data of this frame and the ones after it; only
+    // the bytes that go in this frame are put together
+    const unsigned long PayloadEnd = Frame.PayloadOffset + (Size > Frame.HeaderSize ? Size - Frame.HeaderSize : 0);
+    uint8_t* Payload = Buffer + Frame.HeaderSize;
+    unsigned long Position = Frame.PayloadOffset;
+
+    for (unsigned int i = Index; !Frame.Data && i < Info.Committed; i++)
+    {
+        const elMpegFrame& DataFrame = Output[i - Info.OutputBase];
+        const unsigned long DataEnd = DataFrame.DataOffset + DataFrame.Used - DataFrame.HeaderSize;
+        if (DataFrame.DataOffset >= PayloadEnd)
+        {
+            break;
+        }
+        if (DataEnd <= Position)
+        {
+            continue;
+        }
+
+        const unsigned long Start = DataFrame.DataOffset > Position ? DataFrame.DataOffset : Position;
+        const unsigned long End = min(DataEnd, PayloadEnd);
+
+        // The padding in between, then the part of the main data that goes in this frame
+        memcpy(Payload + (Position - Frame.PayloadOffset), &m_Padding[0], Start - Position);
+        WriteMainData(DataFrame, Start - DataFrame.DataOffset, End - DataFrame.DataOffset,
+            Payload + (Start - Frame.PayloadOffset));
+        Position = End;
+    }
+
+    // The padding
+    if (PayloadEnd > Position)
+    {
+        memcpy(Payload + (Position - Frame.PayloadOffset), &m_Padding[0], PayloadEnd - Position);
+    }
+    return Frame.Size;
+}
+
+unsigned int elMpegGenerator::GetFrameSegments(std::vector<elMpegSegment>& Segments, elMpegSegmentBuffer& Buffer,
+    unsigned int Index, unsigned int StreamIndex) const
+{
+    if (m_DirectDecoding)
+    {
+        throw (elMpegGeneratorException("No MPEG frames are made when decoding directly."));
+    }
+
+    // The frame
+    const elMpegFrame& Frame = GetOutputFrame(Index, StreamIndex);
+    AddFrameSegments(Segments, Buffer, Frame, Index, StreamIndex);
+    return Frame.Size;
+}
+
+void elMpegGenerator::AddFrameSegments(std::vector<elMpegSegment>& Segments, elMpegSegmentBuffer& Buffer,
+    const elMpegFrame& Frame, unsigned int Index, unsigned int StreamIndex) const
+{
+    const elMpegStream& Output = m_Outputs[StreamIndex];
+    const elStreamInfo& Info = m_StreamInfo[StreamIndex];
+
+    // The header; only the VBR frame keeps its own
+    if (Frame.Data)
+    {
+        AddSegment(Segments, Frame.Data.get(), Frame.HeaderSize);
+    }
+    else
+    {
+        uint8_t* Header = Buffer.Allocate(Frame.HeaderSize);
+        WriteSideInfo(Frame, Info, Header);
+        AddSegment(Segments, Header, Frame.HeaderSize);
+    }
+
+    // Fill the main data area with the main data of this frame and the ones after it
+    const unsigned long PayloadEnd = Frame.PayloadOffset + Frame.Size - Frame.HeaderSize;
+    unsigned long Position = Frame.PayloadOffset;
+
+    for (unsigned int i = Index; !Frame.Data && i < Info.Committed; i++)
+    {
+        const elMpegFrame& DataFrame = Output[i - Info.OutputBase];
+        const unsigned long DataEnd = DataFrame.DataOffset + DataFrame.Used - DataFrame.HeaderSize;
+        if (DataFrame.DataOffset >= PayloadEnd)
+        {
+            break;
+        }
+        if (DataEnd <= Position)
+        {
+            continue;
+        }
+
+        const unsigned long Start = DataFrame.DataOffset > Position ? DataFrame.DataOffset : Position;
+        const unsigned long End = min(DataEnd, PayloadEnd);
+
+        // The padding in between, then the part of the main data that goes in this frame
+        AddSegment(Segments, &m_Padding[0], Start - Position);
+        AddMainDataSegments(Segments, Buffer, DataFrame, Start - DataFrame.DataOffset, End - DataFrame.DataOffset);
+        Position = End;
+    }
+
+    // The padding
+    AddSegment(Segments, &m_Padding[0], PayloadEnd - Position);
+    return;
+}
+
+unsigned int elMpegGenerator::GetFirstDataFrame(unsigned int Index, unsigned int StreamIndex) const
+{
+    // The main data starts in the payload of this frame or one of the ones before it, but never the VBR frame
+    const elMpegFrame& Frame = GetOutputFrame(Index, StreamIndex);
+    unsigned int First = Index;
+    while (First > 1 && GetOutputFrame(First, StreamIndex).PayloadOffset > Frame.DataOffset)
+    {
+        First--;
+    }
+    return First;
+}
+
+const elFrame& elMpegGenerator::ReadGranules(unsigned int Index, unsigned int StreamIndex) const
+{
+    // The MPEG frames are put together from the granules, so they're kept either way
+    return GetOutputFrame(Index, StreamIndex).Granules;
+}
+
+const elUncompressedSampleFrames& elMpegGenerator::ReadUncSamples(unsigned int Granule, unsigned int Index, unsigned int StreamIndex) const
+{
+    const elMpegFrame& Frame = GetOutputFrame(Index, StreamIndex);
+    if (Granule == 1)
+    {
+        return Frame.UncompB;
+    }
+    return Frame.UncompA;
+}
+
+unsigned int elMpegGenerator::ReadVbrFrame(uint8_t* Buffer, unsigned int BufferSize, unsigned int StreamIndex) const
 {
     // Check some things
     if (!m_DoneParsingBlocks)
     {
         throw (elMpegGeneratorException("Haven't called DoneParsingBlocks(), we're not done parsing blocks."));
     }
-    if (StreamIndex >= m_Outputs.size())
+    if (m_DirectDecoding)
+    {
+        throw (elMpegGeneratorException("No MPEG frames are made when decoding directly."));
+    }
+    if (StreamIndex >= m_VbrFrames.size())
+    {
+        throw (elMpegGeneratorException("Stream index exceeds the number of streams."));
+    }
+
+    const elMpegFrame& Frame = m_VbrFrames[StreamIndex];
+    const unsigned int ToCopy = min(Frame.HeaderSize, BufferSize);
+    memcpy(Buffer, Frame.Data.get(), ToCopy);
+    return ToCopy;
+}
+
+void elMpegGenerator::SetReplayGain(double Gain, double Peak, unsigned int StreamIndex)
+{
+    // Check some things
+    if (!m_DoneParsingBlocks)
+    {
+        throw (elMpegGeneratorException("Haven't called DoneParsingBlocks(), we're not done parsing blocks."));
+    }
+    if (m_DirectDecoding)
+    {
+        throw (elMpegGeneratorException("No MPEG frames are made when decoding directly."));
+    }
+    if (StreamIndex >= m_VbrFrames.size())
+    {
+        throw (elMpegGeneratorException("Stream index exceeds the number of streams."));
+    }
+
+    // The VBR frame shares its data with the first frame, so both get the new tag
+    elStreamInfo& Info = m_StreamInfo[StreamIndex];
+    Info.ReplayGain = Gain;
+    Info.ReplayPeak = Peak;
+    Info.HasReplayGain = true;
+    ConstructMpegVbrFrame(NULL, m_VbrFrames[StreamIndex], Info);
+    return;
+}
+
+const elMpegGenerator::elMpegFrame& elMpegGenerator::GetOutputFrame(unsigned int Index, unsigned int StreamIndex) const
+{
+    // Check some things
+    if (!m_DoneParsingBlocks && !m_Streaming)
+    {
+        throw (elMpegGeneratorException("Haven't called DoneParsingBlocks(), we're not done parsing blocks."));
+    }
+    if (StreamIndex >= m_Outputs.size())
+    {
+        throw (elMpegGeneratorException("Stream index exceeds the number of streams."));
+    }
+    if (Index >= m_StreamInfo[StreamIndex].Finished)
+    {
+        throw (elMpegGeneratorException("Current frame is past the end of the stream."));
+    }
+    if (Index < m_StreamInfo[StreamIndex].OutputBase)
+    {
+        throw (elMpegGeneratorException("The frame has already been released."));
+    }
+    return m_Outputs[StreamIndex][Index - m_StreamInfo[StreamIndex].OutputBase];
+}
+
+void elMpegGenerator::SizeFrames(unsigned int StreamIndex)
+{
+    elStreamInfo& Info = m_StreamInfo[StreamIndex];
+
+    while (Info.Sized < Info.OutputBase + m_Outputs[StreamIndex].size())
+    {
+        if (m_FreeFormat)
+        {
+            AddFreeFormatFrame(StreamIndex);
+        }
+        else
+        {
+            AddReservoirStates(StreamIndex);
+        }
+        Info.Sized++;
+
+        CommitFrames(StreamIndex, false);
+    }
+    return;
+}
+
+void elMpegGenerator::FinishStreams(elStreamQueue* Queue, boost::mutex* Lock)
+{
+    while (true)
+    {
+        unsigned int StreamIndex;
+        {
+            boost::mutex::scoped_lock Locked(*Lock);
+            if (Queue->Next == Queue->Streams.size())
+            {
+                break;
+            }
+            StreamIndex = Queue->Streams[Queue->Next++];
+        }
+
+        // The exception is thrown again once all of the threads are done
+        try
+        {
+            SizeFrames(StreamIndex);
+            CommitFrames(StreamIndex, true);
+            UpdateFinishedFrames(StreamIndex, true);
+        }
+        catch (std::exception& E)
+        {
+            Queue->Errors[StreamIndex] = E.what();
+        }
+    }
+    return;
+}
+
+void elMpegGenerator::AddSegment(std::vector<elMpegSegment>& Segments, const uint8_t* Data, unsigned int Size)
+{
+    if (!Size)
+    {
+        return;
+    }
+
+    // Pieces that follow on from each other in memory are written in one go
+    if (!Segments.empty() && Segments.back().Data + Segments.back().Size == Data)
+    {
+        Segments.back().Size += Size;
+        return;
+    }
+
+    elMpegSegment Segment;
+    Segment.Data = Data;
+    Segment.Size = Size;
+    Segments.push_back(Segment);
+    return;
+}
+
+void elMpegGenerator::AddReservoirStates(unsigned int StreamIndex)
+{
+    elMpegStream& Output = m_Outputs[StreamIndex];
+    const elStreamInfo& Info = m_StreamInfo[StreamIndex];
+    const unsigned int Index = Info.Sized - Info.OutputBase;
+    elMpegFrame& Frame = Output[Index];
+    const std::vector<elReservoirState>& PrevStates = Output[Index - 1].States;
+
+    const unsigned int MaxBegin = Info.MaxMainDataBegin;
+    const unsigned int MainData = Frame.Used - Frame.HeaderSize;
+    const unsigned int* Sizes = Info.FrameSizes;
+
+    // With a constant bitrate, follow each bitrate from the asked for one up that still fits
+    if (m_ConstantBitrate)
+    {
+        const elMpegFrame& PrevFrame = Output[Index - 1];
+        const bool First = PrevFrame.Data.get() != NULL;
+
+        // The VBR frame has to fit in the bitrate too
+        unsigned int LowestIndex = FindBitrateIndex(m_ConstantBitrate, Frame.Version);
+        if (First)
+        {
+            LowestIndex = PrevFrame.BitrateIndex > LowestIndex ? PrevFrame.BitrateIndex : LowestIndex;
+        }
+
+        Frame.States.clear();
+        for (unsigned int i = 0; i < PrevStates.size(); i++)
+        {
+            const elReservoirState& Prev = PrevStates[i];
+            const unsigned int Reservoir = min(Prev.Reservoir, MaxBegin);
+
+            // The frame after the VBR frame starts them all, highest first
+            for (unsigned int BitrateIndex = First ? 14 : Prev.BitrateIndex;
+                 BitrateIndex >= (First ? LowestIndex : Prev.BitrateIndex); BitrateIndex--)
+            {
+                const unsigned int Space = Sizes[BitrateIndex] - Frame.HeaderSize + Reservoir;
+                if (Space >= MainData)
+                {
+                    elReservoirState State;
+                    State.Reservoir = min(Space - MainData, MaxBegin);
+                    State.Cost = Prev.Cost + Sizes[BitrateIndex];
+                    State.BitrateIndex = BitrateIndex;
+                    State.Previous = i;
+                    Frame.States.push_back(State);
+                }
+            }
+        }
+
+        if (Frame.States.empty())
+        {
+            throw (elMpegGeneratorException("Was unable to construct MPEG audio frame. The frame doesn't fit in the constant bitrate."));
+        }
+        return;
+    }
+
+    // Find the cheapest way to end up with each amount of reservoir
+    std::vector<elReservoirState> Best(MaxBegin + 1);
+
+    for (unsigned int i = 0; i < PrevStates.size(); i++)
+    {
+        const elReservoirState& Prev = PrevStates[i];
+        const unsigned int Reservoir = min(Prev.Reservoir, MaxBegin);
+
+        for (unsigned int BitrateIndex = 1; BitrateIndex < 15; BitrateIndex++)
+        {
+            const unsigned int Space = Sizes[BitrateIndex] - Frame.HeaderSize + Reservoir;
+            if (Space < MainData)
+            {
+                continue;
+            }
+
+            const unsigned int Left = min(Space - MainData, MaxBegin);
+            const unsigned long Cost = Prev.Cost + Sizes[BitrateIndex];
+
+            elReservoirState& State = Best[Left];
+            if (!State.BitrateIndex || Cost < State.Cost)
+            {
+                State.Reservoir = Left;
+                State.Cost = Cost;
+                State.BitrateIndex = BitrateIndex;
+                State.Previous = i;
+            }
+
+            // A bigger frame would only be padding
+            if (Left == MaxBegin)
+            {
+                break;
+            }
+        }
+    }
+
+    // Only keep the states that are cheaper than all of the ones with more reservoir
+    Frame.States.clear();
+    for (unsigned int i = MaxBegin + 1; i > 0; i--)
+    {
+        if (Best[i - 1].BitrateIndex && (Frame.States.empty() || Best[i - 1].Cost < Frame.States.back().Cost))
+        {
+            Frame.States.push_back(Best[i - 1]);
+        }
+    }
+
+    // The frames committed so far may not have left enough reservoir for a frame that would otherwise fit
+    if (Frame.States.empty() && Sizes[14] - Frame.HeaderSize + MaxBegin >= MainData && Info.Committed > 1)
+    {
+        throw (elMpegGeneratorException("Was unable to construct MPEG audio frame. The bit reservoir was used up by the earlier frames; try a longer lookahead."));
+    }
+    if (Frame.States.empty())
+    {
+        throw (elMpegGeneratorException("Was unable to construct MPEG audio frame. The bitrate exceeded the maximum."));
+    }
+    return;
+}
+
+void elMpegGenerator::AddFreeFormatFrame(unsigned int StreamIndex)
+{
+    const elMpegStream& Output = m_Outputs[StreamIndex];
+    elStreamInfo& Info = m_StreamInfo[StreamIndex];
+    const unsigned int Index = Info.Sized - Info.OutputBase;
+    const elMpegFrame& Frame = Output[Index];
+
+    const int MaxBegin = Info.MaxMainDataBegin;
+    const int MainData = Frame.Used - Frame.HeaderSize;
+
+    // Every size from the one that holds the VBR frame up to the largest standard frame is tried
+    if (Info.FreeReservoirs.empty())
+    {
+        Info.FreeSizeBase = Output[Index - 1].Used;
+        const unsigned int MaxSize = Info.FrameSizes[14];
+        Info.FreeReservoirs.assign(MaxSize + 1 - min(Info.FreeSizeBase, MaxSize + 1), 0);
+    }
+
+    // Follow the reservoir of each size that still fits
+    bool Fits = false;
+    for (unsigned int i = 0; i < Info.FreeReservoirs.size(); i++)
+    {
+        int& Reservoir = Info.FreeReservoirs[i];
+        if (Reservoir < 0)
+        {
+            continue;
+        }
+
+        const int Space = Info.FreeSizeBase + i - Frame.HeaderSize + min(Reservoir, MaxBegin);
+        Reservoir = Space < MainData ? -1 : min(Space - MainData, MaxBegin);
+        Fits = Fits || Reservoir >= 0;
+    }
+
+    if (!Fits)
+    {
+        throw (elMpegGeneratorException("Was unable to construct MPEG audio frame. The bitrate exceeded the maximum."));
+    }
+    return;
+}
+
+void elMpegGenerator::CommitFrames(unsigned int StreamIndex, bool Final)
+{
+    elMpegStream& Output = m_Outputs[StreamIndex];
+    elStreamInfo& Info = m_StreamInfo[StreamIndex];
+
+    if (Info.Committed == Info.Sized)
+    {
+        return;
+    }
+
+    const unsigned int First = Info.Committed - Info.OutputBase;
+    const unsigned int Last = Info.Sized - 1 - Info.OutputBase;
+
+    // Wait until enough newer frames are known to pick a good size for the older ones; a
+    // constant frame size is only picked at the end unless the frames are needed earlier
+    if (!Final && (!m_Lookahead || Last - First < m_Lookahead || ((m_ConstantBitrate || m_FreeFormat) && !m_Streaming)))
+    {
+        return;
+    }
+    const unsigned int CommitTo = Final ? Last : Last - m_Lookahead / 2;
+
+    // Free format frames all get the smallest size that every frame so far fits in
+    if (m_FreeFormat)
+    {
+        for (unsigned int i = 0; !Info.FreeFrameSize && i < Info.FreeReservoirs.size(); i++)
+        {
+            if (Info.FreeReservoirs[i] >= 0)
+            {
+                Info.FreeFrameSize = Info.FreeSizeBase + i;
+            }
+        }
+        if (Info.FreeReservoirs[Info.FreeFrameSize - Info.FreeSizeBase] < 0)
+        {
+            throw (elMpegGeneratorException("Was unable to construct MPEG audio frame. The frame doesn't fit in the free format frame size."));
+        }
+
+        elReservoirState State;
+        State.BitrateIndex = 0;
+        for (unsigned int i = First; i <= CommitTo; i++)
+        {
+            CommitFrame(StreamIndex, State);
+        }
+        return;
+    }
+
+    // Trace the cheapest way of sizing all of the frames back to the first one that isn't committed
+    std::vector<unsigned int> Chosen(Last - First + 1);
+    Chosen.back() = Output[Last].States.size() - 1;
+    for (unsigned int i = Last; i > First; i--)
+    {
+        Chosen[i - 1 - First] = Output[i].States[Chosen[i - First]].Previous;
+    }
+
+    for (unsigned int i = First; i <= CommitTo; i++)
+    {
+        CommitFrame(StreamIndex, Output[i].States[Chosen[i - First]]);
+    }
+
+    // Only keep the ways of sizing the later frames that follow on from the committed frame
+    const unsigned int Kept = Chosen[CommitTo - First];
+    std::vector<unsigned int> Remap(Output[CommitTo].States.size(), UINT_MAX);
+    Remap[Kept] = 0;
+
+    std::vector<elReservoirState> KeptStates(1, Output[CommitTo].States[Kept]);
+    Output[CommitTo].States.swap(KeptStates);
+
+    for (unsigned int i = CommitTo + 1; i <= Last; i++)
+    {
+        std::vector<elReservoirState>& States = Output[i].States;
+        std::vector<unsigned int> NewRemap(States.size(), UINT_MAX);
+        unsigned int Count = 0;
+
+        for (unsigned int j = 0; j < States.size(); j++)
+        {
+            if (Remap[States[j].Previous] == UINT_MAX)
+            {
+                continue;
+            }
+            States[Count] = States[j];
+            States[Count].Previous = Remap[States[j].Previous];
+            NewRemap[j] = Count++;
+        }
+        States.resize(Count);
+        Remap.swap(NewRemap);
+    }
+
+    // The older frames don't need their states any more
+    for (unsigned int i = First; i < CommitTo; i++)
     {
-        throw (elMpegGeneratorException("Stream index exceeds the number of streams."));
+        std::vector<elReservoirState>().swap(Output[i].States);
     }
-    return m_Outputs[StreamIndex].size();
+    return;
 }
 
-
-unsigned int elMpegGenerator::ReadFrame(uint8_t* Buffer, unsigned int BufferSize, unsigned int Index, unsigned int StreamIndex) const
+void elMpegGenerator::CommitFrame(unsigned int StreamIndex, const elReservoirState& State)
 {
-    // Check some things
-    if (!m_DoneParsingBlocks)
+    elStreamInfo& Info = m_StreamInfo[StreamIndex];
+    elMpegFrame& Frame = m_Outputs[StreamIndex][Info.Committed - Info.OutputBase];
+    const unsigned int MaxBegin = Info.MaxMainDataBegin;
+
+    // Start the main data as early as main_data_begin allows
+    Frame.PayloadOffset = Info.PayloadEnd;
+    if (Info.PayloadEnd - Info.DataEnd > MaxBegin)
     {
-        throw (elMpegGeneratorException("Haven't called DoneParsingBlocks(), we're not done parsing blocks."));
+        Frame.DataOffset = Info.PayloadEnd - MaxBegin;
     }
-    if (StreamIndex >= m_Outputs.size())
+    else
     {
-        throw (elMpegGeneratorException("Stream index exceeds the number of streams."));
+        Frame.DataOffset = Info.DataEnd;
     }
-    if (!m_Outputs[StreamIndex].size())
+
+    if (State.BitrateIndex)
     {
-        throw (elMpegGeneratorException("No frames are outputted."));
+        Frame.Size = Info.FrameSizes[State.BitrateIndex];
     }
-    if (Index >= m_Outputs[StreamIndex].size())
+    else
     {
-        throw (elMpegGeneratorException("Current frame is past the end of the stream."));
+        Frame.Size = Info.FreeFrameSize;
     }
+    WriteFields(Frame, State.BitrateIndex, Frame.PayloadOffset - Frame.DataOffset);
 
-    // The frame
-    const elMpegFrame& Frame = m_Outputs[StreamIndex][Index];
-    unsigned int ToCopy;
-    const uint8_t* OldBuffer = Buffer;
-
-    // Write the header
-    ToCopy = min(Frame.HeaderSize, BufferSize);
-
-    memcpy(Buffer, Frame.Data.get(), ToCopy);
-
-    BufferSize -= ToCopy;
-    Buffer += ToCopy;
-
-    // Write part of the main data
-    ToCopy = min(Frame.Used - Frame.HeaderSize - Frame.UsedFromPrevious, BufferSize);
-
-    memcpy(Buffer, Frame.Data.get() + Frame.HeaderSize + Frame.UsedFromPrevious, ToCopy);
+    // The VBR frame is the same size as the others when they're all the same size
+    if ((m_ConstantBitrate || m_FreeFormat) && Info.Committed == 1)
+    {
+        elMpegFrame& VbrFrame = m_Outputs[StreamIndex][0];
+        VbrFrame.Size = Frame.Size;
+        WriteFields(VbrFrame, State.BitrateIndex, 0);
 
-    BufferSize -= ToCopy;
-    Buffer += ToCopy;
+        m_VbrFrames[StreamIndex].Size = VbrFrame.Size;
+        m_VbrFrames[StreamIndex].BitrateIndex = State.BitrateIndex;
+    }
 
-    // Write the padding
-    ToCopy = min(Frame.Size - (Frame.Used - Frame.UsedFromPrevious) - Frame.UsedByNext,
-                 BufferSize);
+    Info.PayloadEnd += Frame.Size - Frame.HeaderSize;
+    Info.DataEnd = Frame.DataOffset + Frame.Used - Frame.HeaderSize;
+    assert(Info.DataEnd <= Info.PayloadEnd);
 
-    memset(Buffer, 0xE5, ToCopy);
+    Info.Committed++;
+    return;
+}
 
-    BufferSize -= ToCopy;
-    Buffer += ToCopy;
+void elMpegGenerator::UpdateFinishedFrames(unsigned int StreamIndex, bool Final)
+{
+    const elMpegStream& Output = m_Outputs[StreamIndex];
+    elStreamInfo& Info = m_StreamInfo[StreamIndex];
+    std::vector<elMpegSegment> Segments;
+    elMpegSegmentBuffer Buffer;
 
-    // Finally write any bytes used by the next frame
-    if (Frame.UsedByNext > 0)
+    while (Info.Finished < Info.Committed)
     {
-        const elMpegFrame& NextFrame = m_Outputs[StreamIndex][Index + 1];
-        assert(Frame.UsedByNext == NextFrame.UsedFromPrevious);
+        const elMpegFrame& Frame = Output[Info.Finished - Info.OutputBase];
 
-        ToCopy = min(Frame.UsedByNext, BufferSize);
+        // Frames that aren't committed yet might still put some main data in this one; the
+        // VBR frame waits for the bitrate of the frame after it
+        const unsigned long PayloadEnd = Frame.PayloadOffset + Frame.Size - Frame.HeaderSize;
+        if (!Final && (Frame.Data ? Info.Committed < 2 :
+            PayloadEnd + Info.MaxMainDataBegin > Info.PayloadEnd))
+        {
+            break;
+        }
+
+        // Remember where some of the frames start for the seek table
+        if (Info.Finished % Info.SeekPointSpacing == 0)
+        {
+            if (Info.SeekPoints.size() == MAX_VBR_SEEK_POINTS)
+            {
+                for (unsigned int i = 0; i < MAX_VBR_SEEK_POINTS / 2; i++)
+                {
+                    Info.SeekPoints[i] = Info.SeekPoints[i * 2];
+                }
+                Info.SeekPoints.resize(MAX_VBR_SEEK_POINTS / 2);
+                Info.SeekPointSpacing *= 2;
+            }
+            Info.SeekPoints.push_back(Info.FinishedSize);
+        }
 
-        memcpy(Buffer, NextFrame.Data.get() + NextFrame.HeaderSize, ToCopy);
+        // Nothing more goes in the frame, so it's put together once for the music CRC
+        if (!Frame.Data)
+        {
+            Segments.clear();
+            Buffer.Clear();
+            AddFrameSegments(Segments, Buffer, Frame, Info.Finished, StreamIndex);
+            for (unsigned int i = 0; i < Segments.size(); i++)
+            {
+                Info.MusicCrc = CalculateCrc16(Segments[i].Data, Segments[i].Size, Info.MusicCrc);
+            }
+        }
 
-        BufferSize -= ToCopy;
-        Buffer += ToCopy;
+        Info.FinishedSize += Frame.Size;
+        Info.Finished++;
     }
-
-    assert(Buffer - OldBuffer == Frame.Size);
-    return Frame.Size;
+    return;
 }
 
-const elUncompressedSampleFrames& elMpegGenerator::ReadUncSamples(unsigned int Granule, unsigned int Index, unsigned int StreamIndex) const
+void elMpegGenerator::FinishDirectFrames(unsigned int StreamIndex)
 {
-    // Check some things
-    if (!m_DoneParsingBlocks)
-    {
-        throw (elMpegGeneratorException("Haven't called DoneParsingBlocks(), we're not done parsing blocks."));
-    }
-    if (StreamIndex >= m_Outputs.size())
-    {
-        throw (elMpegGeneratorException("Stream index exceeds the number of streams."));
-    }
-    if (!m_Outputs[StreamIndex].size())
-    {
-        throw (elMpegGeneratorException("No frames are outputted."));
-    }
-    if (Index >= m_Outputs[StreamIndex].size())
-    {
-        throw (elMpegGeneratorException("Current frame is past the end of the stream."));
-    }
-
-    if (Granule == 1)
-    {
-        return m_Outputs[StreamIndex][Index].UncompB;
-    }
-    return m_Outputs[StreamIndex][Index].UncompA;
+    // Every frame that has been parsed can be decoded right away
+    elStreamInfo& Info = m_StreamInfo[StreamIndex];
+    Info.Finished = Info.OutputBase + m_Outputs[StreamIndex].size();
+    Info.Sized = Info.Finished;
+    Info.Committed = Info.Finished;
+    return;
 }
 
-
 void elMpegGenerator::ReadBlockData(elStreamVector& Streams, bsBitstream& IS)
 {
     m_Parser->Parse(Streams, IS);
     
 #ifdef ENABLE_VERY_VERBOSE
-    if (g_Verbose >= 2)
+    if (m_Context.GetVerbose() >= 2)
     {
         Print(Streams);
     }
@@ -423,10 +1374,29 @@ void elMpegGenerator::ReadBlockData(elStreamVector& Streams, bsBitstream& IS)
     return;
 }
 
-void elMpegGenerator::ConstructMpegVbrFrame(const elGranule* Granule, elMpegFrame& Out, unsigned int Frames, unsigned int DataSize)
+void elMpegGenerator::SetFrameFormat(elStreamInfo& Info, const elGranule& Gr)
 {
-    bsBitstream OS(Out.Data.get(), MAX_MPEG_FRAME_BUFFER);
+    Info.Version = Gr.Version;
+    Info.SampleRateIndex = Gr.SampleRateIndex;
+
+    // Sync, version, layer III, no CRC, sample rate, copyrighted and original
+    Info.HeaderTemplate = (0x7FFU << 21) | (Gr.Version << 19) | (0x1 << 17) | (1 << 16) |
+        (Gr.SampleRateIndex << 10) | (1 << 3) | (1 << 2);
 
+    for (unsigned int i = 0; i < 16; i++)
+    {
+        Info.FrameSizes[i] = CalculateFrameSize(i, Gr.SampleRate, Gr.Version);
+    }
+
+    Info.SideInfoSize = CalculateSideInfoSize(Gr.Channels, Gr.Version);
+    Info.MainDataStartBits = CalculateMainDataStartBits(Gr.Version);
+    Info.PrivateBits = CalculatePrivateBits(Gr.Channels, Gr.Version);
+    Info.MaxMainDataBegin = CalculateMaxMainDataBegin(Gr.Version);
+    return;
+}
+
+void elMpegGenerator::ConstructMpegVbrFrame(const elGranule* Granule, elMpegFrame& Out, const elStreamInfo& Info)
+{
     // Get some stuff
     if (Granule)
     {
@@ -439,9 +1409,17 @@ void elMpegGenerator::ConstructMpegVbrFrame(const elGranule* Granule, elMpegFram
     const unsigned int SideInfoSize = CalculateSideInfoSize(Out.Channels, Out.Version);
     Out.Used = 4;
     Out.Used += SideInfoSize;
-    Out.Used += 4 * 4;
+    Out.Used += VBR_HEADER_SIZE;
+    Out.Used += LAME_TAG_SIZE;
     Out.HeaderSize = Out.Used;
 
+    // This is the only frame which is stored as it is
+    if (!Out.Data)
+    {
+        Out.Data = shared_array<uint8_t>(new uint8_t[Out.HeaderSize]);
+    }
+    bsBitstream OS(Out.Data.get(), Out.HeaderSize);
+
     // Write the MPEG frame header if we have the information
     if (Granule)
     {
@@ -467,28 +1445,119 @@ void elMpegGenerator::ConstructMpegVbrFrame(const elGranule* Granule, elMpegFram
         OS.WriteAligned8<uint8_t>(0);
     }
 
-    // Write the info
-    OS.WriteAligned8<char>('X');
-    OS.WriteAligned8<char>('i');
-    OS.WriteAligned8<char>('n');
-    OS.WriteAligned8<char>('g');
-    OS.WriteAligned32BE<uint32_t>(VBR_FRAMES_FLAG | VBR_BYTES_FLAG);
-    OS.WriteAligned32BE<uint32_t>(Frames);
-    OS.WriteAligned32BE<uint32_t>(DataSize);
+    // Write the info; constant bitrate files are tagged the way LAME tags them
+    const char* Tag = (m_ConstantBitrate || m_FreeFormat) ? "Info" : "Xing";
+    for (unsigned int i = 0; i < 4; i++)
+    {
+        OS.WriteAligned8<char>(Tag[i]);
+    }
+    OS.WriteAligned32BE<uint32_t>(VBR_FRAMES_FLAG | VBR_BYTES_FLAG | VBR_TOC_FLAG | VBR_SCALE_FLAG);
+    OS.WriteAligned32BE<uint32_t>(Info.Finished ? Info.Finished - 1 : 0);
+    OS.WriteAligned32BE<uint32_t>(Info.FinishedSize);
+    WriteVbrToc(OS, Info);
+    OS.WriteAligned32BE<uint32_t>(0);           // Quality
+    WriteLameTag(OS, Out, Info);
+    return;
+}
+
+void elMpegGenerator::WriteVbrToc(bsBitstream& OS, const elStreamInfo& Info) const
+{
+    const unsigned int Frames = Info.Finished ? Info.Finished - 1 : 0;
+
+    for (unsigned int i = 0; i < VBR_TOC_SIZE; i++)
+    {
+        if (!Info.FinishedSize)
+        {
+            OS.WriteAligned8<uint8_t>(0);
+            continue;
+        }
+
+        // Find where the frame i percent of the way in starts, between the seek points around it
+        const unsigned int Frame = 1 + (unsigned int)((double)i * Frames / VBR_TOC_SIZE);
+        const unsigned int Point = Frame / Info.SeekPointSpacing;
+        const unsigned int PointFrame = Point * Info.SeekPointSpacing;
+
+        unsigned int NextFrame = Info.Finished;
+        unsigned long NextOffset = Info.FinishedSize;
+        if (Point + 1 < Info.SeekPoints.size())
+        {
+            NextFrame = PointFrame + Info.SeekPointSpacing;
+            NextOffset = Info.SeekPoints[Point + 1];
+        }
+
+        const double Offset = Info.SeekPoints[Point] + (double)(NextOffset - Info.SeekPoints[Point]) *
+            (Frame - PointFrame) / (NextFrame - PointFrame);
+        OS.WriteAligned8<uint8_t>((uint8_t)min(255.0, 256.0 * Offset / Info.FinishedSize));
+    }
+    return;
+}
+
+void elMpegGenerator::WriteLameTag(bsBitstream& OS, const elMpegFrame& Out, const elStreamInfo& Info) const
+{
+    // The delay and padding that make gapless players output the same samples as the PCM output
+    const unsigned long Decoded = (Info.Finished ? Info.Finished - 1 : 0) * CalculateSamplesPerFrame(Out.Version);
+    const unsigned long Skipped = min((unsigned long)Info.SkippedSamples, Decoded);
+    const unsigned long Wanted = min(m_SampleFrames, Decoded - Skipped);
+    const unsigned int Delay = Skipped > MPEG_DECODER_DELAY ? Skipped - MPEG_DECODER_DELAY : 0;
+    const unsigned int Padding = min(Decoded - Skipped - Wanted + MPEG_DECODER_DELAY, 0xFFFUL);
+
+    // The bitrate is only known for constant bitrate files
+    const unsigned int Bitrate = m_ConstantBitrate ? MpegBitrateTable[Out.Version][Out.BitrateIndex] : 0;
+
+    // The peak is fixed point with 23 fraction bits; the gain is in tenths of a dB, set automatically for radio
+    uint32_t Peak = 0;
+    uint16_t RadioGain = 0;
+    if (Info.HasReplayGain)
+    {
+        Peak = (uint32_t)min(Info.ReplayPeak * 8388608.0 + 0.5, 4294967295.0);
+        const int Gain = (int)floor(fabs(Info.ReplayGain) * 10.0 + 0.5);
+        RadioGain = (1 << 13) | (3 << 10) | (Info.ReplayGain < 0.0 ? 0x200 : 0) | min(Gain, 0x1FF);
+    }
+
+    const char* Encoder = "LAME";
+    for (unsigned int i = 0; i < 9; i++)
+    {
+        OS.WriteAligned8<char>(i < 4 ? Encoder[i] : 0);
+    }
+    OS.WriteAligned8<uint8_t>((m_ConstantBitrate || m_FreeFormat) ? 1 : 0); // Tag revision and VBR method
+    OS.WriteAligned8<uint8_t>(0);                           // Lowpass
+    OS.WriteAligned32BE<uint32_t>(Peak);                    // Peak signal
+    OS.WriteAligned16BE<uint16_t>(RadioGain);               // Radio replay gain
+    OS.WriteAligned16BE<uint16_t>(0);                       // Audiophile replay gain
+    OS.WriteAligned8<uint8_t>(0);                           // Encoding flags and ATH type
+    OS.WriteAligned8<uint8_t>(min(Bitrate, 255U));          // Bitrate
+    OS.WriteBits(Delay, 12);                                // Encoder delay
+    OS.WriteBits(Padding, 12);                              // Padding
+    OS.WriteAligned8<uint8_t>(0);                           // Misc
+    OS.WriteAligned8<uint8_t>(0);                           // MP3 gain
+    OS.WriteAligned16BE<uint16_t>(0);                       // Preset and surround info
+    OS.WriteAligned32BE<uint32_t>(Info.FinishedSize);       // Music length
+    OS.WriteAligned16BE<uint16_t>(Info.MusicCrc);           // Music CRC
+
+    // The CRC covers the whole frame up to here
+    OS.WriteAligned16BE<uint16_t>(CalculateCrc16(Out.Data.get(), Out.HeaderSize - 2));
     return;
 }
 
 
-void elMpegGenerator::ConstructMpegFrame(const elFrame& Fr, bsBitstream& IS, elMpegGenerator::elMpegFrame& Out)
+void elMpegGenerator::ConstructMpegFrame(const elFrame& Fr, bsBitstream& IS, elMpegGenerator::elMpegFrame& Out, const elStreamInfo& Info)
 {
-    switch (Fr.Gr[0].Version)
+    // The frames are sized and written with the tables of the stream
+    const elGranule& BaseGr = Fr.Gr[0];
+    if (BaseGr.Used && (BaseGr.Version != Info.Version || BaseGr.SampleRateIndex != Info.SampleRateIndex ||
+        BaseGr.Channels != Info.Channels))
+    {
+        throw (elMpegGeneratorException("The sample rate or the number of channels changes within the stream."));
+    }
+
+    switch (BaseGr.Version)
     {
         case MV_1:
-            ConstructMpegFrameV1(Fr, IS, Out);
+            ConstructMpegFrameV1(Fr, IS, Out, Info);
         break;
         case MV_2:
         case MV_2_5:
-            ConstructMpegFrameV2(Fr, IS, Out);
+            ConstructMpegFrameV2(Fr, IS, Out, Info);
         break;
         default:
             throw (elMpegGeneratorException("Invalid version passed to ConstructMpegFrame."));
@@ -496,7 +1565,7 @@ void elMpegGenerator::ConstructMpegFrame(const elFrame& Fr, bsBitstream& IS, elM
     return;
 }
 
-void elMpegGenerator::ConstructMpegFrameV1(const elFrame& Fr, bsBitstream& IS, elMpegFrame& Out)
+void elMpegGenerator::ConstructMpegFrameV1(const elFrame& Fr, bsBitstream& IS, elMpegFrame& Out, const elStreamInfo& Info)
 {
     const elGranule& BaseGr = Fr.Gr[0];
 
@@ -509,7 +1578,7 @@ void elMpegGenerator::ConstructMpegFrameV1(const elFrame& Fr, bsBitstream& IS, e
     // If we don't have a full frame, jump ship
     if (!Fr.Gr[0].Used || !Fr.Gr[1].Used)
     {
-        VERBOSE("G: we only have one granule, not enough for a frame");
+        VERBOSE(m_Context, "G: we only have one granule, not enough for a frame");
         Out.Used = 0;
         Out.Size = 0;
         return;
@@ -517,7 +1586,7 @@ void elMpegGenerator::ConstructMpegFrameV1(const elFrame& Fr, bsBitstream& IS, e
 
     // Calculate the amount of data this frame will use
     Out.Used = 4;
-    Out.Used += CalculateSideInfoSize(BaseGr.Channels, BaseGr.Version);
+    Out.Used += Info.SideInfoSize;
     Out.HeaderSize = Out.Used;
 
     unsigned long DataBitCount = 0;
@@ -538,24 +1607,6 @@ void elMpegGenerator::ConstructMpegFrameV1(const elFrame& Fr, bsBitstream& IS, e
     Out.UncompA = Fr.Gr[0].Uncomp;
     Out.UncompB = Fr.Gr[1].Uncomp;
 
-    // Write the MPEG header
-    bsBitstream OS(Out.Data.get(), MAX_MPEG_FRAME_BUFFER);
-    unsigned int Padding = 0;
-
-    OS.WriteBits(0x7FF, 11);                    // Frame sync
-    OS.WriteBits(BaseGr.Version, 2);            // Version
-    OS.WriteBits(0x1, 2);                       // Layer
-    OS.WriteBit(1);                             // CRC protection
-    OS.WriteBits(0, 4);                         // Bitrate index
-    OS.WriteBits(BaseGr.SampleRateIndex, 2);    // Sample rate index
-    OS.WriteBit(Padding);                       // Padding
-    OS.WriteBit(0);                             // Private bit
-    OS.WriteBits(BaseGr.ChannelMode, 2);        // Channel mode
-    OS.WriteBits(BaseGr.ModeExtension, 2);      // Channel mode extension
-    OS.WriteBit(1);                             // Copyrighted
-    OS.WriteBit(1);                             // Original
-    OS.WriteBits(0, 2);                         // Emphasis
-
     m_UncompressedSampleFrames += Fr.Gr[0].Uncomp.Count;
     m_UncompressedSampleFrames += Fr.Gr[1].Uncomp.Count;
 
@@ -563,57 +1614,12 @@ void elMpegGenerator::ConstructMpegFrameV1(const elFrame& Fr, bsBitstream& IS, e
     Out.SampleRate = BaseGr.SampleRate;
     Out.Channels = BaseGr.Channels;
 
-    // Write the beginning of the side info
-    OS.WriteBits(0, CalculateMainDataStartBits(Out.Version));
-    OS.WriteBits(0, CalculatePrivateBits(Out.Channels, Out.Version));
-
-    // Write the scfsi
-    for (unsigned int i = 0; i < Fr.Gr[1].Channels; i++)
-    {
-        OS.WriteBits(Fr.Gr[1].ChannelInfo[i].Scfsi, 4);
-    }
-
-    // Write the rest of the side info
-    for (unsigned int i = 0; i < 2; i++)
-    {
-        for (unsigned int j = 0; j < Fr.Gr[i].Channels; j++)
-        {
-            OS.WriteBits(Fr.Gr[i].ChannelInfo[j].Size, 12);
-            OS.WriteBits(Fr.Gr[i].ChannelInfo[j].SideInfo[0], 32);
-            OS.WriteBits(Fr.Gr[i].ChannelInfo[j].SideInfo[1], 47 - 32);
-        }
-    }
-
-    // Now write the actual data
-    for (unsigned int i = 0; i < 2; i++)
-    {
-        if (Fr.Gr[i].DataSize == 0)
-        {
-            continue;
-        }
-        
-        bsBitstream DataReader(Fr.Gr[i].Data.get(), Fr.Gr[i].DataSize);
-
-        for (unsigned int j = 0; j < BaseGr.Channels; j++)
-        {
-            unsigned int BitsLeft = Fr.Gr[i].ChannelInfo[j].Size;
-
-            while (BitsLeft)
-            {
-                unsigned int BitsToRead = min(32, BitsLeft);
-                uint32_t Bits = DataReader.ReadBits(BitsToRead);
-                OS.WriteBits(Bits, BitsToRead);
-                BitsLeft -= BitsToRead;
-            }
-        }
-    }
-
-    // Pad to the nearest byte
-    OS.WriteToNextByte();
+    // Keep the granules around to write the frame when it's read
+    Out.Granules = Fr;
     return;
 }
 
-void elMpegGenerator::ConstructMpegFrameV2(const elFrame& Fr, bsBitstream& IS, elMpegFrame& Out)
+void elMpegGenerator::ConstructMpegFrameV2(const elFrame& Fr, bsBitstream& IS, elMpegFrame& Out, const elStreamInfo& Info)
 {
     const elGranule& BaseGr = Fr.Gr[0];
 
@@ -626,7 +1632,7 @@ void elMpegGenerator::ConstructMpegFrameV2(const elFrame& Fr, bsBitstream& IS, e
     // If we don't have a full frame, jump ship
     if (!BaseGr.Used)
     {
-        VERBOSE("G: we only have one granule, not enough for a frame");
+        VERBOSE(m_Context, "G: we only have one granule, not enough for a frame");
         Out.Used = 0;
         Out.Size = 0;
         return;
@@ -634,7 +1640,7 @@ void elMpegGenerator::ConstructMpegFrameV2(const elFrame& Fr, bsBitstream& IS, e
 
     // Calculate the amount of data this frame will use
     Out.Used = 4;
-    Out.Used += CalculateSideInfoSize(BaseGr.Channels, BaseGr.Version);
+    Out.Used += Info.SideInfoSize;
     Out.HeaderSize = Out.Used;
 
     unsigned long DataBitCount = 0;
@@ -650,63 +1656,185 @@ void elMpegGenerator::ConstructMpegFrameV2(const elFrame& Fr, bsBitstream& IS, e
 
     Out.Used += DataBitCount / 8;
 
-    // Write the MPEG header
-    bsBitstream OS(Out.Data.get(), MAX_MPEG_FRAME_BUFFER);
-    unsigned int Padding = 0;
-
-    OS.WriteBits(0x7FF, 11);                    // Frame sync
-    OS.WriteBits(BaseGr.Version, 2);            // Version
-    OS.WriteBits(0x1, 2);                       // Layer
-    OS.WriteBit(1);                             // CRC protection
-    OS.WriteBits(0, 4);                         // Bitrate index
-    OS.WriteBits(BaseGr.SampleRateIndex, 2);    // Sample rate index
-    OS.WriteBit(Padding);                       // Padding
-    OS.WriteBit(0);                             // Private bit
-    OS.WriteBits(BaseGr.ChannelMode, 2);        // Channel mode
-    OS.WriteBits(BaseGr.ModeExtension, 2);      // Channel mode extension
-    OS.WriteBit(1);                             // Copyrighted
-    OS.WriteBit(1);                             // Original
-    OS.WriteBits(0, 2);                         // Emphasis
-
     m_UncompressedSampleFrames += BaseGr.Uncomp.Count;
 
     Out.Version = BaseGr.Version;
     Out.SampleRate = BaseGr.SampleRate;
     Out.Channels = BaseGr.Channels;
 
+    // Keep the granule around to write the frame when it's read
+    Out.Granules = Fr;
+    return;
+}
+
+void elMpegGenerator::WriteSideInfo(const elMpegFrame& Frame, const elStreamInfo& Info, uint8_t* Buffer) const
+{
+    // Each layout of the side info gets its own writer
+    bsBitstream OS(Buffer, Frame.HeaderSize);
+    switch (Frame.Version)
+    {
+        case MV_1:
+            if (Frame.Channels == 1)
+            {
+                WriteSideInfoV1<1>(Frame, Info, OS);
+            }
+            else
+            {
+                WriteSideInfoV1<2>(Frame, Info, OS);
+            }
+        break;
+        case MV_2:
+        case MV_2_5:
+            if (Frame.Channels == 1)
+            {
+                WriteSideInfoV2<1>(Frame, Info, OS);
+            }
+            else
+            {
+                WriteSideInfoV2<2>(Frame, Info, OS);
+            }
+        break;
+        default:
+            throw (elMpegGeneratorException("Invalid version passed to WriteSideInfo."));
+    }
+    return;
+}
+
+void elMpegGenerator::WriteMpegHeader(const elMpegFrame& Frame, const elStreamInfo& Info, bsBitstream& OS) const
+{
+    const elGranule& BaseGr = Frame.Granules.Gr[0];
+
+    // Only the bitrate and the channel mode change from frame to frame
+    OS.WriteBits(Info.HeaderTemplate | (Frame.BitrateIndex << 12) |
+        (BaseGr.ChannelMode << 6) | (BaseGr.ModeExtension << 4), 32);
+
     // Write the beginning of the side info
-    OS.WriteBits(0, CalculateMainDataStartBits(Out.Version));
-    OS.WriteBits(0, CalculatePrivateBits(Out.Channels, Out.Version));
+    OS.WriteBits(Frame.UsedFromPrevious << Info.PrivateBits, Info.MainDataStartBits + Info.PrivateBits);
+    return;
+}
+
+template <unsigned int Channels>
+void elMpegGenerator::WriteSideInfoV1(const elMpegFrame& Frame, const elStreamInfo& Info, bsBitstream& OS) const
+{
+    const elFrame& Fr = Frame.Granules;
+    WriteMpegHeader(Frame, Info, OS);
+
+    // Write the scfsi
+    for (unsigned int i = 0; i < Channels; i++)
+    {
+        OS.WriteBits(Fr.Gr[1].ChannelInfo[i].Scfsi, 4);
+    }
 
     // Write the rest of the side info
-    for (unsigned int j = 0; j < BaseGr.Channels; j++)
+    for (unsigned int i = 0; i < 2; i++)
+    {
+        for (unsigned int j = 0; j < Channels; j++)
+        {
+            OS.WriteBits(Fr.Gr[i].ChannelInfo[j].Size, 12);
+            OS.WriteBits(Fr.Gr[i].ChannelInfo[j].SideInfo[0], 32);
+            OS.WriteBits(Fr.Gr[i].ChannelInfo[j].SideInfo[1], 47 - 32);
+        }
+    }
+    return;
+}
+
+template <unsigned int Channels>
+void elMpegGenerator::WriteSideInfoV2(const elMpegFrame& Frame, const elStreamInfo& Info, bsBitstream& OS) const
+{
+    const elGranule& BaseGr = Frame.Granules.Gr[0];
+    WriteMpegHeader(Frame, Info, OS);
+
+    // Write the rest of the side info
+    for (unsigned int j = 0; j < Channels; j++)
     {
         OS.WriteBits(BaseGr.ChannelInfo[j].Size, 12);
         OS.WriteBits(BaseGr.ChannelInfo[j].SideInfo[0], 32);
         OS.WriteBits(BaseGr.ChannelInfo[j].SideInfo[1], 51 - 32);
     }
+    return;
+}
+
+void elMpegGenerator::WriteMainData(const elMpegFrame& Frame, unsigned int Start, unsigned int End, uint8_t* Buffer) const
+{
+    if (Start >= End)
+    {
+        return;
+    }
+
+    // The main data is the bits of the granules one after the other, padded to a byte with zeros
+    memset(Buffer, 0, End - Start);
+    bsBitstream OS(Buffer, End - Start);
+    unsigned long Skip = Start * 8;
+    unsigned long Left = (End - Start) * 8;
 
-    // Now write the actual data
-    if (BaseGr.DataSize > 0)
+    const unsigned int GranuleCount = Frame.Version == MV_1 ? 2 : 1;
+    for (unsigned int i = 0; i < GranuleCount && Left; i++)
     {
-        bsBitstream DataReader(BaseGr.Data.get(), BaseGr.DataSize);
+        const elGranule& Gr = Frame.Granules.Gr[i];
+        const unsigned long Bits = GetGranuleBits(Gr);
+        if (Skip >= Bits)
+        {
+            Skip -= Bits;
+            continue;
+        }
 
-        for (unsigned int j = 0; j < BaseGr.Channels; j++)
+        // Only the bits that are asked for are read
+        unsigned long BitsLeft = min(Bits - Skip, Left);
+        bsBitstream DataReader(Gr.Data.get(), Gr.DataSize);
+        DataReader.SeekAbsolute(Skip);
+        Left -= BitsLeft;
+        Skip = 0;
+
+        // Whole bytes are copied when both sides are on a byte
+        if (DataReader.Tell() % 8 == 0 && OS.Tell() % 8 == 0)
         {
-            unsigned int BitsLeft = BaseGr.ChannelInfo[j].Size;
+            const unsigned long Bytes = BitsLeft / 8;
+            memcpy(OS.GetDataAtCurrentOffset(), DataReader.GetDataAtCurrentOffset(), Bytes);
+            OS.SeekRelative(Bytes * 8);
+            DataReader.SeekRelative(Bytes * 8);
+            BitsLeft -= Bytes * 8;
+        }
 
-            while (BitsLeft)
-            {
-                unsigned int BitsToRead = min(32, BitsLeft);
-                uint32_t Bits = DataReader.ReadBits(BitsToRead);
-                OS.WriteBits(Bits, BitsToRead);
-                BitsLeft -= BitsToRead;
-            }
+        while (BitsLeft)
+        {
+            unsigned int BitsToRead = min(32, BitsLeft);
+            uint32_t Bits = DataReader.ReadBits(BitsToRead);
+            OS.WriteBits(Bits, BitsToRead);
+            BitsLeft -= BitsToRead;
         }
     }
+    return;
+}
+
+void elMpegGenerator::AddMainDataSegments(std::vector<elMpegSegment>& Segments, elMpegSegmentBuffer& Buffer,
+    const elMpegFrame& Frame, unsigned int Start, unsigned int End) const
+{
+    const elFrame& Fr = Frame.Granules;
+
+    // The first granule starts on a byte, so its whole bytes are written straight from it
+    const unsigned int FirstBits = GetGranuleBits(Fr.Gr[0]);
+    const unsigned int Split = Frame.Version == MV_1 ? FirstBits / 8 : Frame.Used - Frame.HeaderSize;
+    if (Start < Split)
+    {
+        const unsigned int To = min(Split, End);
+        AddSegment(Segments, Fr.Gr[0].Data.get() + Start, To - Start);
+        Start = To;
+    }
+    if (Start >= End)
+    {
+        return;
+    }
+
+    // So is the second one if the first one ends on a byte; otherwise its bits are shifted into place
+    if (FirstBits % 8 == 0)
+    {
+        AddSegment(Segments, Fr.Gr[1].Data.get() + (Start - Split), End - Start);
+        return;
+    }
 
-    // Pad to the nearest byte
-    OS.WriteToNextByte();
+    uint8_t* Data = Buffer.Allocate(End - Start);
+    WriteMainData(Frame, Start, End, Data);
+    AddSegment(Segments, Data, End - Start);
     return;
 }
 
@@ -722,6 +1850,18 @@ unsigned int elMpegGenerator::EstimateBitrateIndex(unsigned int FrameUsed, unsig
     return 0;
 }
 
+unsigned int elMpegGenerator::FindBitrateIndex(unsigned int Bitrate, unsigned int Version)
+{
+    for (unsigned int i = 1; i < 15; i++)
+    {
+        if (MpegBitrateTable[Version][i] == Bitrate)
+        {
+            return i;
+        }
+    }
+    return 0;
+}
+
 unsigned int elMpegGenerator::CalculateFrameSize(unsigned int BitrateIndex, unsigned int SampleRate, unsigned int Version)
 {
     switch (Version)
@@ -782,8 +1922,55 @@ unsigned int elMpegGenerator::CalculateMainDataStartBits(unsigned int Version)
     return 0;
 }
 
+unsigned int elMpegGenerator::CalculateMaxMainDataBegin(unsigned int Version)
+{
+    return (1 << CalculateMainDataStartBits(Version)) - 1;
+}
+
+unsigned int elMpegGenerator::CalculateSamplesPerFrame(unsigned int Version)
+{
+    switch (Version)
+    {
+        case MV_1:
+            return 1152;
+        case MV_2:
+        case MV_2_5:
+            return 576;
+        default:
+            throw (elMpegGeneratorException("Invalid version passed to CalculateSamplesPerFrame."));
+    };
+    return 0;
+}
+
+uint16_t elMpegGenerator::CalculateCrc16(const uint8_t* Data, unsigned int Size, uint16_t Crc)
+{
+    // Eight bytes at a time, carried on from Crc; the CRC only reaches into the first two
+    const uint16_t (*Slices)[256] = Crc16Tables.Slices;
+    unsigned int i = 0;
+    for (; i + 8 <= Size; i += 8)
+    {
+        Crc ^= Data[i] | (Data[i + 1] << 8);
+        Crc = Slices[7][Crc & 0xFF] ^ Slices[6][Crc >> 8] ^ Slices[5][Data[i + 2]] ^ Slices[4][Data[i + 3]] ^
+              Slices[3][Data[i + 4]] ^ Slices[2][Data[i + 5]] ^ Slices[1][Data[i + 6]] ^ Slices[0][Data[i + 7]];
+    }
+    for (; i < Size; i++)
+    {
+        Crc = (Crc >> 8) ^ Slices[0][(Crc ^ Data[i]) & 0xFF];
+    }
+    return Crc;
+}
+
 void elMpegGenerator::WriteFields(elMpegFrame& Frame, unsigned int NewBitrateIndex, unsigned int NewUsedFromPrev) const
 {
+    Frame.BitrateIndex = NewBitrateIndex;
+    Frame.UsedFromPrevious = NewUsedFromPrev;
+
+    // The other frames are written with the new fields when they're read
+    if (!Frame.Data)
+    {
+        return;
+    }
+
     bsBitstream OS(Frame.Data.get(), 8);
     OS.SeekAbsolute(16);
     OS.WriteBits(NewBitrateIndex, 4);
@@ -11,15 +11,50 @@
 
 #define MAX_MPEG_FRAME_BUFFER (144 * 1000 * 320 / 32000 * 2)
 
+/// How many frames can wait for a bitrate before the cheapest choice so far is taken.
+#define DEFAULT_LOOKAHEAD 64
+
+namespace boost { class mutex; }
+
 class bsBitstream;
 class elBlock;
 class elMpegOutputStream;
 class elPcmOutputStream;
+class elContext;
 
 class elMpegGenerator
 {
 public:
-    elMpegGenerator();
+    /// A piece of an output frame, in memory held by the generator or by an elMpegSegmentBuffer.
+    struct elMpegSegment
+    {
+        const uint8_t* Data;
+        unsigned int Size;
+    };
+
+    /**
+     * Holds the pieces of frames that aren't in memory as they're written, like
+     * the headers and main data that doesn't start on a byte, so segments can
+     * point at them. The memory is kept until Clear() is called.
+     */
+    class elMpegSegmentBuffer
+    {
+    public:
+        elMpegSegmentBuffer();
+
+        /// Get some memory which stays where it is until Clear() is called; at most MAX_MPEG_FRAME_BUFFER bytes.
+        uint8_t* Allocate(unsigned int Size);
+
+        /// Let go of everything that was allocated, keeping the memory to use again.
+        void Clear();
+
+    protected:
+        std::vector< shared_array<uint8_t> > m_Blocks;
+        unsigned int m_Block;
+        unsigned int m_Used;
+    };
+
+    elMpegGenerator(const elContext& Context);
     ~elMpegGenerator();
 
     /// Clears all data from this object and restores it to an initial state;
@@ -37,12 +72,114 @@ public:
     /// Get the total number of sample frames that were ignored.
     unsigned long GetSampleFrameCount() const;
 
+    /// Get how many sample frames the PCM output of a stream has, once every frame is finished.
+    unsigned long GetDecodedSampleFrameCount(unsigned int StreamIndex = 0) const;
+
     /// Get the sample rate of a stream.
     unsigned int GetSampleRate(unsigned int StreamIndex = 0) const;
 
+    /// Get how many sample frames each MPEG frame of a stream has.
+    unsigned int GetSamplesPerFrame(unsigned int StreamIndex = 0) const;
+
     /// Get the number of channels in a stream.
     unsigned int GetChannels(unsigned int StreamIndex = 0) const;
 
+    /**
+     * Finish the frames while the blocks are being parsed instead of all at the end.
+     * The bitrates of the older frames are picked once SetLookahead() frames
+     * are waiting for one. A frame is finished when no later frame can put main data
+     * in it; it can then be read right away and is released at the next
+     * ParseBlock() call, so the output has to be read after every call. The VBR
+     * frame is written with empty fields; once DoneParsingBlocks() is called
+     * ReadVbrFrame() returns the filled in version to write over it. Unless the
+     * granules are decoded directly, the lookahead can't be 0, as nothing would
+     * be finished before the end. Call this after Initialize().
+     */
+    void EnableStreaming();
+
+    /// Are the frames finished while parsing?
+    bool IsStreaming() const;
+
+    /**
+     * Set how many frames can wait for a bitrate before the older half of them
+     * is given the cheapest bitrates found so far; pass 0 to wait for the whole
+     * stream, which can't be done when streaming MPEG frames. The bitrates, and so the bytes written, depend on this: a longer
+     * lookahead can find smaller sizes, but the search takes longer and the
+     * frames are held for longer when streaming. One that's too short can leave
+     * too little reservoir for a large frame, which then throws. The search
+     * goes through every reservoir amount for each frame whatever the lookahead
+     * is, so it's several times slower than sizing each frame on its own.
+     * Streaming and buffering the whole file write the same bytes for the same
+     * lookahead. Call this after Initialize() and before parsing any blocks.
+     */
+    void SetLookahead(unsigned int Frames);
+
+    /// Get how many frames can wait for a bitrate, or 0 for the whole stream.
+    unsigned int GetLookahead() const;
+
+    /**
+     * Write every frame at the same bitrate (in kbit/s), using the bit reservoir to
+     * fit the granules in. If the bitrate is too low for the stream, the lowest
+     * bitrate that fits is used instead. When streaming, the bitrate is settled
+     * within the first frames and an exception is thrown if a later frame doesn't
+     * fit. Pass 0 to size each frame on its own again. Call this after Initialize().
+     */
+    void SetConstantBitrate(unsigned int Bitrate);
+
+    /// Get the constant bitrate in kbit/s, or 0 if the bitrate varies.
+    unsigned int GetConstantBitrate() const;
+
+    /**
+     * Write free format frames (bitrate index 0), all of the smallest size the
+     * stream fits in with the bit reservoir, instead of rounding each frame up to
+     * a standard bitrate. The decoder has to support free format. When streaming,
+     * the size is settled within the first frames like a constant bitrate is.
+     * Call this after Initialize().
+     */
+    void SetFreeFormat(bool FreeFormat);
+
+    /// Are free format frames written?
+    bool IsFreeFormat() const;
+
+    /**
+     * Size the frames of up to this many streams at the same time when
+     * DoneParsingBlocks() is called. The streams don't share any data, so each one
+     * is worked on by its own thread; in streaming mode the frames are sized while
+     * parsing instead. The frames of one stream are always sized in order, as the
+     * bitrates picked for a range of frames depend on the reservoir left by the
+     * frames before it; once they're sized, ReadFrame() can put together any
+     * range of them on any thread. Pass 0 to use one thread per processor. Call
+     * this after Initialize().
+     */
+    void SetThreadCount(unsigned int Threads);
+
+    /// Get the number of threads used to size the frames, or 0 for one per processor.
+    unsigned int GetThreadCount() const;
+
+    /**
+     * Keep the granules of each frame for a decoder that works on them directly,
+     * instead of sizing the frames and putting MPEG frames together. Every frame
+     * is finished as soon as it's parsed, and nothing that reads MPEG frames can
+     * be used. Call this after Initialize() and before parsing any blocks.
+     */
+    void SetDirectDecoding(bool DirectDecoding);
+
+    /// Are the granules kept for decoding directly instead of making MPEG frames?
+    bool IsDirectDecoding() const;
+
+    /**
+     * Decode PCM streams from the granules with the built-in decoder even though
+     * MPEG frames are made too, instead of feeding the frames to mpg123. Direct
+     * decoding always does this.
+     */
+    void SetDecodeGranules(bool DecodeGranules);
+
+    /// Are PCM streams decoded from the granules instead of from the MPEG frames?
+    bool IsDecodingGranules() const;
+
+    /// Only construct frames for the streams in the mask (bit N is stream N). Call this after Initialize().
+    void SetStreamMask(uint32_t Mask);
+
     /// Parses the block and adds it to the internal output buffer. Remember to call this on the first frame.
     void ParseBlock(const elBlock& Block);
 
@@ -55,37 +192,157 @@ public:
     /// Create a PCM stream from the output frames
     shared_ptr<elPcmOutputStream> CreatePcmStream(unsigned int StreamIndex = 0) const;
 
-    /// Get the total number of frames in the output.
+    /// Get the total number of frames in the output. In streaming mode this is the number finished so far.
     unsigned int GetFrameCount(unsigned int StreamIndex = 0) const;
 
-    /// Reads a frame from the output.
+    /// Get the size of a frame in the output, which is how much ReadFrame() writes for it.
+    unsigned int GetFrameSize(unsigned int Index, unsigned int StreamIndex = 0) const;
+
+    /// Get the total size of the frames in the output, including the VBR frame.
+    unsigned long GetStreamSize(unsigned int StreamIndex = 0) const;
+
+    /// Reads a frame from the output. Frames can be read from several threads at once.
     unsigned int ReadFrame(uint8_t* Buffer, unsigned int BufferSize, unsigned int Index, unsigned int StreamIndex = 0) const;
 
+    /**
+     * Gets the pieces a frame from the output is made of, adding them to the end
+     * of Segments in order. Main data that starts on a byte points straight into
+     * the granules of the frame and the ones after it, so it stays valid until
+     * those frames are released; the header and anything that has to be shifted
+     * into place is put together in Buffer. Returns the size of the frame.
+     */
+    unsigned int GetFrameSegments(std::vector<elMpegSegment>& Segments, elMpegSegmentBuffer& Buffer,
+        unsigned int Index, unsigned int StreamIndex = 0) const;
+
+    /// Get the first frame holding any of the main data of a frame, which a decoder has to be fed before that frame.
+    unsigned int GetFirstDataFrame(unsigned int Index, unsigned int StreamIndex = 0) const;
+
+    /// Gets the granules of a frame from the output.
+    const elFrame& ReadGranules(unsigned int Index, unsigned int StreamIndex = 0) const;
+
     /// Gets uncompressed samples from the output.
     const elUncompressedSampleFrames& ReadUncSamples(unsigned int Granule, unsigned int Index, unsigned int StreamIndex = 0) const;
 
+    /**
+     * Put the radio ReplayGain of a stream (in dB) and its peak (where 1.0 is
+     * full scale) in its LAME tag. Call this after DoneParsingBlocks(); the VBR
+     * frame is written again, so read it or write the stream after this.
+     */
+    void SetReplayGain(double Gain, double Peak, unsigned int StreamIndex = 0);
+
+    /// Reads the header of the VBR frame, up to the end of the LAME tag.
+    unsigned int ReadVbrFrame(uint8_t* Buffer, unsigned int BufferSize, unsigned int StreamIndex = 0) const;
+
     
 protected:
     /// Information about each stream.
     struct elStreamInfo
     {
+        elStreamInfo() : SampleRate(0), Channels(0), Version(0), SampleRateIndex(0),
+            HeaderTemplate(0), SideInfoSize(0), MainDataStartBits(0), PrivateBits(0),
+            MaxMainDataBegin(0), OutputBase(0), Sized(0), Committed(0),
+            Finished(0), FinishedSize(0), PayloadEnd(0), DataEnd(0), SkippedSamples(0),
+            SeekPointSpacing(1), FreeFrameSize(0), FreeSizeBase(0), ReplayGain(0.0), ReplayPeak(0.0),
+            HasReplayGain(false), MusicCrc(0) {};
+
         unsigned int SampleRate;
         unsigned char Channels;
+        unsigned int Version;
+        unsigned int SampleRateIndex;
+
+        /// The frame header bits that are the same in every frame; the bitrate and channel mode are added to it.
+        uint32_t HeaderTemplate;
+
+        /// The size of a frame at each bitrate index.
+        unsigned int FrameSizes[16];
+
+        /// The side info layout of every frame.
+        unsigned int SideInfoSize;
+        unsigned int MainDataStartBits;
+        unsigned int PrivateBits;
+        unsigned int MaxMainDataBegin;
+
+        /// The index of the first frame in the output; earlier frames have been released.
+        unsigned int OutputBase;
+
+        /// The number of frames whose ways of sizing have been worked out.
+        unsigned int Sized;
+
+        /// The number of frames whose bitrate has been picked.
+        unsigned int Committed;
+
+        /// The number of frames which are complete and can be read.
+        unsigned int Finished;
+
+        /// The size of the finished frames.
+        unsigned long FinishedSize;
+
+        /// Where the main data area of the last committed frame ends, counted over all frames after the VBR frame.
+        unsigned long PayloadEnd;
+
+        /// Where the main data of the last committed frame ends.
+        unsigned long DataEnd;
+
+        /// How many decoded samples are left out at the start of the stream.
+        unsigned int SkippedSamples;
+
+        /// Where every SeekPointSpacing-th finished frame starts, for the seek table.
+        std::vector<unsigned long> SeekPoints;
+        unsigned int SeekPointSpacing;
+
+        /// The size of the free format frames, once it has been picked.
+        unsigned int FreeFrameSize;
+
+        /// The reservoir left with each free format frame size from FreeSizeBase up, or -1 if it doesn't fit.
+        std::vector<int> FreeReservoirs;
+        unsigned int FreeSizeBase;
+
+        /// The radio ReplayGain in dB and the peak for the LAME tag, if they were measured.
+        double ReplayGain;
+        double ReplayPeak;
+        bool HasReplayGain;
+
+        /// The CRC of the finished frames after the VBR frame, for the LAME tag.
+        uint16_t MusicCrc;
     };
 
-    /// A place to store a decoded MPEG audio frame.
+    /// One way of sizing the frames up to and including a frame.
+    struct elReservoirState
+    {
+        /// The bytes left in the reservoir for the next frame, at most the largest main_data_begin.
+        unsigned int Reservoir;
+
+        /// The total size of the frames.
+        unsigned long Cost;
+
+        /// The bitrate index picked for the frame.
+        unsigned int BitrateIndex;
+
+        /// The index of the state of the frame before.
+        unsigned int Previous;
+    };
+
+    /// An MPEG audio frame; the bytes are only put together when it is read.
     struct elMpegFrame
     {
-        elMpegFrame() : HeaderSize(0), Data(new uint8_t[MAX_MPEG_FRAME_BUFFER]),
-            Used(0), Size(0), UsedFromPrevious(0), UsedByNext(0), Version(0),
-            SampleRate(0), Channels(0) {};
+        elMpegFrame() : HeaderSize(0),
+            Used(0), Size(0), UsedFromPrevious(0), BitrateIndex(0), PayloadOffset(0),
+            DataOffset(0), Version(0), SampleRate(0), Channels(0) {};
 
         unsigned int HeaderSize;
-        shared_array<uint8_t> Data;
         unsigned int Used;
         unsigned int Size;
         unsigned int UsedFromPrevious;
-        unsigned int UsedByNext;
+        unsigned int BitrateIndex;
+
+        /// Where the frame's main data area starts, counted over all frames after the VBR frame.
+        unsigned long PayloadOffset;
+
+        /// Where the frame's main data starts; it can start in the frames before it.
+        unsigned long DataOffset;
+
+        /// The ways of sizing the frames up to this one that are still being considered.
+        std::vector<elReservoirState> States;
 
         unsigned int Version;
         unsigned int SampleRate;
@@ -93,29 +350,78 @@ protected:
 
         elUncompressedSampleFrames UncompA;
         elUncompressedSampleFrames UncompB;
+
+        /// The granules the frame is made of; the main data is read straight from them.
+        elFrame Granules;
+
+        /// The header of the VBR frame, which doesn't have any granules.
+        shared_array<uint8_t> Data;
+    };
+
+    /// The streams left for the threads in DoneParsingBlocks() to size.
+    struct elStreamQueue
+    {
+        elStreamQueue() : Next(0) {};
+
+        std::vector<unsigned int> Streams;
+        unsigned int Next;
+
+        /// What went wrong with each stream, if anything.
+        std::vector<std::string> Errors;
     };
 
     typedef std::vector<elStreamInfo> elStreamInfoVector;
-    typedef std::vector<elMpegFrame> elMpegStream;
+    typedef std::deque<elMpegFrame> elMpegStream;
     typedef std::vector<elMpegStream> elMpegStreamVector;
 
     void ReadBlockData(elStreamVector& Streams, bsBitstream& IS);
-    void ConstructMpegVbrFrame(const elGranule* Granule, elMpegFrame& Out, unsigned int Frames, unsigned int DataSize);
-    void ConstructMpegFrame(const elFrame& Fr, bsBitstream& IS, elMpegFrame& Out);
-    void ConstructMpegFrameV1(const elFrame& Fr, bsBitstream& IS, elMpegFrame& Out);
-    void ConstructMpegFrameV2(const elFrame& Fr, bsBitstream& IS, elMpegFrame& Out);
+    void SetFrameFormat(elStreamInfo& Info, const elGranule& Gr);
+    void ConstructMpegVbrFrame(const elGranule* Granule, elMpegFrame& Out, const elStreamInfo& Info);
+    void WriteVbrToc(bsBitstream& OS, const elStreamInfo& Info) const;
+    void WriteLameTag(bsBitstream& OS, const elMpegFrame& Out, const elStreamInfo& Info) const;
+    void ConstructMpegFrame(const elFrame& Fr, bsBitstream& IS, elMpegFrame& Out, const elStreamInfo& Info);
+    void ConstructMpegFrameV1(const elFrame& Fr, bsBitstream& IS, elMpegFrame& Out, const elStreamInfo& Info);
+    void ConstructMpegFrameV2(const elFrame& Fr, bsBitstream& IS, elMpegFrame& Out, const elStreamInfo& Info);
+    void WriteSideInfo(const elMpegFrame& Frame, const elStreamInfo& Info, uint8_t* Buffer) const;
+    void WriteMpegHeader(const elMpegFrame& Frame, const elStreamInfo& Info, bsBitstream& OS) const;
+    template <unsigned int Channels>
+    void WriteSideInfoV1(const elMpegFrame& Frame, const elStreamInfo& Info, bsBitstream& OS) const;
+    template <unsigned int Channels>
+    void WriteSideInfoV2(const elMpegFrame& Frame, const elStreamInfo& Info, bsBitstream& OS) const;
+    void WriteMainData(const elMpegFrame& Frame, unsigned int Start, unsigned int End, uint8_t* Buffer) const;
+    void AddMainDataSegments(std::vector<elMpegSegment>& Segments, elMpegSegmentBuffer& Buffer,
+        const elMpegFrame& Frame, unsigned int Start, unsigned int End) const;
+    void AddFrameSegments(std::vector<elMpegSegment>& Segments, elMpegSegmentBuffer& Buffer,
+        const elMpegFrame& Frame, unsigned int Index, unsigned int StreamIndex) const;
+    void SizeFrames(unsigned int StreamIndex);
+    void FinishStreams(elStreamQueue* Queue, boost::mutex* Lock);
+    void AddReservoirStates(unsigned int StreamIndex);
+    void AddFreeFormatFrame(unsigned int StreamIndex);
+    void CommitFrames(unsigned int StreamIndex, bool Final);
+    void CommitFrame(unsigned int StreamIndex, const elReservoirState& State);
+    void UpdateFinishedFrames(unsigned int StreamIndex, bool Final);
+    void FinishDirectFrames(unsigned int StreamIndex);
+    const elMpegFrame& GetOutputFrame(unsigned int Index, unsigned int StreamIndex) const;
+    static void AddSegment(std::vector<elMpegSegment>& Segments, const uint8_t* Data, unsigned int Size);
 public:
     static unsigned int EstimateBitrateIndex(unsigned int FrameUsed, unsigned int SampleRate, unsigned int Version);
+    static unsigned int FindBitrateIndex(unsigned int Bitrate, unsigned int Version);
     static unsigned int CalculateFrameSize(unsigned int BitrateIndex, unsigned int SampleRate, unsigned int Version);
     static unsigned int CalculateSideInfoSize(unsigned int Channels, unsigned int Version);
     static unsigned int CalculatePrivateBits(unsigned int Channels, unsigned int Version);
     static unsigned int CalculateMainDataStartBits(unsigned int Version);
+    static unsigned int CalculateMaxMainDataBegin(unsigned int Version);
+    static unsigned int CalculateSamplesPerFrame(unsigned int Version);
+    static uint16_t CalculateCrc16(const uint8_t* Data, unsigned int Size, uint16_t Crc = 0);
 protected:
     void WriteFields(elMpegFrame& Frame, unsigned int NewBitrateIndex, unsigned int NewUsedFromPrev) const;
 
     void Print(const elGranule& Gr, const std::string& Indent);
     void Print(const elStreamVector& Streams);
 
+    /// Where the messages go, and what the streams are given.
+    const elContext& m_Context;
+
     /// The EALayer3 parser we are using.
     shared_ptr<elParser> m_Parser;
 
@@ -145,6 +451,33 @@ protected:
 
     /// Hold all of the outputted MPEG audio frames for each stream.
     elMpegStreamVector m_Outputs;
+
+    /// Are the frames finished while parsing?
+    bool m_Streaming;
+
+    /// How many frames can wait for a bitrate, or 0 for all of them.
+    unsigned int m_Lookahead;
+
+    /// The bitrate of every frame in kbit/s, or 0 to let it vary.
+    unsigned int m_ConstantBitrate;
+
+    /// Are the frames written in free format?
+    bool m_FreeFormat;
+
+    /// How many streams are sized at the same time, or 0 for one per processor.
+    unsigned int m_ThreadCount;
+
+    /// Are the granules kept for decoding directly instead of making MPEG frames?
+    bool m_DirectDecoding;
+
+    /// Are PCM streams decoded from the granules while MPEG frames are made too?
+    bool m_DecodeGranules;
+
+    /// The VBR frame of each output; it shares its data with the first frame.
+    elMpegStream m_VbrFrames;
+
+    /// What the unused parts of the main data areas are filled with.
+    std::vector<uint8_t> m_Padding;
 };
 
 class elMpegGeneratorException : public std::exception
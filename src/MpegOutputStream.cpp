@@ -22,7 +22,7 @@ elMpegOutputStream::~elMpegOutputStream()
 
 unsigned int elMpegOutputStream::Read(uint8_t* Buffer, unsigned int BufferSize)
 {
-    if (m_CurrentFrame >= m_Gen.GetFrameCount())
+    if (m_CurrentFrame >= m_Gen.GetFrameCount(m_StreamIndex))
     {
         m_Eos = true;
         return 0;
@@ -9,6 +9,7 @@
 #include "Parser.h"
 #include "Bitstream.h"
 #include "MpegGenerator.h"
+#include "Context.h"
 
 static const unsigned int MpegSampleRateTable[4][4] = {
     {11025, 12000, 8000, 0},
@@ -17,7 +18,8 @@ static const unsigned int MpegSampleRateTable[4][4] = {
     {44100, 48000, 32000, 0}
 };
 
-elMpegParser::elMpegParser() :
+elMpegParser::elMpegParser(const elContext& Context) :
+    m_Context(Context),
     m_ReservoirUsed(0)
 {
     return;
@@ -84,7 +86,7 @@ bool elMpegParser::ReadFrame(elFrame& Frame)
     else
     {
         // Try to find the capture pattern in the first 2000 bytes.
-        VERBOSE("Trying to find the next frame... (ignore message if at the end of file)");
+        VERBOSE(m_Context, "Trying to find the next frame... (ignore message if at the end of file)");
         for (unsigned int i = 0; i < 2000 && !m_Input->eof(); i++)
         {
             StartOffset = m_Input->tellg();
@@ -92,7 +94,7 @@ bool elMpegParser::ReadFrame(elFrame& Frame)
             
             if (FrameHeader[0] == 0xFF)
             {
-                VERBOSE("Found a frame!");
+                VERBOSE(m_Context, "Found a frame!");
                 m_Input->read((char*)(FrameHeader + 1), 10 - 1);
                 m_Input->seekg(StartOffset);
 
@@ -110,13 +112,13 @@ bool elMpegParser::ReadFrame(elFrame& Frame)
                 }
                 catch (std::exception& E)
                 {
-                    VERBOSE("Exception finding frame (doesn't matter if at the end of the file): " << E.what());
+                    VERBOSE(m_Context, "Exception finding frame (doesn't matter if at the end of the file): " << E.what());
                     return false;
                 }
                 return true;
             }
         }
-        VERBOSE("Not found.");
+        VERBOSE(m_Context, "Not found.");
         return false;
     }
     return true;
@@ -149,7 +151,7 @@ void elMpegParser::SkipID3Tag(uint8_t FrameHeader[10])
     Temp.SeekAbsolute(0);
     Size = Temp.ReadAligned32BE<unsigned int>();
 
-    VERBOSE("ID3 Tag size: " << Size);
+    VERBOSE(m_Context, "ID3 Tag size: " << Size);
 
     // Finally seek past it.
     m_Input->seekg(Size + 10, std::ios_base::cur);
@@ -204,7 +206,7 @@ bool elMpegParser::ProcessFrameHeader(elRawFrameHeader& Fr, uint8_t FrameHeader[
     // Seek past the header and the CRC.
     m_Input->seekg(Fr.HeaderSize, std::ios_base::cur);
 
-    //VERBOSE("Frame size: " << Fr.FrameSize);
+    //VERBOSE(m_Context, "Frame size: " << Fr.FrameSize);
     
     return true;
 }
@@ -265,7 +267,7 @@ bool elMpegParser::ProcessMpegFrame(elFrame& Fr, elMpegParser::elRawFrameHeader&
             elChannelInfo& Ci = Gr.ChannelInfo[j];
             
             Ci.Size = IS.ReadBits(12);
-            //VERBOSE("        Size: " << Ci.Size);
+            //VERBOSE(m_Context, "        Size: " << Ci.Size);
             Ci.SideInfo[0] = IS.ReadBits(32);
             if (Gr.Version == MV_1)
             {
@@ -298,7 +300,7 @@ bool elMpegParser::ProcessMpegFrame(elFrame& Fr, elMpegParser::elRawFrameHeader&
 
     if (m_ReservoirUsed && MainDataStart)
     {
-        //VERBOSEVAR(int(m_ReservoirUsed - MainDataStart));
+        //VERBOSEVAR(m_Context, int(m_ReservoirUsed - MainDataStart));
         Res.SetData(m_Reservoir + (m_ReservoirUsed - MainDataStart), m_ReservoirUsed);
     }
 
@@ -364,20 +366,20 @@ bool elMpegParser::ProcessMpegFrame(elFrame& Fr, elMpegParser::elRawFrameHeader&
     unsigned int StillInReservoir = ResBitsLeft / 8;
     if (StillInReservoir > 0)
     {
-        //VERBOSEVAR(OldReservoirUsed);
-        //VERBOSEVAR(StillInReservoir);
-        //VERBOSEVAR(OldReservoirUsed - StillInReservoir);
+        //VERBOSEVAR(m_Context, OldReservoirUsed);
+        //VERBOSEVAR(m_Context, StillInReservoir);
+        //VERBOSEVAR(m_Context, OldReservoirUsed - StillInReservoir);
         memmove(m_Reservoir, m_Reservoir + (OldReservoirUsed - StillInReservoir),
                 StillInReservoir);
     }
 
-    //VERBOSEVAR(Hdr.FrameSize);
-    //VERBOSEVAR(Hdr.HeaderSize);
-    //VERBOSEVAR(SideInfoSize);
-    //VERBOSEVAR(DataSize);
-    //VERBOSEVAR(MainDataStart);
+    //VERBOSEVAR(m_Context, Hdr.FrameSize);
+    //VERBOSEVAR(m_Context, Hdr.HeaderSize);
+    //VERBOSEVAR(m_Context, SideInfoSize);
+    //VERBOSEVAR(m_Context, DataSize);
+    //VERBOSEVAR(m_Context, MainDataStart);
 
-    //VERBOSEVAR(m_ReservoirUsed);
+    //VERBOSEVAR(m_Context, m_ReservoirUsed);
 
     // Put the bits on the end into the reservoir.
     if (m_ReservoirUsed < 0)
@@ -393,8 +395,8 @@ bool elMpegParser::ProcessMpegFrame(elFrame& Fr, elMpegParser::elRawFrameHeader&
     // Make sure this frame actually has data
     if (DataSize < 1)
     {
-        VERBOSE("Skipped empty frame");
-        //VERBOSE("");
+        VERBOSE(m_Context, "Skipped empty frame");
+        //VERBOSE(m_Context, "");
         return true;
     }
 
@@ -408,7 +410,7 @@ bool elMpegParser::ProcessMpegFrame(elFrame& Fr, elMpegParser::elRawFrameHeader&
         Fr.Gr[0].Used = true;
         Fr.Gr[1].Used = false;
     }
-    //VERBOSE("-------------next frame---------------");
+    //VERBOSE(m_Context, "-------------next frame---------------");
     return true;
 }
 
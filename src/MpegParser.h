@@ -10,11 +10,12 @@
 
 struct elFrame;
 struct elChannelInfo;
+class elContext;
 
 class elMpegParser
 {
 public:
-    elMpegParser();
+    elMpegParser(const elContext& Context);
     ~elMpegParser();
 
     /// Initialize the parser with a pointer to the input stream.
@@ -53,6 +54,9 @@ protected:
     /// Process an actual frame.
     bool ProcessMpegFrame(elFrame& Fr, elRawFrameHeader& Hdr);
     
+    /// Where the messages go.
+    const elContext& m_Context;
+
     std::istream* m_Input;
 
     uint8_t m_Reservoir[2880];
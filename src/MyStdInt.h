@@ -11,6 +11,7 @@
 typedef unsigned char uint8_t;
 typedef unsigned short uint16_t;
 typedef unsigned int uint32_t;
+typedef unsigned __int64 uint64_t;
 typedef char int8_t;
 typedef short int16_t;
 typedef int int32_t;
@@ -0,0 +1,345 @@
+/*
+    EA Layer 3 Extractor/Decoder
+    Copyright (C) 2010, Ben Moench.
+    See License.txt
+*/
+
+#include "Internal.h"
+#include "OutputSink.h"
+#include "Context.h"
+
+#include <stdio.h>
+#include <algorithm>
+#include <stdexcept>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+using std::runtime_error;
+
+
+/// Delete an output file which didn't get finished, as long as it's a plain file and not something like /dev/null.
+static void _RemoveFile(const std::string& Filename)
+{
+    struct stat Status;
+    if (stat(Filename.c_str(), &Status) == 0 && (Status.st_mode & S_IFMT) == S_IFREG)
+    {
+        remove(Filename.c_str());
+    }
+    return;
+}
+
+
+elOutputSink::elOutputSink() :
+    m_Position(0)
+{
+    return;
+}
+
+elOutputSink::~elOutputSink()
+{
+    return;
+}
+
+bool elOutputSink::Seek(uint64_t /*Offset*/)
+{
+    return false;
+}
+
+uint64_t elOutputSink::Tell() const
+{
+    return m_Position;
+}
+
+void elOutputSink::Close()
+{
+    return;
+}
+
+
+elFileSink::elFileSink(const std::string& Filename) :
+    m_Filename(Filename)
+{
+    m_Output.open(Filename.c_str(), std::ios_base::out | std::ios_base::binary);
+    if (!m_Output.is_open())
+    {
+        throw (runtime_error("Could not open output file '" + Filename + "'."));
+    }
+    return;
+}
+
+elFileSink::~elFileSink()
+{
+    // If it was never closed the output didn't get finished, and the header could say it did
+    if (m_Output.is_open())
+    {
+        m_Output.close();
+        _RemoveFile(m_Filename);
+    }
+    return;
+}
+
+void elFileSink::Write(const void* Data, unsigned long Size)
+{
+    m_Output.write((const char*)Data, Size);
+    if (m_Output.fail())
+    {
+        throw (runtime_error("Could not write to the output file."));
+    }
+    m_Position += Size;
+    return;
+}
+
+bool elFileSink::Seek(uint64_t Offset)
+{
+    m_Output.seekp((std::streamoff)Offset);
+    if (m_Output.fail())
+    {
+        m_Output.clear();
+        return false;
+    }
+    m_Position = Offset;
+    return true;
+}
+
+void elFileSink::Close()
+{
+    if (!m_Output.is_open())
+    {
+        return;
+    }
+    m_Output.close();
+    if (m_Output.fail())
+    {
+        _RemoveFile(m_Filename);
+        throw (runtime_error("Could not write to the output file."));
+    }
+    return;
+}
+
+
+elStdoutSink::elStdoutSink()
+{
+#ifdef _WIN32
+    _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    return;
+}
+
+elStdoutSink::~elStdoutSink()
+{
+    return;
+}
+
+void elStdoutSink::Write(const void* Data, unsigned long Size)
+{
+    if (fwrite(Data, 1, Size, stdout) != Size)
+    {
+        throw (runtime_error("Could not write to stdout."));
+    }
+    m_Position += Size;
+    return;
+}
+
+void elStdoutSink::Close()
+{
+    if (fflush(stdout) != 0)
+    {
+        throw (runtime_error("Could not write to stdout."));
+    }
+    return;
+}
+
+
+elMemorySink::elMemorySink()
+{
+    return;
+}
+
+elMemorySink::~elMemorySink()
+{
+    return;
+}
+
+void elMemorySink::Write(const void* Data, unsigned long Size)
+{
+    // Anything past the end is added, anything before it is overwritten
+    const uint8_t* Bytes = (const uint8_t*)Data;
+    const unsigned long Overwritten = (unsigned long)std::min((uint64_t)Size, m_Data.size() - m_Position);
+    std::copy(Bytes, Bytes + Overwritten, m_Data.begin() + m_Position);
+    m_Data.insert(m_Data.end(), Bytes + Overwritten, Bytes + Size);
+    m_Position += Size;
+    return;
+}
+
+bool elMemorySink::Seek(uint64_t Offset)
+{
+    if (Offset > m_Data.size())
+    {
+        m_Data.resize(Offset, 0);
+    }
+    m_Position = Offset;
+    return true;
+}
+
+const std::vector<uint8_t>& elMemorySink::GetData() const
+{
+    return m_Data;
+}
+
+
+#ifndef _WIN32
+elMappedFileSink::elMappedFileSink(const std::string& Filename, uint64_t Size) :
+    m_Filename(Filename),
+    m_File(-1),
+    m_Map(NULL),
+    m_Size(Size),
+    m_End(0)
+{
+    if (!Size || Size != (size_t)Size)
+    {
+        throw (runtime_error("The output file '" + Filename + "' can't be mapped."));
+    }
+
+    m_File = open(Filename.c_str(), O_RDWR | O_CREAT, 0666);
+    if (m_File < 0)
+    {
+        throw (runtime_error("Could not open output file '" + Filename + "'."));
+    }
+
+    // Only a plain file can be given its size and mapped; anything else is left as it is
+    struct stat Status;
+    if (fstat(m_File, &Status) != 0 || !S_ISREG(Status.st_mode))
+    {
+        Release();
+        throw (runtime_error("The output file '" + Filename + "' can't be mapped."));
+    }
+    if (ftruncate(m_File, 0) != 0)
+    {
+        Discard();
+        throw (runtime_error("Could not open output file '" + Filename + "'."));
+    }
+
+    // Make room for the whole file up front, so running out of space isn't found out through the
+    // mapping; a sparse file could still run out of space that way, so it's written instead
+    const int Result = posix_fallocate(m_File, 0, Size);
+    if (Result != 0)
+    {
+        Discard();
+        throw (runtime_error("Could not make room for output file '" + Filename + "' (" + strerror(Result) + ")."));
+    }
+
+    void* Map = mmap(NULL, Size, PROT_READ | PROT_WRITE, MAP_SHARED, m_File, 0);
+    if (Map == MAP_FAILED)
+    {
+        Discard();
+        throw (runtime_error("The output file '" + Filename + "' can't be mapped."));
+    }
+    m_Map = (uint8_t*)Map;
+    return;
+}
+
+elMappedFileSink::~elMappedFileSink()
+{
+    // If it was never closed the output didn't get finished, and a file of the full size would look like it did
+    if (m_File >= 0)
+    {
+        Discard();
+    }
+    return;
+}
+
+void elMappedFileSink::Write(const void* Data, unsigned long Size)
+{
+    if (!m_Map || Size > m_Size - m_Position)
+    {
+        throw (runtime_error("Could not write past the end of the output file."));
+    }
+    memcpy(m_Map + m_Position, Data, Size);
+    m_Position += Size;
+    m_End = std::max(m_End, m_Position);
+    return;
+}
+
+bool elMappedFileSink::Seek(uint64_t Offset)
+{
+    if (Offset > m_Size)
+    {
+        return false;
+    }
+    m_Position = Offset;
+    return true;
+}
+
+void elMappedFileSink::Close()
+{
+    if (m_File < 0)
+    {
+        return;
+    }
+
+    // Anything which wasn't written isn't part of the file
+    bool Failed = munmap(m_Map, m_Size) != 0;
+    m_Map = NULL;
+    if (m_End < m_Size)
+    {
+        Failed = ftruncate(m_File, m_End) != 0 || Failed;
+    }
+    Failed = close(m_File) != 0 || Failed;
+    m_File = -1;
+    if (Failed)
+    {
+        _RemoveFile(m_Filename);
+        throw (runtime_error("Could not write to the output file."));
+    }
+    return;
+}
+
+void elMappedFileSink::Release()
+{
+    if (m_Map)
+    {
+        munmap(m_Map, m_Size);
+        m_Map = NULL;
+    }
+    if (m_File >= 0)
+    {
+        close(m_File);
+        m_File = -1;
+    }
+    return;
+}
+
+void elMappedFileSink::Discard()
+{
+    Release();
+    _RemoveFile(m_Filename);
+    return;
+}
+#endif
+
+
+shared_ptr<elOutputSink> CreateFileSink(const elContext& Context, const std::string& Filename, uint64_t Size)
+{
+#ifndef _WIN32
+    if (Size)
+    {
+        try
+        {
+            return shared_ptr<elOutputSink>(new elMappedFileSink(Filename, Size));
+        }
+        catch (std::exception& E)
+        {
+            VERBOSE(Context, E.what() << " Writing it instead.");
+        }
+    }
+#endif
+    return shared_ptr<elOutputSink>(new elFileSink(Filename));
+}
@@ -0,0 +1,132 @@
+/*
+    EA Layer 3 Extractor/Decoder
+    Copyright (C) 2010, Ben Moench.
+    See License.txt
+*/
+
+#pragma once
+
+#include "Internal.h"
+
+#include <fstream>
+
+/**
+ * Where the bytes of an output go. They're written one after another; only
+ * some sinks can go back to overwrite what's been written, so anything which
+ * can be has to be written in order. Anything which goes wrong is thrown.
+ */
+class elContext;
+
+class elOutputSink
+{
+public:
+    elOutputSink();
+    virtual ~elOutputSink();
+
+    /// Write some bytes after the ones before.
+    virtual void Write(const void* Data, unsigned long Size) = 0;
+
+    /// Go to where the next bytes are written; returns false if the sink can't go back.
+    virtual bool Seek(uint64_t Offset);
+
+    /// Get where the next bytes are written.
+    uint64_t Tell() const;
+
+    /// Write out anything which is left, once the output is finished.
+    virtual void Close();
+
+protected:
+    uint64_t m_Position;
+};
+
+/**
+ * Writes to a file. A file which is never closed is deleted, since its header
+ * could already say it's finished.
+ */
+class elFileSink : public elOutputSink
+{
+public:
+    elFileSink(const std::string& Filename);
+    virtual ~elFileSink();
+
+    virtual void Write(const void* Data, unsigned long Size);
+    virtual bool Seek(uint64_t Offset);
+    virtual void Close();
+
+protected:
+    std::string m_Filename;
+    std::ofstream m_Output;
+};
+
+/**
+ * Writes to stdout, so the output can go into a pipe. Nothing else should be
+ * printed to stdout while it's being written.
+ */
+class elStdoutSink : public elOutputSink
+{
+public:
+    elStdoutSink();
+    virtual ~elStdoutSink();
+
+    virtual void Write(const void* Data, unsigned long Size);
+    virtual void Close();
+};
+
+/**
+ * Keeps the output in memory, for handing it on to something else.
+ */
+class elMemorySink : public elOutputSink
+{
+public:
+    elMemorySink();
+    virtual ~elMemorySink();
+
+    virtual void Write(const void* Data, unsigned long Size);
+    virtual bool Seek(uint64_t Offset);
+
+    /// Get everything which was written.
+    const std::vector<uint8_t>& GetData() const;
+
+protected:
+    std::vector<uint8_t> m_Data;
+};
+
+#ifndef _WIN32
+/**
+ * Writes to a file whose size is known up front by mapping all of it, so the
+ * bytes are copied straight into the page cache. Writing past the size is an
+ * error, and what isn't written by the end is cut off. The space is allocated
+ * when it's opened, and if it can't be an exception is thrown instead of
+ * mapping a sparse file. A file which is never closed is deleted.
+ */
+class elMappedFileSink : public elOutputSink
+{
+public:
+    elMappedFileSink(const std::string& Filename, uint64_t Size);
+    virtual ~elMappedFileSink();
+
+    virtual void Write(const void* Data, unsigned long Size);
+    virtual bool Seek(uint64_t Offset);
+    virtual void Close();
+
+protected:
+    void Release();
+
+    /// Let go of the file and delete it.
+    void Discard();
+
+    std::string m_Filename;
+    int m_File;
+    uint8_t* m_Map;
+    uint64_t m_Size;
+
+    /// The furthest anything was written to.
+    uint64_t m_End;
+};
+#endif
+
+/**
+ * Open a file to write an output to, mapping it if its size is known and the
+ * system can; pass 0 for the size if it isn't known.
+ */
+shared_ptr<elOutputSink> CreateFileSink(const elContext& Context, const std::string& Filename, uint64_t Size = 0);
@@ -37,10 +37,13 @@ struct elUncompressedSampleFrames
 
 struct elGranule
 {
-    elGranule() : Used(false), Version(0) {};
+    elGranule() : Used(false), Skipped(false), Version(0) {};
 
     bool Used;
 
+    /// The granule belongs to a stream outside of the stream mask, so its data was not read.
+    bool Skipped;
+
     unsigned char Version;
     unsigned char SampleRateIndex;
     unsigned int SampleRate;
@@ -83,46 +86,111 @@ enum
 
 
 class bsBitstream;
+class elContext;
+
+
+/// A stream mask which includes every stream.
+#define EL_ALL_STREAMS 0xFFFFFFFF
+
+
+/// An exception thrown by the parser.
+class elParserException : public std::exception
+{
+public:
+    elParserException(const std::string& What) throw();
+    virtual ~elParserException() throw();
+    virtual const char* what() const throw();
 
+protected:
+    std::string m_What;
+};
 
-/// The EALayer3 parser class.
+
+/// The EALayer3 parser interface.
 class elParser
 {
 public:
-    elParser();
+    elParser(const elContext& Context);
     virtual ~elParser();
 
     /// Get the name associated with this parser.
-    virtual const std::string GetName() const;
+    virtual const std::string GetName() const = 0;
 
     /// Parses the entire input stream and checks to see if it's a format that can be parsed.
-    virtual bool Initialize(bsBitstream& IS);
+    virtual bool Initialize(bsBitstream& IS) = 0;
 
     /// Parses the entire input stream and outputs an elStreamVector.
-    virtual void Parse(elStreamVector& Streams, bsBitstream& IS);
-    
+    virtual void Parse(elStreamVector& Streams, bsBitstream& IS) = 0;
+
+    /**
+     * Set which streams Parse() should read the data for; bit N is stream N.
+     * Granules of the other streams are skipped over without being copied.
+     * Streams past the 32nd are always read.
+     */
+    void SetStreamMask(uint32_t Mask);
+
+    /// Is the data for this stream wanted?
+    inline bool IsStreamWanted(unsigned int Stream) const
+    {
+        return Stream >= 32 || (m_StreamMask >> Stream) & 1;
+    }
+
 protected:
-    /// Read a granule and uncompressed samples if they exist from the stream.
-    virtual bool ReadGranuleWithUncSamples(bsBitstream& IS, elGranule& Gr);
-    
-    /// Read a granule from the stream.
-    virtual bool ReadGranule(bsBitstream& IS, elGranule& Gr);
+    /// Where the messages go.
+    const elContext& m_Context;
+
+    /// The sample rates for each MPEG version and sample rate index.
+    static const unsigned int SampleRateTable[4][4];
+
+    /// The streams to read the data for.
+    uint32_t m_StreamMask;
 
-    /// Read the actual uncompressed samples from the file.
-    virtual void ReadUncSamples(bsBitstream& IS, elGranule& Gr);
-    
     /// The current frame number for debugging purposes.
     unsigned int m_CurrentFrame;
 };
 
-/// An exception thrown by the parser.
-class elParserException : public std::exception
+
+/**
+ * The granule loop shared by all of the EALayer3 bitstream formats.
+ *
+ * TParser must provide ReadGranuleWithUncSamples(bsBitstream&, elGranule&).
+ * It is called through a static_cast rather than a virtual function, so each
+ * format gets its own copy of Initialize() and Parse() with the granule reader
+ * inlined. The only virtual call left is the one into Parse() per block.
+ *
+ * The member definitions are in ParserTemplate.h; each format explicitly
+ * instantiates the template in its own source file.
+ */
+template<class TParser>
+class elParserTemplate : public elParser
 {
 public:
-    elParserException(const std::string& What) throw();
-    virtual ~elParserException() throw();
-    virtual const char* what() const throw();
+    elParserTemplate(const elContext& Context);
+
+    /// Parses the entire input stream and checks to see if it's a format that can be parsed.
+    virtual bool Initialize(bsBitstream& IS);
+
+    /// Parses the entire input stream and outputs an elStreamVector.
+    virtual void Parse(elStreamVector& Streams, bsBitstream& IS);
 
 protected:
-    std::string m_What;
+    /// Read a granule from the stream.
+    inline bool ReadGranule(bsBitstream& IS, elGranule& Gr);
+
+    /// Read the actual uncompressed samples from the file.
+    inline void ReadUncSamples(bsBitstream& IS, elGranule& Gr);
+
+private:
+    /// Get the actual format parser.
+    inline TParser& Format()
+    {
+        return static_cast<TParser&>(*this);
+    }
+
+    /// Whether granules are being filtered by the stream mask.
+    bool m_Filtering;
+
+    /// Where Parse() will put the next granule, if the granule index matches.
+    unsigned int m_NextStream;
+    unsigned int m_NextGranule;
 };
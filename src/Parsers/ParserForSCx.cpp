@@ -7,8 +7,12 @@
 #include "Internal.h"
 #include "ParserForSCx.h"
 #include "../Bitstream.h"
+#include "../ParserTemplate.h"
 
-elParserForSCx::elParserForSCx()
+template class elParserTemplate<elParserForSCx>;
+
+elParserForSCx::elParserForSCx(const elContext& Context) :
+    elParserTemplate<elParserForSCx>(Context)
 {
     return;
 }
@@ -50,7 +54,7 @@ bool elParserForSCx::ReadGranuleWithUncSamples(bsBitstream& IS, elGranule& Gr)
     if (Gr.Version == 0 && Gr.SampleRateIndex == 0 && Gr.ChannelMode == 0 &&
         Gr.ModeExtension == 0 && Gr.Index == 0)
     {
-        VERBOSE("P: " << GetName() << " null granule encountered, end of stream");
+        VERBOSE(m_Context, "P: " << GetName() << " null granule encountered, end of stream");
         return false;
     }
 
@@ -64,7 +68,7 @@ bool elParserForSCx::ReadGranuleWithUncSamples(bsBitstream& IS, elGranule& Gr)
         {
             unsigned int Unknown = IS.ReadAligned16BE<unsigned int>();
             Gr.Uncomp.Count = IS.ReadAligned16BE<unsigned int>();
-            VERBOSE("  Unknown: " << Unknown << ", Count: " << Gr.Uncomp.Count << ", Granule: " << (int)Gr.Index);
+            VERBOSE(m_Context, "  Unknown: " << Unknown << ", Count: " << Gr.Uncomp.Count << ", Granule: " << (int)Gr.Index);
             //Gr.Uncomp.OffsetInOutput = Unknown - Gr.Uncomp.Count;
             ReadUncSamples(IS, Gr);
         }
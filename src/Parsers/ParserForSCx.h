@@ -10,10 +10,12 @@
 #include "../Parser.h"
 
 /// The EALayer3 parser class for ASF files.
-class elParserForSCx : public elParser
+class elParserForSCx : public elParserTemplate<elParserForSCx>
 {
+    friend class elParserTemplate<elParserForSCx>;
+
 public:
-    elParserForSCx();
+    elParserForSCx(const elContext& Context);
     virtual ~elParserForSCx();
 
     /// Get the name associated with this parser.
@@ -21,5 +23,5 @@ public:
 
 protected:
     /// Read a granule and uncompressed samples if existant from the stream.
-    virtual bool ReadGranuleWithUncSamples(bsBitstream& IS, elGranule& Gr);
+    bool ReadGranuleWithUncSamples(bsBitstream& IS, elGranule& Gr);
 };
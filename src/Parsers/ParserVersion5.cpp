@@ -0,0 +1,69 @@
+/*
+    EA Layer 3 Extractor/Decoder
+    Copyright (C) 2010, Ben Moench.
+    See License.txt
+*/
+
+#include "Internal.h"
+#include "ParserVersion5.h"
+#include "../Bitstream.h"
+#include "../ParserTemplate.h"
+
+template class elParserTemplate<elParserVersion5>;
+
+elParserVersion5::elParserVersion5(const elContext& Context) :
+    elParserTemplate<elParserVersion5>(Context)
+{
+    return;
+}
+
+elParserVersion5::~elParserVersion5()
+{
+    return;
+}
+
+const std::string elParserVersion5::GetName() const
+{
+    return "EAL3 ver. 5";
+}
+
+bool elParserVersion5::ReadGranuleWithUncSamples(bsBitstream& IS, elGranule& Gr)
+{
+    if (IS.Eos())
+    {
+        return false;
+    }
+
+    // See if there are any uncompressed samples at the end
+    unsigned int UncompressedSamples = IS.ReadBits(8);
+    
+    if (!ReadGranule(IS, Gr))
+    {
+        return false;
+    }
+
+    // Check if this is the last granule in the block
+    if (Gr.Version == 0 && Gr.SampleRateIndex == 0 && Gr.ChannelMode == 0 &&
+        Gr.ModeExtension == 0 && Gr.Index == 0)
+    {
+        VERBOSE(m_Context, "P: " << GetName() << ": null granule encountered, end of stream");
+        return false;
+    }
+
+    // Read in the uncompressed samples
+    IS.SeekToNextByte();
+    if (UncompressedSamples)
+    {
+        Gr.Uncomp.Count = IS.ReadAligned32BE<unsigned int>();
+        Gr.Uncomp.OffsetInOutput = IS.ReadAligned32BE<unsigned int>();
+        ReadUncSamples(IS, Gr);
+    }
+    else
+    {
+        Gr.Uncomp.Count = 0;
+        Gr.Uncomp.OffsetInOutput = 0;
+    }
+        
+    Gr.Used = true;
+    return true;
+}
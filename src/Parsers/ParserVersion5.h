@@ -0,0 +1,27 @@
+/*
+    EA Layer 3 Extractor/Decoder
+    Copyright (C) 2010, Ben Moench.
+    See License.txt
+*/
+
+#pragma once
+
+#include "Internal.h"
+#include "../Parser.h"
+
+/// The EALayer3 parser class for version 5 files.
+class elParserVersion5 : public elParserTemplate<elParserVersion5>
+{
+    friend class elParserTemplate<elParserVersion5>;
+
+public:
+    elParserVersion5(const elContext& Context);
+    virtual ~elParserVersion5();
+
+    /// Get the name associated with this parser.
+    virtual const std::string GetName() const;
+
+protected:
+    /// Read a granule and uncompressed samples if they exist from the stream.
+    bool ReadGranuleWithUncSamples(bsBitstream& IS, elGranule& Gr);
+};
@@ -7,8 +7,12 @@
 #include "Internal.h"
 #include "ParserVersion6.h"
 #include "../Bitstream.h"
+#include "../ParserTemplate.h"
 
-elParserVersion6::elParserVersion6()
+template class elParserTemplate<elParserVersion6>;
+
+elParserVersion6::elParserVersion6(const elContext& Context) :
+    elParserTemplate<elParserVersion6>(Context)
 {
     return;
 }
@@ -90,7 +94,7 @@ bool elParserVersion6::ReadGranuleWithUncSamples(bsBitstream& IS, elGranule& Gr)
     }
     else if (Mode > 0)
     {
-        VERBOSE("P: " << GetName() << " mode " << Mode << " encountered, continuing");
+        VERBOSE(m_Context, "P: " << GetName() << " mode " << Mode << " encountered, continuing");
     }
 
     Gr.Uncomp.Count = UncSampleCount;
@@ -117,7 +121,7 @@ bool elParserVersion6::ReadGranuleWithUncSamples(bsBitstream& IS, elGranule& Gr)
     if (Gr.Version == 0 && Gr.SampleRateIndex == 0 && Gr.ChannelMode == 0 &&
         Gr.ModeExtension == 0 && Gr.Index == 0)
     {
-        VERBOSE("P: " << GetName() << " null granule encountered, end of stream");
+        VERBOSE(m_Context, "P: " << GetName() << " null granule encountered, end of stream");
         return false;
     }
 
@@ -10,10 +10,12 @@
 #include "../Parser.h"
 
 /// The EALayer3 parser class for version 6 and 7 (CHECK) files.
-class elParserVersion6 : public elParser
+class elParserVersion6 : public elParserTemplate<elParserVersion6>
 {
+    friend class elParserTemplate<elParserVersion6>;
+
 public:
-    elParserVersion6();
+    elParserVersion6(const elContext& Context);
     virtual ~elParserVersion6();
 
     /// Get the name associated with this parser.
@@ -21,5 +23,5 @@ public:
 
 protected:
     /// Read a granule and uncompressed samples if existant from the stream.
-    virtual bool ReadGranuleWithUncSamples(bsBitstream& IS, elGranule& Gr);
+    bool ReadGranuleWithUncSamples(bsBitstream& IS, elGranule& Gr);
 };
@@ -0,0 +1,354 @@
+/*
+    EA Layer 3 Extractor/Decoder
+    Copyright (C) 2010, Ben Moench.
+    See License.txt
+*/
+
+#include "Internal.h"
+#include "PcmConverter.h"
+
+#include <math.h>
+#include <algorithm>
+#include <stdexcept>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+/// How many taps each phase of the filter has when the rate goes up; going down takes more.
+#define RESAMPLER_TAPS 104
+
+/// Where the passband ends, as a fraction of the lower of the two Nyquist frequencies, which is where the stopband starts.
+#define RESAMPLER_PASSBAND 0.9
+
+/// The Kaiser window of the filter; with the taps above, everything past the stopband edge is at least 81 dB down.
+#define RESAMPLER_KAISER_BETA 8.0
+
+/// The most phases the filter can have; rates that don't have a small ratio need too many.
+#define RESAMPLER_MAX_PHASES 8192
+
+
+bool ParseChannelMap(const std::string& Text, elChannelMap& Map)
+{
+    Map.clear();
+    std::istringstream Channels(Text);
+    std::string Channel;
+    while (std::getline(Channels, Channel, ','))
+    {
+        Map.push_back(std::vector<unsigned int>());
+        if (Channel == "-")
+        {
+            continue;
+        }
+
+        // Every channel that's mixed in has to be a number
+        std::istringstream Sources(Channel);
+        std::string Source;
+        while (std::getline(Sources, Source, '+'))
+        {
+            if (Source.empty() || Source.find_first_not_of("0123456789") != std::string::npos)
+            {
+                return false;
+            }
+            Map.back().push_back(atoi(Source.c_str()));
+        }
+        if (Map.back().empty())
+        {
+            return false;
+        }
+    }
+    return !Map.empty() && Text[Text.length() - 1] != ',';
+}
+
+
+static unsigned int _GreatestCommonDivisor(unsigned int A, unsigned int B)
+{
+    while (B)
+    {
+        const unsigned int C = A % B;
+        A = B;
+        B = C;
+    }
+    return A;
+}
+
+/// The zeroth order modified Bessel function, for the Kaiser window.
+static double _BesselI0(double X)
+{
+    double Sum = 1.0;
+    double Term = 1.0;
+    for (unsigned int k = 1; k < 50 && Term > Sum * 1e-12; k++)
+    {
+        Term *= (X / (2.0 * k)) * (X / (2.0 * k));
+        Sum += Term;
+    }
+    return Sum;
+}
+
+/// Multiply two runs of floats and add it all up.
+static float _DotProduct(const float* A, const float* B, unsigned int Count)
+{
+    unsigned int i = 0;
+    float Sum = 0.0f;
+#ifdef __SSE__
+    __m128 Sums = _mm_setzero_ps();
+    for (; i + 4 <= Count; i += 4)
+    {
+        Sums = _mm_add_ps(Sums, _mm_mul_ps(_mm_loadu_ps(A + i), _mm_loadu_ps(B + i)));
+    }
+    float Lanes[4];
+    _mm_storeu_ps(Lanes, Sums);
+    Sum = (Lanes[0] + Lanes[1]) + (Lanes[2] + Lanes[3]);
+#endif // __SSE__
+    for (; i < Count; i++)
+    {
+        Sum += A[i] * B[i];
+    }
+    return Sum;
+}
+
+
+elResampler::elResampler(unsigned int InputRate, unsigned int OutputRate, unsigned int Channels) :
+    m_Channels(Channels),
+    m_History(Channels),
+    m_Whole(0),
+    m_Phase(0),
+    m_InputFrames(0)
+{
+    const unsigned int Divisor = _GreatestCommonDivisor(InputRate, OutputRate);
+    m_Up = OutputRate / Divisor;
+    m_Down = InputRate / Divisor;
+    if (m_Up > RESAMPLER_MAX_PHASES)
+    {
+        std::ostringstream Message;
+        Message << "Can't resample from " << InputRate << " Hz to " << OutputRate << " Hz.";
+        throw (std::runtime_error(Message.str()));
+    }
+
+    // Going down, the cutoff is lower and the taps have to reach further to keep the same slope
+    const double Ratio = (double)InputRate / OutputRate;
+    m_Taps = (unsigned int)ceil(RESAMPLER_TAPS * (Ratio > 1.0 ? Ratio : 1.0) / 4.0) * 4;
+
+    // The cutoff is halfway through the transition band, so that the stopband starts at the lower Nyquist
+    // frequency; it's a fraction of the rate the input would have with m_Up samples for each one
+    const double Cutoff = (RESAMPLER_PASSBAND + 1.0) * 0.25 / (m_Up * (Ratio > 1.0 ? Ratio : 1.0));
+    const double Length = (double)m_Up * m_Taps;
+    const double Center = Length / 2.0;
+    const double WindowScale = 1.0 / _BesselI0(RESAMPLER_KAISER_BETA);
+
+    m_Filter.resize(m_Up * m_Taps);
+    for (unsigned int p = 0; p < m_Up; p++)
+    {
+        // Each phase sums to one, so there's no ripple from one output to the next
+        float* Taps = &m_Filter[p * m_Taps];
+        double Sum = 0.0;
+        for (unsigned int i = 0; i < m_Taps; i++)
+        {
+            const double X = p + (double)(m_Taps - 1 - i) * m_Up - Center;
+            const double Arg = 2.0 * Cutoff * X;
+            const double Sinc = fabs(Arg) < 1e-9 ? 1.0 : sin(M_PI * Arg) / (M_PI * Arg);
+            const double Edge = 2.0 * X / Length;
+            const double Window = Edge * Edge < 1.0 ?
+                _BesselI0(RESAMPLER_KAISER_BETA * sqrt(1.0 - Edge * Edge)) * WindowScale : 0.0;
+            Taps[i] = (float)(Sinc * Window);
+            Sum += Taps[i];
+        }
+        for (unsigned int i = 0; i < m_Taps; i++)
+        {
+            Taps[i] = (float)(Taps[i] / Sum);
+        }
+    }
+
+    // The first outputs reach back past the start, where it's silent
+    for (unsigned int c = 0; c < m_Channels; c++)
+    {
+        m_History[c].assign(m_Taps / 2 - 1, 0.0f);
+    }
+    return;
+}
+
+elResampler::~elResampler()
+{
+    return;
+}
+
+void elResampler::Process(const float* Input, unsigned int Frames, std::vector<float>& Output)
+{
+    for (unsigned int c = 0; c < m_Channels; c++)
+    {
+        std::vector<float>& History = m_History[c];
+        const unsigned int Start = History.size();
+        History.resize(Start + Frames);
+        for (unsigned int i = 0; i < Frames; i++)
+        {
+            History[Start + i] = Input[i * m_Channels + c];
+        }
+    }
+    m_InputFrames += Frames;
+
+    Produce(Output, false);
+    return;
+}
+
+void elResampler::Flush(std::vector<float>& Output)
+{
+    // The last outputs reach past the end by half of the taps
+    for (unsigned int c = 0; c < m_Channels; c++)
+    {
+        m_History[c].resize(m_History[c].size() + m_Taps / 2, 0.0f);
+    }
+    Produce(Output, true);
+    return;
+}
+
+unsigned long elResampler::GetOutputFrames(unsigned long InputFrames) const
+{
+    // Every output which falls before the end of the input
+    return (unsigned long)(((uint64_t)InputFrames * m_Up + m_Down - 1) / m_Down);
+}
+
+void elResampler::Produce(std::vector<float>& Output, bool Ending)
+{
+    // The taps of the next output start at Offset in the history
+    const unsigned int Size = m_History[0].size();
+    unsigned int Offset = 0;
+    while (Offset + m_Taps <= Size && (!Ending || m_Whole < m_InputFrames))
+    {
+        const float* Taps = &m_Filter[m_Phase * m_Taps];
+        for (unsigned int c = 0; c < m_Channels; c++)
+        {
+            Output.push_back(_DotProduct(Taps, &m_History[c][Offset], m_Taps));
+        }
+
+        m_Phase += m_Down;
+        const unsigned int Step = m_Phase / m_Up;
+        m_Phase %= m_Up;
+        Offset += Step;
+        m_Whole += Step;
+    }
+
+    // Only keep what the outputs to come use
+    Offset = std::min(Offset, Size);
+    for (unsigned int c = 0; c < m_Channels; c++)
+    {
+        m_History[c].erase(m_History[c].begin(), m_History[c].begin() + Offset);
+    }
+    return;
+}
+
+
+elPcmConverter::elPcmConverter(unsigned int InputRate, unsigned int InputChannels, unsigned int OutputRate,
+                               const elChannelMap& Map, elSampleFormat Format) :
+    m_InputChannels(InputChannels),
+    m_OutputRate(OutputRate ? OutputRate : InputRate),
+    m_Map(Map),
+    m_Format(Format)
+{
+    for (unsigned int i = 0; i < m_Map.size(); i++)
+    {
+        for (unsigned int j = 0; j < m_Map[i].size(); j++)
+        {
+            if (m_Map[i][j] >= InputChannels)
+            {
+                std::ostringstream Message;
+                Message << "The channel map uses channel " << m_Map[i][j] << ", but there are only "
+                        << InputChannels << " channels.";
+                throw (std::runtime_error(Message.str()));
+            }
+        }
+    }
+
+    if (m_OutputRate != InputRate)
+    {
+        m_Resampler = make_shared<elResampler>(InputRate, m_OutputRate, InputChannels);
+    }
+    return;
+}
+
+elPcmConverter::~elPcmConverter()
+{
+    return;
+}
+
+unsigned int elPcmConverter::GetSampleRate() const
+{
+    return m_OutputRate;
+}
+
+unsigned int elPcmConverter::GetChannels() const
+{
+    return m_Map.empty() ? m_InputChannels : m_Map.size();
+}
+
+elSampleFormat elPcmConverter::GetSampleFormat() const
+{
+    return m_Format;
+}
+
+unsigned long elPcmConverter::GetOutputFrames(unsigned long InputFrames) const
+{
+    return m_Resampler ? m_Resampler->GetOutputFrames(InputFrames) : InputFrames;
+}
+
+void elPcmConverter::Convert(const float* Input, unsigned int Samples, std::vector<uint8_t>& Output)
+{
+    if (!m_Resampler)
+    {
+        Finish(Input, Samples, Output);
+        return;
+    }
+
+    m_Resampled.clear();
+    m_Resampler->Process(Input, Samples / m_InputChannels, m_Resampled);
+    Finish(m_Resampled.empty() ? NULL : &m_Resampled[0], m_Resampled.size(), Output);
+    return;
+}
+
+void elPcmConverter::Flush(std::vector<uint8_t>& Output)
+{
+    if (m_Resampler)
+    {
+        m_Resampled.clear();
+        m_Resampler->Flush(m_Resampled);
+        Finish(m_Resampled.empty() ? NULL : &m_Resampled[0], m_Resampled.size(), Output);
+    }
+    return;
+}
+
+void elPcmConverter::Finish(const float* Samples, unsigned int Count, std::vector<uint8_t>& Output)
+{
+    if (!Count)
+    {
+        return;
+    }
+
+    // Mix the channels of each sample frame
+    if (!m_Map.empty())
+    {
+        const unsigned int Frames = Count / m_InputChannels;
+        const unsigned int Channels = m_Map.size();
+        m_Mapped.resize(Frames * Channels);
+        for (unsigned int i = 0; i < Channels; i++)
+        {
+            const std::vector<unsigned int>& Sources = m_Map[i];
+            const float Scale = Sources.empty() ? 0.0f : 1.0f / Sources.size();
+            for (unsigned int j = 0; j < Frames; j++)
+            {
+                const float* Frame = Samples + j * m_InputChannels;
+                float Sum = 0.0f;
+                for (unsigned int k = 0; k < Sources.size(); k++)
+                {
+                    Sum += Frame[Sources[k]];
+                }
+                m_Mapped[j * Channels + i] = Sum * Scale;
+            }
+        }
+        Samples = &m_Mapped[0];
+        Count = m_Mapped.size();
+    }
+
+    const unsigned int Start = Output.size();
+    Output.resize(Start + Count * GetSampleSize(m_Format));
+    ConvertSamples(&Output[Start], m_Format, Samples, Count);
+    return;
+}
@@ -0,0 +1,109 @@
+/*
+    EA Layer 3 Extractor/Decoder
+    Copyright (C) 2010, Ben Moench.
+    See License.txt
+*/
+
+#pragma once
+
+#include "Internal.h"
+#include "SampleFormat.h"
+
+/// The decoded channels which are mixed together for each channel of the output; an empty list is silent.
+typedef std::vector< std::vector<unsigned int> > elChannelMap;
+
+/**
+ * Read a channel map, with the output channels separated by commas and the
+ * decoded channels mixed into each one separated by plus signs, counting from
+ * 0. A dash is a silent channel. For example "0+1" mixes stereo down to mono,
+ * "0,0" makes mono into stereo and "1,0" swaps the channels.
+ */
+bool ParseChannelMap(const std::string& Text, elChannelMap& Map);
+
+/**
+ * Changes the sample rate of interleaved samples with a polyphase windowed sinc
+ * filter. The rates are taken as a ratio of whole numbers, each phase of the
+ * filter being the taps for one fraction of an input sample. The samples can
+ * come in a piece at a time; the filter delay is left out, so the output lines
+ * up with the input and has as many samples as the length of the input takes.
+ */
+class elResampler
+{
+public:
+    elResampler(unsigned int InputRate, unsigned int OutputRate, unsigned int Channels);
+    ~elResampler();
+
+    /// Resample some sample frames, adding what can be worked out so far to the end of Output.
+    void Process(const float* Input, unsigned int Frames, std::vector<float>& Output);
+
+    /// Add the rest of the output to the end of Output, once the input has ended.
+    void Flush(std::vector<float>& Output);
+
+    /// Get how many sample frames the output of this many input sample frames has.
+    unsigned long GetOutputFrames(unsigned long InputFrames) const;
+
+protected:
+    /// Work out the output for as much of the history as there is.
+    void Produce(std::vector<float>& Output, bool Ending);
+
+    unsigned int m_Channels;
+
+    /// The output rate over the input rate, as the smallest whole numbers.
+    unsigned int m_Up;
+    unsigned int m_Down;
+
+    /// How many taps each phase has.
+    unsigned int m_Taps;
+
+    /// The taps of each phase, in the order of the input samples they're used on.
+    std::vector<float> m_Filter;
+
+    /// The input samples of each channel that the next outputs use.
+    std::vector< std::vector<float> > m_History;
+
+    /// The input sample frame the next output falls on and how far past it, in m_Up parts.
+    unsigned long m_Whole;
+    unsigned int m_Phase;
+
+    /// How many sample frames came in.
+    unsigned long m_InputFrames;
+};
+
+/**
+ * Takes floating point samples from a stream to another sample rate and set of
+ * channels, and then to the sample format of the output.
+ */
+class elPcmConverter
+{
+public:
+    /// Pass 0 for the output rate to keep the one of the input, and an empty map to keep the channels.
+    elPcmConverter(unsigned int InputRate, unsigned int InputChannels, unsigned int OutputRate,
+                   const elChannelMap& Map, elSampleFormat Format);
+    ~elPcmConverter();
+
+    unsigned int GetSampleRate() const;
+    unsigned int GetChannels() const;
+    elSampleFormat GetSampleFormat() const;
+
+    /// Convert some samples, adding the bytes of what can be worked out so far to the end of Output.
+    void Convert(const float* Input, unsigned int Samples, std::vector<uint8_t>& Output);
+
+    /// Add the rest of the output to the end of Output, once the input has ended.
+    void Flush(std::vector<uint8_t>& Output);
+
+    /// Get how many sample frames the output of this many input sample frames has.
+    unsigned long GetOutputFrames(unsigned long InputFrames) const;
+
+protected:
+    void Finish(const float* Samples, unsigned int Count, std::vector<uint8_t>& Output);
+
+    unsigned int m_InputChannels;
+    unsigned int m_OutputRate;
+    elChannelMap m_Map;
+    elSampleFormat m_Format;
+    shared_ptr<elResampler> m_Resampler;
+
+    /// The samples between the stages.
+    std::vector<float> m_Resampled;
+    std::vector<float> m_Mapped;
+};
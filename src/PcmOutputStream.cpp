@@ -7,24 +7,44 @@
 #include "Internal.h"
 #include "PcmOutputStream.h"
 #include "MpegGenerator.h"
+#include "Layer3Decoder.h"
+#include "Context.h"
 
 #include <mpg123.h>
+#include <algorithm>
 
 #ifndef min
 #define min(a, b) ( (a) < (b) ? (a) : (b) )
 #endif // min
 
+/// The decoder's synthesis filter comes back round to where it started every this many granules.
+#define DECODER_PHASE_GRANULES 8
 
-elPcmOutputStream::elPcmOutputStream(const elMpegGenerator& Gen, unsigned int StreamIndex):
+/// How many bytes of MPEG frames are handed to mpg123 at once; at least a whole frame.
+#define MPEG_FEED_BUFFER_SIZE (64 * 1024)
+
+
+elPcmOutputStream::elPcmOutputStream(const elContext& Context, const elMpegGenerator& Gen, unsigned int StreamIndex):
     elOutputStream(Gen, StreamIndex),
+    m_Context(Context),
     m_Decoder(NULL),
-    m_SamplesLeft(0)
+    m_SamplesWritten(0),
+    m_Format(SF_INT16),
+    m_FirstFrame(0),
+    m_LastFrame(0),
+    m_FrameOffset(0),
+    m_FeedVbrFrame(false),
+    m_MpegFrames(new uint8_t[MPEG_FEED_BUFFER_SIZE])
 {
+    // The granules can be decoded as they are, without going through mpg123
+    if (Gen.IsDecodingGranules())
+    {
+        m_DirectDecoder = make_shared<elLayer3Decoder>();
+        return;
+    }
+
     // Initialize the decoder
-    m_Decoder = mpg123_new(NULL, NULL);
-    mpg123_open_feed(m_Decoder);
-    mpg123_param(m_Decoder, MPG123_REMOVE_FLAGS, MPG123_GAPLESS, 0);
-    m_SamplesLeft = m_Gen.GetSampleFrameCount() * GetChannels();
+    m_Decoder = m_Context.CreateMpg123Decoder();
     return;
 }
 
@@ -38,8 +58,26 @@ elPcmOutputStream::~elPcmOutputStream()
     return;
 }
 
-unsigned int elPcmOutputStream::Read(short int* Buffer, unsigned int BufferSamples)
+unsigned int elPcmOutputStream::Read(uint8_t* Buffer, unsigned int BufferSamples)
+{
+    // Keep decoding while there's room left for a whole frame
+    const unsigned int FrameSamples = (GetSampleRate() >= 32000 ? 1152 : 576) * GetChannels();
+    unsigned int Samples = 0;
+    do
+    {
+        Samples += ReadFrame(Buffer + Samples * GetSampleSize(m_Format), BufferSamples - Samples);
+    }
+    while (!m_Eos && BufferSamples - Samples >= FrameSamples);
+    return Samples;
+}
+
+unsigned int elPcmOutputStream::ReadFrame(uint8_t* Buffer, unsigned int BufferSamples)
 {
+    if (m_DirectDecoder)
+    {
+        return ReadDirect(Buffer, BufferSamples);
+    }
+
     // Check to make sure that we have something to decode
     if (!m_Decoder)
     {
@@ -47,41 +85,46 @@ unsigned int elPcmOutputStream::Read(short int* Buffer, unsigned int BufferSampl
         return 0;
     }
 
-    // See if we can decode anything
+    // Feed the decoder until it can decode a frame
     int Result;
     off_t DecoderFrameIndex;
     unsigned char* InternalBuffer;
     size_t Done;
-    Result = mpg123_decode_frame(m_Decoder, &DecoderFrameIndex, &InternalBuffer, &Done);
-
-    // If we need a new format do that and try it again
-    if (Result == MPG123_NEW_FORMAT)
+    while (true)
     {
-        long Rate;
-        int Channels;
-        int Encoding;
-        mpg123_getformat(m_Decoder, &Rate, &Channels, &Encoding);
-        mpg123_format_none(m_Decoder);
-        mpg123_format(m_Decoder, GetSampleRate(), GetChannels(), MPG123_ENC_SIGNED_16);
         Result = mpg123_decode_frame(m_Decoder, &DecoderFrameIndex, &InternalBuffer, &Done);
-    }
 
-    // Handle the return value
-    if (Result == MPG123_NEED_MORE)
-    {
-        if (m_CurrentFrame >= m_Gen.GetFrameCount(m_StreamIndex))
+        // If we need a new format do that and try it again
+        if (Result == MPG123_NEW_FORMAT)
+        {
+            long Rate;
+            int Channels;
+            int Encoding;
+            mpg123_getformat(m_Decoder, &Rate, &Channels, &Encoding);
+            switch (m_Format)
+            {
+                case SF_INT24: Encoding = MPG123_ENC_SIGNED_24; break;
+                case SF_FLOAT32: Encoding = MPG123_ENC_FLOAT_32; break;
+                default: Encoding = MPG123_ENC_SIGNED_16; break;
+            }
+            mpg123_format_none(m_Decoder);
+            mpg123_format(m_Decoder, GetSampleRate(), GetChannels(), Encoding);
+            Result = mpg123_decode_frame(m_Decoder, &DecoderFrameIndex, &InternalBuffer, &Done);
+        }
+        if (Result != MPG123_NEED_MORE)
+        {
+            break;
+        }
+        if (!FeedFrames())
         {
             // We don't have any more
             m_Eos = true;
             return 0;
         }
-        else
-        {
-            FeedNextFrame();
-            return Read(Buffer, BufferSamples);
-        }
     }
-    else if (Result == MPG123_NEW_FORMAT)
+
+    // Handle the return value
+    if (Result == MPG123_NEW_FORMAT)
     {
         // Err... can this happen?
         m_Eos = true;
@@ -95,47 +138,153 @@ unsigned int elPcmOutputStream::Read(short int* Buffer, unsigned int BufferSampl
         throw (elMpg123Exception(Result));
     }
 
+    // There's a frame, even if the stream had caught up with the parser before
+    m_Eos = false;
+
+    // The frames before the range only get the decoder ready
+    const unsigned int FrameIndex = DecoderFrameIndex + m_FrameOffset;
+    if (m_LastFrame && FrameIndex >= m_LastFrame)
+    {
+        m_Eos = true;
+        return 0;
+    }
+    if (FrameIndex < m_FirstFrame)
+    {
+        return 0;
+    }
+
     // Now that we have the buffer
-    unsigned long Samples = Done / sizeof(short);
+    unsigned long Samples = Done / GetSampleSize(m_Format);
     if (Samples > BufferSamples)
     {
         return 0;
     }
     memcpy(Buffer, InternalBuffer, Done);
+    return FinishFrame(Buffer, Samples, FrameIndex);
+}
+
+unsigned int elPcmOutputStream::ReadDirect(uint8_t* Buffer, unsigned int BufferSamples)
+{
+    // The VBR frame doesn't have any granules
+    if (m_CurrentFrame == 0)
+    {
+        m_CurrentFrame = 1;
+    }
+    if (m_CurrentFrame >= m_Gen.GetFrameCount(m_StreamIndex) || (m_LastFrame && m_CurrentFrame >= m_LastFrame))
+    {
+        m_Eos = true;
+        return 0;
+    }
+    m_Eos = false;
 
+    const unsigned int FrameIndex = m_CurrentFrame++;
+    const elFrame& Frame = m_Gen.ReadGranules(FrameIndex, m_StreamIndex);
+    const unsigned int Samples = m_DirectDecoder->DecodeFrame(Frame, Buffer, BufferSamples, m_Format);
+
+    // The frames before the range only get the decoder ready
+    if (!Samples || FrameIndex < m_FirstFrame)
+    {
+        return 0;
+    }
+    return FinishFrame(Buffer, Samples, FrameIndex);
+}
+
+unsigned int elPcmOutputStream::FinishFrame(uint8_t* Buffer, unsigned int Samples, unsigned int FrameIndex)
+{
     // Add the uncompressed samples
     unsigned int NewSamples;
-    NewSamples = FixupOutFrame(Buffer, Samples, DecoderFrameIndex);
-    Samples = min(NewSamples, m_SamplesLeft);
-    m_SamplesLeft -= Samples;
+    NewSamples = FixupOutFrame(Buffer, Samples, FrameIndex);
+
+    // The sample count keeps growing while streaming, so check it every time
+    const unsigned long SampleCount = m_Gen.GetSampleFrameCount() * GetChannels();
+    Samples = min(NewSamples, SampleCount - min(m_SamplesWritten, SampleCount));
+    m_SamplesWritten += Samples;
     return Samples;
 }
 
 unsigned int elPcmOutputStream::RecommendBufferSize()
 {
-    return (unsigned int)mpg123_safe_buffer();
+    return std::max((unsigned int)mpg123_safe_buffer(), elLayer3Decoder::RecommendBufferSize());
 }
 
-unsigned int elPcmOutputStream::FeedNextFrame()
+void elPcmOutputStream::SetSampleFormat(elSampleFormat Format)
+{
+    m_Format = Format;
+    return;
+}
+
+elSampleFormat elPcmOutputStream::GetSampleFormat() const
+{
+    return m_Format;
+}
+
+void elPcmOutputStream::SetFrameRange(unsigned int First, unsigned int Last)
+{
+    m_FirstFrame = First;
+    m_LastFrame = Last;
+    if (First <= 1)
+    {
+        return;
+    }
+
+    // The overlap and the synthesis filter are carried over from the last granule before the
+    // range, which is only right once the granule before that has been decoded too; with one
+    // granule a frame, as in MPEG-2 and 2.5, that's two frames back
+    const unsigned int Frames = GetSampleRate() >= 32000 ? 1 : 2;
+    const unsigned int Primed = First > Frames ? First - Frames : 1;
+    if (m_DirectDecoder)
+    {
+        m_CurrentFrame = Primed;
+        return;
+    }
+
+    // mpg123 also needs the bit reservoir of those frames, so it starts where their main data does
+    unsigned int Start = m_Gen.GetFirstDataFrame(Primed, m_StreamIndex);
+
+    // Skip whole turns of the synthesis filter so its sums are rounded the same way as from the start
+    const unsigned int Granules = GetSampleRate() >= 32000 ? 2 : 1;
+    const unsigned int Turn = DECODER_PHASE_GRANULES / Granules;
+    Start = 1 + (Start - 1) / Turn * Turn;
+
+    // Feeding the VBR frame first has the decoder treat it and count the frames as it does from the start
+    m_CurrentFrame = Start;
+    m_FrameOffset = Start - 1;
+    m_FeedVbrFrame = true;
+    return;
+}
+
+unsigned int elPcmOutputStream::FeedFrames()
 {
-    // A place to store the current compressed frame
-    static uint8_t MpegFrame[MAX_MPEG_FRAME_BUFFER];
     unsigned int Bytes = 0;
-    if (m_CurrentFrame < m_Gen.GetFrameCount(m_StreamIndex))
+    if (m_FeedVbrFrame)
+    {
+        Bytes = m_Gen.ReadFrame(m_MpegFrames.get(), MAX_MPEG_FRAME_BUFFER, 0, m_StreamIndex);
+        m_FeedVbrFrame = false;
+    }
+
+    // The decoder never needs more than the frame after the last one in the range
+    unsigned int End = m_Gen.GetFrameCount(m_StreamIndex);
+    if (m_LastFrame)
     {
-        Bytes = m_Gen.ReadFrame(MpegFrame, sizeof(MpegFrame), m_CurrentFrame++, m_StreamIndex);
+        End = min(End, m_LastFrame + 1);
     }
 
-    // Now feed it to the decoder
+    // Put as many whole frames together as fit
+    while (m_CurrentFrame < End && Bytes + m_Gen.GetFrameSize(m_CurrentFrame, m_StreamIndex) <= MPEG_FEED_BUFFER_SIZE)
+    {
+        Bytes += m_Gen.ReadFrame(m_MpegFrames.get() + Bytes, MPEG_FEED_BUFFER_SIZE - Bytes, m_CurrentFrame++, m_StreamIndex);
+    }
+
+    // Now feed them to the decoder
     if (Bytes > 0)
     {
         int Result;
-        Result = mpg123_feed(m_Decoder, MpegFrame, Bytes);
+        Result = mpg123_feed(m_Decoder, m_MpegFrames.get(), Bytes);
     }
     return Bytes;
 }
 
-unsigned int elPcmOutputStream::FixupOutFrame(short* Buffer, unsigned int BufferSamples, unsigned int FrameIndex)
+unsigned int elPcmOutputStream::FixupOutFrame(uint8_t* Buffer, unsigned int BufferSamples, unsigned int FrameIndex)
 {
     if (FrameIndex == 0)
     {
@@ -164,25 +313,26 @@ unsigned int elPcmOutputStream::FixupOutFrame(short* Buffer, unsigned int Buffer
     // So far I haven't found out exactly how the uncompressed samples work, but I know just enough to get by.
 
     // If we have a full granule go ahead and replace it
+    const unsigned int SampleSize = GetSampleSize(m_Format);
     if (GrA.Count == 576)
     {
         ToCopy = min(GrA.Count * GetChannels(), BufferSamples);
-        memcpy(Buffer, GrA.Data.get(), ToCopy * sizeof(short));
+        ConvertSamples(Buffer, m_Format, GrA.Data.get(), ToCopy);
     }
     if (GrB.Count == 576)
     {
         ToCopy = min(GrB.Count * GetChannels(), (long)BufferSamples - GrOffsetB);
-        memcpy(Buffer + GrOffsetB, GrB.Data.get(), ToCopy * sizeof(short));
+        ConvertSamples(Buffer + GrOffsetB * SampleSize, m_Format, GrB.Data.get(), ToCopy);
     }
     if (GrA.Count == 1152)
     {
         ToCopy = min(GrA.Count * GetChannels(), BufferSamples);
-        memcpy(Buffer, GrA.Data.get(), ToCopy * sizeof(short));
+        ConvertSamples(Buffer, m_Format, GrA.Data.get(), ToCopy);
     }
     if (GrB.Count == 1152)
     {
         ToCopy = min(GrB.Count * GetChannels(), BufferSamples);
-        memcpy(Buffer, GrB.Data.get(), ToCopy * sizeof(short));
+        ConvertSamples(Buffer, m_Format, GrB.Data.get(), ToCopy);
     }
 
     // If this is the first frame replace it
@@ -191,18 +341,18 @@ unsigned int elPcmOutputStream::FixupOutFrame(short* Buffer, unsigned int Buffer
         if (GrA.Count && GrA.Count < 576)
         {
             ToCopy = GrA.Count * GetChannels();
-            memcpy(Buffer, GrA.Data.get(), ToCopy * sizeof(short));
+            ConvertSamples(Buffer, m_Format, GrA.Data.get(), ToCopy);
             return GrA.Count * GetChannels();
         }
         if (GrB.Count && GrB.Count < 576)
         {
             ToCopy = GrB.Count * GetChannels();
-            memcpy(Buffer, GrB.Data.get(), ToCopy * sizeof(short));
+            ConvertSamples(Buffer, m_Format, GrB.Data.get(), ToCopy);
             return ToCopy;
         }
     }
 
-    VERBOSE("Skipping " << (GrA.Count + GrB.Count) << " uncompressed samples.");
+    VERBOSE(m_Context, "Skipping " << (GrA.Count + GrB.Count) << " uncompressed samples.");
     return BufferSamples;
 }
 
@@ -221,18 +371,3 @@ const char* elMpg123Exception::what() const throw()
 {
     return mpg123_plain_strerror(m_ErrorCode);
 }
-
-// Initialize the decoder
-struct elMpg123Initializer
-{
-    inline elMpg123Initializer()
-    {
-        mpg123_init();
-    }
-    inline ~elMpg123Initializer()
-    {
-        mpg123_exit();
-    }
-};
-
-elMpg123Initializer g_RealMpg123Initializer;
@@ -8,32 +8,88 @@
 
 #include "Internal.h"
 #include "OutputStream.h"
+#include "SampleFormat.h"
 
 class elMpegGenerator;
+class elLayer3Decoder;
+class elContext;
 struct mpg123_handle_struct;
 typedef struct mpg123_handle_struct mpg123_handle;
 
 class elPcmOutputStream : public elOutputStream
 {
 public:
-    elPcmOutputStream(const elMpegGenerator& Gen, unsigned int StreamIndex);
+    elPcmOutputStream(const elContext& Context, const elMpegGenerator& Gen, unsigned int StreamIndex);
     virtual ~elPcmOutputStream();
 
-    /// Read PCM samples from the stream.
-    virtual unsigned int Read(short* Buffer, unsigned int BufferSamples);
+    /**
+     * Read PCM samples from the stream, in its sample format. Decodes as many
+     * whole frames as fit in the buffer, so it only comes back with less when
+     * the stream has ended or has caught up with the parser. The buffer holds
+     * BufferSamples samples and the number of samples read is returned.
+     */
+    virtual unsigned int Read(uint8_t* Buffer, unsigned int BufferSamples);
 
-    /// Get the size of the buffer that should be used.
+    /// Get the size of the buffer that should be used, in samples.
     static unsigned int RecommendBufferSize();
 
+    /// Decode to 24-bit or floating point samples instead of 16-bit ones. Call this before reading anything.
+    void SetSampleFormat(elSampleFormat Format);
+
+    elSampleFormat GetSampleFormat() const;
+
+    /**
+     * Only decode the frames from First up to Last, or to the end if Last is 0.
+     * The decoder starts far enough before First to have the bit reservoir, the
+     * overlap and the synthesis filter from the granules before it (two frames
+     * for MPEG-2 and 2.5, which have one granule each), and what it decodes for
+     * those frames is dropped, so the samples are the same as from decoding the
+     * whole stream.
+     * Call this before reading anything.
+     */
+    void SetFrameRange(unsigned int First, unsigned int Last);
+
 protected:
-    /// Feed the next frame into the decoder.
-    unsigned int FeedNextFrame();
+    /// Decode the next frame, with whichever decoder the stream has.
+    unsigned int ReadFrame(uint8_t* Buffer, unsigned int BufferSamples);
+
+    /// Decode the next frame from its granules with the built-in decoder.
+    unsigned int ReadDirect(uint8_t* Buffer, unsigned int BufferSamples);
+
+    /// Add the uncompressed samples to a decoded frame and leave out what's past the end of the stream.
+    unsigned int FinishFrame(uint8_t* Buffer, unsigned int Samples, unsigned int FrameIndex);
+
+    /// Feed the next frames into the decoder, as many as fit in the buffer at once.
+    unsigned int FeedFrames();
     
     /// Add the uncompressed samples to the frame.
-    unsigned int FixupOutFrame(short* Buffer, unsigned int BufferSamples, unsigned int FrameIndex);
+    unsigned int FixupOutFrame(uint8_t* Buffer, unsigned int BufferSamples, unsigned int FrameIndex);
+
+    /// Where the messages go, and where the mpg123 decoder comes from.
+    const elContext& m_Context;
 
     mpg123_handle* m_Decoder;
-    unsigned long m_SamplesLeft;
+
+    /// Decodes the granules when the generator wants them decoded instead of the MPEG frames.
+    shared_ptr<elLayer3Decoder> m_DirectDecoder;
+
+    unsigned long m_SamplesWritten;
+
+    /// The format the samples are decoded to.
+    elSampleFormat m_Format;
+
+    /// The frames being decoded; see SetFrameRange().
+    unsigned int m_FirstFrame;
+    unsigned int m_LastFrame;
+
+    /// The frames skipped before the decoder was started, as it only counts what it's fed.
+    unsigned int m_FrameOffset;
+
+    /// Whether the VBR frame still has to be fed before the frames the decoder starts on.
+    bool m_FeedVbrFrame;
+
+    /// The compressed frames being fed to the decoder.
+    shared_array<uint8_t> m_MpegFrames;
 };
 
 class elMpg123Exception : public std::exception
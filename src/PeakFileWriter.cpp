@@ -0,0 +1,144 @@
+/*
+    EA Layer 3 Extractor/Decoder
+    Copyright (C) 2010, Ben Moench.
+    See License.txt
+*/
+
+#include "Internal.h"
+#include "PeakFileWriter.h"
+
+#include <math.h>
+#include <algorithm>
+
+/// The version of the peak file format.
+#define PEAK_FILE_VERSION 1
+
+/// How many values of finished buckets are gathered before they're written.
+#define PEAK_WRITE_BUFFER_SIZE (64 * 1024)
+
+
+/// A level where 1.0 is full scale as a 16-bit sample, clipped.
+static int _ToInt16(double Level)
+{
+    const double Sample = floor(Level * 32768.0 + 0.5);
+    return (int)std::max(-32768.0, std::min(32767.0, Sample));
+}
+
+
+elPeakFileWriter::elPeakFileWriter(std::ostream& Output, unsigned int SampleRate, unsigned int Channels,
+                                   unsigned int BucketFrames) :
+    m_Output(Output),
+    m_SampleRate(SampleRate),
+    m_Channels(Channels),
+    m_BucketFrames(BucketFrames ? BucketFrames : 1),
+    m_Buckets(0),
+    m_Frames(0),
+    m_Filled(0),
+    m_Minimums(Channels, 0.0f),
+    m_Maximums(Channels, 0.0f),
+    m_Squares(Channels, 0.0)
+{
+    WriteHeader();
+    return;
+}
+
+elPeakFileWriter::~elPeakFileWriter()
+{
+    return;
+}
+
+void elPeakFileWriter::Process(const uint8_t* Samples, elSampleFormat Format, unsigned int Count)
+{
+    const unsigned int Frames = Count / m_Channels;
+    if (!Frames)
+    {
+        return;
+    }
+
+    m_Input.resize(Frames * m_Channels);
+    ConvertSamplesToFloat(&m_Input[0], Samples, Format, Frames * m_Channels);
+
+    const float* Sample = &m_Input[0];
+    for (unsigned int i = 0; i < Frames; i++)
+    {
+        for (unsigned int c = 0; c < m_Channels; c++, Sample++)
+        {
+            // The first sample of a bucket starts it off
+            if (!m_Filled || *Sample < m_Minimums[c])
+            {
+                m_Minimums[c] = *Sample;
+            }
+            if (!m_Filled || *Sample > m_Maximums[c])
+            {
+                m_Maximums[c] = *Sample;
+            }
+            m_Squares[c] += (double)*Sample * *Sample;
+        }
+
+        if (++m_Filled == m_BucketFrames)
+        {
+            WriteBucket();
+        }
+    }
+    m_Frames += Frames;
+    return;
+}
+
+void elPeakFileWriter::Finish()
+{
+    if (m_Filled)
+    {
+        WriteBucket();
+    }
+    if (!m_Written.empty())
+    {
+        m_Output.write((const char*)&m_Written[0], m_Written.size() * sizeof(int16_t));
+        m_Written.clear();
+    }
+
+    m_Output.seekp(0);
+    WriteHeader();
+    return;
+}
+
+void elPeakFileWriter::WriteHeader()
+{
+    const uint16_t Version = PEAK_FILE_VERSION;
+    const uint16_t Channels = m_Channels;
+    const uint32_t SampleRate = m_SampleRate;
+    const uint32_t BucketFrames = m_BucketFrames;
+    const uint32_t Buckets = m_Buckets;
+    const uint32_t Frames = m_Frames;
+
+    m_Output.write("PEAK", 4);
+    m_Output.write((const char*)&Version, 2);
+    m_Output.write((const char*)&Channels, 2);
+    m_Output.write((const char*)&SampleRate, 4);
+    m_Output.write((const char*)&BucketFrames, 4);
+    m_Output.write((const char*)&Buckets, 4);
+    m_Output.write((const char*)&Frames, 4);
+    return;
+}
+
+void elPeakFileWriter::WriteBucket()
+{
+    for (unsigned int c = 0; c < m_Channels; c++)
+    {
+        m_Written.push_back(_ToInt16(m_Minimums[c]));
+        m_Written.push_back(_ToInt16(m_Maximums[c]));
+
+        // The RMS can't be negative, so it has all 16 bits
+        const int Rms = (int)std::min(65535.0, floor(sqrt(m_Squares[c] / m_Filled) * 32768.0 + 0.5));
+        m_Written.push_back((int16_t)(uint16_t)Rms);
+        m_Squares[c] = 0.0;
+    }
+    m_Filled = 0;
+    m_Buckets++;
+
+    if (m_Written.size() >= PEAK_WRITE_BUFFER_SIZE)
+    {
+        m_Output.write((const char*)&m_Written[0], m_Written.size() * sizeof(int16_t));
+        m_Written.clear();
+    }
+    return;
+}
@@ -0,0 +1,65 @@
+/*
+    EA Layer 3 Extractor/Decoder
+    Copyright (C) 2010, Ben Moench.
+    See License.txt
+*/
+
+#pragma once
+
+#include "Internal.h"
+#include "SampleFormat.h"
+
+#include <iosfwd>
+
+/**
+ * Writes a waveform peak file, for drawing the waveform of a stream without
+ * decoding it. Everything is little endian. The file starts with a 24 byte
+ * header:
+ *
+ *   char[4]  "PEAK"
+ *   uint16   Version (1)
+ *   uint16   Channels
+ *   uint32   Sample rate
+ *   uint32   Sample frames in each bucket
+ *   uint32   Bucket count
+ *   uint32   Sample frame count
+ *
+ * Then for each bucket, the minimum, maximum and RMS of each channel as
+ * 16-bit samples (int16, int16, uint16). The last bucket can be short.
+ */
+class elPeakFileWriter
+{
+public:
+    /// The header is written right away; the counts are filled in by Finish().
+    elPeakFileWriter(std::ostream& Output, unsigned int SampleRate, unsigned int Channels, unsigned int BucketFrames);
+    ~elPeakFileWriter();
+
+    /// Add some samples, which have to be whole sample frames, writing each bucket once it's full.
+    void Process(const uint8_t* Samples, elSampleFormat Format, unsigned int Count);
+
+    /// Write the bucket that isn't full and go back to fill in the header.
+    void Finish();
+
+protected:
+    void WriteHeader();
+    void WriteBucket();
+
+    std::ostream& m_Output;
+    unsigned int m_SampleRate;
+    unsigned int m_Channels;
+    unsigned int m_BucketFrames;
+    unsigned long m_Buckets;
+    unsigned long m_Frames;
+
+    /// The samples being added, as floats.
+    std::vector<float> m_Input;
+
+    /// The bucket being filled.
+    unsigned int m_Filled;
+    std::vector<float> m_Minimums;
+    std::vector<float> m_Maximums;
+    std::vector<double> m_Squares;
+
+    /// The buckets which are ready to be written.
+    std::vector<int16_t> m_Written;
+};
@@ -0,0 +1,203 @@
+/*
+    EA Layer 3 Extractor/Decoder
+    Copyright (C) 2010, Ben Moench.
+    See License.txt
+*/
+
+#include "Internal.h"
+#include "SampleFormat.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+unsigned int GetSampleSize(elSampleFormat Format)
+{
+    switch (Format)
+    {
+        case SF_INT24:
+            return 3;
+        case SF_FLOAT32:
+            return 4;
+        case SF_INT16:
+        default:
+            return 2;
+    }
+}
+
+unsigned int GetSampleBits(elSampleFormat Format)
+{
+    return GetSampleSize(Format) * 8;
+}
+
+/// Store a sample as three little endian bytes.
+static inline void _StoreInt24(uint8_t* Output, int Sample)
+{
+    Output[0] = (uint8_t)Sample;
+    Output[1] = (uint8_t)(Sample >> 8);
+    Output[2] = (uint8_t)(Sample >> 16);
+    return;
+}
+
+/// Round a sample to the nearest integer, away from zero at the halves, and clip it to Low and High.
+static inline int _RoundSample(float Sample, float Low, float High)
+{
+    if (Sample >= High)
+    {
+        return (int)High;
+    }
+    else if (Sample <= Low)
+    {
+        return (int)Low;
+    }
+    return (int)(Sample >= 0.0f ? Sample + 0.5f : Sample - 0.5f);
+}
+
+#ifdef __SSE2__
+/// 16-bit samples to floats, eight at a time; returns how many were done.
+static unsigned int _Int16ToFloat(float* Output, const short* Input, unsigned int Samples)
+{
+    const __m128 Scale = _mm_set1_ps(1.0f / 32768.0f);
+    unsigned int i = 0;
+    for (; i + 8 <= Samples; i += 8)
+    {
+        // Sign extend each half by putting the sample in the top of a 32-bit lane
+        const __m128i X = _mm_loadu_si128((const __m128i*)(Input + i));
+        const __m128i Low = _mm_srai_epi32(_mm_unpacklo_epi16(X, X), 16);
+        const __m128i High = _mm_srai_epi32(_mm_unpackhi_epi16(X, X), 16);
+        _mm_storeu_ps(Output + i, _mm_mul_ps(_mm_cvtepi32_ps(Low), Scale));
+        _mm_storeu_ps(Output + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(High), Scale));
+    }
+    return i;
+}
+#else
+static unsigned int _Int16ToFloat(float*, const short*, unsigned int) { return 0; }
+#endif // __SSE2__
+
+#ifdef __SSE2__
+/// Pack four 24-bit samples, one in the bottom of each 32-bit lane, into the bottom twelve bytes.
+static inline __m128i _PackInt24(__m128i Samples)
+{
+    // Join the pairs in each half, then the two halves
+    const __m128i LowLanes = _mm_set_epi32(0, -1, 0, -1);
+    const __m128i HighLanes = _mm_set_epi32(-1, (int)0xFF000000, -1, (int)0xFF000000);
+    const __m128i Pairs = _mm_or_si128(_mm_and_si128(Samples, LowLanes),
+                                       _mm_and_si128(_mm_srli_epi64(Samples, 8), HighLanes));
+    const __m128i LowHalf = _mm_set_epi32(0, 0, -1, -1);
+    return _mm_or_si128(_mm_and_si128(Pairs, LowHalf), _mm_srli_si128(_mm_andnot_si128(LowHalf, Pairs), 2));
+}
+
+/// 16-bit samples to packed 24-bit ones, sixteen at a time.
+static unsigned int _Int16ToInt24(uint8_t* Output, const short* Input, unsigned int Samples)
+{
+    const __m128i Zero = _mm_setzero_si128();
+    unsigned int i = 0;
+    for (; i + 16 <= Samples; i += 16)
+    {
+        // Each sample gets a zero byte below it and above it in a 32-bit lane
+        const __m128i A = _mm_loadu_si128((const __m128i*)(Input + i));
+        const __m128i B = _mm_loadu_si128((const __m128i*)(Input + i + 8));
+        const __m128i P0 = _PackInt24(_mm_srli_epi32(_mm_unpacklo_epi16(Zero, A), 8));
+        const __m128i P1 = _PackInt24(_mm_srli_epi32(_mm_unpackhi_epi16(Zero, A), 8));
+        const __m128i P2 = _PackInt24(_mm_srli_epi32(_mm_unpacklo_epi16(Zero, B), 8));
+        const __m128i P3 = _PackInt24(_mm_srli_epi32(_mm_unpackhi_epi16(Zero, B), 8));
+
+        // The 48 bytes out are the four runs of twelve back to back
+        uint8_t* Out = Output + i * 3;
+        _mm_storeu_si128((__m128i*)(Out + 0), _mm_or_si128(P0, _mm_slli_si128(P1, 12)));
+        _mm_storeu_si128((__m128i*)(Out + 16), _mm_or_si128(_mm_srli_si128(P1, 4), _mm_slli_si128(P2, 8)));
+        _mm_storeu_si128((__m128i*)(Out + 32), _mm_or_si128(_mm_srli_si128(P2, 8), _mm_slli_si128(P3, 4)));
+    }
+    return i;
+}
+#else
+static unsigned int _Int16ToInt24(uint8_t*, const short*, unsigned int) { return 0; }
+#endif // __SSE2__
+
+void ConvertSamples(uint8_t* Output, elSampleFormat Format, const short* Input, unsigned int Samples)
+{
+    // The vector kernels do what they can and the rest is finished one sample at a time
+    switch (Format)
+    {
+        case SF_INT16:
+            memcpy(Output, Input, Samples * sizeof(short));
+            break;
+
+        case SF_INT24:
+            for (unsigned int i = _Int16ToInt24(Output, Input, Samples); i < Samples; i++)
+            {
+                _StoreInt24(Output + i * 3, (int)Input[i] << 8);
+            }
+            break;
+
+        case SF_FLOAT32:
+        {
+            float* Out = (float*)Output;
+            for (unsigned int i = _Int16ToFloat(Out, Input, Samples); i < Samples; i++)
+            {
+                Out[i] = Input[i] / 32768.0f;
+            }
+            break;
+        }
+    }
+    return;
+}
+
+void ConvertSamples(uint8_t* Output, elSampleFormat Format, const float* Input, unsigned int Samples)
+{
+    switch (Format)
+    {
+        case SF_INT16:
+        {
+            short* Out = (short*)Output;
+            for (unsigned int i = 0; i < Samples; i++)
+            {
+                Out[i] = (short)_RoundSample(Input[i] * 32768.0f, -32768.0f, 32767.0f);
+            }
+            break;
+        }
+
+        case SF_INT24:
+            for (unsigned int i = 0; i < Samples; i++)
+            {
+                _StoreInt24(Output + i * 3, _RoundSample(Input[i] * 8388608.0f, -8388608.0f, 8388607.0f));
+            }
+            break;
+
+        case SF_FLOAT32:
+            memcpy(Output, Input, Samples * sizeof(float));
+            break;
+    }
+    return;
+}
+
+void ConvertSamplesToFloat(float* Output, const uint8_t* Input, elSampleFormat Format, unsigned int Samples)
+{
+    switch (Format)
+    {
+        case SF_INT16:
+        {
+            const short* In = (const short*)Input;
+            for (unsigned int i = _Int16ToFloat(Output, In, Samples); i < Samples; i++)
+            {
+                Output[i] = In[i] / 32768.0f;
+            }
+            break;
+        }
+
+        case SF_INT24:
+            for (unsigned int i = 0; i < Samples; i++)
+            {
+                // Put the sample in the top of an int to sign extend it
+                const uint8_t* In = Input + i * 3;
+                const int Sample = (int)(((uint32_t)In[0] << 8) | ((uint32_t)In[1] << 16) | ((uint32_t)In[2] << 24)) >> 8;
+                Output[i] = Sample / 8388608.0f;
+            }
+            break;
+
+        case SF_FLOAT32:
+            memcpy(Output, Input, Samples * sizeof(float));
+            break;
+    }
+    return;
+}
@@ -0,0 +1,36 @@
+/*
+    EA Layer 3 Extractor/Decoder
+    Copyright (C) 2010, Ben Moench.
+    See License.txt
+*/
+
+#pragma once
+
+#include "Internal.h"
+
+/// The formats the PCM streams can be decoded to.
+enum elSampleFormat
+{
+    SF_INT16,
+    SF_INT24,
+    SF_FLOAT32
+};
+
+/// Get how many bytes a sample takes; 24-bit samples are packed in three.
+unsigned int GetSampleSize(elSampleFormat Format);
+
+/// Get how many bits a sample has, for the wave header.
+unsigned int GetSampleBits(elSampleFormat Format);
+
+/// Convert 16-bit samples to another format. Floats are scaled so that 32768 is 1.0.
+void ConvertSamples(uint8_t* Output, elSampleFormat Format, const short* Input, unsigned int Samples);
+
+/**
+ * Convert the samples of the synthesis filter, where 1.0 is full scale, to a
+ * format. The integer formats are rounded and clipped, the floats are kept as
+ * they are.
+ */
+void ConvertSamples(uint8_t* Output, elSampleFormat Format, const float* Input, unsigned int Samples);
+
+/// Convert samples of a format to floats, where 1.0 is full scale.
+void ConvertSamplesToFloat(float* Output, const uint8_t* Input, elSampleFormat Format, unsigned int Samples);
@@ -7,32 +7,1051 @@
 #include "Internal.h"
 
 #include <fstream>
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
 #include <boost/format.hpp>
 
 #include "Version.h"
 #include "AllFormats.h"
+#include "FileDecoder.h"
 #include "MpegGenerator.h"
 #include "MpegOutputStream.h"
 #include "PcmOutputStream.h"
+#include "PcmConverter.h"
+#include "LoudnessMeter.h"
+#include "Hash64.h"
+#include "WaveWriter.h"
+#include "OutputSink.h"
+#include "Bitstream.h"
+#include "Context.h"
 
-int g_Verbose = 1;
+using boost::format;
 
-int main(int Argc, char **Argv)
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+/// Check that two granules were read the same.
+static bool SameGranule(const elGranule& A, const elGranule& B)
 {
-    // Show a small banner.
-    std::cout << "Version ";
-    std::cout << ealayer3_VERSION_MAJOR << "." << ealayer3_VERSION_MINOR << "." << ealayer3_VERSION_PATCH;
-    std::cout << std::endl;
-    
-    // Check the arguments.
-    if (Argc != 2)
+    if (A.Used != B.Used || A.Skipped != B.Skipped)
     {
-        std::cout << "Invalid argument(s). Call with input file name as the only argument." << std::endl;
-        std::cout << std::endl;
-        return 1;
+        return false;
+    }
+    if (!A.Used || A.Skipped)
+    {
+        return true;
+    }
+
+    if (A.Version != B.Version || A.SampleRateIndex != B.SampleRateIndex || A.ChannelMode != B.ChannelMode ||
+        A.ModeExtension != B.ModeExtension || A.Index != B.Index || A.DataSize != B.DataSize ||
+        A.ChannelInfo.size() != B.ChannelInfo.size() || A.Uncomp.Mode != B.Uncomp.Mode ||
+        A.Uncomp.Count != B.Uncomp.Count || A.Uncomp.OffsetInOutput != B.Uncomp.OffsetInOutput)
+    {
+        return false;
+    }
+    for (unsigned int i = 0; i < A.ChannelInfo.size(); i++)
+    {
+        const elChannelInfo& ChannelA = A.ChannelInfo[i];
+        const elChannelInfo& ChannelB = B.ChannelInfo[i];
+        if (ChannelA.Scfsi != ChannelB.Scfsi || ChannelA.Size != ChannelB.Size ||
+            ChannelA.SideInfo[0] != ChannelB.SideInfo[0] || ChannelA.SideInfo[1] != ChannelB.SideInfo[1])
+        {
+            return false;
+        }
+    }
+    if (A.DataSize && memcmp(A.Data.get(), B.Data.get(), A.DataSize) != 0)
+    {
+        return false;
+    }
+    if (A.Uncomp.Count && memcmp(A.Uncomp.Data.get(), B.Uncomp.Data.get(), A.Uncomp.Count * A.Channels * sizeof(short)) != 0)
+    {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Check that every block of a file parses the same through the parser the
+ * loader creates, which may be a selector handing each block on, as through
+ * the format parser the selector picks, which is the one the generator keeps.
+ */
+static bool TestParser(const elContext& Context, const std::string& InputFilename)
+{
+    std::ifstream Input;
+    Input.open(InputFilename.c_str(), std::ios_base::in | std::ios_base::binary);
+    if (!Input.is_open())
+    {
+        throw (std::runtime_error("Could not open input file '" + InputFilename + "'."));
+    }
+
+    elBlockLoaderSelector Loader(Context);
+    if (!Loader.Initialize(&Input))
+    {
+        throw (std::runtime_error("The input is not in a readable file format."));
+    }
+
+    elBlock Block;
+    if (!Loader.ReadNextBlock(Block))
+    {
+        throw (std::runtime_error("The first block could not be read from the input."));
+    }
+
+    shared_ptr<elParser> Created = Loader.CreateParser();
+    shared_ptr<elParser> Format = Loader.CreateParser();
+    bsBitstream FirstIS(Block.Data.get(), Block.Size);
+    bsBitstream FormatIS(Block.Data.get(), Block.Size);
+    if (!Created->Initialize(FirstIS) || !Format->Initialize(FormatIS))
+    {
+        throw (std::runtime_error("The EALayer3 parser could not be initialized."));
+    }
+    shared_ptr<elParserSelector> Selector = dynamic_pointer_cast<elParserSelector>(Format);
+    if (Selector)
+    {
+        Format = Selector->SelectorUsed();
+    }
+    std::cout << "Parser: " << Format->GetName() << (Selector ? ", picked by the selector" : "") << std::endl;
+    if (dynamic_pointer_cast<elParserSelector>(Format))
+    {
+        std::cout << "The selector picked another selector." << std::endl;
+        return false;
+    }
+
+    unsigned int BlockCount = 0;
+    unsigned long GranuleCount = 0;
+    do
+    {
+        elStreamVector CreatedStreams;
+        elStreamVector FormatStreams;
+        bsBitstream CreatedIS(Block.Data.get(), Block.Size);
+        bsBitstream BlockIS(Block.Data.get(), Block.Size);
+        Created->Parse(CreatedStreams, CreatedIS);
+        Format->Parse(FormatStreams, BlockIS);
+
+        bool Same = CreatedStreams.size() == FormatStreams.size();
+        for (unsigned int i = 0; Same && i < CreatedStreams.size(); i++)
+        {
+            Same = CreatedStreams[i].size() == FormatStreams[i].size();
+            for (unsigned int j = 0; Same && j < CreatedStreams[i].size(); j++)
+            {
+                Same = SameGranule(CreatedStreams[i][j].Gr[0], FormatStreams[i][j].Gr[0]) &&
+                       SameGranule(CreatedStreams[i][j].Gr[1], FormatStreams[i][j].Gr[1]);
+                GranuleCount += CreatedStreams[i][j].Gr[0].Used + CreatedStreams[i][j].Gr[1].Used;
+            }
+        }
+        if (!Same)
+        {
+            std::cout << "Block " << BlockCount << " at offset " << Block.Offset << " parsed differently." << std::endl;
+            return false;
+        }
+        BlockCount++;
+    }
+    while (Loader.ReadNextBlock(Block));
+
+    std::cout << BlockCount << " blocks, " << GranuleCount << " granules" << std::endl;
+    return true;
+}
+
+/// How far apart the samples of the built-in decoder and mpg123 can be, where 1.0 is full scale.
+#define DECODER_TOLERANCE 0.001
+
+/// The chunk sizes in frames that the stream is split into to check the chunks against a single pass.
+static const unsigned int g_ChunkFrames[] = {1, 3, 1024};
+
+/// Parse all of the blocks of a file; anything that goes wrong is thrown.
+static void LoadFile(const elContext& Context, const std::string& InputFilename, elMpegGenerator& Gen, bool DecodeGranules)
+{
+    std::ifstream Input;
+    Input.open(InputFilename.c_str(), std::ios_base::in | std::ios_base::binary);
+    if (!Input.is_open())
+    {
+        throw (std::runtime_error("Could not open input file '" + InputFilename + "'."));
+    }
+
+    elBlockLoaderSelector Loader(Context);
+    if (!Loader.Initialize(&Input))
+    {
+        throw (std::runtime_error("The input is not in a readable file format."));
+    }
+
+    elBlock Block;
+    if (!Loader.ReadNextBlock(Block))
+    {
+        throw (std::runtime_error("The first block could not be read from the input."));
+    }
+    if (!Gen.Initialize(Block, Loader.CreateParser()))
+    {
+        throw (std::runtime_error("The EALayer3 parser could not be initialized."));
+    }
+
+    // Decoding the granules straight away is how WAVs are written
+    if (DecodeGranules)
+    {
+        Gen.SetDecodeGranules(true);
+        Gen.SetDirectDecoding(true);
+    }
+
+    do
+    {
+        Gen.ParseBlock(Block);
+    }
+    while (Loader.ReadNextBlock(Block));
+    Gen.DoneParsingBlocks();
+    return;
+}
+
+/// Decode the frames of a stream from First up to Last, or all of them if both are 0, to floats.
+static void DecodeStream(const elMpegGenerator& Gen, unsigned int StreamIndex, unsigned int First, unsigned int Last,
+                         std::vector<float>& Samples)
+{
+    shared_ptr<elPcmOutputStream> Stream = Gen.CreatePcmStream(StreamIndex);
+    Stream->SetSampleFormat(SF_FLOAT32);
+    if (First || Last)
+    {
+        Stream->SetFrameRange(First, Last);
+    }
+
+    const unsigned int BufferSamples = elPcmOutputStream::RecommendBufferSize();
+    std::vector<float> Buffer(BufferSamples);
+    do
+    {
+        const unsigned int Read = Stream->Read((uint8_t*) &Buffer[0], BufferSamples);
+        Samples.insert(Samples.end(), Buffer.begin(), Buffer.begin() + Read);
+    }
+    while (!Stream->Eos());
+    return;
+}
+
+/// Check that the built-in Layer III decoder comes out the same as mpg123 on every stream of a file.
+static bool TestDecoder(const elContext& Context, const std::string& InputFilename)
+{
+    elMpegGenerator Direct(Context);
+    elMpegGenerator Mpg123(Context);
+    LoadFile(Context, InputFilename, Direct, true);
+    LoadFile(Context, InputFilename, Mpg123, false);
+
+    bool Passed = true;
+    for (unsigned int i = 0; i < Direct.GetStreamCount(); i++)
+    {
+        std::vector<float> DirectSamples;
+        std::vector<float> Mpg123Samples;
+        DecodeStream(Direct, i, 0, 0, DirectSamples);
+        DecodeStream(Mpg123, i, 0, 0, Mpg123Samples);
+
+        if (DirectSamples.size() != Mpg123Samples.size())
+        {
+            std::cout << "Stream " << i << ": the built-in decoder gave " << DirectSamples.size() << " samples, mpg123 ";
+            std::cout << Mpg123Samples.size() << "." << std::endl;
+            Passed = false;
+            continue;
+        }
+
+        double MaxDifference = 0.0;
+        for (unsigned int j = 0; j < DirectSamples.size(); j++)
+        {
+            MaxDifference = std::max(MaxDifference, (double) std::fabs(DirectSamples[j] - Mpg123Samples[j]));
+        }
+        std::cout << "Stream " << i << ": " << DirectSamples.size() << " samples, largest difference " << MaxDifference << std::endl;
+        if (MaxDifference > DECODER_TOLERANCE)
+        {
+            Passed = false;
+        }
+    }
+    return Passed;
+}
+
+/// Check that decoding the streams of a file in chunks of frames gives the same samples as in one go, with both decoders.
+static bool TestChunks(const elContext& Context, const std::string& InputFilename)
+{
+    bool Passed = true;
+    for (unsigned int Decoder = 0; Decoder < 2; Decoder++)
+    {
+        elMpegGenerator Gen(Context);
+        LoadFile(Context, InputFilename, Gen, Decoder == 0);
+        const char* DecoderName = Decoder == 0 ? "built-in decoder" : "mpg123";
+
+        for (unsigned int i = 0; i < Gen.GetStreamCount(); i++)
+        {
+            std::vector<float> Serial;
+            DecodeStream(Gen, i, 0, 0, Serial);
+
+            // The first chunk takes the VBR frame too, and the last one goes on to the end
+            const unsigned int FrameCount = Gen.GetFrameCount(i);
+            for (unsigned int j = 0; j < sizeof(g_ChunkFrames) / sizeof(g_ChunkFrames[0]); j++)
+            {
+                std::vector<float> Chunked;
+                for (unsigned int First = 1; First < FrameCount; First += g_ChunkFrames[j])
+                {
+                    const unsigned int Last = First + g_ChunkFrames[j];
+                    DecodeStream(Gen, i, First == 1 ? 0 : First, Last < FrameCount ? Last : 0, Chunked);
+                }
+
+                unsigned int Differs = 0;
+                while (Differs < Serial.size() && Differs < Chunked.size() && Serial[Differs] == Chunked[Differs])
+                {
+                    Differs++;
+                }
+                if (Serial.size() != Chunked.size() || Differs != Serial.size())
+                {
+                    std::cout << "Stream " << i << " with the " << DecoderName << " in chunks of " << g_ChunkFrames[j];
+                    std::cout << " frames: " << Chunked.size() << " samples instead of " << Serial.size();
+                    std::cout << ", the first difference at sample " << Differs << "." << std::endl;
+                    Passed = false;
+                }
+            }
+        }
+    }
+    return Passed;
+}
+
+/// Get the level in dB of a tone, from a whole number of seconds so that the other frequencies cancel out.
+static double ToneLevel(const std::vector<float>& Samples, unsigned int Start, unsigned int Count, double Frequency,
+                        unsigned int SampleRate)
+{
+    double Real = 0.0;
+    double Imaginary = 0.0;
+    for (unsigned int i = 0; i < Count; i++)
+    {
+        const double Phase = 2.0 * M_PI * Frequency * (Start + i) / SampleRate;
+        Real += Samples[Start + i] * std::cos(Phase);
+        Imaginary += Samples[Start + i] * std::sin(Phase);
+    }
+    return 20.0 * std::log10(2.0 * std::sqrt(Real * Real + Imaginary * Imaginary) / Count);
+}
+
+/// Get the level in dB of a tone with the same power as some samples.
+static double PowerLevel(const std::vector<float>& Samples, unsigned int Start, unsigned int Count)
+{
+    double Sum = 0.0;
+    for (unsigned int i = 0; i < Count; i++)
+    {
+        Sum += (double) Samples[Start + i] * Samples[Start + i];
+    }
+    return 10.0 * std::log10(2.0 * Sum / Count);
+}
+
+/// Resample two seconds of a full scale tone, and measure a tone in the second in the middle of the output.
+static double ResampleTone(unsigned int InputRate, unsigned int OutputRate, double Frequency, double Measured)
+{
+    std::vector<float> Input(2 * InputRate);
+    for (unsigned int i = 0; i < Input.size(); i++)
+    {
+        Input[i] = (float) std::sin(2.0 * M_PI * Frequency * i / InputRate);
+    }
+
+    elResampler Resampler(InputRate, OutputRate, 1);
+    std::vector<float> Output;
+    Resampler.Process(&Input[0], Input.size(), Output);
+    Resampler.Flush(Output);
+
+    // What's left of a tone the output can't have comes out as some other frequency
+    if (!Measured)
+    {
+        return PowerLevel(Output, OutputRate / 2, OutputRate);
+    }
+    return ToneLevel(Output, OutputRate / 2, OutputRate, Measured, OutputRate);
+}
+
+/// Check that the resampler keeps the passband flat and takes out what the lower rate can't have.
+static bool TestResampler()
+{
+    struct elResamplerCase
+    {
+        unsigned int InputRate;
+        unsigned int OutputRate;
+        double Frequency;
+        double Measured;
+        double Lowest;
+        double Highest;
+    };
+
+    // Up to 90% of the lower Nyquist frequency is passed, and from that frequency up is at least 80 dB down
+    const elResamplerCase Cases[] =
+    {
+        {48000, 44100, 100.0, 100.0, -0.05, 0.05},
+        {48000, 44100, 1000.0, 1000.0, -0.05, 0.05},
+        {48000, 44100, 10000.0, 10000.0, -0.05, 0.05},
+        {48000, 44100, 19800.0, 19800.0, -0.05, 0.05},
+        {48000, 44100, 22100.0, 0.0, -1000.0, -80.0},
+        {48000, 44100, 23000.0, 0.0, -1000.0, -80.0},
+        {44100, 48000, 1000.0, 1000.0, -0.05, 0.05},
+        {44100, 48000, 19800.0, 19800.0, -0.05, 0.05},
+        {44100, 48000, 21000.0, 23100.0, -1000.0, -80.0},
+        {22050, 44100, 9900.0, 9900.0, -0.05, 0.05},
+        {22050, 44100, 10000.0, 12050.0, -1000.0, -80.0},
+        {44100, 22050, 9900.0, 9900.0, -0.05, 0.05},
+        {44100, 22050, 12000.0, 0.0, -1000.0, -80.0},
+    };
+
+    bool Passed = true;
+    for (unsigned int i = 0; i < sizeof(Cases) / sizeof(Cases[0]); i++)
+    {
+        const elResamplerCase& Case = Cases[i];
+        const double Level = ResampleTone(Case.InputRate, Case.OutputRate, Case.Frequency, Case.Measured);
+        const bool CasePassed = Level >= Case.Lowest && Level <= Case.Highest;
+        std::cout << Case.InputRate << " Hz to " << Case.OutputRate << " Hz, " << Case.Frequency << " Hz tone: ";
+        std::cout << Level << " dB" << (CasePassed ? "" : " (wrong)") << std::endl;
+        Passed = Passed && CasePassed;
+    }
+    return Passed;
+}
+
+/// Measure the loudness of a stereo 1 kHz tone at 48 kHz which goes through levels in dBFS for so many seconds each.
+static double MeasureToneLoudness(const double* Levels, const double* Seconds, unsigned int Count)
+{
+    const unsigned int SampleRate = 48000;
+    elLoudnessMeter Meter(SampleRate, 2);
+
+    unsigned long Frame = 0;
+    for (unsigned int i = 0; i < Count; i++)
+    {
+        const double Amplitude = std::pow(10.0, Levels[i] / 20.0);
+        std::vector<float> Samples((unsigned long) (Seconds[i] * SampleRate) * 2);
+        for (unsigned int j = 0; j < Samples.size(); j += 2, Frame++)
+        {
+            Samples[j] = Samples[j + 1] = (float) (Amplitude * std::sin(2.0 * M_PI * 1000.0 * Frame / SampleRate));
+        }
+        Meter.Process((const uint8_t*) &Samples[0], SF_FLOAT32, Samples.size());
+    }
+    return Meter.GetIntegratedLoudness();
+}
+
+/// Check the integrated loudness against the tones of EBU Tech 3341.
+static bool TestLoudness()
+{
+    struct elLoudnessCase
+    {
+        unsigned int Count;
+        double Levels[5];
+        double Seconds[5];
+        double Loudness;
+    };
+
+    const elLoudnessCase Cases[] =
+    {
+        {1, {-23.0}, {20.0}, -23.0},
+        {1, {-33.0}, {20.0}, -33.0},
+        {3, {-36.0, -23.0, -36.0}, {10.0, 60.0, 10.0}, -23.0},
+        {5, {-72.0, -36.0, -23.0, -36.0, -72.0}, {10.0, 10.0, 60.0, 10.0, 10.0}, -23.0},
+        {3, {-26.0, -20.0, -26.0}, {20.0, 20.1, 20.0}, -23.0},
+    };
+
+    bool Passed = true;
+    for (unsigned int i = 0; i < sizeof(Cases) / sizeof(Cases[0]); i++)
+    {
+        const elLoudnessCase& Case = Cases[i];
+        const double Loudness = MeasureToneLoudness(Case.Levels, Case.Seconds, Case.Count);
+        const bool CasePassed = std::fabs(Loudness - Case.Loudness) <= 0.1;
+        std::cout << "Test " << (i + 1) << ": " << Loudness << " LUFS" << (CasePassed ? "" : " (wrong)") << std::endl;
+        Passed = Passed && CasePassed;
+    }
+
+    // Nothing gets past the absolute gate in silence
+    const double SilentLevels[] = {-200.0};
+    const double SilentSeconds[] = {5.0};
+    if (MeasureToneLoudness(SilentLevels, SilentSeconds, 1) != -HUGE_VAL)
+    {
+        std::cout << "Silence wasn't gated out." << std::endl;
+        Passed = false;
+    }
+    return Passed;
+}
+
+/// Check the hashes against the ones the reference XXH64 gives, both in one go and a piece at a time.
+static bool TestHash()
+{
+    struct elHashCase
+    {
+        const char* Text;
+        unsigned int Generated;
+        uint64_t Seed;
+        const char* Digest;
+    };
+
+    // Without any text, the bytes come from the generator the reference implementation checks itself with
+    const elHashCase Cases[] =
+    {
+        {"", 0, 0, "ef46db3751d8e999"},
+        {"a", 0, 0, "d24ec4f1a98c6e5b"},
+        {"abc", 0, 0, "44bc2cf5ad770999"},
+        {"Nobody inspects the spammish repetition", 0, 0, "fbcea83c8a378bf1"},
+        {NULL, 1, 0, "e934a84adb052768"},
+        {NULL, 1, 2654435761U, "5014607643a9b4c3"},
+        {NULL, 14, 0, "8282dcc4994e35c8"},
+        {NULL, 222, 0, "b641ae8cb691c174"},
+        {NULL, 222, 2654435761U, "20cb8ab7ae10c14a"},
+    };
+
+    bool Passed = true;
+    for (unsigned int i = 0; i < sizeof(Cases) / sizeof(Cases[0]); i++)
+    {
+        const elHashCase& Case = Cases[i];
+        std::vector<uint8_t> Bytes;
+        if (Case.Text)
+        {
+            Bytes.assign(Case.Text, Case.Text + strlen(Case.Text));
+        }
+        uint64_t Generator = 2654435761U;
+        for (unsigned int j = 0; j < Case.Generated; j++)
+        {
+            Bytes.push_back((uint8_t) (Generator >> 56));
+            Generator *= 11400714785074694797ULL;
+        }
+
+        elHash64 Whole(Case.Seed);
+        Whole.Update(Bytes.empty() ? NULL : &Bytes[0], Bytes.size());
+
+        // Pieces of 7 bytes keep the stripes from lining up with the updates
+        elHash64 Pieces(Case.Seed);
+        for (unsigned int j = 0; j < Bytes.size(); j += 7)
+        {
+            Pieces.Update(&Bytes[j], min(7U, (unsigned int) Bytes.size() - j));
+        }
+
+        const bool CasePassed = Whole.GetHexDigest() == Case.Digest && Pieces.GetHexDigest() == Case.Digest;
+        std::cout << "Case " << (i + 1) << ": " << Whole.GetHexDigest() << ", " << Pieces.GetHexDigest();
+        std::cout << (CasePassed ? "" : " (wrong)") << std::endl;
+        Passed = Passed && CasePassed;
+    }
+    return Passed;
+}
+
+/// What a wave header says.
+struct elWaveHeader
+{
+    bool Rf64;
+    unsigned int FormatTag;
+    unsigned int Channels;
+    unsigned int SampleRate;
+    unsigned int BitsPerSample;
+    uint64_t DataSize;
+    uint64_t SampleCount;
+    unsigned int HeaderSize;
+};
+
+static uint64_t ReadLittleEndian(const std::vector<uint8_t>& Bytes, unsigned int Offset, unsigned int Size)
+{
+    if (Offset + Size > Bytes.size())
+    {
+        throw (std::runtime_error("The wave header is cut off."));
+    }
+    uint64_t Value = 0;
+    for (unsigned int i = Size; i > 0; i--)
+    {
+        Value = (Value << 8) | Bytes[Offset + i - 1];
+    }
+    return Value;
+}
+
+/// Read a wave header back the way a player would, going through its chunks up to the data.
+static elWaveHeader ReadWaveHeader(const std::vector<uint8_t>& Bytes)
+{
+    const std::string Riff(Bytes.begin(), Bytes.begin() + 4);
+    if ((Riff != "RIFF" && Riff != "RF64") || std::string(Bytes.begin() + 8, Bytes.begin() + 12) != "WAVE")
+    {
+        throw (std::runtime_error("The wave doesn't start with a RIFF or RF64 header."));
+    }
+
+    elWaveHeader Header;
+    Header.Rf64 = Riff == "RF64";
+    Header.FormatTag = 0;
+    Header.SampleCount = 0;
+    uint64_t Ds64RiffSize = 0;
+    uint64_t Ds64DataSize = 0;
+
+    unsigned int Offset = 12;
+    while (true)
+    {
+        const std::string Id(Bytes.begin() + Offset, Bytes.begin() + Offset + 4);
+        const unsigned int Size = (unsigned int) ReadLittleEndian(Bytes, Offset + 4, 4);
+        Offset += 8;
+
+        if (Id == "ds64")
+        {
+            Ds64RiffSize = ReadLittleEndian(Bytes, Offset, 8);
+            Ds64DataSize = ReadLittleEndian(Bytes, Offset + 8, 8);
+            Header.SampleCount = ReadLittleEndian(Bytes, Offset + 16, 8);
+        }
+        else if (Id == "fmt ")
+        {
+            Header.FormatTag = (unsigned int) ReadLittleEndian(Bytes, Offset, 2);
+            Header.Channels = (unsigned int) ReadLittleEndian(Bytes, Offset + 2, 2);
+            Header.SampleRate = (unsigned int) ReadLittleEndian(Bytes, Offset + 4, 4);
+            Header.BitsPerSample = (unsigned int) ReadLittleEndian(Bytes, Offset + 14, 2);
+            if (ReadLittleEndian(Bytes, Offset + 8, 4) != Header.SampleRate * Header.Channels * Header.BitsPerSample / 8 ||
+                ReadLittleEndian(Bytes, Offset + 12, 2) != Header.Channels * Header.BitsPerSample / 8)
+            {
+                throw (std::runtime_error("The byte rate or the block alignment is wrong."));
+            }
+        }
+        else if (Id == "data")
+        {
+            Header.HeaderSize = Offset;
+            Header.DataSize = Header.Rf64 ? Ds64DataSize : Size;
+            break;
+        }
+        Offset += Size + (Size & 1);
+    }
+
+    const uint64_t RiffSize = Header.Rf64 ? Ds64RiffSize : ReadLittleEndian(Bytes, 4, 4);
+    if (!Header.FormatTag || RiffSize != Header.HeaderSize + Header.DataSize - 8)
+    {
+        throw (std::runtime_error("The format chunk is missing or the RIFF size is wrong."));
     }
-    const std::string InputFilename = Argv[1];
+    return Header;
+}
+
+/// Write the header of a wave and read it back, checking it says what was written.
+static bool RoundTripWave(elSampleFormat Format, unsigned int Channels, uint64_t NumberSamples, bool Streamed)
+{
+    elMemorySink Sink;
+    if (Streamed)
+    {
+        WriteStreamingWaveHeader(Sink, 44100, Format, Channels);
+        Sink.Seek(0);
+        FinishStreamingWaveHeader(Sink, 44100, Format, Channels, NumberSamples);
+    }
+    else
+    {
+        WriteWaveHeader(Sink, 44100, Format, Channels, NumberSamples);
+    }
+
+    const elWaveHeader Header = ReadWaveHeader(Sink.GetData());
+    const bool Rf64 = Streamed ? GetWaveHeaderSize(Format, NumberSamples) > WAVE_HEADER_SIZE :
+                                 Sink.GetData().size() > WAVE_HEADER_SIZE;
+    const bool Passed = Header.Rf64 == Rf64 &&
+        Header.HeaderSize == Sink.GetData().size() &&
+        Header.HeaderSize == (Streamed ? WAVE_RF64_HEADER_SIZE : GetWaveHeaderSize(Format, NumberSamples)) &&
+        Header.FormatTag == (Format == SF_FLOAT32 ? 3U : 1U) &&
+        Header.Channels == Channels &&
+        Header.SampleRate == 44100 &&
+        Header.BitsPerSample == GetSampleBits(Format) &&
+        Header.DataSize == NumberSamples * GetSampleSize(Format) &&
+        (!Rf64 || Header.SampleCount == NumberSamples / Channels);
+
+    std::cout << (Streamed ? "Streamed " : "") << NumberSamples << " samples of " << GetSampleBits(Format) << " bits: ";
+    std::cout << (Header.Rf64 ? "RF64" : "RIFF") << ", " << Header.DataSize << " bytes of data";
+    std::cout << (Passed ? "" : " (wrong)") << std::endl;
+    return Passed;
+}
+
+/// Check that wave headers read back right, with the sizes going to RF64 once they don't fit in 32 bits.
+static bool TestWave()
+{
+    // The largest 16-bit wave that still fits in a RIFF header, and one sample more
+    const uint64_t LargestRiff = (0xFFFFFFFFULL - WAVE_HEADER_SIZE + 8) / 2;
+
+    bool Passed = true;
+    Passed = RoundTripWave(SF_INT16, 2, 88200, false) && Passed;
+    Passed = RoundTripWave(SF_INT16, 1, LargestRiff, false) && Passed;
+    Passed = RoundTripWave(SF_INT16, 1, LargestRiff + 1, false) && Passed;
+    Passed = RoundTripWave(SF_INT24, 6, 6ULL * 300000000, false) && Passed;
+    Passed = RoundTripWave(SF_FLOAT32, 2, 2ULL * 1000000000, false) && Passed;
+    Passed = RoundTripWave(SF_INT16, 2, 88200, true) && Passed;
+    Passed = RoundTripWave(SF_INT24, 6, 6ULL * 300000000, true) && Passed;
+    return Passed;
+}
+
+/// What a player finds in the header and side info of an MPEG frame.
+struct elMp3Frame
+{
+    unsigned int Offset;
+    unsigned int Size;
+    unsigned int Version;
+    unsigned int BitrateIndex;
+    unsigned int SampleRate;
+    unsigned int Channels;
+    bool Padding;
+    bool Vbr;
+    unsigned int MainDataBegin;
+    unsigned int MainDataBits;
+};
+
+/// Does an MPEG layer III header start here, with the same version, sample rate and bitrate as the one at First?
+static bool IsMp3Header(const std::vector<uint8_t>& Bytes, unsigned long Offset, unsigned long First)
+{
+    return Offset + 4 <= Bytes.size() && Bytes[Offset] == 0xFF && Bytes[Offset + 1] == Bytes[First + 1] &&
+           (Bytes[Offset + 2] & 0xFC) == (Bytes[First + 2] & 0xFC);
+}
+
+/**
+ * Read the frames of an MP3 the way a player would, following the main data
+ * through the bit reservoir. Throws if the frames don't line up, if a
+ * main_data_begin goes past what the format allows or back before the
+ * stream, or if the main data of a frame overlaps the frame before it or goes
+ * past the frames that have been read.
+ */
+static void ReadMp3Frames(const std::vector<uint8_t>& Bytes, std::vector<elMp3Frame>& Frames)
+{
+    const unsigned int SampleRates[3] = {44100, 48000, 32000};
+    unsigned long FreeSize = 0;
+
+    // Where the main data of the frames read so far ends, counting only the bytes after the side info
+    unsigned long StreamEnd = 0;
+    unsigned long DataEnd = 0;
+
+    unsigned long Offset = 0;
+    while (Offset < Bytes.size())
+    {
+        const unsigned int Number = Frames.size();
+        if (Offset + 4 > Bytes.size() || Bytes[Offset] != 0xFF || (Bytes[Offset + 1] & 0xE6) != 0xE2 ||
+            (Bytes[Offset + 1] & 0x18) == 0x08 || (Bytes[Offset + 2] & 0x0C) == 0x0C)
+        {
+            throw (std::runtime_error((format("Frame %i at offset %i isn't an MPEG layer III header.") % Number % Offset).str()));
+        }
+
+        elMp3Frame Frame;
+        Frame.Offset = Offset;
+        Frame.Version = (Bytes[Offset + 1] >> 3) & 3;
+        Frame.BitrateIndex = Bytes[Offset + 2] >> 4;
+        Frame.SampleRate = SampleRates[(Bytes[Offset + 2] >> 2) & 3] >> (Frame.Version == MV_1 ? 0 : Frame.Version == MV_2 ? 1 : 2);
+        Frame.Padding = (Bytes[Offset + 2] >> 1) & 1;
+        Frame.Channels = (Bytes[Offset + 3] >> 6) == CM_MONO ? 1 : 2;
+        const unsigned int HeaderSize = Bytes[Offset + 1] & 1 ? 4 : 6;
 
+        // A free format frame goes up to the next header, and the rest are the same size
+        if (Frame.BitrateIndex == 15)
+        {
+            throw (std::runtime_error((format("Frame %i has a bad bitrate index.") % Number).str()));
+        }
+        else if (Frame.BitrateIndex)
+        {
+            Frame.Size = elMpegGenerator::CalculateFrameSize(Frame.BitrateIndex, Frame.SampleRate, Frame.Version) + Frame.Padding;
+        }
+        else if (FreeSize)
+        {
+            Frame.Size = FreeSize + Frame.Padding;
+        }
+        else
+        {
+            unsigned long Next = Offset + HeaderSize;
+            while (Next < Bytes.size() && !(IsMp3Header(Bytes, Next, Offset) &&
+                   (Next + (Next - Offset) >= Bytes.size() || IsMp3Header(Bytes, Next + (Next - Offset), Offset) ||
+                    IsMp3Header(Bytes, Next + (Next - Offset) - 1, Offset) || IsMp3Header(Bytes, Next + (Next - Offset) + 1, Offset))))
+            {
+                Next++;
+            }
+            Frame.Size = Next - Offset;
+            FreeSize = Frame.Size - Frame.Padding;
+        }
+        if (Offset + Frame.Size > Bytes.size())
+        {
+            throw (std::runtime_error((format("Frame %i is cut off.") % Number).str()));
+        }
+
+        // Read the side info
+        const unsigned int SideInfoSize = Frame.Version == MV_1 ? (Frame.Channels == 1 ? 17 : 32) : (Frame.Channels == 1 ? 9 : 17);
+        const unsigned int Granules = Frame.Version == MV_1 ? 2 : 1;
+        bsBitstream IS((uint8_t*) &Bytes[Offset + HeaderSize], SideInfoSize);
+        Frame.MainDataBegin = IS.ReadBits(Frame.Version == MV_1 ? 9 : 8);
+        IS.ReadBits(Frame.Version == MV_1 ? (Frame.Channels == 1 ? 5 : 3) : Frame.Channels);
+        if (Frame.Version == MV_1)
+        {
+            IS.ReadBits(4 * Frame.Channels);
+        }
+        Frame.MainDataBits = 0;
+        for (unsigned int i = 0; i < Granules * Frame.Channels; i++)
+        {
+            Frame.MainDataBits += IS.ReadBits(12);
+            IS.ReadBits(32);
+            IS.ReadBits(Frame.Version == MV_1 ? 47 - 32 : 51 - 32);
+        }
+
+        // The first frame can be the VBR frame, which has no main data
+        const unsigned long Payload = Offset + HeaderSize + SideInfoSize;
+        Frame.Vbr = !Number && Payload + 4 <= Bytes.size() &&
+            (memcmp(&Bytes[Payload], "Xing", 4) == 0 || memcmp(&Bytes[Payload], "Info", 4) == 0);
+        if (!Frame.Vbr)
+        {
+            if (Frame.MainDataBegin > (Frame.Version == MV_1 ? 511U : 255U))
+            {
+                throw (std::runtime_error((format("Frame %i: main_data_begin is %i.") % Number % Frame.MainDataBegin).str()));
+            }
+            if (Frame.MainDataBegin > StreamEnd)
+            {
+                throw (std::runtime_error((format("Frame %i: main_data_begin goes %i bytes back, before the first frame.") %
+                    Number % Frame.MainDataBegin).str()));
+            }
+            const unsigned long Start = StreamEnd - Frame.MainDataBegin;
+            if (Start < DataEnd)
+            {
+                throw (std::runtime_error((format("Frame %i: the main data overlaps the frame before by %i bytes.") %
+                    Number % (DataEnd - Start)).str()));
+            }
+            StreamEnd += Offset + Frame.Size - Payload;
+            DataEnd = Start + (Frame.MainDataBits + 7) / 8;
+            if (DataEnd > StreamEnd)
+            {
+                throw (std::runtime_error((format("Frame %i: the main data goes %i bytes past the end of the frame.") %
+                    Number % (DataEnd - StreamEnd)).str()));
+            }
+        }
+
+        Frames.push_back(Frame);
+        Offset += Frame.Size;
+    }
+    return;
+}
+
+/// Check the music length, the music CRC and the CRC of the LAME tag in the VBR frame of an MP3.
+static void CheckLameTag(const std::vector<uint8_t>& Bytes, const std::vector<elMp3Frame>& Frames)
+{
+    const uint8_t Encoder[4] = {'L', 'A', 'M', 'E'};
+    if (Frames.empty() || !Frames[0].Vbr)
+    {
+        throw (std::runtime_error("There's no VBR frame."));
+    }
+    const unsigned int Offset = std::search(Bytes.begin(), Bytes.begin() + Frames[0].Size, Encoder, Encoder + 4) - Bytes.begin();
+    if (Offset + 36 > Frames[0].Size)
+    {
+        throw (std::runtime_error("There's no LAME tag in the VBR frame."));
+    }
+
+    unsigned long Length = 0;
+    for (unsigned int i = 28; i < 32; i++)
+    {
+        Length = (Length << 8) | Bytes[Offset + i];
+    }
+    const uint16_t MusicCrc = (Bytes[Offset + 32] << 8) | Bytes[Offset + 33];
+    const uint16_t TagCrc = (Bytes[Offset + 34] << 8) | Bytes[Offset + 35];
+    if (Length != Bytes.size())
+    {
+        throw (std::runtime_error((format("The music length is %i instead of %i.") % Length % Bytes.size()).str()));
+    }
+    if (MusicCrc != elMpegGenerator::CalculateCrc16(&Bytes[Frames[0].Size], Bytes.size() - Frames[0].Size))
+    {
+        throw (std::runtime_error("The music CRC is wrong."));
+    }
+    if (TagCrc != elMpegGenerator::CalculateCrc16(&Bytes[0], Offset + 34))
+    {
+        throw (std::runtime_error("The CRC of the LAME tag is wrong."));
+    }
+    return;
+}
+
+/// Write a stream of a file to MP3 in memory, the way ealayer3 writes it to stdout.
+static std::vector<uint8_t> WriteMp3(const elContext& Context, const std::string& InputFilename, unsigned int StreamIndex,
+                                     bool LowMemory, unsigned int Lookahead, unsigned int Bitrate = 0,
+                                     bool FreeFormat = false)
+{
+    shared_ptr<elMemorySink> Sink = make_shared<elMemorySink>();
+    elFileDecoder Decoder(Context);
+    Decoder.SetInput(InputFilename);
+    Decoder.SetStream(StreamIndex);
+    Decoder.SetOutput("-", elFileDecoder::F_MP3);
+    Decoder.SetOutputSink(Sink);
+    Decoder.SetLowMemory(LowMemory);
+    Decoder.SetLookahead(Lookahead);
+    Decoder.SetConstantBitrate(Bitrate);
+    Decoder.SetFreeFormat(FreeFormat);
+    Decoder.Process();
+    return Sink->GetData();
+}
+
+/**
+ * Check that the frames the bit reservoir is planned over can be read back,
+ * that the LAME tag matches them, and that streaming the MP3 writes the same
+ * bytes as buffering the whole stream, with the default lookahead and a short
+ * one. If a lookahead is too short for the stream, both have to fail.
+ */
+static void CheckReservoir(const elContext& Context, const std::string& InputFilename, unsigned int StreamIndex)
+{
+    const unsigned int Lookaheads[] = {DEFAULT_LOOKAHEAD, DEFAULT_LOOKAHEAD / 4};
+    for (unsigned int i = 0; i < sizeof(Lookaheads) / sizeof(Lookaheads[0]); i++)
+    {
+        std::vector<uint8_t> Buffered;
+        std::vector<uint8_t> Streamed;
+        std::string BufferedError;
+        std::string StreamedError;
+        try
+        {
+            Buffered = WriteMp3(Context, InputFilename, StreamIndex, false, Lookaheads[i]);
+        }
+        catch (std::exception& E)
+        {
+            BufferedError = E.what();
+        }
+        try
+        {
+            Streamed = WriteMp3(Context, InputFilename, StreamIndex, true, Lookaheads[i]);
+        }
+        catch (std::exception& E)
+        {
+            StreamedError = E.what();
+        }
+
+        std::cout << "Stream " << StreamIndex << " with a lookahead of " << Lookaheads[i] << ": ";
+        if (BufferedError != StreamedError)
+        {
+            std::cout << "buffered '" << BufferedError << "', streamed '" << StreamedError << "'" << std::endl;
+            throw (std::runtime_error("Streaming and buffering didn't both work."));
+        }
+        if (!BufferedError.empty())
+        {
+            std::cout << BufferedError << std::endl;
+            continue;
+        }
+        if (Buffered != Streamed)
+        {
+            std::cout << Buffered.size() << " bytes buffered, " << Streamed.size() << " streamed" << std::endl;
+            throw (std::runtime_error("Streaming and buffering wrote different bytes."));
+        }
+
+        std::vector<elMp3Frame> Frames;
+        ReadMp3Frames(Buffered, Frames);
+        CheckLameTag(Buffered, Frames);
+        std::cout << Frames.size() << " frames, " << Buffered.size() << " bytes" << std::endl;
+    }
+    return;
+}
+
+/**
+ * Check that asking for a constant bitrate gives every frame, the VBR frame
+ * too, the same bitrate index. Streaming settles the bitrate early, so it's
+ * allowed to fail on a later frame which doesn't fit.
+ */
+static void CheckConstantBitrate(const elContext& Context, const std::string& InputFilename, unsigned int StreamIndex)
+{
+    const unsigned int Bitrate = 128;
+    for (unsigned int LowMemory = 0; LowMemory < 2; LowMemory++)
+    {
+        std::cout << "Stream " << StreamIndex << (LowMemory ? " streamed" : " buffered") << " at " << Bitrate << " kbit/s: ";
+        std::vector<uint8_t> Bytes;
+        try
+        {
+            Bytes = WriteMp3(Context, InputFilename, StreamIndex, LowMemory != 0, DEFAULT_LOOKAHEAD, Bitrate);
+        }
+        catch (std::exception& E)
+        {
+            if (!LowMemory)
+            {
+                throw;
+            }
+            std::cout << E.what() << std::endl;
+            continue;
+        }
+
+        std::vector<elMp3Frame> Frames;
+        ReadMp3Frames(Bytes, Frames);
+        for (unsigned int i = 0; i < Frames.size(); i++)
+        {
+            if (Frames[i].BitrateIndex != Frames[0].BitrateIndex)
+            {
+                throw (std::runtime_error((format("Frame %i has bitrate index %i instead of %i.") %
+                    i % Frames[i].BitrateIndex % Frames[0].BitrateIndex).str()));
+            }
+        }
+        if (Frames.empty() || !Frames[0].Vbr)
+        {
+            throw (std::runtime_error("There's no VBR frame."));
+        }
+        std::cout << Frames.size() << " frames at bitrate index " << Frames[0].BitrateIndex << std::endl;
+    }
+    return;
+}
+
+/**
+ * Check that free format frames all have bitrate index 0 and the same size,
+ * not counting the padding byte, both buffered and streamed. Streaming is
+ * allowed to fail on a later frame which doesn't fit the early size.
+ */
+static void CheckFreeFormat(const elContext& Context, const std::string& InputFilename, unsigned int StreamIndex)
+{
+    for (unsigned int LowMemory = 0; LowMemory < 2; LowMemory++)
+    {
+        std::cout << "Stream " << StreamIndex << (LowMemory ? " streamed" : " buffered") << " in free format: ";
+        std::vector<uint8_t> Bytes;
+        try
+        {
+            Bytes = WriteMp3(Context, InputFilename, StreamIndex, LowMemory != 0, DEFAULT_LOOKAHEAD, 0, true);
+        }
+        catch (std::exception& E)
+        {
+            if (!LowMemory)
+            {
+                throw;
+            }
+            std::cout << E.what() << std::endl;
+            continue;
+        }
+
+        std::vector<elMp3Frame> Frames;
+        ReadMp3Frames(Bytes, Frames);
+        if (Frames.empty())
+        {
+            throw (std::runtime_error("There are no frames."));
+        }
+        const unsigned int Size = Frames[0].Size - Frames[0].Padding;
+        for (unsigned int i = 0; i < Frames.size(); i++)
+        {
+            if (Frames[i].BitrateIndex != 0)
+            {
+                throw (std::runtime_error((format("Frame %i has bitrate index %i.") % i % Frames[i].BitrateIndex).str()));
+            }
+            if (Frames[i].Size - Frames[i].Padding != Size)
+            {
+                throw (std::runtime_error((format("Frame %i is %i bytes instead of %i.") %
+                    i % (Frames[i].Size - Frames[i].Padding) % Size).str()));
+            }
+        }
+        std::cout << Frames.size() << " frames of " << Size << " bytes" << std::endl;
+    }
+    return;
+}
+
+/**
+ * Check that writing an MP3 file with several threads, each putting its chunk
+ * of frames at its own offset, gives the same bytes as writing it in order to
+ * a sink. The file is written to the working directory and removed after.
+ */
+static void CheckParallelWriter(const elContext& Context, const std::string& InputFilename, unsigned int StreamIndex)
+{
+    const std::string::size_type Slash = InputFilename.find_last_of("/\\");
+    const std::string Name = (format("ealayer3testdriver-%s-%i") %
+        InputFilename.substr(Slash == std::string::npos ? 0 : Slash + 1) % StreamIndex).str();
+    const std::string Filename = Name + ".mp3";
+    const std::vector<uint8_t> Serial = WriteMp3(Context, InputFilename, StreamIndex, false, DEFAULT_LOOKAHEAD);
+
+    // Only the first part goes to the sink, while the file writer goes on to the rest
+    std::vector<uint8_t> Parallel;
+    try
+    {
+        elFileDecoder Decoder(Context);
+        Decoder.SetInput(InputFilename);
+        Decoder.SetStream(StreamIndex);
+        Decoder.SetOutput(Filename, elFileDecoder::F_MP3);
+        Decoder.SetThreadCount(4);
+        Decoder.Process();
+
+        std::ifstream Input(Filename.c_str(), std::ios_base::in | std::ios_base::binary);
+        Parallel.assign(std::istreambuf_iterator<char>(Input), std::istreambuf_iterator<char>());
+    }
+    catch (...)
+    {
+        remove(Filename.c_str());
+        throw;
+    }
+    remove(Filename.c_str());
+    unsigned int Part = 2;
+    while (remove((format("%s_part%i.mp3") % Name % Part).str().c_str()) == 0)
+    {
+        Part++;
+    }
+
+    std::cout << "Stream " << StreamIndex << " written by 4 threads: ";
+    if (Parallel != Serial)
+    {
+        std::cout << Parallel.size() << " bytes, " << Serial.size() << " in order" << std::endl;
+        throw (std::runtime_error("Writing with several threads gave different bytes."));
+    }
+    std::cout << Parallel.size() << " bytes" << std::endl;
+    return;
+}
+
+/// Parse and decode a file the way the decoder does.
+static int TestFile(const elContext& Context, const std::string& InputFilename)
+{
     // Open the input file.
     std::ifstream Input;
     Input.open(InputFilename.c_str(), std::ios_base::in | std::ios_base::binary);
@@ -42,8 +1061,8 @@ int main(int Argc, char **Argv)
         return 1;
     }
 
-    elBlockLoaderSelector Loader;
-    elMpegGenerator Gen;
+    elBlockLoaderSelector Loader(Context);
+    elMpegGenerator Gen(Context);
     try
     {
         // Determine the input's file type.
@@ -133,7 +1152,7 @@ int main(int Argc, char **Argv)
     try
     {
         const unsigned int PcmBufferSamples = elPcmOutputStream::RecommendBufferSize();
-        shared_array<short> PcmBuffer(new short[PcmBufferSamples]);
+        shared_array<uint8_t> PcmBuffer(new uint8_t[PcmBufferSamples * GetSampleSize(SF_INT16)]);
     
         for (unsigned int i = 0; i < Gen.GetStreamCount(); i++)
         {
@@ -160,9 +1179,104 @@ int main(int Argc, char **Argv)
         return 1;
     }
 
+    // Write the streams to MP3 and check them, without printing what the decoder does
+    try
+    {
+        elContext Quiet;
+        for (unsigned int i = 0; i < Gen.GetStreamCount(); i++)
+        {
+            CheckReservoir(Quiet, InputFilename, i);
+            CheckConstantBitrate(Quiet, InputFilename, i);
+            CheckFreeFormat(Quiet, InputFilename, i);
+            CheckParallelWriter(Quiet, InputFilename, i);
+        }
+    }
+    catch (std::exception& E)
+    {
+        std::cout << "While writing MP3s: " << std::endl;
+        std::cout << "    There was an error." << std::endl;
+        std::cout << "    Exception: " << E.what() << std::endl;
+        return 1;
+    }
+
     // Show some info.
     Input.clear();
     std::cout << "Uncompressed sample frames: " << Gen.GetUncSampleFrameCount() << std::endl;
     std::cout << "End offset in file: " << Input.tellg() << std::endl;
     return 0;
 }
+
+static void ShowUsage()
+{
+    std::cout << "Call with an input file name to parse and decode it, or with one of these:" << std::endl;
+    std::cout << "  --parser File    Compare parsing through the parser selector with the parser it picks." << std::endl;
+    std::cout << "  --decoder File   Compare the built-in decoder with mpg123." << std::endl;
+    std::cout << "  --chunks File    Compare decoding in chunks of frames with decoding in one go." << std::endl;
+    std::cout << "  --resampler      Check the frequency response of the resampler." << std::endl;
+    std::cout << "  --loudness       Check the loudness of reference tones." << std::endl;
+    std::cout << "  --hash           Check the hash against known values." << std::endl;
+    std::cout << "  --wave           Check that wave headers read back right." << std::endl;
+    std::cout << std::endl;
+    return;
+}
+
+int main(int Argc, char **Argv)
+{
+    // Show a small banner.
+    std::cout << "Version ";
+    std::cout << ealayer3_VERSION_MAJOR << "." << ealayer3_VERSION_MINOR << "." << ealayer3_VERSION_PATCH;
+    std::cout << std::endl;
+
+    // The tests which take a file have it after their name
+    const std::string Test = Argc >= 2 ? Argv[1] : "";
+    elContext Context;
+    Context.SetVerbose(1);
+
+    try
+    {
+        if (Argc == 3 && Test == "--parser")
+        {
+            return TestParser(Context, Argv[2]) ? 0 : 1;
+        }
+        if (Argc == 3 && Test == "--decoder")
+        {
+            return TestDecoder(Context, Argv[2]) ? 0 : 1;
+        }
+        if (Argc == 3 && Test == "--chunks")
+        {
+            return TestChunks(Context, Argv[2]) ? 0 : 1;
+        }
+        if (Argc == 2 && Test == "--resampler")
+        {
+            return TestResampler() ? 0 : 1;
+        }
+        if (Argc == 2 && Test == "--loudness")
+        {
+            return TestLoudness() ? 0 : 1;
+        }
+        if (Argc == 2 && Test == "--hash")
+        {
+            return TestHash() ? 0 : 1;
+        }
+        if (Argc == 2 && Test == "--wave")
+        {
+            return TestWave() ? 0 : 1;
+        }
+    }
+    catch (std::exception& E)
+    {
+        std::cout << "There was an error." << std::endl;
+        std::cout << "    Exception: " << E.what() << std::endl;
+        return 1;
+    }
+
+    // Check the arguments.
+    if (Argc != 2 || Test.compare(0, 2, "--") == 0)
+    {
+        std::cout << "Invalid argument(s)." << std::endl;
+        ShowUsage();
+        return 1;
+    }
+
+    return TestFile(Context, Test);
+}
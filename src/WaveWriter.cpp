@@ -7,6 +7,13 @@
 #include "Internal.h"
 #include "WaveWriter.h"
 
+// Wave format tags
+#define WAVE_FORMAT_PCM 1
+#define WAVE_FORMAT_IEEE_FLOAT 3
+
+/// The size a wave leaves open when it's streamed, or has in a RIFF header when it's RF64.
+#define WAVE_UNKNOWN_SIZE 0xFFFFFFFFU
+
 // Wave 'fmt ' chunk
 struct SWaveFmtChunk
 {
@@ -22,40 +29,106 @@ struct SWaveFmtChunk
     uint16_t BitsPerSample;
 };
 
-void PrepareWaveHeader(std::ostream& Output)
+// Wave 'ds64' chunk, which has the sizes of an RF64 wave
+struct SWaveDs64Chunk
 {
-    WriteWaveHeader(Output, 0, 0, 0, 0);
-    return;
-}
+    SWaveDs64Chunk()
+    {
+        memset(this, 0, sizeof(SWaveDs64Chunk));
+    }
+    uint64_t RiffSize;
+    uint64_t DataSize;
+    uint64_t SampleCount;
+    uint32_t TableLength;
+};
 
-void WriteWaveHeader(std::ostream& Output, unsigned long SampleRate, \
-                     unsigned char BitsPerSample, unsigned char Channels, \
-                     unsigned long NumberSamples)
+static void _WriteWaveHeader(elOutputSink& Output, unsigned long SampleRate, elSampleFormat Format,
+                             unsigned char Channels, uint64_t NumberSamples, unsigned int HeaderSize, bool Open)
 {
-    unsigned long Temp;
-
-    // Write some RIFF information
-    Output.write("RIFF", 4);
-    Temp = NumberSamples * (BitsPerSample / 8) + 36;
-    Output.write((char*)&Temp, 4);
-    Output.write("WAVE", 4);
-    Output.write("fmt ", 4);
-    Temp = 16;
-    Output.write((char*)&Temp, 4);
-
-    // Write the format chunk
+    const unsigned int BitsPerSample = GetSampleBits(Format);
+    const uint64_t DataSize = NumberSamples * GetSampleSize(Format);
+    const uint64_t RiffSize = DataSize + HeaderSize - 8;
+    const bool Rf64 = !Open && RiffSize > WAVE_UNKNOWN_SIZE;
+    assert(!Rf64 || HeaderSize == WAVE_RF64_HEADER_SIZE);
+
+    // The 32-bit sizes are left open when they don't fit or aren't known
+    const uint32_t RiffSize32 = Open || Rf64 ? WAVE_UNKNOWN_SIZE : (uint32_t)RiffSize;
+    const uint32_t DataSize32 = Open || Rf64 ? WAVE_UNKNOWN_SIZE : (uint32_t)DataSize;
+    const uint32_t FmtSize = 16;
+    const uint32_t Ds64Size = 28;
+
+    // Put the whole header together so it's written in one go
+    uint8_t Header[WAVE_RF64_HEADER_SIZE];
+    unsigned int Position = 12;
+    memcpy(Header, Rf64 ? "RF64" : "RIFF", 4);
+    memcpy(Header + 4, &RiffSize32, 4);
+    memcpy(Header + 8, "WAVE", 4);
+
+    // The ds64 chunk has the real sizes; until it's needed, the room for it is a JUNK chunk
+    if (HeaderSize == WAVE_RF64_HEADER_SIZE)
+    {
+        SWaveDs64Chunk Ds64;
+        if (Rf64)
+        {
+            Ds64.RiffSize = RiffSize;
+            Ds64.DataSize = DataSize;
+            Ds64.SampleCount = Channels ? NumberSamples / Channels : 0;
+        }
+        memcpy(Header + Position, Rf64 ? "ds64" : "JUNK", 4);
+        memcpy(Header + Position + 4, &Ds64Size, 4);
+        memcpy(Header + Position + 8, &Ds64, Ds64Size);
+        Position += 8 + Ds64Size;
+    }
+
+    // The format chunk
     SWaveFmtChunk Fmt;
-    Fmt.FormatTag = 1;
+    Fmt.FormatTag = Format == SF_FLOAT32 ? WAVE_FORMAT_IEEE_FLOAT : WAVE_FORMAT_PCM;
     Fmt.Channels = Channels;
     Fmt.SampleRate = SampleRate;
     Fmt.BitsPerSample = BitsPerSample;
     Fmt.BytesPerSec = Fmt.BitsPerSample / 8 * Fmt.SampleRate * Fmt.Channels;
     Fmt.BlockAlign = Fmt.BitsPerSample / 8 * Fmt.Channels;
-    Output.write((char*)&Fmt, 16);
+    memcpy(Header + Position, "fmt ", 4);
+    memcpy(Header + Position + 4, &FmtSize, 4);
+    memcpy(Header + Position + 8, &Fmt, FmtSize);
+    Position += 8 + FmtSize;
+
+    // The data information
+    memcpy(Header + Position, "data", 4);
+    memcpy(Header + Position + 4, &DataSize32, 4);
+    Position += 8;
+    assert(Position == HeaderSize);
 
-    // Write the data information
-    Output.write("data", 4);
-    Temp = NumberSamples * (BitsPerSample / 8);
-    Output.write((char*)&Temp, 4);
+    Output.Write(Header, HeaderSize);
+    return;
+}
+
+unsigned int GetWaveHeaderSize(elSampleFormat Format, uint64_t NumberSamples)
+{
+    const uint64_t RiffSize = NumberSamples * GetSampleSize(Format) + WAVE_HEADER_SIZE - 8;
+    return RiffSize > WAVE_UNKNOWN_SIZE ? WAVE_RF64_HEADER_SIZE : WAVE_HEADER_SIZE;
+}
+
+void WriteWaveHeader(elOutputSink& Output, unsigned long SampleRate, \
+                     elSampleFormat Format, unsigned char Channels, \
+                     uint64_t NumberSamples)
+{
+    _WriteWaveHeader(Output, SampleRate, Format, Channels, NumberSamples,
+                     GetWaveHeaderSize(Format, NumberSamples), false);
+    return;
+}
+
+void WriteStreamingWaveHeader(elOutputSink& Output, unsigned long SampleRate, \
+                              elSampleFormat Format, unsigned char Channels)
+{
+    _WriteWaveHeader(Output, SampleRate, Format, Channels, 0, WAVE_RF64_HEADER_SIZE, true);
+    return;
+}
+
+void FinishStreamingWaveHeader(elOutputSink& Output, unsigned long SampleRate, \
+                               elSampleFormat Format, unsigned char Channels, \
+                               uint64_t NumberSamples)
+{
+    _WriteWaveHeader(Output, SampleRate, Format, Channels, NumberSamples, WAVE_RF64_HEADER_SIZE, false);
     return;
 }
@@ -6,7 +6,32 @@
 
 #pragma once
 
-void PrepareWaveHeader(std::ostream& Output);
-void WriteWaveHeader(std::ostream& Output, unsigned long SampleRate, \
-                       unsigned char BitsPerSample, unsigned char Channels, \
-                       unsigned long NumberSamples);
+#include "SampleFormat.h"
+#include "OutputSink.h"
+
+/// How many bytes of header come before the samples of a wave.
+#define WAVE_HEADER_SIZE 44
+
+/// How many bytes of header an RF64 wave has, with its ds64 chunk; streamed waves keep room for one.
+#define WAVE_RF64_HEADER_SIZE 80
+
+/// Get how many bytes of header a wave with this many samples has; it's RF64 if the sizes don't fit in 32 bits.
+unsigned int GetWaveHeaderSize(elSampleFormat Format, uint64_t NumberSamples);
+
+/// Write the header of a wave which is going to have this many samples.
+void WriteWaveHeader(elOutputSink& Output, unsigned long SampleRate, \
+                     elSampleFormat Format, unsigned char Channels, \
+                     uint64_t NumberSamples);
+
+/**
+ * Write the header of a wave whose length isn't known yet. The sizes are as
+ * large as they go, the way waves going into pipes are read, and a JUNK chunk
+ * keeps room for a ds64 chunk in case the wave turns out too long for them.
+ */
+void WriteStreamingWaveHeader(elOutputSink& Output, unsigned long SampleRate, \
+                              elSampleFormat Format, unsigned char Channels);
+
+/// Write the header of a streamed wave over the one it started with, once its length is known.
+void FinishStreamingWaveHeader(elOutputSink& Output, unsigned long SampleRate, \
+                               elSampleFormat Format, unsigned char Channels, \
+                               uint64_t NumberSamples);